@@ -0,0 +1,991 @@
+"""Stream compaction, partitioning, sorting and histograms."""
+
+from __future__ import division
+
+import numpy as np
+
+import pycuda.gpuarray as gpuarray
+from pycuda.tools import context_dependent_memoize, VectorArg, ScalarArg
+from pycuda.scan import GenericScanKernel
+
+
+
+
+# {{{ argument handling
+
+def _get_array_names(prefix, count, is_tuple):
+    if not is_tuple:
+        return [prefix]
+    return ["%s%d" % (prefix, i) for i in range(count)]
+
+def _normalize_arrays(ary):
+    """Return a list of the arrays given as *ary*, either a single
+    :class:`pycuda.gpuarray.GPUArray` or a tuple or list of them, and
+    whether they were given as a sequence.
+    """
+    if isinstance(ary, (tuple, list)):
+        arrays = list(ary)
+        is_tuple = True
+    else:
+        arrays = [ary]
+        is_tuple = False
+
+    if not arrays:
+        raise ValueError("need at least one array")
+
+    n = arrays[0].size
+    for a in arrays:
+        if a.size != n:
+            raise ValueError("all arrays must have the same size")
+        if not a.flags.forc:
+            raise RuntimeError("algorithms cannot deal with "
+                    "non-contiguous arrays")
+
+    return arrays, is_tuple
+
+def _get_extra_arg_types(extra_args):
+    """Return a hashable description of the *(name, value)* pairs in
+    *extra_args*.
+    """
+    result = []
+    for name, value in extra_args:
+        if isinstance(value, gpuarray.GPUArray):
+            result.append((name, value.dtype, True))
+        else:
+            result.append((name, np.asarray(value).dtype, False))
+    return tuple(result)
+
+def _get_extra_call_arg(value):
+    if isinstance(value, gpuarray.GPUArray):
+        return value.gpudata
+    else:
+        return value
+
+def _get_scan_dtype(n):
+    if n < 2**31:
+        return np.dtype(np.int32)
+    else:
+        return np.dtype(np.int64)
+
+# }}}
+
+
+
+
+# {{{ kernel builders
+
+def _make_compaction_kernel(scan_dtype, dtypes, is_tuple, input_expr,
+        output_names, scatter_statement, extra_arg_types, preamble,
+        name_prefix):
+    in_names = _get_array_names("ary", len(dtypes), is_tuple)
+
+    arguments = [VectorArg(dtype, name)
+            for dtype, name in zip(dtypes, in_names)]
+    for out_prefix in output_names:
+        arguments.extend(VectorArg(dtype, name)
+            for dtype, name in zip(dtypes,
+                _get_array_names(out_prefix, len(dtypes), is_tuple)))
+    arguments.append(VectorArg(scan_dtype, "count"))
+    arguments.extend(
+            (VectorArg if is_vector else ScalarArg)(dtype, name)
+            for name, dtype, is_vector in extra_arg_types)
+
+    def scatter(out_prefix, index):
+        return " ".join(
+                "%s[%s] = %s[i];" % (out_name, index, in_name)
+                for out_name, in_name in zip(
+                    _get_array_names(out_prefix, len(dtypes), is_tuple),
+                    in_names))
+
+    output_statement = scatter_statement(scatter) + """
+        if (i + 1 == N) *count = item;
+        """
+
+    return GenericScanKernel(
+            scan_dtype, arguments,
+            input_expr=input_expr,
+            scan_expr="a+b", neutral="0",
+            output_statement=output_statement,
+            name_prefix=name_prefix,
+            preamble=preamble)
+
+@context_dependent_memoize
+def _get_copy_if_kernel(scan_dtype, dtypes, is_tuple, predicate,
+        extra_arg_types, preamble):
+    return _make_compaction_kernel(scan_dtype, dtypes, is_tuple,
+            "(%s) ? 1 : 0" % predicate, ["out"],
+            lambda scatter: "if (prev_item != item) { %s }"
+                % scatter("out", "prev_item"),
+            extra_arg_types, preamble, "copy_if")
+
+@context_dependent_memoize
+def _get_partition_kernel(scan_dtype, dtypes, is_tuple, predicate,
+        extra_arg_types, preamble):
+    return _make_compaction_kernel(scan_dtype, dtypes, is_tuple,
+            "(%s) ? 1 : 0" % predicate, ["out_true", "out_false"],
+            lambda scatter: "if (prev_item != item) { %s } else { %s }"
+                % (scatter("out_true", "prev_item"),
+                    scatter("out_false", "i - prev_item")),
+            extra_arg_types, preamble, "partition")
+
+@context_dependent_memoize
+def _get_unique_kernel(scan_dtype, dtypes, is_tuple, is_equal_expr,
+        extra_arg_types, preamble):
+    key_name = _get_array_names("ary", len(dtypes), is_tuple)[0]
+
+    preamble = preamble + """
+        #define PYCUDA_UNIQUE_IS_EQUAL(a, b) (%s)
+        """ % is_equal_expr
+
+    return _make_compaction_kernel(scan_dtype, dtypes, is_tuple,
+            "(i == 0 || !PYCUDA_UNIQUE_IS_EQUAL(%(key)s[i-1], %(key)s[i])) "
+            "? 1 : 0" % {"key": key_name},
+            ["out"],
+            lambda scatter: "if (prev_item != item) { %s }"
+                % scatter("out", "prev_item"),
+            extra_arg_types, preamble, "unique")
+
+# }}}
+
+
+
+
+# {{{ driver
+
+def _run_compaction(get_kernel, ary, expr, extra_args, preamble,
+        output_count, stream):
+    arrays, is_tuple = _normalize_arrays(ary)
+    n = arrays[0].size
+
+    scan_dtype = _get_scan_dtype(n)
+    knl = get_kernel(scan_dtype,
+            tuple(a.dtype for a in arrays), is_tuple, expr,
+            _get_extra_arg_types(extra_args), preamble)
+
+    allocator = arrays[0].allocator
+    outputs = [
+            [gpuarray.empty_like(a) for a in arrays]
+            for i in range(output_count)]
+    count = gpuarray.empty((), scan_dtype, allocator=allocator)
+
+    if n:
+        args = list(arrays)
+        for out_arrays in outputs:
+            args.extend(out_arrays)
+        args.append(count)
+        args.extend(_get_extra_call_arg(value) for name, value in extra_args)
+
+        knl(*args, size=n, allocator=allocator, stream=stream)
+    else:
+        count.fill(0, stream=stream)
+
+    if not is_tuple:
+        outputs = [out_arrays[0] for out_arrays in outputs]
+
+    return outputs, count
+
+def copy_if(ary, predicate, extra_args=[], preamble="", stream=None):
+    """Copy the entries of *ary* for which *predicate* is true to the front
+    of a new array, preserving their order. See the documentation for
+    details.
+
+    :returns: a tuple *(out, count)*
+    """
+    (out,), count = _run_compaction(_get_copy_if_kernel,
+            ary, predicate, extra_args, preamble, 1, stream)
+    return out, count
+
+def remove_if(ary, predicate, extra_args=[], preamble="", stream=None):
+    """Copy the entries of *ary* for which *predicate* is false to the front
+    of a new array, preserving their order.
+
+    :returns: a tuple *(out, count)*
+    """
+    return copy_if(ary, "!(%s)" % predicate, extra_args, preamble, stream)
+
+def partition(ary, predicate, extra_args=[], preamble="", stream=None):
+    """Copy the entries of *ary* for which *predicate* is true and those for
+    which it is false to the front of two new arrays, preserving their
+    order.
+
+    :returns: a tuple *(out_true, out_false, count_true)*
+    """
+    (out_true, out_false), count = _run_compaction(_get_partition_kernel,
+            ary, predicate, extra_args, preamble, 2, stream)
+    return out_true, out_false, count
+
+def unique(ary, is_equal_expr="a == b", extra_args=[], preamble="",
+        stream=None):
+    """Copy the first entry of each run of equal entries of *ary* to the
+    front of a new array, preserving their order.
+
+    :returns: a tuple *(out, count)*
+    """
+    (out,), count = _run_compaction(_get_unique_kernel,
+            ary, is_equal_expr, extra_args, preamble, 1, stream)
+    return out, count
+
+# }}}
+
+
+
+
+# {{{ radix sort
+
+def get_radix_sort_key_bits(ary):
+    """Return the unsigned integers whose order matches that of the keys in
+    the :mod:`numpy` array *ary*, in the same way the radix sort computes
+    them on the device. Signed integers have their sign bit flipped.
+    Floating point numbers have it set if they are positive, and all their
+    bits flipped if they are negative.
+    """
+    ary = np.asarray(ary)
+    kind = ary.dtype.kind
+    wide = ary.dtype.itemsize > 4
+
+    unsigned_dtype = np.dtype(np.uint64 if wide else np.uint32)
+    sign_bit = unsigned_dtype.type(1) << unsigned_dtype.type(
+            8*unsigned_dtype.itemsize - 1)
+
+    if kind == "u":
+        return ary.astype(unsigned_dtype)
+    elif kind == "i":
+        signed_dtype = np.dtype(np.int64 if wide else np.int32)
+        return ary.astype(signed_dtype).view(unsigned_dtype) ^ sign_bit
+    elif kind == "f" and ary.dtype.itemsize in [4, 8]:
+        bits = ary.view(unsigned_dtype)
+        return np.where(bits & sign_bit, ~bits, bits | sign_bit)
+    else:
+        raise TypeError("unsupported key type: %s" % ary.dtype)
+
+def _get_key_bits_source(dtype):
+    """Return a device function computing
+    :func:`get_radix_sort_key_bits` for keys of type *dtype*.
+    """
+    from pycuda.tools import dtype_to_ctype
+
+    kind = dtype.kind
+    wide = dtype.itemsize > 4
+
+    if wide:
+        bits_type = "unsigned long long"
+        sign_bit = "0x8000000000000000ull"
+    else:
+        bits_type = "unsigned int"
+        sign_bit = "0x80000000u"
+
+    if kind == "u":
+        expr = "(%s) key" % bits_type
+    elif kind == "i":
+        expr = "((%s) key) ^ %s" % (bits_type, sign_bit)
+    elif kind == "f" and dtype.itemsize in [4, 8]:
+        expr = "(bits & %s) ? ~bits : (bits | %s)" % (sign_bit, sign_bit)
+    else:
+        raise TypeError("unsupported key type: %s" % dtype)
+
+    if kind == "f":
+        bits_source = "const %s bits = %s(key);" % (bits_type,
+                "__double_as_longlong" if wide else "__float_as_int")
+    else:
+        bits_source = ""
+
+    return """
+        WITHIN_KERNEL %(bits_type)s pycuda_radix_key_bits(%(key_type)s key)
+        {
+            %(bits_source)s
+            return %(expr)s;
+        }
+        """ % dict(bits_type=bits_type, key_type=dtype_to_ctype(dtype),
+                bits_source=bits_source, expr=expr)
+
+RADIX_SORT_WG_SIZE = 256
+
+# Each work group sorts a tile of this many chunks of RADIX_SORT_WG_SIZE
+# entries. Larger tiles make the scan over the per-tile digit counts
+# smaller.
+RADIX_SORT_CHUNKS_PER_TILE = 8
+
+# The scatter kernel keeps one counter per digit value and warp in local
+# memory.
+RADIX_SORT_MAX_BITS_PER_PASS = 8
+
+def get_radix_sort_plan(key_bits, bits_per_pass=8, begin_bit=0, end_bit=None):
+    """Return the list of shifts of the digits sorted by the passes of a
+    radix sort of keys with *key_bits* bits, considering only bits
+    *begin_bit* up to, but not including, *end_bit*. The last digit may
+    extend beyond *end_bit*.
+    """
+    if end_bit is None:
+        end_bit = key_bits
+
+    if not 0 <= begin_bit <= end_bit <= key_bits:
+        raise ValueError("invalid bit range")
+    if not 1 <= bits_per_pass <= RADIX_SORT_MAX_BITS_PER_PASS:
+        raise ValueError("bits_per_pass must be between 1 and %d"
+                % RADIX_SORT_MAX_BITS_PER_PASS)
+
+    return list(range(begin_bit, end_bit, bits_per_pass))
+
+RADIX_SORT_SOURCE = """
+typedef %(index_type)s index_type;
+
+#define RADIX %(radix)d
+#define BITS_PER_PASS %(bits_per_pass)d
+#define WG_SIZE %(wg_size)d
+#define TILE_SIZE %(tile_size)d
+#define WARP_SIZE 32
+#define WARP_COUNT (WG_SIZE / WARP_SIZE)
+
+#if defined(__CUDACC_VER_MAJOR__) && __CUDACC_VER_MAJOR__ >= 9
+#define PYCUDA_BALLOT(pred) __ballot_sync(0xffffffffu, pred)
+#else
+#define PYCUDA_BALLOT(pred) __ballot(pred)
+#endif
+
+#define PYCUDA_RADIX_DIGIT(key) \\
+    ((unsigned int) (pycuda_radix_key_bits(key) >> shift) & (RADIX - 1))
+
+// Tiles are numbered across a two-dimensional grid, see
+// pycuda.scan.get_single_pass_scan_plan.
+#define TILE_INDEX (GID_1*GDIM_0 + GID_0)
+
+// Write the number of entries with each digit in each tile to
+// tile_counts, digit-major, so that an exclusive scan over it yields the
+// position of the first entry with each digit from each tile.
+KERNEL void pycuda_radix_count(%(key_type)s *keys,
+    index_type *tile_counts, const index_type n,
+    const unsigned int tile_count, const unsigned int shift)
+{
+    LOCAL_MEM unsigned int counts[RADIX];
+
+    const unsigned int tile = TILE_INDEX;
+    if (tile >= tile_count)
+        return;
+
+    for (unsigned int d = LID_0; d < RADIX; d += WG_SIZE)
+        counts[d] = 0;
+    local_barrier();
+
+    const index_type tile_start = (index_type) tile * TILE_SIZE;
+    for (unsigned int chunk = 0; chunk < TILE_SIZE; chunk += WG_SIZE)
+    {
+        const index_type i = tile_start + chunk + LID_0;
+        if (i < n)
+            atomicAdd(&counts[PYCUDA_RADIX_DIGIT(keys[i])], 1);
+    }
+    local_barrier();
+
+    for (unsigned int d = LID_0; d < RADIX; d += WG_SIZE)
+        tile_counts[d*tile_count + tile] = counts[d];
+}
+
+// Move the entries of each tile to the positions given by the scanned
+// tile_offsets, keeping entries with the same digit in order.
+KERNEL void pycuda_radix_scatter(%(arguments)s,
+    index_type *tile_offsets, const index_type n,
+    const unsigned int tile_count, const unsigned int shift)
+{
+    LOCAL_MEM index_type digit_offsets[RADIX];
+    LOCAL_MEM unsigned int warp_counts[WARP_COUNT][RADIX];
+
+    const unsigned int tile = TILE_INDEX;
+    if (tile >= tile_count)
+        return;
+
+    const unsigned int lane = LID_0 %% WARP_SIZE;
+    const unsigned int warp = LID_0 / WARP_SIZE;
+    const unsigned int lanes_before = (1u << lane) - 1;
+
+    for (unsigned int d = LID_0; d < RADIX; d += WG_SIZE)
+        digit_offsets[d] = tile_offsets[d*tile_count + tile];
+
+    const index_type tile_start = (index_type) tile * TILE_SIZE;
+    for (unsigned int chunk = 0;
+        chunk < TILE_SIZE && tile_start + chunk < n;
+        chunk += WG_SIZE)
+    {
+        for (unsigned int k = LID_0; k < WARP_COUNT*RADIX; k += WG_SIZE)
+            warp_counts[k / RADIX][k %% RADIX] = 0;
+        local_barrier();
+
+        const index_type i = tile_start + chunk + LID_0;
+        const bool valid = i < n;
+        const unsigned int digit =
+            valid ? PYCUDA_RADIX_DIGIT(%(key_name)s[i]) : 0;
+
+        // lanes of this warp holding an entry with the same digit
+        unsigned int peers = PYCUDA_BALLOT(valid);
+        for (unsigned int b = 0; b < BITS_PER_PASS; ++b)
+        {
+            const bool bit = (digit >> b) & 1;
+            const unsigned int lanes_with_bit = PYCUDA_BALLOT(bit);
+            peers &= bit ? lanes_with_bit : ~lanes_with_bit;
+        }
+
+        if (valid && !(peers & lanes_before))
+            warp_counts[warp][digit] = __popc(peers);
+        local_barrier();
+
+        if (valid)
+        {
+            index_type dest = digit_offsets[digit]
+                + __popc(peers & lanes_before);
+            for (unsigned int w = 0; w < warp; ++w)
+                dest += warp_counts[w][digit];
+
+            %(scatter_source)s
+        }
+        local_barrier();
+
+        for (unsigned int d = LID_0; d < RADIX; d += WG_SIZE)
+        {
+            index_type count = 0;
+            for (unsigned int w = 0; w < WARP_COUNT; ++w)
+                count += warp_counts[w][d];
+            digit_offsets[d] += count;
+        }
+        local_barrier();
+    }
+}
+"""
+
+@context_dependent_memoize
+def _get_radix_sort_kernels(index_dtype, dtypes, key_index, bits_per_pass):
+    from pycuda.tools import dtype_to_ctype
+
+    radix = 2**bits_per_pass
+    key_dtype = dtypes[key_index]
+
+    in_names = _get_array_names("ary", len(dtypes), True)
+    out_names = _get_array_names("out", len(dtypes), True)
+    arguments = (
+            [VectorArg(dtype, name) for dtype, name in zip(dtypes, in_names)]
+            + [VectorArg(dtype, name)
+                for dtype, name in zip(dtypes, out_names)])
+
+    from pycuda._cluda import CLUDA_PREAMBLE
+    source = (CLUDA_PREAMBLE + _get_key_bits_source(key_dtype)
+            + RADIX_SORT_SOURCE % dict(
+                index_type=dtype_to_ctype(index_dtype),
+                radix=radix,
+                bits_per_pass=bits_per_pass,
+                wg_size=RADIX_SORT_WG_SIZE,
+                tile_size=RADIX_SORT_WG_SIZE*RADIX_SORT_CHUNKS_PER_TILE,
+                key_type=dtype_to_ctype(key_dtype),
+                key_name=in_names[key_index],
+                arguments=", ".join(arg.declarator() for arg in arguments),
+                scatter_source=" ".join(
+                    "%s[dest] = %s[i];" % (out_name, in_name)
+                    for in_name, out_name in zip(in_names, out_names))))
+
+    from pycuda.compiler import SourceModule
+    mod = SourceModule(source)
+
+    scalar_arg_types = ScalarArg(index_dtype, "n").struct_char + "II"
+    count_knl = mod.get_function("pycuda_radix_count")
+    count_knl.prepare("PP" + scalar_arg_types)
+    scatter_knl = mod.get_function("pycuda_radix_scatter")
+    scatter_knl.prepare(
+            "".join(arg.struct_char for arg in arguments)
+            + "P" + scalar_arg_types)
+
+    from pycuda.scan import ExclusiveScanKernel
+    scan_knl = ExclusiveScanKernel(index_dtype, "a+b", "0",
+            name_prefix="radix_sort_offsets")
+
+    return count_knl, scan_knl, scatter_knl
+
+SEGMENT_ID_KERNEL_SOURCE = """
+    // number of segment starts at or before i, minus one
+    %(index_type)s lower = 0, upper = segment_count;
+    while (lower < upper)
+    {
+        %(index_type)s mid = (lower + upper) / 2;
+        if (offsets[mid+1] <= i)
+            lower = mid + 1;
+        else
+            upper = mid;
+    }
+    ids[i] = lower;
+    """
+
+@context_dependent_memoize
+def _get_segment_id_kernel(ids_dtype, offsets_dtype):
+    from pycuda.tools import dtype_to_ctype
+    from pycuda.elementwise import ElementwiseKernel
+
+    index_type = dtype_to_ctype(offsets_dtype)
+    return ElementwiseKernel(
+            "%s *ids, %s *offsets, %s segment_count" % (
+                dtype_to_ctype(ids_dtype), index_type, index_type),
+            SEGMENT_ID_KERNEL_SOURCE % dict(index_type=index_type),
+            "segment_ids")
+
+def _run_radix_sort_passes(arrays, key_index, shifts, bits_per_pass,
+        allocator, stream):
+    """Return arrays holding the entries of *arrays* stably sorted by the
+    digits at *shifts* of the keys in arrays[key_index]. Does not modify
+    *arrays*.
+
+    Each pass counts the digits in each tile of entries, scans these
+    counts to find where the entries of each tile go, and moves them
+    there.
+    """
+    n = arrays[0].size
+    index_dtype = _get_scan_dtype(n)
+    count_knl, scan_knl, scatter_knl = _get_radix_sort_kernels(index_dtype,
+            tuple(a.dtype for a in arrays), key_index, bits_per_pass)
+
+    from pycuda.scan import get_single_pass_scan_plan
+    tile_count, grid = get_single_pass_scan_plan(n,
+            RADIX_SORT_WG_SIZE, RADIX_SORT_CHUNKS_PER_TILE)
+    block = (RADIX_SORT_WG_SIZE, 1, 1)
+
+    tile_offsets = gpuarray.empty(2**bits_per_pass*tile_count, index_dtype,
+            allocator=allocator)
+    targets = [
+            [gpuarray.empty(a.shape, a.dtype, allocator=allocator)
+                for a in arrays]
+            for i in range(min(2, len(shifts)))]
+
+    source = arrays
+    for i, shift in enumerate(shifts):
+        dest = targets[i % 2]
+        scalar_args = (index_dtype.type(n), tile_count, shift)
+
+        count_knl.prepared_async_call(grid, block, stream,
+                source[key_index].gpudata, tile_offsets.gpudata,
+                *scalar_args)
+        scan_knl(tile_offsets, allocator=allocator, stream=stream)
+        scatter_knl.prepared_async_call(grid, block, stream,
+                *([a.gpudata for a in source + dest]
+                    + [tile_offsets.gpudata] + list(scalar_args)))
+
+        source = dest
+
+    return source
+
+def _normalize_sort_arrays(ary):
+    arrays, is_tuple = _normalize_arrays(ary)
+
+    key_dtype = arrays[0].dtype
+    if key_dtype.kind not in "uif" or key_dtype.itemsize not in [4, 8]:
+        raise TypeError("unsupported key type: %s" % key_dtype)
+
+    return arrays, is_tuple, 8*key_dtype.itemsize
+
+def _copy_arrays(arrays, allocator, stream):
+    result = []
+    for a in arrays:
+        copy = gpuarray.empty(a.shape, a.dtype, allocator=allocator)
+        if a.size:
+            import pycuda.driver as drv
+            if stream is None:
+                drv.memcpy_dtod(copy.gpudata, a.gpudata, a.nbytes)
+            else:
+                drv.memcpy_dtod_async(copy.gpudata, a.gpudata, a.nbytes,
+                        stream)
+        result.append(copy)
+    return result
+
+def radix_sort(ary, begin_bit=0, end_bit=None, bits_per_pass=8,
+        allocator=None, stream=None):
+    """Return new arrays holding the entries of *ary* stably sorted by the
+    keys in its first array. See the documentation for details.
+    """
+    arrays, is_tuple, key_bits = _normalize_sort_arrays(ary)
+    if allocator is None:
+        allocator = arrays[0].allocator
+
+    shifts = get_radix_sort_plan(key_bits, bits_per_pass, begin_bit, end_bit)
+
+    if arrays[0].size and shifts:
+        result = _run_radix_sort_passes(arrays, 0, shifts, bits_per_pass,
+                allocator, stream)
+    else:
+        result = _copy_arrays(arrays, allocator, stream)
+
+    if not is_tuple:
+        return result[0]
+    return result
+
+def segmented_radix_sort(ary, segment_offsets, begin_bit=0, end_bit=None,
+        bits_per_pass=8, allocator=None, stream=None):
+    """Like :func:`radix_sort`, but sort each of the segments starting at
+    the entries of *segment_offsets* separately.
+    """
+    arrays, is_tuple, key_bits = _normalize_sort_arrays(ary)
+    if allocator is None:
+        allocator = arrays[0].allocator
+
+    n = arrays[0].size
+    segment_count = segment_offsets.size - 1
+
+    if segment_count <= 1 or not n:
+        return radix_sort(ary, begin_bit, end_bit, bits_per_pass,
+                allocator, stream)
+
+    # Sort by key, then by segment. Since the sort is stable, the second
+    # step keeps entries of the same segment in key order.
+    ids = gpuarray.empty(n, np.uint32, allocator=allocator)
+    _get_segment_id_kernel(ids.dtype, segment_offsets.dtype)(
+            ids, segment_offsets, segment_offsets.dtype.type(segment_count),
+            stream=stream)
+
+    shifts = get_radix_sort_plan(key_bits, bits_per_pass, begin_bit, end_bit)
+    result = arrays + [ids]
+    if shifts:
+        result = _run_radix_sort_passes(result, 0, shifts, bits_per_pass,
+                allocator, stream)
+
+    id_bits = int(segment_count - 1).bit_length()
+    result = _run_radix_sort_passes(result, len(result)-1,
+            get_radix_sort_plan(32, bits_per_pass, 0, id_bits),
+            bits_per_pass, allocator, stream)[:-1]
+
+    if not is_tuple:
+        return result[0]
+    return result
+
+# }}}
+
+
+
+
+# {{{ histogram
+
+HISTOGRAM_WG_SIZE = 256
+
+# Bins are privatized per work group if their counters fit into this many
+# bytes of local memory, and accumulated with global atomics otherwise.
+HISTOGRAM_LOCAL_MEM_BYTES = 16384
+
+HISTOGRAM_GROUPS_PER_MULTIPROCESSOR = 4
+
+def get_histogram_plan(n, bin_count, count_size, multiprocessor_count,
+        wg_size=HISTOGRAM_WG_SIZE, local_mem_bytes=HISTOGRAM_LOCAL_MEM_BYTES):
+    """Return a tuple *(use_local, group_count)* describing how to
+    accumulate *n* entries into *bin_count* counters of *count_size* bytes
+    each. If *use_local* is true, each of the *group_count* work groups
+    builds a histogram of its entries in local memory, and the resulting
+    histograms are added up afterwards. Otherwise, the work groups add to
+    the result with global atomics.
+    """
+    group_count = min(
+            HISTOGRAM_GROUPS_PER_MULTIPROCESSOR*multiprocessor_count,
+            (n + wg_size - 1) // wg_size)
+    group_count = max(group_count, 1)
+
+    if bin_count*count_size > local_mem_bytes:
+        return False, group_count
+
+    # Merging reads group_count*bin_count counters, which should not
+    # exceed the number of entries.
+    local_group_count = min(group_count, n // bin_count)
+    if local_group_count < 1:
+        return False, group_count
+
+    return True, local_group_count
+
+HISTOGRAM_SOURCE = """
+typedef %(count_type)s count_type;
+
+WITHIN_KERNEL void pycuda_histogram_add(count_type *dest, count_type value)
+{
+    %(add_source)s
+}
+
+WITHIN_KERNEL int pycuda_histogram_bin(%(arguments)s,
+    const unsigned int i, const unsigned int bin_count)
+{
+    %(bin_source)s
+}
+
+#define BIN(i) pycuda_histogram_bin(%(argument_names)s, i, bin_count)
+#define WEIGHT(i) (%(weight_expr)s)
+
+KERNEL void pycuda_histogram_local(%(arguments)s,
+    GLOBAL_MEM count_type *partial_results,
+    const unsigned int n, const unsigned int bin_count)
+{
+    extern LOCAL_MEM count_type local_counts[];
+
+    for (unsigned int b = LID_0; b < bin_count; b += LDIM_0)
+        local_counts[b] = 0;
+    local_barrier();
+
+    for (unsigned int i = GID_0*LDIM_0 + LID_0; i < n; i += GDIM_0*LDIM_0)
+    {
+        const int bin = BIN(i);
+        if (bin >= 0)
+            pycuda_histogram_add(&local_counts[bin], WEIGHT(i));
+    }
+    local_barrier();
+
+    for (unsigned int b = LID_0; b < bin_count; b += LDIM_0)
+        partial_results[GID_0*bin_count + b] = local_counts[b];
+}
+
+KERNEL void pycuda_histogram_merge(
+    GLOBAL_MEM count_type *partial_results,
+    GLOBAL_MEM count_type *result,
+    const unsigned int bin_count, const unsigned int group_count)
+{
+    for (unsigned int b = GID_0*LDIM_0 + LID_0; b < bin_count;
+        b += GDIM_0*LDIM_0)
+    {
+        count_type sum = 0;
+        for (unsigned int g = 0; g < group_count; ++g)
+            sum += partial_results[g*bin_count + b];
+        result[b] = sum;
+    }
+}
+
+KERNEL void pycuda_histogram_global(%(arguments)s,
+    GLOBAL_MEM count_type *result,
+    const unsigned int n, const unsigned int bin_count)
+{
+    for (unsigned int i = GID_0*LDIM_0 + LID_0; i < n; i += GDIM_0*LDIM_0)
+    {
+        const int bin = BIN(i);
+        if (bin >= 0)
+            pycuda_histogram_add(&result[bin], WEIGHT(i));
+    }
+}
+"""
+
+def _get_atomic_add_source(dtype):
+    if dtype == np.float32:
+        return "atomicAdd(dest, value);"
+    elif dtype == np.float64:
+        return """
+            unsigned long long *address = (unsigned long long *) dest;
+            unsigned long long old = *address, assumed;
+            do
+            {
+                assumed = old;
+                old = atomicCAS(address, assumed, __double_as_longlong(
+                    value + __longlong_as_double(assumed)));
+            }
+            while (assumed != old);
+            """
+    elif dtype.kind in "iu" and dtype.itemsize == 4:
+        return "atomicAdd(dest, value);"
+    elif dtype.kind in "iu" and dtype.itemsize == 8:
+        return ("atomicAdd((unsigned long long *) dest, "
+                "(unsigned long long) value);")
+    else:
+        raise TypeError("unsupported count type: %s" % dtype)
+
+# Bins are found like numpy.histogram does it: computed for equal-width
+# bins, corrected against the bin edges, and searched for otherwise. The
+# last bin includes its right edge.
+UNIFORM_BIN_SOURCE = """
+    const double x = ary[i];
+    if (!(x >= lower && x <= upper))
+        return -1;
+
+    int bin = (int) ((x - lower) * norm);
+    if (bin == bin_count)
+        bin = bin_count - 1;
+
+    if (x < lower + bin*step)
+        --bin;
+    else if (bin != bin_count - 1 && x >= lower + (bin + 1)*step)
+        ++bin;
+
+    return bin;
+    """
+
+EDGES_BIN_SOURCE = """
+    const double x = ary[i];
+    if (!(x >= edges[0] && x <= edges[bin_count]))
+        return -1;
+
+    // index of the last edge at or before x
+    int lower = 0, upper = bin_count;
+    while (upper - lower > 1)
+    {
+        const int mid = (lower + upper) / 2;
+        if (edges[mid] <= x)
+            lower = mid;
+        else
+            upper = mid;
+    }
+    return lower;
+    """
+
+BINCOUNT_SOURCE = """
+    const long long bin = ary[i];
+    return (bin >= 0 && bin < bin_count) ? (int) bin : -1;
+    """
+
+@context_dependent_memoize
+def _get_histogram_kernels(mode, dtype, weights_dtype, count_dtype):
+    from pycuda.tools import dtype_to_ctype
+
+    arguments = ["%s *ary" % dtype_to_ctype(dtype)]
+    arg_types = "P"
+
+    if mode == "uniform":
+        arguments += ["double lower", "double upper", "double norm",
+                "double step"]
+        arg_types += "dddd"
+        bin_source = UNIFORM_BIN_SOURCE
+    elif mode == "edges":
+        arguments.append("double *edges")
+        arg_types += "P"
+        bin_source = EDGES_BIN_SOURCE
+    elif mode == "bincount":
+        bin_source = BINCOUNT_SOURCE
+    else:
+        raise ValueError("invalid histogram mode: %s" % mode)
+
+    if weights_dtype is not None:
+        arguments.append("%s *weights" % dtype_to_ctype(weights_dtype))
+        arg_types += "P"
+        weight_expr = "(count_type) weights[i]"
+    else:
+        weight_expr = "(count_type) 1"
+
+    from pycuda._cluda import CLUDA_PREAMBLE
+    source = CLUDA_PREAMBLE + HISTOGRAM_SOURCE % dict(
+            count_type=dtype_to_ctype(count_dtype),
+            add_source=_get_atomic_add_source(count_dtype),
+            arguments=", ".join(arguments),
+            argument_names=", ".join(
+                arg.split()[-1].lstrip("*") for arg in arguments),
+            bin_source=bin_source,
+            weight_expr=weight_expr)
+
+    from pycuda.compiler import SourceModule
+    mod = SourceModule(source)
+
+    local_knl = mod.get_function("pycuda_histogram_local")
+    local_knl.prepare(arg_types + "PII")
+    merge_knl = mod.get_function("pycuda_histogram_merge")
+    merge_knl.prepare("PPII")
+    global_knl = mod.get_function("pycuda_histogram_global")
+    global_knl.prepare(arg_types + "PII")
+
+    return local_knl, merge_knl, global_knl
+
+def _run_histogram(mode, ary, args, weights, bin_count, allocator, stream):
+    if weights is not None:
+        if weights.size != ary.size:
+            raise ValueError("weights must have the same size as the input")
+        count_dtype = weights.dtype
+    else:
+        count_dtype = np.dtype(np.uint32)
+
+    if allocator is None:
+        allocator = ary.allocator
+
+    result = gpuarray.empty(bin_count, count_dtype, allocator=allocator)
+    n = ary.size
+    if not n or not bin_count:
+        result.fill(0, stream=stream)
+        return result
+
+    local_knl, merge_knl, global_knl = _get_histogram_kernels(
+            mode, ary.dtype, None if weights is None else weights.dtype,
+            count_dtype)
+
+    from pycuda.scan import _get_multiprocessor_count
+    use_local, group_count = get_histogram_plan(n, bin_count,
+            count_dtype.itemsize, _get_multiprocessor_count())
+
+    args = [ary.gpudata] + list(args)
+    if weights is not None:
+        args.append(weights.gpudata)
+
+    wg_size = HISTOGRAM_WG_SIZE
+    if use_local:
+        partial_results = gpuarray.empty((group_count, bin_count),
+                count_dtype, allocator=allocator)
+        local_knl.prepared_async_call((group_count, 1), (wg_size, 1, 1),
+                stream, *(args + [partial_results.gpudata, n, bin_count]),
+                shared_size=bin_count*count_dtype.itemsize)
+
+        merge_knl.prepared_async_call(
+                ((bin_count + wg_size - 1) // wg_size, 1), (wg_size, 1, 1),
+                stream, partial_results.gpudata, result.gpudata,
+                bin_count, group_count)
+    else:
+        result.fill(0, stream=stream)
+        global_knl.prepared_async_call((group_count, 1), (wg_size, 1, 1),
+                stream, *(args + [result.gpudata, n, bin_count]))
+
+    return result
+
+def histogram(a, bins=10, range=None, weights=None, allocator=None,
+        stream=None):
+    """Return a tuple *(hist, bin_edges)* like :func:`numpy.histogram`.
+    See the documentation for details.
+    """
+    if a.dtype.kind not in "iuf":
+        raise TypeError("unsupported input type: %s" % a.dtype)
+
+    if isinstance(bins, (int, np.integer)):
+        bin_count = int(bins)
+        if bin_count < 1:
+            raise ValueError("bins must be positive")
+
+        if range is None:
+            if a.size:
+                range = (float(gpuarray.min(a, stream=stream).get()),
+                        float(gpuarray.max(a, stream=stream).get()))
+            else:
+                range = (0, 1)
+
+        lower, upper = float(range[0]), float(range[1])
+        if lower > upper:
+            raise ValueError("max must be larger than min in range")
+        if lower == upper:
+            lower -= 0.5
+            upper += 0.5
+
+        bin_edges = np.linspace(lower, upper, bin_count + 1)
+        args = [lower, upper, bin_count/(upper - lower),
+                (upper - lower)/bin_count]
+        hist = _run_histogram("uniform", a, args, weights, bin_count,
+                allocator, stream)
+    else:
+        if isinstance(bins, gpuarray.GPUArray):
+            bin_edges = bins.get()
+        else:
+            bin_edges = np.asarray(bins)
+
+        if bin_edges.ndim != 1 or bin_edges.size < 2:
+            raise ValueError("bins must have at least two edges")
+        if (np.diff(bin_edges) < 0).any():
+            raise ValueError("bins must increase monotonically")
+
+        edges_gpu = gpuarray.to_gpu(bin_edges.astype(np.float64),
+                allocator=allocator or a.allocator)
+        hist = _run_histogram("edges", a, [edges_gpu.gpudata], weights,
+                bin_edges.size - 1, allocator, stream)
+
+    return hist, bin_edges
+
+def bincount(x, weights=None, minlength=None, allocator=None, stream=None):
+    """Return the number of occurrences of each value in the integer array
+    *x*, like :func:`numpy.bincount`. See the documentation for details.
+    """
+    if x.dtype.kind not in "iu":
+        raise TypeError("bincount needs an integer array")
+
+    length = 0
+    if x.size:
+        length = int(gpuarray.max(x, stream=stream).get()) + 1
+        if x.dtype.kind == "i" and int(gpuarray.min(x, stream=stream).get()) < 0:
+            raise ValueError("bincount needs non-negative values")
+    if minlength is not None:
+        length = max(length, minlength)
+
+    return _run_histogram("bincount", x, [], weights, length,
+            allocator, stream)
+
+# }}}
+
+# vim: foldmethod=marker
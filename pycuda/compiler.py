@@ -175,6 +175,23 @@ def _find_pycuda_include_path():
     return resource_filename(Requirement.parse("pycuda"), "pycuda/cuda")
 
 
+def _get_default_cache_dir():
+    from os.path import join
+    from tempfile import gettempdir
+    cache_dir = join(gettempdir(),
+            "pycuda-compiler-cache-v1-%s" % _get_per_user_string())
+
+    from os import mkdir
+    try:
+        mkdir(cache_dir)
+    except OSError, e:
+        from errno import EEXIST
+        if e.errno != EEXIST:
+            raise
+
+    return cache_dir
+
+
 import os
 DEFAULT_NVCC_FLAGS = [
         _flag.strip() for _flag in
@@ -207,18 +224,7 @@ def compile(source, nvcc="nvcc", options=None, keep=False,
         options.extend(["-g", "-G"])
 
     if cache_dir is None:
-        from os.path import join
-        from tempfile import gettempdir
-        cache_dir = join(gettempdir(),
-                "pycuda-compiler-cache-v1-%s" % _get_per_user_string())
-
-        from os import mkdir
-        try:
-            mkdir(cache_dir)
-        except OSError, e:
-            from errno import EEXIST
-            if e.errno != EEXIST:
-                raise
+        cache_dir = _get_default_cache_dir()
 
     if arch is not None:
         options.extend(["-arch", arch])
@@ -241,22 +247,191 @@ def compile(source, nvcc="nvcc", options=None, keep=False,
     return compile_plain(source, options, keep, nvcc, cache_dir)
 
 
-class SourceModule(object):
+# {{{ PTX just-in-time compilation
+
+def make_jit_options(optimization_level=None, max_registers=None,
+        target=None, fallback=None, threads_per_block=None):
+    """Return a list of (:class:`pycuda.driver.jit_option`, value) pairs
+    suitable for :func:`pycuda.driver.module_from_buffer` and
+    :class:`pycuda.driver.Linker`.
+    """
+    from pycuda.driver import jit_option
+
+    result = []
+    if optimization_level is not None:
+        if not 0 <= optimization_level <= 4:
+            raise ValueError("optimization_level must be between 0 and 4")
+        result.append((jit_option.OPTIMIZATION_LEVEL, int(optimization_level)))
+    if max_registers is not None:
+        result.append((jit_option.MAX_REGISTERS, int(max_registers)))
+    if threads_per_block is not None:
+        result.append((jit_option.THREADS_PER_BLOCK, int(threads_per_block)))
+    if target is not None:
+        result.append((jit_option.TARGET, target))
+    if fallback is not None:
+        result.append((jit_option.FALLBACK_STRATEGY, fallback))
+
+    return result
+
+
+def link_ptx(ptx, jit_options=[], cache_dir=None, message_handler=None):
+    """JIT-compile the PTX assembly *ptx* for the device of the current
+    context and return the resulting cubin.
+
+    The driver's JIT cache is keyed on the whole binary image and is easily
+    invalidated, so the generated cubin is instead stored in PyCUDA's own
+    on-disk kernel cache (the same one used by :func:`compile`). *cache_dir*
+    behaves as for :func:`compile`; passing *False* disables caching.
+    """
+    import pycuda.driver as drv
+
+    if isinstance(ptx, unicode):
+        ptx = ptx.encode("utf-8")
+
+    if cache_dir is None:
+        cache_dir = _get_default_cache_dir()
+
+    if drv.CUDA_DEBUGGING:
+        cache_dir = False
+
+    if cache_dir:
+        from os.path import join
+
+        checksum = _new_md5()
+        checksum.update(ptx)
+        for key, value in jit_options:
+            checksum.update(("%s=%d" % (key, int(value))).encode("utf-8"))
+        checksum.update(repr(drv.Context.get_device().compute_capability())
+                .encode("utf-8"))
+        checksum.update(str(drv.get_driver_version()).encode("utf-8"))
+        from pycuda.characterize import platform_bits
+        checksum.update(str(platform_bits()).encode("utf-8"))
+
+        cache_path = join(cache_dir, checksum.hexdigest() + ".jit.cubin")
+
+        try:
+            cache_file = open(cache_path, "rb")
+            try:
+                return cache_file.read()
+            finally:
+                cache_file.close()
+        except (IOError, OSError):
+            pass
+
+    linker = drv.Linker(jit_options, message_handler)
+    linker.add_data(ptx, drv.jit_input_type.PTX, "kernel.ptx")
+    cubin = linker.complete()
+
+    if cache_dir:
+        # write to a temporary file first, so that concurrent readers never
+        # see a partial cubin
+        tmp_path = "%s.tmp-%d" % (cache_path, os.getpid())
+        outf = open(tmp_path, "wb")
+        try:
+            outf.write(cubin)
+        finally:
+            outf.close()
+
+        try:
+            os.rename(tmp_path, cache_path)
+        except OSError:
+            # another process wrote it first
+            os.unlink(tmp_path)
+
+    return cubin
+
+# }}}
+
+
+class _ModuleBase(object):
+    """Functionality shared by :class:`SourceModule` and :class:`PTXModule`.
+
+    If *lazy* loading is requested, only the module image is kept until the
+    module is first used. Function handles are looked up once per name, so
+    that state attached by :meth:`pycuda.driver.Function.prepare` survives
+    repeated calls to :meth:`get_function`.
+    """
+
+    def _set_module_loader(self, loader, lazy):
+        self._module_loader = loader
+        self._module = None
+        self._function_cache = {}
+
+        if not lazy:
+            self._module = loader()
+            self._module_loader = None
+
+    @property
+    def module(self):
+        if self._module is None:
+            self._module = self._module_loader()
+            self._module_loader = None
+
+        return self._module
+
+    def get_function(self, name):
+        try:
+            return self._function_cache[name]
+        except KeyError:
+            func = self.module.get_function(name)
+            self._function_cache[name] = func
+            return func
+
+    def get_global(self, name):
+        return self.module.get_global(name)
+
+    def get_texref(self, name):
+        return self.module.get_texref(name)
+
+    def get_surfref(self, name):
+        return self.module.get_surfref(name)
+
+
+class PTXModule(_ModuleBase):
+    """Load PTX assembly *ptx*, e.g. as emitted by an external code generator,
+    into the current context.
+
+    If the driver supports it (CUDA 5.5 and newer), the PTX is linked to a
+    cubin through :class:`pycuda.driver.Linker` and the result is kept in
+    the on-disk kernel cache, see :func:`link_ptx`. Otherwise, the PTX is
+    handed straight to :func:`pycuda.driver.module_from_buffer`.
+    """
+
+    def __init__(self, ptx, optimization_level=None, max_registers=None,
+            target=None, fallback=None, cache_dir=None, message_handler=None,
+            lazy=False):
+        import pycuda.driver as drv
+
+        jit_options = make_jit_options(
+                optimization_level=optimization_level,
+                max_registers=max_registers,
+                target=target, fallback=fallback)
+
+        if hasattr(drv, "Linker") and cache_dir is not False:
+            cubin = link_ptx(ptx, jit_options, cache_dir=cache_dir,
+                    message_handler=message_handler)
+            self._set_module_loader(
+                    lambda: drv.module_from_buffer(cubin), lazy)
+        else:
+            if isinstance(ptx, unicode):
+                ptx = ptx.encode("utf-8")
+            self._set_module_loader(
+                    lambda: drv.module_from_buffer(ptx, jit_options,
+                        message_handler=message_handler),
+                    lazy)
+
+
+class SourceModule(_ModuleBase):
     def __init__(self, source, nvcc="nvcc", options=None, keep=False,
             no_extern_c=False, arch=None, code=None, cache_dir=None,
-            include_dirs=[]):
+            include_dirs=[], lazy=False):
         self._check_arch(arch)
 
         cubin = compile(source, nvcc, options, keep, no_extern_c,
                 arch, code, cache_dir, include_dirs)
 
         from pycuda.driver import module_from_buffer
-        self.module = module_from_buffer(cubin)
-
-        self.get_global = self.module.get_global
-        self.get_texref = self.module.get_texref
-        if hasattr(self.module, "get_surfref"):
-            self.get_surfref = self.module.get_surfref
+        self._set_module_loader(lambda: module_from_buffer(cubin), lazy)
 
     def _check_arch(self, arch):
         if arch is None:
@@ -270,6 +445,3 @@ class SourceModule(object):
                         "higher than selected GPU")
         except:
             pass
-
-    def get_function(self, name):
-        return self.module.get_function(name)
@@ -5,6 +5,7 @@ import pycuda.compiler
 import pycuda.driver as drv
 import pycuda.gpuarray as array
 from pytools import memoize_method
+from pycuda.tools import context_dependent_memoize
 
 
 
@@ -244,6 +245,424 @@ def rand(shape, dtype=np.float32, stream=None):
 
 # }}}
 
+# {{{ counter-based random number generation
+
+PHILOX_M0 = 0xD2511F53
+PHILOX_M1 = 0xCD9E8D57
+PHILOX_W0 = 0x9E3779B9
+PHILOX_W1 = 0xBB67AE85
+
+philox_preamble = """
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+// Philox4x32-10 of J. K. Salmon et al., Parallel Random Numbers: As Easy
+// as 1, 2, 3, SC11 (2011).
+__device__ uint4 philox4x32_10(uint4 ctr, uint2 key)
+{
+  #pragma unroll
+  for (int i = 0; i < 10; ++i)
+  {
+    if (i)
+    {
+      key.x += PHILOX_W0;
+      key.y += PHILOX_W1;
+    }
+
+    const unsigned hi0 = __umulhi(PHILOX_M0, ctr.x);
+    const unsigned lo0 = PHILOX_M0*ctr.x;
+    const unsigned hi1 = __umulhi(PHILOX_M1, ctr.z);
+    const unsigned lo1 = PHILOX_M1*ctr.z;
+    ctr = make_uint4(hi1 ^ ctr.y ^ key.x, lo1, hi0 ^ ctr.w ^ key.y, lo0);
+  }
+  return ctr;
+}
+
+__device__ uint4 philox_block(const unsigned long long counter,
+    const unsigned long long subsequence, const uint2 key)
+{
+  return philox4x32_10(make_uint4(
+        (unsigned) counter, (unsigned) (counter >> 32),
+        (unsigned) subsequence, (unsigned) (subsequence >> 32)), key);
+}
+
+// uniform on (0, 1]
+__device__ float philox_u01_float(const unsigned x)
+{
+  return x * 2.3283064365386963e-10f + 1.1641532182693481e-10f;
+}
+
+// uniform on (0, 1), with 53 random bits
+__device__ double philox_u01_double(const unsigned x, const unsigned y)
+{
+  return ((x >> 5) * 67108864.0 + (y >> 6) + 0.5)
+    * (1.0/9007199254740992.0);
+}
+
+__device__ void philox_box_muller_float(const float u1, const float u2,
+    float *out)
+{
+  const float radius = sqrtf(-2.0f*logf(u1));
+  float s, c;
+  sincosf(6.283185307179586f*u2, &s, &c);
+  out[0] = radius*c;
+  out[1] = radius*s;
+}
+
+__device__ void philox_box_muller_double(const double u1, const double u2,
+    double *out)
+{
+  const double radius = sqrt(-2.0*log(u1));
+  double s, c;
+  sincos(6.283185307179586*u2, &s, &c);
+  out[0] = radius*c;
+  out[1] = radius*s;
+}
+"""
+
+philox_kernel_template = """
+// Block b of the output is made from the random bits of counter
+// counter_base + b, regardless of the launch configuration.
+extern "C" __global__ void %(name)s(%(out_type)s *d,
+    const unsigned long long n, const unsigned key0, const unsigned key1,
+    const unsigned long long counter_base,
+    const unsigned long long subsequence)
+{
+  const uint2 key = make_uint2(key0, key1);
+
+  for (unsigned long long b = blockIdx.x*blockDim.x + threadIdx.x;
+      b*%(per_block)d < n; b += blockDim.x*gridDim.x)
+  {
+    const uint4 r = philox_block(counter_base + b, subsequence, key);
+
+    %(out_type)s out[%(per_block)d];
+    %(convert)s
+
+    const unsigned long long i = b*%(per_block)d;
+    for (int k = 0; k < %(per_block)d; ++k)
+      if (i + k < n)
+        d[i + k] = out[k];
+  }
+}
+"""
+
+# name -> (output type, values per counter, conversion from r to out)
+philox_gen_info = {
+        "uniform_int": ("unsigned int", 4,
+            "out[0] = r.x; out[1] = r.y; out[2] = r.z; out[3] = r.w;"),
+        "uniform_long": ("unsigned long long", 2,
+            "out[0] = ((unsigned long long) r.y << 32) | r.x;"
+            "out[1] = ((unsigned long long) r.w << 32) | r.z;"),
+        "uniform_float": ("float", 4,
+            "out[0] = philox_u01_float(r.x);"
+            "out[1] = philox_u01_float(r.y);"
+            "out[2] = philox_u01_float(r.z);"
+            "out[3] = philox_u01_float(r.w);"),
+        "uniform_double": ("double", 2,
+            "out[0] = philox_u01_double(r.x, r.y);"
+            "out[1] = philox_u01_double(r.z, r.w);"),
+        "normal_float": ("float", 4,
+            "philox_box_muller_float("
+            "philox_u01_float(r.x), philox_u01_float(r.y), out);"
+            "philox_box_muller_float("
+            "philox_u01_float(r.z), philox_u01_float(r.w), out+2);"),
+        "normal_double": ("double", 2,
+            "philox_box_muller_double("
+            "philox_u01_double(r.x, r.y), philox_u01_double(r.z, r.w), out);"),
+        }
+
+
+@context_dependent_memoize
+def _get_philox_kernel(name):
+    out_type, per_block, convert = philox_gen_info[name]
+
+    mod = pycuda.compiler.SourceModule(
+            philox_preamble + philox_kernel_template % {
+                "name": name,
+                "out_type": out_type,
+                "per_block": per_block,
+                "convert": convert,
+                }, no_extern_c=True)
+
+    func = mod.get_function(name)
+    func.prepare("PQIIQQ")
+    return func, per_block
+
+
+def philox4x32_10(counter, key):
+    """Return the Philox4x32-10 function of the four 32-bit words *counter*
+    and the two 32-bit words *key*, as a list of four integers. This is a
+    host reference for the device code used by
+    :class:`PhiloxRandomNumberGenerator`.
+    """
+    mask = 0xffffffff
+    c0, c1, c2, c3 = [int(x) & mask for x in counter]
+    k0, k1 = [int(x) & mask for x in key]
+
+    for i in range(10):
+        if i:
+            k0 = (k0 + PHILOX_W0) & mask
+            k1 = (k1 + PHILOX_W1) & mask
+
+        p0 = PHILOX_M0*c0
+        p1 = PHILOX_M1*c2
+        c0, c1, c2, c3 = (
+                (p1 >> 32) ^ c1 ^ k0, p1 & mask,
+                (p0 >> 32) ^ c3 ^ k1, p0 & mask)
+
+    return [c0, c1, c2, c3]
+
+
+def philox_reference_words(block_count, key, counter_base=0, subsequence=0):
+    """Return a :mod:`numpy` array of shape *(block_count, 4)* of the random
+    words for the counters *counter_base* to *counter_base+block_count-1*,
+    computed on the host.
+    """
+    mask = np.uint64(0xffffffff)
+    counters = np.arange(block_count, dtype=np.uint64) + np.uint64(counter_base)
+
+    c0 = counters & mask
+    c1 = counters >> np.uint64(32)
+    c2 = np.empty_like(c0)
+    c2.fill(subsequence & 0xffffffff)
+    c3 = np.empty_like(c0)
+    c3.fill((subsequence >> 32) & 0xffffffff)
+    k0, k1 = [int(x) & 0xffffffff for x in key]
+
+    for i in range(10):
+        if i:
+            k0 = (k0 + PHILOX_W0) & 0xffffffff
+            k1 = (k1 + PHILOX_W1) & 0xffffffff
+
+        p0 = np.uint64(PHILOX_M0)*c0
+        p1 = np.uint64(PHILOX_M1)*c2
+        c0, c1, c2, c3 = (
+                (p1 >> np.uint64(32)) ^ c1 ^ np.uint64(k0), p1 & mask,
+                (p0 >> np.uint64(32)) ^ c3 ^ np.uint64(k1), p0 & mask)
+
+    return np.array([c0, c1, c2, c3], dtype=np.uint32).T.copy()
+
+
+class PhiloxRandomNumberGenerator(object):
+    """Counter-based pseudorandom numbers. Each block of four 32-bit random
+    words is a pure function of the 64-bit *seed*, the 64-bit *subsequence*
+    number and a 64-bit counter, so that no generator state is kept on the
+    device, results do not depend on the launch configuration, and skipping
+    ahead is free.
+
+    *offset* is the counter used for the first values generated. Every fill
+    advances it by the number of counters used, i.e. by the size of the
+    filled array divided by the number of values per counter (four for
+    32-bit types, two for 64-bit types), rounded up.
+    """
+
+    def __init__(self, seed=None, subsequence=0, offset=0):
+        if seed is None:
+            seed = (int(np.random.randint(2**31-1)) << 32) \
+                    | np.random.randint(2**31-1)
+
+        self.key = (int(seed) & 0xffffffff, (int(seed) >> 32) & 0xffffffff)
+        self.subsequence = subsequence
+        self.offset = offset
+
+    def _fill(self, name, data, stream):
+        func, per_block = _get_philox_kernel(name)
+
+        block_count = (data.size + per_block - 1) // per_block
+        if block_count:
+            from pycuda.gpuarray import splay
+            grid, block = splay(block_count)
+
+            func.prepared_async_call(grid, block, stream,
+                    data.gpudata, data.size, self.key[0], self.key[1],
+                    self.offset, self.subsequence)
+
+        self.offset += block_count
+
+    def fill_uniform(self, data, stream=None):
+        """Fill *data* with values uniformly distributed on (0, 1] for
+        floating point types, or with random bits for integer types.
+        """
+        if data.dtype == np.float32:
+            name = "uniform_float"
+        elif data.dtype == np.float64:
+            name = "uniform_double"
+        elif data.dtype in [np.int32, np.uint32]:
+            name = "uniform_int"
+        elif data.dtype in [np.int64, np.uint64]:
+            name = "uniform_long"
+        else:
+            raise NotImplementedError
+
+        self._fill(name, data, stream)
+
+    def fill_normal(self, data, stream=None):
+        if data.dtype == np.float32:
+            name = "normal_float"
+        elif data.dtype == np.float64:
+            name = "normal_double"
+        else:
+            raise NotImplementedError
+
+        self._fill(name, data, stream)
+
+    def gen_uniform(self, shape, dtype, stream=None):
+        result = array.empty(shape, dtype)
+        self.fill_uniform(result, stream)
+        return result
+
+    def gen_normal(self, shape, dtype, stream=None):
+        result = array.empty(shape, dtype)
+        self.fill_normal(result, stream)
+        return result
+
+    def skip_ahead(self, i):
+        """Skip *i* counters, i.e. *4 i* 32-bit random words."""
+        self.offset += i
+
+    def get_random_source_args(self, count):
+        """Return the kernel arguments making up a ``philox_rng`` random
+        source for *count* elements, see :func:`get_random_source_code`, and
+        advance :attr:`offset` by *count*.
+        """
+        result = [self.key[0], self.key[1], self.offset, self.subsequence]
+        self.offset += count
+        return result
+
+# }}}
+
+# {{{ random numbers in generated kernels
+
+RANDOM_SOURCE_TYPE = "philox_rng"
+
+philox_stream_preamble = """
+// Random words for one element: word k of element i comes from the
+// Philox block for counter counter_base + i and subsequence
+// subsequence + (k/4) 2^32.
+struct pycuda_philox_stream
+{
+  uint2 key;
+  unsigned long long counter_base;
+  unsigned long long subsequence;
+
+  unsigned long long counter;
+  unsigned draw;
+  uint4 block;
+};
+
+__device__ void pycuda_rng_begin(pycuda_philox_stream &s,
+    const unsigned long long i)
+{
+  s.counter = s.counter_base + i;
+  s.draw = 0;
+}
+
+__device__ unsigned pycuda_rng_next_word(pycuda_philox_stream &s)
+{
+  const unsigned draw = s.draw++;
+  if (draw % 4 == 0)
+    s.block = philox_block(s.counter,
+        s.subsequence + ((unsigned long long) (draw / 4) << 32), s.key);
+
+  switch (draw % 4)
+  {
+    case 0: return s.block.x;
+    case 1: return s.block.y;
+    case 2: return s.block.z;
+    default: return s.block.w;
+  }
+}
+
+__device__ float pycuda_rand_uniform_float(pycuda_philox_stream &s)
+{
+  return philox_u01_float(pycuda_rng_next_word(s));
+}
+
+__device__ double pycuda_rand_uniform_double(pycuda_philox_stream &s)
+{
+  const unsigned x = pycuda_rng_next_word(s);
+  const unsigned y = pycuda_rng_next_word(s);
+  return philox_u01_double(x, y);
+}
+
+__device__ float pycuda_rand_normal_float(pycuda_philox_stream &s)
+{
+  const float u1 = pycuda_rand_uniform_float(s);
+  const float u2 = pycuda_rand_uniform_float(s);
+  float out[2];
+  philox_box_muller_float(u1, u2, out);
+  return out[0];
+}
+
+__device__ double pycuda_rand_normal_double(pycuda_philox_stream &s)
+{
+  const double u1 = pycuda_rand_uniform_double(s);
+  const double u2 = pycuda_rand_uniform_double(s);
+  double out[2];
+  philox_box_muller_double(u1, u2, out);
+  return out[0];
+}
+
+#define rand_bits() pycuda_rng_next_word(pycuda_rng)
+#define rand_uniform() pycuda_rand_uniform_float(pycuda_rng)
+#define rand_uniform_double() pycuda_rand_uniform_double(pycuda_rng)
+#define rand_normal() pycuda_rand_normal_float(pycuda_rng)
+#define rand_normal_double() pycuda_rand_normal_double(pycuda_rng)
+"""
+
+def expand_random_source_arguments(arguments):
+    """Replace a declaration ``philox_rng name`` among the comma-separated C
+    argument declarations *arguments* by the scalar kernel arguments that
+    make up the random source. Return a tuple *(arguments, name)*, where
+    *name* is *None* if no random source is declared.
+    """
+    result = []
+    names = []
+    for arg in arguments.split(","):
+        words = arg.split()
+        if len(words) == 2 and words[0] == RANDOM_SOURCE_TYPE:
+            name = words[1]
+            names.append(name)
+            result.extend([
+                "unsigned int %s_key0" % name,
+                "unsigned int %s_key1" % name,
+                "unsigned long long %s_counter" % name,
+                "unsigned long long %s_subsequence" % name,
+                ])
+        else:
+            result.append(arg)
+
+    if len(names) > 1:
+        raise ValueError("at most one random source per kernel "
+                "is supported")
+
+    if names:
+        return ",".join(result), names[0]
+    else:
+        return arguments, None
+
+def get_random_source_code(name):
+    """Return a tuple *(preamble, prep)* of source code for a kernel with
+    the random source *name*, as declared by ``philox_rng name``. *prep*
+    must be placed at the start of the kernel body, and
+    ``pycuda_rng_begin(pycuda_rng, i)`` must be called before the
+    random numbers for element *i* are drawn by ``rand_uniform()``,
+    ``rand_normal()``, ``rand_uniform_double()``,
+    ``rand_normal_double()`` or ``rand_bits()``.
+    """
+    prep = """
+        pycuda_philox_stream pycuda_rng;
+        pycuda_rng.key = make_uint2(%(name)s_key0, %(name)s_key1);
+        pycuda_rng.counter_base = %(name)s_counter;
+        pycuda_rng.subsequence = %(name)s_subsequence;
+        """ % {"name": name}
+
+    return philox_preamble + philox_stream_preamble, prep
+
+# }}}
+
 # {{{ CURAND wrapper
 
 try:
@@ -265,7 +684,7 @@ if get_curand_version() >= (4, 0, 0):
 # {{{ Base class
 
 gen_template = """
-__global__ void %(name)s(%(state_type)s *s, %(out_type)s *d, const int n)
+__global__ void __launch_bounds__(%(threads)d) %(name)s(%(state_type)s *s, %(out_type)s *d, const int n)
 {
   const int tidx = blockIdx.x*blockDim.x+threadIdx.x;
   const int delta = blockDim.x*gridDim.x;
@@ -275,7 +694,7 @@ __global__ void %(name)s(%(state_type)s *s, %(out_type)s *d, const int n)
 """
 
 gen_log_template = """
-__global__ void %(name)s(%(state_type)s *s, %(out_type)s *d, %(in_type)s mean, %(in_type)s stddev, const int n)
+__global__ void __launch_bounds__(%(threads)d) %(name)s(%(state_type)s *s, %(out_type)s *d, %(in_type)s mean, %(in_type)s stddev, const int n)
 {
   const int tidx = blockIdx.x*blockDim.x+threadIdx.x;
   const int delta = blockDim.x*gridDim.x;
@@ -285,7 +704,7 @@ __global__ void %(name)s(%(state_type)s *s, %(out_type)s *d, %(in_type)s mean, %
 """
 
 gen_poisson_template = """
-__global__ void %(name)s(%(state_type)s *s, %(out_type)s *d, double lambda, const int n)
+__global__ void __launch_bounds__(%(threads)d) %(name)s(%(state_type)s *s, %(out_type)s *d, double lambda, const int n)
 {
   const int tidx = blockIdx.x*blockDim.x+threadIdx.x;
   const int delta = blockDim.x*gridDim.x;
@@ -342,6 +761,17 @@ __global__ void skip_ahead_array(%(state_type)s *s, const int n, const unsigned
 }
 """
 
+@context_dependent_memoize
+def _get_rng_module(source):
+    # shared by all generators using the same code in the current context
+    return pycuda.compiler.SourceModule(source, no_extern_c=True)
+
+@context_dependent_memoize
+def _get_rng_function(source, name, arg_types):
+    func = _get_rng_module(source).get_function(name)
+    func.prepare(arg_types)
+    return func
+
 class _RandomNumberGeneratorBase(object):
     """
     Class surrounding CURAND kernels from CUDA 3.2.
@@ -391,70 +821,42 @@ class _RandomNumberGeneratorBase(object):
                 result = result and self.has_box_muller
             return result
 
-        my_generators = [
-                (name, out_type, suffix)
-                for name, out_type, suffix in self.gen_info
-                if do_generate(out_type)]
-
-        if get_curand_version() >= (4, 0, 0):
-            my_log_generators = [
-                    (name, in_type, out_type, suffix)
-                    for name, in_type, out_type, suffix in self.gen_log_info
-                    if do_generate(out_type)]
-
-        if get_curand_version() >= (5, 0, 0):
-            my_poisson_generators = [
-                    (name, out_type, suffix)
-                    for name, out_type, suffix in self.gen_poisson_info
-                    if do_generate(out_type)]
+        # name -> (template, substitutions, argument types), compiled on
+        # first use by _get_generator
+        self._generator_info = {}
 
-        generator_sources = [
-                gen_template % {
+        for name, out_type, suffix in self.gen_info:
+            if do_generate(out_type):
+                self._generator_info[name] = (gen_template, {
                     "name": name, "out_type": out_type, "suffix": suffix,
-                    "state_type": state_type, }
-                for name, out_type, suffix in my_generators]
-        
+                    "state_type": state_type, }, "PPi")
+
         if get_curand_version() >= (4, 0, 0):
-            generator_sources.extend([
-                    gen_log_template % {
-                        "name": name, "in_type": in_type, "out_type": out_type,
-                        "suffix": suffix, "state_type": state_type, }
-                    for name, in_type, out_type, suffix in my_log_generators])
+            for name, in_type, out_type, suffix in self.gen_log_info:
+                if do_generate(out_type):
+                    self._generator_info[name] = (gen_log_template, {
+                        "name": name, "in_type": in_type,
+                        "out_type": out_type, "suffix": suffix,
+                        "state_type": state_type, },
+                        {"float": "PPffi", "double": "PPddi"}[in_type])
 
         if get_curand_version() >= (5, 0, 0):
-            generator_sources.extend([
-                    gen_poisson_template % {
+            for name, out_type, suffix in self.gen_poisson_info:
+                if do_generate(out_type):
+                    self._generator_info[name] = (gen_poisson_template, {
                         "name": name, "out_type": out_type, "suffix": suffix,
-                        "state_type": state_type, }
-                    for name, out_type, suffix in my_poisson_generators])
+                        "state_type": state_type, }, "PPdi")
 
         source = (random_source + additional_source) % {
             "state_type": state_type,
             "vector_type": vector_type,
             "scramble_type": scramble_type,
-            "generators": "\n".join(generator_sources)}
+            "generators": ""}
 
         # store in instance to let subclass constructors get to it.
-        self.module = module = pycuda.compiler.SourceModule(source, no_extern_c=True)
+        self.module = _get_rng_module(source)
 
         self.generators = {}
-        for name, out_type, suffix  in my_generators:
-            gen_func = module.get_function(name)
-            gen_func.prepare("PPi")
-            self.generators[name] = gen_func
-        if get_curand_version() >= (4, 0, 0):
-            for name, in_type, out_type, suffix  in my_log_generators:
-                gen_func = module.get_function(name)
-                if in_type == "float":
-                    gen_func.prepare("PPffi")
-                if in_type == "double":
-                    gen_func.prepare("PPddi")
-                self.generators[name] = gen_func
-        if get_curand_version() >= (5, 0, 0):
-            for name, out_type, suffix  in my_poisson_generators:
-                gen_func = module.get_function(name)
-                gen_func.prepare("PPdi")
-                self.generators[name] = gen_func
 
         self.generator_bits = generator_bits
         self._prepare_skipahead()
@@ -472,9 +874,11 @@ class _RandomNumberGeneratorBase(object):
         self.skip_ahead_array.prepare("PiP")
 
     def _kernels(self):
-        return (
-                list(self.generators.itervalues())
-                + [self.skip_ahead, self.skip_ahead_array])
+        """Return the kernels that are launched with
+        :attr:`generators_per_block` threads per block and are compiled
+        eagerly.
+        """
+        return [self.skip_ahead, self.skip_ahead_array]
 
     @property
     @memoize_method
@@ -482,26 +886,91 @@ class _RandomNumberGeneratorBase(object):
         return min(kernel.max_threads_per_block
                 for kernel in self._kernels())
 
+    def _get_generator(self, name):
+        try:
+            return self.generators[name]
+        except KeyError:
+            pass
+
+        try:
+            template, context, arg_types = self._generator_info[name]
+        except KeyError:
+            raise NotImplementedError("generator '%s' is not available "
+                    "on this device" % name)
+
+        # Launch bounds make sure that the generator can be launched with
+        # as many threads per block as the state was laid out for.
+        context = context.copy()
+        context["threads"] = self.generators_per_block
+
+        func = _get_rng_function(
+                random_source % {"generators": template % context},
+                name, arg_types)
+        self.generators[name] = func
+        return func
+
+    @memoize_method
+    def _get_state_nbytes(self):
+        from pycuda.characterize import sizeof
+        data_type_size = sizeof(self.state_type, "#include <curand_kernel.h>")
+
+        return self.block_count * self.generators_per_block * data_type_size
+
     @property
     def state(self):
         if self._state is None:
-            from pycuda.characterize import sizeof
-            data_type_size = sizeof(self.state_type, "#include <curand_kernel.h>")
-
-            self._state = drv.mem_alloc(
-                self.block_count * self.generators_per_block * data_type_size)
+            self._state = drv.mem_alloc(self._get_state_nbytes())
 
         return self._state
 
+    def get_state(self):
+        """Return a copy of the generator state as a :mod:`numpy` array of
+        bytes.
+        """
+        result = np.empty(self._get_state_nbytes(), dtype=np.uint8)
+        drv.memcpy_dtoh(result, self.state)
+        return result
+
+    def set_state(self, state):
+        """Restore a generator state returned by :meth:`get_state`."""
+        state = np.ascontiguousarray(state)
+        if state.nbytes != self._get_state_nbytes():
+            raise ValueError("state does not match the size of this "
+                    "generator's state")
+
+        drv.memcpy_htod(self.state, state)
+
+    def save_state(self, file):
+        """Save the generator state to *file*, a file name or file object, in
+        :func:`numpy.savez` format.
+        """
+        np.savez(file, state=self.get_state(),
+                state_type=np.array(self.state_type),
+                generator_count=np.array(
+                    self.block_count * self.generators_per_block))
+
+    def load_state(self, file):
+        """Restore a generator state saved by :meth:`save_state`, which must
+        stem from a generator of the same type on a device with the same
+        number of generators.
+        """
+        data = np.load(file)
+        if (str(data["state_type"]) != self.state_type
+                or int(data["generator_count"])
+                != self.block_count * self.generators_per_block):
+            raise ValueError("saved state does not match this generator")
+
+        self.set_state(data["state"])
+
     def fill_uniform(self, data, stream=None):
         if data.dtype == np.float32:
-            func = self.generators["uniform_float"]
+            func = self._get_generator("uniform_float")
         elif data.dtype == np.float64:
-            func = self.generators["uniform_double"]
+            func = self._get_generator("uniform_double")
         elif data.dtype in [np.int, np.int32, np.uint32]:
-            func = self.generators["uniform_int"]
+            func = self._get_generator("uniform_int")
         elif data.dtype in [np.int64, np.uint64] and self.generator_bits >= 64:
-            func = self.generators["uniform_long"]
+            func = self._get_generator("uniform_long")
         else:
             raise NotImplementedError
 
@@ -522,7 +991,7 @@ class _RandomNumberGeneratorBase(object):
             func_name += "2"
             data_size //= 2
 
-        func = self.generators[func_name]
+        func = self._get_generator(func_name)
 
         func.prepared_async_call(
                 (self.block_count, 1), (self.generators_per_block, 1, 1), stream,
@@ -552,7 +1021,7 @@ class _RandomNumberGeneratorBase(object):
                 func_name += "2"
                 data_size //= 2
 
-            func = self.generators[func_name]
+            func = self._get_generator(func_name)
 
             func.prepared_async_call(
                     (self.block_count, 1), (self.generators_per_block, 1, 1), stream,
@@ -570,7 +1039,7 @@ class _RandomNumberGeneratorBase(object):
             else:
                 raise NotImplementedError
 
-            func = self.generators[func_name]
+            func = self._get_generator(func_name)
 
             func.prepared_async_call(
                     (self.block_count, 1), (self.generators_per_block, 1, 1), stream,
@@ -597,11 +1066,20 @@ class _RandomNumberGeneratorBase(object):
 
 class _PseudoRandomNumberGeneratorBase(_RandomNumberGeneratorBase):
     def __init__(self, seed_getter, offset, state_type, vector_type,
-        generator_bits, additional_source, scramble_type=None):
+        generator_bits, additional_source, scramble_type=None,
+        saved_state=None):
 
         super(_PseudoRandomNumberGeneratorBase, self).__init__(
             state_type, vector_type, generator_bits, additional_source)
 
+        if saved_state is not None:
+            # skip the expensive initialization
+            if isinstance(saved_state, np.ndarray):
+                self.set_state(saved_state)
+            else:
+                self.load_state(saved_state)
+            return
+
         generator_count = self.generators_per_block * self.block_count
         if seed_getter is None:
             seed = array.to_gpu(
@@ -711,16 +1189,19 @@ if get_curand_version() >= (3, 2, 0):
     class XORWOWRandomNumberGenerator(_PseudoRandomNumberGeneratorBase):
         has_box_muller = True
 
-        def __init__(self, seed_getter=None, offset=0):
+        def __init__(self, seed_getter=None, offset=0, saved_state=None):
             """
             :arg seed_getter: a function that, given an integer count, will yield an `int32`
               :class:`GPUArray` of seeds.
+            :arg saved_state: a state returned by :meth:`get_state` or a file
+              written by :meth:`save_state`, to be used instead of seeding.
             """
 
             super(XORWOWRandomNumberGenerator, self).__init__(
                 seed_getter, offset,
                 'curandStateXORWOW', 'unsigned int', 32, xorwow_random_source+
-                xorwow_skip_ahead_sequence_source+random_skip_ahead64_source)
+                xorwow_skip_ahead_sequence_source+random_skip_ahead64_source,
+                saved_state=saved_state)
 
 # }}}
 
@@ -774,16 +1255,19 @@ if get_curand_version() >= (4, 1, 0):
     class MRG32k3aRandomNumberGenerator(_PseudoRandomNumberGeneratorBase):
         has_box_muller = True
 
-        def __init__(self, seed_getter=None, offset=0):
+        def __init__(self, seed_getter=None, offset=0, saved_state=None):
             """
             :arg seed_getter: a function that, given an integer count, will yield an `int32`
               :class:`GPUArray` of seeds.
+            :arg saved_state: a state returned by :meth:`get_state` or a file
+              written by :meth:`save_state`, to be used instead of seeding.
             """
 
             super(MRG32k3aRandomNumberGenerator, self).__init__(
                 seed_getter, offset,
                 'curandStateMRG32k3a', 'unsigned int', 32, mrg32k3a_random_source+
-                mrg32k3a_skip_ahead_sequence_source+random_skip_ahead64_source)
+                mrg32k3a_skip_ahead_sequence_source+random_skip_ahead64_source,
+                saved_state=saved_state)
 
         def _prepare_skipahead(self):
             super(MRG32k3aRandomNumberGenerator, self)._prepare_skipahead()
@@ -834,6 +1318,58 @@ if get_curand_version() >= (4, 0, 0):
         _get_scramble_constants64(result, count)
         return pycuda.gpuarray.to_gpu(result)
 
+# The tables below are computed on the host by pycuda._driver, without
+# CURAND. Dimension i of each table does not depend on the number of
+# dimensions requested, so the largest table computed so far for each
+# (kind, bits, seed) is kept and sliced.
+_sobol_table_cache = {}
+
+def _get_sobol_table(kind, count, bits, seed):
+    if bits == 32:
+        dtype = np.uint32
+    elif bits == 64:
+        dtype = np.uint64
+    else:
+        raise ValueError("bits must be 32 or 64")
+
+    key = (kind, bits, seed)
+    table = _sobol_table_cache.get(key)
+    if table is None or len(table) < count:
+        import pycuda._driver as _drv
+        if kind == "shifts":
+            table = np.empty((count,), dtype=dtype)
+            _drv._sobol_digital_shifts(table, count, bits, seed)
+        else:
+            table = np.empty((count, bits), dtype=dtype)
+            _drv._sobol_direction_vectors(table, count, bits)
+            if seed is not None:
+                _drv._sobol_scramble_direction_vectors(
+                        table, count, bits, seed)
+
+        _sobol_table_cache[key] = table
+
+    return table[:count]
+
+def generate_sobol_direction_vectors(count, bits=32, scramble_seed=None):
+    """Return a :class:`pycuda.gpuarray.GPUArray` of shape *(count, bits)*
+    holding Sobol direction vectors for *count* dimensions, computed on the
+    host. Unlike :func:`generate_direction_vectors`, this does not need
+    CURAND and is not limited to 20000 dimensions.
+
+    If *scramble_seed* is given, the vectors are scrambled by a random
+    linear matrix scramble drawn from *scramble_seed*.
+    """
+    return pycuda.gpuarray.to_gpu(
+            _get_sobol_table("vectors", count, bits, scramble_seed))
+
+def generate_sobol_digital_shifts(count, bits=32, seed=0):
+    """Return a :class:`pycuda.gpuarray.GPUArray` of *count* random
+    *bits*-bit digital shifts drawn from *seed*, suitable as the
+    *scramble_vector* of the scrambled Sobol generators.
+    """
+    return pycuda.gpuarray.to_gpu(
+            _get_sobol_table("shifts", count, bits, seed))
+
 sobol_random_source = """
 extern "C" {
 __global__ void prepare(%(state_type)s *s, const int n,
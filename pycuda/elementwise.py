@@ -31,14 +31,336 @@ OTHER DEALINGS IN THE SOFTWARE.
 from pycuda.tools import context_dependent_memoize
 import numpy as np
 from pycuda.tools import dtype_to_ctype, VectorArg, ScalarArg
+from pycuda.tools import get_specialization_policy
 from pytools import memoize_method
 
 
-def get_elwise_module(arguments, operation,
-        name="kernel", keep=False, options=None,
-        preamble="", loop_prep="", after_loop=""):
-    from pycuda.compiler import SourceModule
-    return SourceModule("""
+# {{{ vectorized access
+
+# bytes moved per vector load/store
+VECTOR_ACCESS_BYTES = 16
+
+
+def get_vector_width(dtype):
+    """Return the number of entries of *dtype* moved by one vector
+    load/store, or 1 if vector access is not possible for *dtype*.
+    """
+    itemsize = np.dtype(dtype).itemsize
+    if itemsize >= VECTOR_ACCESS_BYTES or VECTOR_ACCESS_BYTES % itemsize:
+        return 1
+    return VECTOR_ACCESS_BYTES // itemsize
+
+
+def _get_vector_transport_type(dtype, vector_width):
+    from pycuda.gpuarray import vec
+
+    dtype = np.dtype(dtype)
+    assert dtype.itemsize * vector_width == VECTOR_ACCESS_BYTES
+
+    if dtype == np.float32:
+        transport_dtype = vec.float4
+    elif dtype == np.float64:
+        transport_dtype = vec.double2
+    elif dtype == np.uint32:
+        transport_dtype = vec.uint4
+    else:
+        # only moves bits, entry type does not matter
+        transport_dtype = vec.int4
+
+    return dtype_to_ctype(transport_dtype)
+
+
+def _get_vectorized_loop(arguments, operation, vector_width):
+    """Return source code for a loop that processes *vector_width* entries per
+    iteration using vector loads and stores, or *None* if *operation* does not
+    permit this.
+
+    This works by textual substitution: every vector argument must only be
+    accessed as ``name[i]`` in *operation*. Such accesses are redirected to a
+    local copy of the current vector.
+    """
+    import re
+
+    if re.search(r"\b(return|break|goto)\b", operation):
+        return None
+
+    vector_args = [arg for arg in arguments if isinstance(arg, VectorArg)]
+    if not vector_args:
+        return None
+
+    if len(set(arg.dtype.itemsize for arg in vector_args)) != 1:
+        return None
+
+    # Without control flow, a vector whose only access is a plain assignment
+    # at the start of a statement does not need to be loaded.
+    has_control_flow = bool(re.search(
+        r"\b(if|switch|while|for|do|continue)\b|\?", operation))
+
+    loads = []
+    stores = []
+    vec_operation = operation
+
+    for arg in vector_args:
+        access_re = re.compile(r"\b%s\s*\[\s*i\s*\]" % re.escape(arg.name))
+        write_re = re.compile(
+                r"(%s\s*(=(?!=)|\+=|-=|\*=|/=|%%=|&=|\|=|\^=|<<=|>>=|\+\+|--))"
+                r"|((\+\+|--)\s*%s)"
+                r"|(&\s*%s)"
+                % ((access_re.pattern,)*3))
+
+        first_access = access_re.search(vec_operation)
+        if first_access is None:
+            if re.search(r"\b%s\b" % re.escape(arg.name), vec_operation):
+                return None
+            continue
+
+        is_written = bool(write_re.search(vec_operation))
+        is_read = not (is_written
+                and not has_control_flow
+                and len(access_re.findall(vec_operation)) == 1
+                and vec_operation[:first_access.start()].rstrip()[-1:]
+                in ["", ";", "{"]
+                and re.match(r"\s*=(?!=)",
+                    vec_operation[first_access.end():]))
+
+        local_name = "%s_pycuda_vec" % arg.name
+        vec_operation = access_re.sub(
+                "%s[pycuda_k]" % local_name, vec_operation)
+        if re.search(r"\b%s\b" % re.escape(arg.name), vec_operation):
+            # pointer used in some other way
+            return None
+
+        ctype = dtype_to_ctype(arg.dtype)
+        vtype = _get_vector_transport_type(arg.dtype, vector_width)
+
+        if is_read:
+            loads.append("%(vtype)s %(name)s_pycuda_vv "
+                    "= ((const %(vtype)s *) %(name)s)[vi];" % {
+                        "vtype": vtype, "name": arg.name})
+        else:
+            loads.append("%(vtype)s %(name)s_pycuda_vv;" % {
+                        "vtype": vtype, "name": arg.name})
+
+        loads.append("%(ctype)s *%(local_name)s "
+                "= (%(ctype)s *) &%(name)s_pycuda_vv;" % {
+                    "ctype": ctype, "local_name": local_name,
+                    "name": arg.name})
+
+        if is_written:
+            stores.append("((%(vtype)s *) %(name)s)[vi] "
+                    "= %(name)s_pycuda_vv;" % {
+                        "vtype": vtype, "name": arg.name})
+
+    return """
+          for (unsigned long vi = cta_start + tid; vi < n / %(width)d;
+              vi += total_threads)
+          {
+            %(loads)s
+
+            #pragma unroll
+            for (unsigned pycuda_k = 0; pycuda_k < %(width)d; ++pycuda_k)
+            {
+              i = vi*%(width)d + pycuda_k;
+              %(operation)s;
+            }
+
+            %(stores)s
+          }
+          """ % {
+                  "width": vector_width,
+                  "loads": "\n            ".join(loads),
+                  "stores": "\n            ".join(stores),
+                  "operation": vec_operation,
+                  }
+
+# }}}
+
+
+# {{{ strided access
+
+STRIDED_ARRAY_PREAMBLE = """
+#ifndef PYCUDA_STRIDED_ARRAY_DEFINED
+#define PYCUDA_STRIDED_ARRAY_DEFINED
+// templates may not have C linkage, and elementwise kernels are compiled
+// inside extern "C"
+extern "C++" {
+template <class T, int NDIM>
+struct pycuda_strided_array
+{
+  T *base;
+  long strides[NDIM];
+  unsigned long shape[NDIM];
+
+  // i is the index in C order, strides are given in entries
+  __device__ T &operator[](unsigned long i) const
+  {
+    long offset = 0;
+    #pragma unroll
+    for (int d = NDIM-1; d >= 0; --d)
+    {
+      offset += (long) (i % shape[d]) * strides[d];
+      i /= shape[d];
+    }
+    return base[offset];
+  }
+};
+}
+#endif
+"""
+
+
+def get_collapsed_layout(shape, strides_list):
+    """Merge adjacent axes along which all arrays described by the byte
+    stride tuples in *strides_list* are contiguous, and drop axes of
+    length 1.
+
+    Return a tuple *(shape, strides_list)* describing the same elements
+    in C order, with at least one axis.
+    """
+    axes = [(length, [strides[d] for strides in strides_list])
+            for d, length in enumerate(shape) if length != 1]
+
+    if not axes:
+        return (1,), [(0,) for strides in strides_list]
+
+    merged = [axes[0]]
+    for length, strides in axes[1:]:
+        prev_length, prev_strides = merged[-1]
+        if all(prev_stride == stride*length
+                for prev_stride, stride in zip(prev_strides, strides)):
+            merged[-1] = (prev_length*length, strides)
+        else:
+            merged.append((length, strides))
+
+    new_shape = tuple(length for length, strides in merged)
+    new_strides_list = [
+            tuple(strides[i] for length, strides in merged)
+            for i in range(len(strides_list))]
+
+    return new_shape, new_strides_list
+
+
+def get_c_strides(shape, itemsize):
+    strides = []
+    stride = itemsize
+    for length in shape[::-1]:
+        strides.append(stride)
+        stride *= length
+
+    return tuple(strides[::-1])
+
+
+def get_strided_layout(vectors):
+    """Return *None* if the arrays in *vectors* can be accessed as flat
+    arrays with a common index. Otherwise, return a tuple
+    *(shape, strides_list)* with the collapsed shape and the strides in
+    entries (or *None* for arrays that can be accessed as flat arrays)
+    for each array.
+    """
+    if (all(vec.flags.c_contiguous for vec in vectors)
+            or all(vec.flags.f_contiguous for vec in vectors)):
+        return None
+
+    shape = vectors[0].shape
+    for vec in vectors:
+        if vec.shape != shape:
+            if all(vec.flags.forc for vec in vectors):
+                # flat access, as before strided access was supported
+                return None
+
+            raise ValueError("non-contiguous vector arguments must all "
+                    "have the same shape")
+
+    collapsed_shape, strides_list = get_collapsed_layout(
+            shape, [vec.strides for vec in vectors])
+
+    result_strides = []
+    for vec, strides in zip(vectors, strides_list):
+        if strides == get_c_strides(collapsed_shape, vec.dtype.itemsize):
+            result_strides.append(None)
+        else:
+            for stride in strides:
+                if stride % vec.dtype.itemsize:
+                    raise ValueError("strides must be a multiple of the "
+                            "entry size")
+            result_strides.append(
+                    tuple(stride // vec.dtype.itemsize for stride in strides))
+
+    if all(strides is None for strides in result_strides):
+        return None
+
+    return collapsed_shape, result_strides
+
+
+def get_strided_arguments(arguments, strided_names, ndim):
+    """Rewrite *arguments* so that the vector arguments named in
+    *strided_names* are accessed through a ``pycuda_strided_array``.
+
+    Return a tuple *(arguments, declarations)*. The returned *arguments*
+    have the stride arguments of each strided vector (in the order of
+    *strided_names*) and then the *ndim* shape arguments appended.
+    *declarations* needs to be placed at the start of the kernel body.
+    """
+    new_arguments = []
+    decls = []
+    for arg in arguments:
+        if isinstance(arg, VectorArg) and arg.name in strided_names:
+            new_arguments.append(VectorArg(arg.dtype, arg.name+"_pycuda_base"))
+            decls.append(
+                    "pycuda_strided_array<%(tp)s, %(ndim)d> %(name)s = {"
+                    "%(name)s_pycuda_base, {%(strides)s}, {%(shape)s}};" % {
+                        "tp": dtype_to_ctype(arg.dtype),
+                        "ndim": ndim,
+                        "name": arg.name,
+                        "strides": ", ".join(
+                            "%s_pycuda_stride%d" % (arg.name, i)
+                            for i in range(ndim)),
+                        "shape": ", ".join(
+                            "pycuda_shape%d" % i for i in range(ndim)),
+                        })
+        else:
+            new_arguments.append(arg)
+
+    for name in strided_names:
+        new_arguments.extend(
+                ScalarArg(np.intp, "%s_pycuda_stride%d" % (name, i))
+                for i in range(ndim))
+
+    new_arguments.extend(
+            ScalarArg(np.uintp, "pycuda_shape%d" % i) for i in range(ndim))
+
+    return new_arguments, "\n".join(decls)
+
+# }}}
+
+
+def get_elwise_source(arguments, operation,
+        name="kernel", preamble="", loop_prep="", after_loop="",
+        static_n=None, static_total_threads=None, vector_width=None):
+    """Return the source code of an elementwise kernel, see
+    :func:`get_elwise_module`.
+    """
+    if static_n is not None:
+        size_decls = """
+          const unsigned long n = %dul;
+          const unsigned total_threads = %du;
+          """ % (static_n, static_total_threads)
+    else:
+        size_decls = """
+          unsigned total_threads = gridDim.x*blockDim.x;
+          """
+
+    if vector_width is not None and vector_width > 1:
+        vector_loop = _get_vectorized_loop(arguments, operation, vector_width)
+        if vector_loop is None:
+            raise ValueError("operation does not permit vector access")
+        scalar_start = "(n / %d) * %d + cta_start + tid" % (
+                vector_width, vector_width)
+    else:
+        vector_loop = ""
+        scalar_start = "cta_start + tid"
+
+    return """
         #include <pycuda-complex.hpp>
 
         %(preamble)s
@@ -47,13 +369,15 @@ def get_elwise_module(arguments, operation,
         {
 
           unsigned tid = threadIdx.x;
-          unsigned total_threads = gridDim.x*blockDim.x;
+          %(size_decls)s
           unsigned cta_start = blockDim.x*blockIdx.x;
           unsigned i;
 
           %(loop_prep)s;
 
-          for (i = cta_start + tid; i < n; i += total_threads)
+          %(vector_loop)s
+
+          for (i = %(scalar_start)s; i < n; i += total_threads)
           {
             %(operation)s;
           }
@@ -67,8 +391,33 @@ def get_elwise_module(arguments, operation,
             "preamble": preamble,
             "loop_prep": loop_prep,
             "after_loop": after_loop,
-            },
-        options=options, keep=keep)
+            "size_decls": size_decls,
+            "vector_loop": vector_loop,
+            "scalar_start": scalar_start,
+            }
+
+
+def get_elwise_module(arguments, operation,
+        name="kernel", keep=False, options=None,
+        preamble="", loop_prep="", after_loop="",
+        static_n=None, static_total_threads=None, vector_width=None):
+    """If *static_n* is given, *n* is not expected among *arguments* but
+    baked into the generated code as a compile-time constant, along with
+    *static_total_threads*, the number of threads the kernel will be
+    launched with.
+
+    If *vector_width* is greater than one, the bulk of the work is done by a
+    loop that accesses *vector_width* consecutive entries of each vector
+    argument at once, followed by a scalar loop for the remainder. All vector
+    arguments must then be aligned to :data:`VECTOR_ACCESS_BYTES` and the
+    kernel should be launched for ``n // vector_width`` threads.
+    """
+    from pycuda.compiler import SourceModule
+    return SourceModule(
+            get_elwise_source(arguments, operation, name,
+                preamble, loop_prep, after_loop,
+                static_n, static_total_threads, vector_width),
+            options=options, keep=keep)
 
 
 def get_elwise_range_module(arguments, operation,
@@ -119,11 +468,69 @@ def get_elwise_range_module(arguments, operation,
         options=options, keep=keep)
 
 
-def get_elwise_kernel_and_types(arguments, operation,
-        name="kernel", keep=False, options=None, use_range=False, **kwargs):
+def _parse_elwise_arguments(arguments):
     if isinstance(arguments, str):
         from pycuda.tools import parse_c_arg
-        arguments = [parse_c_arg(arg) for arg in arguments.split(",")]
+        from pycuda.curandom import expand_random_source_arguments
+        arguments, rng_name = expand_random_source_arguments(arguments)
+        return [parse_c_arg(arg) for arg in arguments.split(",")]
+    else:
+        # don't modify the caller's list
+        return list(arguments)
+
+
+def _expand_random_source_call_args(args):
+    """Replace the random number generators among the kernel call arguments
+    *args* by the arguments of their random source, advancing them by one
+    counter per entry of the first vector argument.
+    """
+    if not [arg for arg in args if hasattr(arg, "get_random_source_args")]:
+        return args
+
+    size = [arg for arg in args if hasattr(arg, "gpudata")][0].size
+
+    result = []
+    for arg in args:
+        if hasattr(arg, "get_random_source_args"):
+            result.extend(arg.get_random_source_args(size))
+        else:
+            result.append(arg)
+
+    return tuple(result)
+
+
+def get_elwise_kernel_and_types(arguments, operation,
+        name="kernel", keep=False, options=None, use_range=False,
+        strided=None, **kwargs):
+    """If *strided* is given, it must be a tuple *(strided_names, ndim)*, see
+    :func:`get_strided_arguments`.
+
+    If *arguments* is a string declaring a random source ``philox_rng
+    name``, *operation* may draw random numbers for element *i* by
+    ``rand_uniform()`` etc., see
+    :func:`pycuda.curandom.get_random_source_code`.
+    """
+    rng_name = None
+    if isinstance(arguments, str):
+        from pycuda.curandom import expand_random_source_arguments
+        rng_name = expand_random_source_arguments(arguments)[1]
+
+    arguments = _parse_elwise_arguments(arguments)
+
+    if rng_name is not None:
+        from pycuda.curandom import get_random_source_code
+        rng_preamble, rng_prep = get_random_source_code(rng_name)
+        kwargs["preamble"] = rng_preamble + kwargs.get("preamble", "")
+        kwargs["loop_prep"] = rng_prep + "\n" + kwargs.get("loop_prep", "")
+        operation = "pycuda_rng_begin(pycuda_rng, i);\n" + operation
+
+    if strided is not None:
+        strided_names, ndim = strided
+        arguments, decls = get_strided_arguments(
+                arguments, strided_names, ndim)
+        kwargs["preamble"] = (
+                STRIDED_ARRAY_PREAMBLE + kwargs.get("preamble", ""))
+        kwargs["loop_prep"] = decls + "\n" + kwargs.get("loop_prep", "")
 
     if use_range:
         arguments.extend([
@@ -131,7 +538,7 @@ def get_elwise_kernel_and_types(arguments, operation,
             ScalarArg(np.intp, "stop"),
             ScalarArg(np.intp, "step"),
             ])
-    else:
+    elif kwargs.get("static_n") is None:
         arguments.append(ScalarArg(np.uintp, "n"))
 
     if use_range:
@@ -161,12 +568,16 @@ def get_elwise_kernel(arguments, operation,
 
 class ElementwiseKernel:
     def __init__(self, arguments, operation,
-            name="kernel", keep=False, options=None, **kwargs):
+            name="kernel", keep=False, options=None, specialize=False,
+            vectorize=True, **kwargs):
 
         self.gen_kwargs = kwargs.copy()
         self.gen_kwargs.update(dict(keep=keep, options=options, name=name,
             operation=operation, arguments=arguments))
 
+        self.specialization_policy = get_specialization_policy(specialize)
+        self.vectorize = vectorize
+
     @memoize_method
     def generate_stride_kernel_and_types(self, use_range):
         knl, arguments = get_elwise_kernel_and_types(use_range=use_range,
@@ -179,8 +590,60 @@ class ElementwiseKernel:
 
         return knl, arguments
 
+    @memoize_method
+    def generate_kernel(self, vector_width, static_n, static_total_threads):
+        if vector_width == 1 and static_n is None:
+            knl, arguments = self.generate_stride_kernel_and_types(False)
+        else:
+            knl, arguments = get_elwise_kernel_and_types(use_range=False,
+                    vector_width=vector_width, static_n=static_n,
+                    static_total_threads=static_total_threads,
+                    **self.gen_kwargs)
+        return knl
+
+    @memoize_method
+    def get_max_vector_width(self):
+        """Return the vector width the operation could be run with, given
+        suitably aligned arguments.
+        """
+        if not self.vectorize:
+            return 1
+
+        arguments = _parse_elwise_arguments(self.gen_kwargs["arguments"])
+        vector_args = [arg for arg in arguments if isinstance(arg, VectorArg)]
+        if not vector_args:
+            return 1
+
+        vector_width = get_vector_width(vector_args[0].dtype)
+        if (vector_width > 1
+                and _get_vectorized_loop(arguments,
+                    self.gen_kwargs["operation"], vector_width) is not None):
+            return vector_width
+        else:
+            return 1
+
+    @memoize_method
+    def generate_strided_kernel(self, strided_names, ndim):
+        knl, arguments = get_elwise_kernel_and_types(use_range=False,
+                strided=(strided_names, ndim), **self.gen_kwargs)
+        return knl
+
+    def get_vector_width(self, vectors):
+        vector_width = self.get_max_vector_width()
+        if vector_width == 1:
+            return 1
+
+        for vec in vectors:
+            if (int(vec.gpudata) % VECTOR_ACCESS_BYTES
+                    or vec.dtype.itemsize * vector_width
+                    != VECTOR_ACCESS_BYTES):
+                return 1
+
+        return vector_width
+
     def __call__(self, *args, **kwargs):
         vectors = []
+        args = _expand_random_source_call_args(args)
 
         range_ = kwargs.pop("range", None)
         slice_ = kwargs.pop("slice", None)
@@ -194,19 +657,41 @@ class ElementwiseKernel:
         func, arguments = self.generate_stride_kernel_and_types(
                 range_ is not None or slice_ is not None)
 
+        vector_names = []
         for arg, arg_descr in zip(args, arguments):
             if isinstance(arg_descr, VectorArg):
-                if not arg.flags.forc:
-                    raise RuntimeError("elementwise kernel cannot "
-                            "deal with non-contiguous arrays")
-
                 vectors.append(arg)
+                vector_names.append(arg_descr.name)
                 invocation_args.append(arg.gpudata)
             else:
                 invocation_args.append(arg)
 
         repr_vec = vectors[0]
 
+        strided_layout = get_strided_layout(vectors)
+        if strided_layout is not None:
+            if range_ is not None or slice_ is not None:
+                raise RuntimeError("elementwise kernel cannot deal with "
+                        "non-contiguous arrays when range or slice is given")
+
+            shape, strides_list = strided_layout
+
+            strided_names = []
+            for name, strides in zip(vector_names, strides_list):
+                if strides is not None:
+                    strided_names.append(name)
+                    invocation_args.extend(strides)
+            invocation_args.extend(shape)
+            invocation_args.append(repr_vec.size)
+
+            func = self.generate_strided_kernel(
+                    tuple(strided_names), len(shape))
+
+            from pycuda.gpuarray import splay
+            grid, block = splay(repr_vec.size)
+            func.prepared_async_call(grid, block, stream, *invocation_args)
+            return
+
         if slice_ is not None:
             if range_ is not None:
                 raise TypeError("may not specify both range and slice "
@@ -225,9 +710,25 @@ class ElementwiseKernel:
             from pycuda.gpuarray import splay
             grid, block = splay(abs(range_.stop - range_.start)//range_.step)
         else:
-            block = repr_vec._block
-            grid = repr_vec._grid
-            invocation_args.append(repr_vec.mem_size)
+            n = repr_vec.mem_size
+            vector_width = self.get_vector_width(vectors)
+
+            if vector_width > 1:
+                from pycuda.gpuarray import splay
+                grid, block = splay(max(n // vector_width, 1))
+            else:
+                block = repr_vec._block
+                grid = repr_vec._grid
+
+            policy = self.specialization_policy
+            if (policy is not None
+                    and policy.should_specialize(
+                        (n, vector_width, grid, block))):
+                func = self.generate_kernel(
+                        vector_width, n, grid[0]*block[0])
+            else:
+                func = self.generate_kernel(vector_width, None, None)
+                invocation_args.append(n)
 
         func.prepared_async_call(grid, block, stream, *invocation_args)
 
@@ -1248,10 +1248,10 @@ maximum = _make_binary_minmax_func("max")
 
 # {{{ reductions
 
-def sum(a, dtype=None, stream=None):
+def sum(a, dtype=None, stream=None, axis=None):
     from pycuda.reduction import get_sum_kernel
     krnl = get_sum_kernel(dtype, a.dtype)
-    return krnl(a, stream=stream)
+    return krnl(a, stream=stream, axis=axis)
 
 
 def subset_sum(subset, a, dtype=None, stream=None):
@@ -1275,10 +1275,10 @@ def subset_dot(subset, a, b, dtype=None, stream=None):
 
 
 def _make_minmax_kernel(what):
-    def f(a, stream=None):
+    def f(a, stream=None, axis=None):
         from pycuda.reduction import get_minmax_kernel
         krnl = get_minmax_kernel(what, a.dtype)
-        return krnl(a,  stream=stream)
+        return krnl(a,  stream=stream, axis=axis)
 
     return f
 
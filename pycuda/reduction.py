@@ -63,6 +63,8 @@ source code with only those rights set forth herein.
 
 from pycuda.tools import context_dependent_memoize
 from pycuda.tools import dtype_to_ctype
+from pycuda.tools import get_specialization_policy
+from pytools import memoize_method
 import numpy as np
 
 
@@ -70,7 +72,24 @@ import numpy as np
 
 def get_reduction_module(out_type, block_size,
         neutral, reduce_expr, map_expr, arguments,
-        name="reduce_kernel", keep=False, options=None, preamble=""):
+        name="reduce_kernel", keep=False, options=None, preamble="",
+        static_sizes=None, arg_prep=""):
+    """If *static_sizes* is a tuple *(seq_count, n)*, these values are baked
+    into the generated code as compile-time constants instead of being
+    passed as kernel arguments. *arg_prep* is placed at the start of the
+    kernel body.
+    """
+
+    if static_sizes is not None:
+        size_args = ""
+        size_decls = """
+          const unsigned int seq_count = %du;
+          const unsigned int n = %du;
+          """ % static_sizes
+    else:
+        size_args = """,
+          unsigned int seq_count, unsigned int n"""
+        size_decls = ""
 
     from pycuda.compiler import SourceModule
     src = """
@@ -86,9 +105,11 @@ def get_reduction_module(out_type, block_size,
 
         extern "C"
         __global__
-        void %(name)s(out_type *out, %(arguments)s,
-          unsigned int seq_count, unsigned int n)
+        void %(name)s(out_type *out, %(arguments)s%(size_args)s)
         {
+          %(size_decls)s
+          %(arg_prep)s
+
           // Needs to be variable-size to prevent the braindead CUDA compiler from
           // running constructors on this array. Grrrr.
           extern __shared__ out_type sdata[];
@@ -148,7 +169,10 @@ def get_reduction_module(out_type, block_size,
             "reduce_expr": reduce_expr,
             "map_expr": map_expr,
             "name": name,
-            "preamble": preamble
+            "preamble": preamble,
+            "size_args": size_args,
+            "size_decls": size_decls,
+            "arg_prep": arg_prep,
             }
     return SourceModule(src, options=options, keep=keep, no_extern_c=True)
 
@@ -157,12 +181,43 @@ def get_reduction_module(out_type, block_size,
 
 def get_reduction_kernel_and_types(stage, out_type, block_size,
         neutral, reduce_expr, map_expr=None, arguments=None,
-        name="reduce_kernel", keep=False, options=None, preamble=""):
+        name="reduce_kernel", keep=False, options=None, preamble="",
+        static_sizes=None, strided=None):
+    """If *strided* is given, it must be a tuple *(strided_names, ndim)*, see
+    :func:`pycuda.elementwise.get_strided_arguments`. Only supported for
+    stage 1.
+    """
+
+    arg_prep = ""
+
+    rng_name = None
+    if arguments is not None:
+        from pycuda.curandom import expand_random_source_arguments
+        arguments, rng_name = expand_random_source_arguments(arguments)
 
     if stage == 1:
         if map_expr is None:
             map_expr = "in[i]"
 
+        if strided is not None:
+            from pycuda.tools import parse_c_arg
+            from pycuda.elementwise import (get_strided_arguments,
+                    STRIDED_ARRAY_PREAMBLE)
+
+            strided_names, ndim = strided
+            parsed_args, arg_prep = get_strided_arguments(
+                    [parse_c_arg(arg) for arg in arguments.split(",")],
+                    strided_names, ndim)
+            arguments = ", ".join(arg.declarator() for arg in parsed_args)
+            preamble = STRIDED_ARRAY_PREAMBLE + preamble
+
+        if rng_name is not None:
+            from pycuda.curandom import get_random_source_code
+            rng_preamble, rng_prep = get_random_source_code(rng_name)
+            preamble = rng_preamble + preamble
+            arg_prep = arg_prep + rng_prep
+            map_expr = "(pycuda_rng_begin(pycuda_rng, i), (%s))" % map_expr
+
     elif stage == 2:
         if map_expr is None:
             map_expr = "pycuda_reduction_inp[i]"
@@ -178,27 +233,284 @@ def get_reduction_kernel_and_types(stage, out_type, block_size,
 
     mod = get_reduction_module(out_type, block_size,
             neutral, reduce_expr, map_expr, arguments,
-            name, keep, options, preamble)
+            name, keep, options, preamble, static_sizes, arg_prep)
 
     from pycuda.tools import get_arg_type
     func = mod.get_function(name)
     arg_types = [get_arg_type(arg) for arg in arguments.split(",")]
-    func.prepare("P%sII" % "".join(arg_types))
+    if static_sizes is None:
+        func.prepare("P%sII" % "".join(arg_types))
+    else:
+        func.prepare("P%s" % "".join(arg_types))
 
     return func, arg_types
 
 
 
 
+# {{{ reductions along an axis
+
+AXIS_BLOCK_SIZE = 256
+AXIS_WARP_SIZE = 32
+AXIS_COLUMN_WIDTH = 32
+AXIS_COLUMN_SPLIT = AXIS_BLOCK_SIZE // AXIS_COLUMN_WIDTH
+AXIS_MAX_BLOCK_COUNT = 4096
+
+# Rows at least this long are reduced by a whole block instead of a warp
+# if there are too few of them to keep the device busy otherwise.
+AXIS_LONG_ROW_LENGTH = 4096
+AXIS_FEW_ROWS = 512
+
+
+def get_axis_layout(shape, strides, axis, itemsize):
+    """Describe the reduction of an array with byte *strides* along *axis*.
+
+    Return a tuple *(kept_shape, kept_strides, row_length, axis_stride)*.
+    *kept_shape* and *kept_strides* give the collapsed layout of the
+    remaining axes, see :func:`pycuda.elementwise.get_collapsed_layout`,
+    *row_length* is the length of *axis*. All strides are in entries.
+    """
+    for stride in strides:
+        if stride % itemsize:
+            raise ValueError("strides must be a multiple of the entry size")
+
+    kept_shape = shape[:axis] + shape[axis+1:]
+    kept_strides = strides[:axis] + strides[axis+1:]
+
+    from pycuda.elementwise import get_collapsed_layout
+    kept_shape, (kept_strides,) = get_collapsed_layout(
+            kept_shape, [kept_strides])
+
+    return (kept_shape, tuple(stride // itemsize for stride in kept_strides),
+            shape[axis], strides[axis] // itemsize)
+
+
+def get_axis_reduction_plan(out_count, row_length, axis_stride):
+    """Return a tuple *(kind, group_size, block_count)*.
+
+    If *kind* is ``"rows"``, the entries of each output are contiguous and
+    reduced by *group_size* consecutive threads, a warp or a whole block.
+    If *kind* is ``"columns"``, consecutive threads compute consecutive
+    outputs, so that they read neighboring entries if the outputs are
+    contiguous. *group_size* threads then share the work of each output.
+    """
+    if axis_stride == 1 and row_length >= AXIS_WARP_SIZE:
+        kind = "rows"
+        if (row_length >= AXIS_LONG_ROW_LENGTH
+                and out_count < AXIS_FEW_ROWS):
+            group_size = AXIS_BLOCK_SIZE
+        else:
+            group_size = AXIS_WARP_SIZE
+        outputs_per_block = AXIS_BLOCK_SIZE // group_size
+    else:
+        kind = "columns"
+        group_size = AXIS_COLUMN_SPLIT
+        outputs_per_block = AXIS_COLUMN_WIDTH
+
+    block_count = min(
+            (out_count + outputs_per_block - 1) // outputs_per_block,
+            AXIS_MAX_BLOCK_COUNT)
+
+    return kind, group_size, block_count
+
+
+AXIS_REDUCTION_SOURCE = """
+    #include <pycuda-complex.hpp>
+
+    #define BLOCK_SIZE %(block_size)d
+    #define GROUP_SIZE %(group_size)d
+    #define NDIM %(ndim)d
+    #define READ_AND_MAP(i) (%(map_expr)s)
+    #define REDUCE(a, b) (%(reduce_expr)s)
+
+    %(preamble)s
+
+    typedef %(out_type)s out_type;
+
+    // offset in entries of the first entry reduced into output o
+    __device__ long pycuda_reduction_base(unsigned long o,
+        const unsigned long *shape, const long *strides)
+    {
+      long offset = 0;
+      #pragma unroll
+      for (int d = NDIM-1; d >= 0; --d)
+      {
+        offset += (long) (o %% shape[d]) * strides[d];
+        o /= shape[d];
+      }
+      return offset;
+    }
+
+    extern "C"
+    __global__
+    void %(name)s(out_type *out, %(arguments)s,
+      unsigned int out_count, unsigned int row_length, long axis_stride,
+      %(layout_args)s)
+    {
+      const unsigned long shape[NDIM] = {%(shape)s};
+      const long strides[NDIM] = {%(strides)s};
+
+      extern __shared__ out_type sdata[];
+
+      %(body)s
+    }
+    """
+
+# Each group of GROUP_SIZE threads reduces a row of contiguous entries.
+AXIS_ROWS_BODY = """
+      const unsigned int tid = threadIdx.x;
+      const unsigned int lane = tid %% GROUP_SIZE;
+      const unsigned int groups_per_block = BLOCK_SIZE / GROUP_SIZE;
+
+      for (unsigned int first = blockIdx.x*groups_per_block; first < out_count;
+          first += gridDim.x*groups_per_block)
+      {
+        const unsigned int o = first + tid / GROUP_SIZE;
+
+        out_type acc = %(neutral)s;
+        if (o < out_count)
+        {
+          const long base = pycuda_reduction_base(o, shape, strides);
+          for (unsigned int j = lane; j < row_length; j += GROUP_SIZE)
+          {
+            const long i = base + j*axis_stride;
+            acc = REDUCE(acc, READ_AND_MAP(i));
+          }
+        }
+
+        sdata[tid] = acc;
+
+        __syncthreads();
+
+        #if (GROUP_SIZE >= 512)
+          if (lane < 256) { sdata[tid] = REDUCE(sdata[tid], sdata[tid + 256]); }
+          __syncthreads();
+        #endif
+
+        #if (GROUP_SIZE >= 256)
+          if (lane < 128) { sdata[tid] = REDUCE(sdata[tid], sdata[tid + 128]); }
+          __syncthreads();
+        #endif
+
+        #if (GROUP_SIZE >= 128)
+          if (lane < 64) { sdata[tid] = REDUCE(sdata[tid], sdata[tid + 64]); }
+          __syncthreads();
+        #endif
+
+        if (lane < 32)
+        {
+          // 'volatile' required according to Fermi compatibility guide 1.2.2
+          volatile out_type *smem = sdata;
+          if (GROUP_SIZE >= 64) smem[tid] = REDUCE(smem[tid], smem[tid + 32]);
+          if (lane < 16) smem[tid] = REDUCE(smem[tid], smem[tid + 16]);
+          if (lane < 8)  smem[tid] = REDUCE(smem[tid], smem[tid + 8]);
+          if (lane < 4)  smem[tid] = REDUCE(smem[tid], smem[tid + 4]);
+          if (lane < 2)  smem[tid] = REDUCE(smem[tid], smem[tid + 2]);
+          if (lane < 1)  smem[tid] = REDUCE(smem[tid], smem[tid + 1]);
+        }
+
+        if (lane == 0 && o < out_count)
+          out[o] = sdata[tid];
+
+        __syncthreads();
+      }
+    """
+
+# Thread (x, y) reduces every GROUP_SIZE-th entry, starting at y, of
+# output x of the block.
+AXIS_COLUMNS_BODY = """
+      const unsigned int tx = threadIdx.x;
+      const unsigned int ty = threadIdx.y;
+      const unsigned int width = BLOCK_SIZE / GROUP_SIZE;
+
+      for (unsigned int first = blockIdx.x*width; first < out_count;
+          first += gridDim.x*width)
+      {
+        const unsigned int o = first + tx;
+
+        out_type acc = %(neutral)s;
+        if (o < out_count)
+        {
+          const long base = pycuda_reduction_base(o, shape, strides);
+          for (unsigned int j = ty; j < row_length; j += GROUP_SIZE)
+          {
+            const long i = base + j*axis_stride;
+            acc = REDUCE(acc, READ_AND_MAP(i));
+          }
+        }
+
+        sdata[ty*width + tx] = acc;
+
+        __syncthreads();
+
+        if (ty == 0 && o < out_count)
+        {
+          for (unsigned int k = 1; k < GROUP_SIZE; ++k)
+            acc = REDUCE(acc, sdata[k*width + tx]);
+          out[o] = acc;
+        }
+
+        __syncthreads();
+      }
+    """
+
+
+def get_axis_reduction_source(kind, out_type, group_size, ndim,
+        neutral, reduce_expr, map_expr, arguments,
+        name="reduce_kernel", preamble=""):
+    """Return the source of a kernel reducing along an axis, see
+    :func:`get_axis_reduction_plan`. The kernel takes the output, the
+    *arguments*, the number of outputs, the length and stride of the
+    reduced axis and the *ndim* shape and stride entries of the kept axes.
+    """
+    if kind == "rows":
+        body = AXIS_ROWS_BODY
+    elif kind == "columns":
+        body = AXIS_COLUMNS_BODY
+    else:
+        raise ValueError("invalid axis reduction kind: %s" % kind)
+
+    return AXIS_REDUCTION_SOURCE % {
+            "block_size": AXIS_BLOCK_SIZE,
+            "group_size": group_size,
+            "ndim": ndim,
+            "map_expr": map_expr,
+            "reduce_expr": reduce_expr,
+            "preamble": preamble,
+            "out_type": out_type,
+            "name": name,
+            "arguments": arguments,
+            "layout_args": ", ".join(
+                ["unsigned long pycuda_shape%d" % d for d in range(ndim)]
+                + ["long pycuda_stride%d" % d for d in range(ndim)]),
+            "shape": ", ".join("pycuda_shape%d" % d for d in range(ndim)),
+            "strides": ", ".join("pycuda_stride%d" % d for d in range(ndim)),
+            "body": body % {"neutral": neutral},
+            }
+
+# }}}
+
+
+
+
 class ReductionKernel:
     def __init__(self, dtype_out,
             neutral, reduce_expr, map_expr=None, arguments=None,
-            name="reduce_kernel", keep=False, options=None, preamble=""):
+            name="reduce_kernel", keep=False, options=None, preamble="",
+            specialize=False, axis=None):
 
         self.dtype_out = np.dtype(dtype_out)
+        self.axis = axis
 
         self.block_size = 512
 
+        self.gen_kwargs = dict(out_type=dtype_to_ctype(dtype_out),
+                block_size=self.block_size, neutral=neutral,
+                reduce_expr=reduce_expr, map_expr=map_expr,
+                arguments=arguments, name=name, keep=keep, options=options,
+                preamble=preamble)
+        self.specialization_policy = get_specialization_policy(specialize)
+
         s1_func, self.stage1_arg_types = get_reduction_kernel_and_types(
                 1, dtype_to_ctype(dtype_out), self.block_size,
                 neutral, reduce_expr, map_expr,
@@ -218,6 +530,121 @@ class ReductionKernel:
                 "ReductionKernel can only be used with functions that have at least one " \
                 "vector argument"
 
+    @memoize_method
+    def get_specialized_stage_func(self, stage, seq_count, n):
+        kwargs = self.gen_kwargs.copy()
+        kwargs["name"] = kwargs["name"] + "_stage%d" % stage
+        if stage == 2:
+            # stage 2 has only one input and no map expression
+            kwargs["map_expr"] = None
+
+        func, arg_types = get_reduction_kernel_and_types(
+                stage, static_sizes=(seq_count, n), **kwargs)
+        return func.prepared_async_call
+
+    @memoize_method
+    def get_strided_stage1_func(self, strided_names, ndim):
+        kwargs = self.gen_kwargs.copy()
+        kwargs["name"] = kwargs["name"] + "_stage1"
+
+        func, arg_types = get_reduction_kernel_and_types(
+                1, strided=(strided_names, ndim), **kwargs)
+        return func.prepared_async_call
+
+    @memoize_method
+    def get_axis_func(self, kind, group_size, ndim):
+        from pycuda.curandom import expand_random_source_arguments
+        arguments, rng_name = expand_random_source_arguments(
+                self.gen_kwargs["arguments"])
+        if rng_name is not None:
+            raise ValueError("random sources are not supported in "
+                    "reductions along an axis")
+
+        map_expr = self.gen_kwargs["map_expr"]
+        if map_expr is None:
+            map_expr = "in[i]"
+
+        name = self.gen_kwargs["name"] + "_" + kind
+        src = get_axis_reduction_source(kind, self.gen_kwargs["out_type"],
+                group_size, ndim, self.gen_kwargs["neutral"],
+                self.gen_kwargs["reduce_expr"], map_expr, arguments,
+                name=name, preamble=self.gen_kwargs["preamble"])
+
+        from pycuda.compiler import SourceModule
+        mod = SourceModule(src, options=self.gen_kwargs["options"],
+                keep=self.gen_kwargs["keep"], no_extern_c=True)
+
+        func = mod.get_function(name)
+        func.prepare("P%sIIl%s%s" % (
+            "".join(self.stage1_arg_types), "L"*ndim, "l"*ndim))
+        return func.prepared_async_call
+
+    def call_along_axis(self, args, axis, stream=None, kernel_wrapper=None):
+        """Reduce the vector arguments in *args* along *axis*."""
+        vectors = [arg for arg, arg_tp in zip(args, self.stage1_arg_types)
+                if arg_tp == "P"]
+        repr_vec = vectors[0]
+        for vec in vectors:
+            if vec.shape != repr_vec.shape or vec.strides != repr_vec.strides:
+                raise ValueError("vector arguments of a reduction along an "
+                        "axis must have the same shape and strides")
+
+        ndim = len(repr_vec.shape)
+        if not -ndim <= axis < ndim:
+            raise ValueError("axis %d out of range for %d-dimensional array"
+                    % (axis, ndim))
+        if axis < 0:
+            axis += ndim
+
+        out_shape = repr_vec.shape[:axis] + repr_vec.shape[axis+1:]
+        out_count = int(np.prod(out_shape))
+
+        if out_count == 1 and repr_vec.size:
+            # all entries go into a single output
+            return self(*args, stream=stream, kernel_wrapper=kernel_wrapper,
+                    axis=None).reshape(out_shape)
+
+        from pycuda.gpuarray import empty
+        result = empty(out_shape, self.dtype_out, repr_vec.allocator)
+        if not out_count:
+            return result
+
+        kept_shape, kept_strides, row_length, axis_stride = get_axis_layout(
+                repr_vec.shape, repr_vec.strides, axis,
+                repr_vec.dtype.itemsize)
+
+        kind, group_size, block_count = get_axis_reduction_plan(
+                out_count, row_length, axis_stride)
+
+        func = self.get_axis_func(kind, group_size, len(kept_shape))
+        if kernel_wrapper is not None:
+            func = kernel_wrapper(func)
+
+        if kind == "rows":
+            block = (AXIS_BLOCK_SIZE, 1, 1)
+        else:
+            block = (AXIS_BLOCK_SIZE // group_size, group_size, 1)
+
+        invocation_args = [
+                arg.gpudata if arg_tp == "P" else arg
+                for arg, arg_tp in zip(args, self.stage1_arg_types)]
+
+        func((block_count, 1), block, stream,
+                *([result.gpudata] + invocation_args
+                    + [out_count, row_length, axis_stride]
+                    + list(kept_shape) + list(kept_strides)),
+                shared_size=AXIS_BLOCK_SIZE*self.dtype_out.itemsize)
+
+        return result
+
+    @memoize_method
+    def get_stage1_arg_names(self):
+        from pycuda.tools import parse_c_arg
+        from pycuda.curandom import expand_random_source_arguments
+        arguments, rng_name = expand_random_source_arguments(
+                self.gen_kwargs["arguments"])
+        return [parse_c_arg(arg).name for arg in arguments.split(",")]
+
     def __call__(self, *args, **kwargs):
         MAX_BLOCK_COUNT = 1024
         SMALL_SEQ_COUNT = 4
@@ -232,12 +659,21 @@ class ReductionKernel:
 
         stream = kwargs.get("stream")
 
+        axis = kwargs.get("axis", self.axis)
+        if axis is not None:
+            return self.call_along_axis(args, axis, stream, kernel_wrapper)
+
         from gpuarray import empty
 
+        from pycuda.elementwise import _expand_random_source_call_args
+        args = _expand_random_source_call_args(args)
+
         f = s1_func
         arg_types = self.stage1_arg_types
+        stage = 1
 
         stage1_args = args
+        policy = self.specialization_policy
 
         while True:
             invocation_args = []
@@ -245,10 +681,6 @@ class ReductionKernel:
 
             for arg, arg_tp in zip(args, arg_types):
                 if arg_tp == "P":
-                    if not arg.flags.forc:
-                        raise RuntimeError("ReductionKernel cannot "
-                                "deal with non-contiguous arrays")
-
                     vectors.append(arg)
                     invocation_args.append(arg.gpudata)
                 else:
@@ -257,6 +689,31 @@ class ReductionKernel:
             repr_vec = vectors[0]
             sz = repr_vec.size
 
+            # stage 2 receives the stage 1 arguments, but does not use them
+            stage_f = f
+            if stage == 1:
+                from pycuda.elementwise import get_strided_layout
+                strided_layout = get_strided_layout(vectors)
+
+                if strided_layout is not None:
+                    shape, strides_list = strided_layout
+
+                    vector_names = [name
+                            for name, arg_tp in zip(
+                                self.get_stage1_arg_names(), arg_types)
+                            if arg_tp == "P"]
+                    strided_names = []
+                    for name, strides in zip(vector_names, strides_list):
+                        if strides is not None:
+                            strided_names.append(name)
+                            invocation_args.extend(strides)
+                    invocation_args.extend(shape)
+
+                    stage_f = self.get_strided_stage1_func(
+                            tuple(strided_names), len(shape))
+                    if kernel_wrapper is not None:
+                        stage_f = kernel_wrapper(stage_f)
+
             if sz <= self.block_size*SMALL_SEQ_COUNT*MAX_BLOCK_COUNT:
                 total_block_size = SMALL_SEQ_COUNT*self.block_size
                 block_count = (sz + total_block_size - 1) // total_block_size
@@ -273,16 +730,26 @@ class ReductionKernel:
 
             kwargs = dict(shared_size=self.block_size*self.dtype_out.itemsize)
 
-            #print block_count, seq_count, self.block_size, sz
-            f((block_count, 1), (self.block_size, 1, 1), stream,
-                    *([result.gpudata]+invocation_args+[seq_count, sz]),
-                    **kwargs)
+            if (stage_f is f and policy is not None
+                    and policy.should_specialize((stage, seq_count, sz))):
+                spec_f = self.get_specialized_stage_func(stage, seq_count, sz)
+                if kernel_wrapper is not None:
+                    spec_f = kernel_wrapper(spec_f)
+
+                spec_f((block_count, 1), (self.block_size, 1, 1), stream,
+                        *([result.gpudata]+invocation_args), **kwargs)
+            else:
+                #print block_count, seq_count, self.block_size, sz
+                stage_f((block_count, 1), (self.block_size, 1, 1), stream,
+                        *([result.gpudata]+invocation_args+[seq_count, sz]),
+                        **kwargs)
 
             if block_count == 1:
                 return result
             else:
                 f = s2_func
                 arg_types = self.stage2_arg_types
+                stage = 2
                 args = (result,) + stage1_args
 
 
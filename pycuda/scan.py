@@ -37,7 +37,7 @@ import numpy as np
 import pycuda.driver as driver
 import pycuda.gpuarray as gpuarray
 from pycuda.compiler import SourceModule
-from pycuda.tools import dtype_to_ctype
+from pycuda.tools import dtype_to_ctype, context_dependent_memoize
 import pycuda._mymako as mako
 from pycuda._cluda import CLUDA_PREAMBLE
 
@@ -51,23 +51,62 @@ SHARED_PREAMBLE = CLUDA_PREAMBLE + """
 ${preamble}
 
 typedef ${scan_type} scan_type;
-"""
 
+%if is_segmented:
+    // A segmented scan operates on (value, segment start flag) pairs. Their
+    // combination below is associative whenever SCAN_EXPR is, so the
+    // unsegmented algorithm applies unchanged.
 
+    struct pycuda_scan_item
+    {
+        scan_type value;
+        int segment_start;
+    };
 
+    typedef struct pycuda_scan_item item_type;
 
-SCAN_INTERVALS_SOURCE = mako.template.Template(SHARED_PREAMBLE + """//CL//
-#define K ${wg_seq_batches}
+    WITHIN_KERNEL
+    item_type pycuda_scan_make_item(scan_type value, int segment_start)
+    {
+        item_type result;
+        result.value = value;
+        result.segment_start = segment_start;
+        return result;
+    }
+
+    // b follows a; a segment start within b cuts off a.
+    WITHIN_KERNEL
+    item_type pycuda_scan_combine(item_type a, item_type b)
+    {
+        item_type result;
+        result.value = b.segment_start ? b.value : SCAN_EXPR(a.value, b.value);
+        result.segment_start = a.segment_start || b.segment_start;
+        return result;
+    }
+
+    #define ITEM_SCAN(a, b) pycuda_scan_combine(a, b)
+    #define ITEM_VALUE(a) ((a).value)
+%else:
+    typedef scan_type item_type;
 
+    #define ITEM_SCAN(a, b) SCAN_EXPR(a, b)
+    #define ITEM_VALUE(a) (a)
+%endif
+"""
+
+
+
+
+GROUP_SCAN_SOURCE = """
 <%def name="make_group_scan(name, with_bounds_check)">
     WITHIN_KERNEL
-    void ${name}(LOCAL_MEM_ARG scan_type *array
+    void ${name}(LOCAL_MEM_ARG item_type *array
     % if with_bounds_check:
       , const unsigned n
     % endif
     )
     {
-        scan_type val = array[LID_0];
+        item_type val = array[LID_0];
 
         <% offset = 1 %>
 
@@ -78,8 +117,8 @@ SCAN_INTERVALS_SOURCE = mako.template.Template(SHARED_PREAMBLE + """//CL//
             % endif
             )
             {
-                scan_type tmp = array[LID_0 - ${offset}];
-                val = SCAN_EXPR(tmp, val);
+                item_type tmp = array[LID_0 - ${offset}];
+                val = ITEM_SCAN(tmp, val);
             }
 
             local_barrier();
@@ -93,19 +132,30 @@ SCAN_INTERVALS_SOURCE = mako.template.Template(SHARED_PREAMBLE + """//CL//
 
 ${make_group_scan("scan_group", False)}
 ${make_group_scan("scan_group_n", True)}
+"""
+
+
+
+
+SCAN_INTERVALS_SOURCE = mako.template.Template(SHARED_PREAMBLE + """//CL//
+#define K ${wg_seq_batches}
+""" + GROUP_SCAN_SOURCE + """
+
+<%def name="make_scan_intervals(kernel_name, input_args, input_expr)">
+#define READ_INPUT(i) (${input_expr})
 
 KERNEL
 REQD_WG_SIZE(WG_SIZE, 1, 1)
-void ${name_prefix}_scan_intervals(
-    GLOBAL_MEM scan_type *input,
+void ${kernel_name}(
+    ${input_args},
     const unsigned int N,
     const unsigned int interval_size,
-    GLOBAL_MEM scan_type *output,
-    GLOBAL_MEM scan_type *group_results)
+    GLOBAL_MEM item_type *interval_results,
+    GLOBAL_MEM item_type *group_results)
 {
     // padded in WG_SIZE to avoid bank conflicts
     // index K in first dimension used for carry storage
-    LOCAL_MEM scan_type ldata[K + 1][WG_SIZE + 1];
+    LOCAL_MEM item_type ldata[K + 1][WG_SIZE + 1];
 
     const unsigned int interval_begin = interval_size * GID_0;
     const unsigned int interval_end   = min(interval_begin + interval_size, N);
@@ -156,18 +206,18 @@ void ${name_prefix}_scan_intervals(
                 if (unit_base + offset < interval_end)
                 %endif
                 {
-                    ldata[offset % K][offset / K] = input[unit_base + offset];
+                    ldata[offset % K][offset / K] = READ_INPUT(unit_base + offset);
                 }
             }
 
             // carry in from previous unit, if applicable.
             if (LID_0 == 0 && unit_base != interval_begin)
-                ldata[0][0] = SCAN_EXPR(ldata[K][WG_SIZE - 1], ldata[0][0]);
+                ldata[0][0] = ITEM_SCAN(ldata[K][WG_SIZE - 1], ldata[0][0]);
 
             local_barrier();
 
             // scan along k (sequentially in each work item)
-            scan_type sum = ldata[0][LID_0];
+            item_type sum = ldata[0][LID_0];
 
             %if is_tail:
                 const unsigned int offset_end = interval_end - unit_base;
@@ -179,8 +229,8 @@ void ${name_prefix}_scan_intervals(
                 if (K * LID_0 + k < offset_end)
                 %endif
                 {
-                    scan_type tmp = ldata[k][LID_0];
-                    sum = SCAN_EXPR(sum, tmp);
+                    item_type tmp = ldata[k][LID_0];
+                    sum = ITEM_SCAN(sum, tmp);
                     ldata[k][LID_0] = sum;
                 }
             }
@@ -207,8 +257,8 @@ void ${name_prefix}_scan_intervals(
                     if (K * LID_0 + k < offset_end)
                     %endif
                     {
-                        scan_type tmp = ldata[k][LID_0];
-                        ldata[k][LID_0] = SCAN_EXPR(sum, tmp);
+                        item_type tmp = ldata[k][LID_0];
+                        ldata[k][LID_0] = ITEM_SCAN(sum, tmp);
                     }
                 }
             }
@@ -224,7 +274,8 @@ void ${name_prefix}_scan_intervals(
                 if (unit_base + offset < interval_end)
                 %endif
                 {
-                    output[unit_base + offset] = ldata[offset % K][offset / K];
+                    interval_results[unit_base + offset] =
+                        ldata[offset % K][offset / K];
                 }
             }
 
@@ -236,9 +287,16 @@ void ${name_prefix}_scan_intervals(
     // write interval sum
     if (LID_0 == 0)
     {
-        group_results[GID_0] = output[interval_end - 1];
+        group_results[GID_0] = interval_results[interval_end - 1];
     }
 }
+
+#undef READ_INPUT
+</%def>
+
+%for kernel_name, input_args, input_expr in levels:
+${make_scan_intervals(kernel_name, input_args, input_expr)}
+%endfor
 """)
 
 
@@ -344,32 +402,507 @@ void ${name_prefix}_final_update(
 
 
 
+GENERIC_UPDATE_SOURCE = mako.template.Template(SHARED_PREAMBLE + """//CL//
+%if is_segmented:
+#define IS_SEGMENT_START(i) (${is_segment_start_expr})
+%endif
+
+KERNEL
+REQD_WG_SIZE(WG_SIZE, 1, 1)
+void ${name_prefix}_final_update(
+    ${argument_signature},
+    const unsigned int N,
+    const unsigned int interval_size,
+    GLOBAL_MEM item_type *interval_results,
+    GLOBAL_MEM item_type *group_results,
+    const unsigned int num_groups)
+{
+    const unsigned int interval_begin = interval_size * GID_0;
+    const unsigned int interval_end   = min(interval_begin + interval_size, N);
+
+    // scan result of everything before this interval
+    const bool have_carry = GID_0 != 0;
+    item_type carry;
+    if (have_carry)
+        carry = group_results[GID_0 - 1];
+
+    %if use_last_item:
+        const scan_type last_item = ITEM_VALUE(group_results[num_groups - 1]);
+    %endif
+
+    for (unsigned int i = interval_begin + LID_0; i < interval_end; i += WG_SIZE)
+    {
+        item_type full_item = interval_results[i];
+        if (have_carry)
+            full_item = ITEM_SCAN(carry, full_item);
+
+        const scan_type item = ITEM_VALUE(full_item);
+
+        %if use_prev_item:
+            // exclusive result: the inclusive result of the preceding entry
+            scan_type prev_item = ${neutral};
+            if (i != interval_begin)
+            {
+                item_type prev_full_item = interval_results[i - 1];
+                if (have_carry)
+                    prev_full_item = ITEM_SCAN(carry, prev_full_item);
+                prev_item = ITEM_VALUE(prev_full_item);
+            }
+            else if (have_carry)
+                prev_item = ITEM_VALUE(carry);
+
+            %if is_segmented:
+                if (IS_SEGMENT_START(i))
+                    prev_item = ${neutral};
+            %endif
+        %endif
+
+        {
+            ${output_statement};
+        }
+    }
+}
+""")
+
+
+
+
+SINGLE_PASS_SCAN_SOURCE = mako.template.Template(SHARED_PREAMBLE + """//CL//
+#define K ${wg_seq_batches}
+""" + GROUP_SCAN_SOURCE + """
+
+// Bypass the non-coherent L1 cache, which may hold stale copies of
+// entries published by other work groups during this launch.
+WITHIN_KERNEL
+item_type load_item_volatile(GLOBAL_MEM item_type *p)
+{
+    item_type result;
+    if (sizeof(item_type) % sizeof(int) == 0)
+    {
+        for (unsigned int k = 0; k < sizeof(item_type)/sizeof(int); k++)
+            ((int *) &result)[k] = ((volatile int *) p)[k];
+    }
+    else
+    {
+        for (unsigned int k = 0; k < sizeof(item_type); k++)
+            ((char *) &result)[k] = ((volatile char *) p)[k];
+    }
+    return result;
+}
+
+#define READ_INPUT(i) (${input_expr})
+
+%if is_segmented:
+#define IS_SEGMENT_START(i) (${is_segment_start_expr})
+%endif
+
+KERNEL
+REQD_WG_SIZE(WG_SIZE, 1, 1)
+void ${name_prefix}_scan_single_pass(
+    ${argument_signature},
+    const unsigned int N,
+    GLOBAL_MEM unsigned int *tile_counter,
+    const unsigned int ticket_base,
+    const unsigned int epoch,
+    GLOBAL_MEM volatile unsigned int *tile_status,
+    GLOBAL_MEM item_type *tile_aggregates,
+    GLOBAL_MEM item_type *tile_prefixes)
+{
+    // Algorithm: Each work group scans one tile in local memory, in the
+    // same way the interval scan handles one unit. It then publishes the
+    // tile's aggregate and looks back across the status words of the
+    // preceding tiles, combining their aggregates until it finds one
+    // whose inclusive prefix is known. (D. Merrill, M. Garland,
+    // Single-pass Parallel Prefix Scan with Decoupled Look-back, NVIDIA
+    // technical report NVR-2016-002.)
+    //
+    // Status words carry the launch's epoch, so that entries left over
+    // from earlier launches read as invalid without clearing them.
+
+    LOCAL_MEM item_type ldata[K + 1][WG_SIZE + 1];
+    LOCAL_MEM unsigned int tile;
+    LOCAL_MEM item_type tile_carry;
+
+    const unsigned int tile_size = K * WG_SIZE;
+    const unsigned int tile_count = (N + tile_size - 1) / tile_size;
+
+    const unsigned int status_aggregate = 4*epoch + 1;
+    const unsigned int status_prefix = 4*epoch + 2;
+
+    // Tiles are numbered in the order in which work groups start, so that
+    // every tile being waited on belongs to a running work group.
+    if (LID_0 == 0)
+        tile = atomicAdd(tile_counter, 1) - ticket_base;
+
+    local_barrier();
+
+    if (tile >= tile_count)
+        return;
+
+    const unsigned int tile_begin = tile * tile_size;
+    const unsigned int offset_end = min(tile_size, N - tile_begin);
+
+    // read the tile from global
+
+    for(unsigned int k = 0; k < K; k++)
+    {
+        const unsigned int offset = k*WG_SIZE + LID_0;
+
+        if (offset < offset_end)
+            ldata[offset % K][offset / K] = READ_INPUT(tile_begin + offset);
+    }
+
+    local_barrier();
+
+    // scan along k (sequentially in each work item)
+    item_type sum = ldata[0][LID_0];
+
+    for(unsigned int k = 1; k < K; k++)
+    {
+        if (K * LID_0 + k < offset_end)
+        {
+            item_type tmp = ldata[k][LID_0];
+            sum = ITEM_SCAN(sum, tmp);
+            ldata[k][LID_0] = sum;
+        }
+    }
+
+    // store carry in out-of-bounds (padding) array entry in the K direction
+    ldata[K][LID_0] = sum;
+    local_barrier();
+
+    // tree-based parallel scan along local id
+    scan_group_n(&ldata[K][0], offset_end / K);
+
+    // update local values
+    if (LID_0 > 0)
+    {
+        sum = ldata[K][LID_0 - 1];
+
+        for(unsigned int k = 0; k < K; k++)
+        {
+            if (K * LID_0 + k < offset_end)
+            {
+                item_type tmp = ldata[k][LID_0];
+                ldata[k][LID_0] = ITEM_SCAN(sum, tmp);
+            }
+        }
+    }
+
+    local_barrier();
+
+    // decoupled look-back
+    if (LID_0 == 0)
+    {
+        const unsigned int last = offset_end - 1;
+        const item_type aggregate = ldata[last % K][last / K];
+
+        if (tile == 0)
+        {
+            tile_prefixes[0] = aggregate;
+            __threadfence();
+            tile_status[0] = status_prefix;
+        }
+        else
+        {
+            tile_aggregates[tile] = aggregate;
+            __threadfence();
+            tile_status[tile] = status_aggregate;
+
+            item_type carry;
+            unsigned int status = status_aggregate;
+
+            for (unsigned int pred = tile; status != status_prefix; )
+            {
+                --pred;
+
+                do
+                    status = tile_status[pred];
+                while (status != status_aggregate && status != status_prefix);
+
+                __threadfence();
+
+                const item_type tmp = load_item_volatile(
+                    status == status_prefix
+                    ? &tile_prefixes[pred] : &tile_aggregates[pred]);
+
+                carry = pred == tile - 1 ? tmp : ITEM_SCAN(tmp, carry);
+            }
+
+            tile_carry = carry;
+
+            tile_prefixes[tile] = ITEM_SCAN(carry, aggregate);
+            __threadfence();
+            tile_status[tile] = status_prefix;
+        }
+    }
+
+    local_barrier();
+
+    // hand the results to the output statement
+    for(unsigned int k = 0; k < K; k++)
+    {
+        const unsigned int offset = k*WG_SIZE + LID_0;
+
+        if (offset < offset_end)
+        {
+            const unsigned int i = tile_begin + offset;
+
+            item_type full_item = ldata[offset % K][offset / K];
+            if (tile != 0)
+                full_item = ITEM_SCAN(tile_carry, full_item);
+
+            const scan_type item = ITEM_VALUE(full_item);
+
+            %if use_prev_item:
+                // exclusive result: the inclusive result of the preceding entry
+                scan_type prev_item = ${neutral};
+                if (offset != 0)
+                {
+                    item_type prev_full_item =
+                        ldata[(offset - 1) % K][(offset - 1) / K];
+                    if (tile != 0)
+                        prev_full_item = ITEM_SCAN(tile_carry, prev_full_item);
+                    prev_item = ITEM_VALUE(prev_full_item);
+                }
+                else if (tile != 0)
+                    prev_item = ITEM_VALUE(tile_carry);
+
+                %if is_segmented:
+                    if (IS_SEGMENT_START(i))
+                        prev_item = ${neutral};
+                %endif
+            %endif
+
+            {
+                ${output_statement};
+            }
+        }
+    }
+}
+""")
+
+
+
+
+# {{{ sizing and launch planning
+
+# Thrust says these are good for GT200
+SCAN_WG_SIZE = 128
+UPDATE_WG_SIZE = 256
+MAX_SCAN_WG_SEQ_BATCHES = 6
+
+# shared memory available to one work group on all supported devices
+SCAN_LOCAL_MEM_BYTES = 16384
+
+def _get_item_size_bound(dtype, is_segmented):
+    """Return an upper bound on the device size of one scan item, which
+    for segmented scans pairs a *dtype* value with an :class:`int` flag.
+    """
+    if not is_segmented:
+        return dtype.itemsize
+
+    # Device alignment divides the size and does not exceed 16 bytes.
+    alignment = 4
+    while alignment < 16 and dtype.itemsize % (2*alignment) == 0:
+        alignment *= 2
+
+    size = dtype.itemsize + 4
+    return (size + alignment - 1) // alignment * alignment
+
+def get_scan_wg_seq_batches(item_size, wg_size=SCAN_WG_SIZE):
+    """Return the number of items each work item of the interval scan
+    handles per unit, limited so that the kernel's ``(K+1) x (wg_size+1)``
+    local buffer of *item_size*-byte items fits into shared memory.
+    """
+    result = min(MAX_SCAN_WG_SEQ_BATCHES,
+            SCAN_LOCAL_MEM_BYTES // ((wg_size + 1)*item_size) - 1)
+
+    if result < 1:
+        raise ValueError("scan type of %d bytes too large for shared memory"
+                % item_size)
+
+    return result
+
+def get_scan_launch_plan(n, multiprocessor_count,
+        wg_size=SCAN_WG_SIZE, wg_seq_batches=MAX_SCAN_WG_SEQ_BATCHES):
+    """Return a tuple *(interval_size, num_groups)* splitting a scan of *n*
+    items into intervals of whole units, at most three per multiprocessor.
+    """
+    from pytools import uniform_interval_splitting
+    return uniform_interval_splitting(
+            n, wg_size*wg_seq_batches, 3*multiprocessor_count)
+
+MAX_GRID_DIM = 65535
+
+def get_single_pass_scan_plan(n,
+        wg_size=SCAN_WG_SIZE, wg_seq_batches=MAX_SCAN_WG_SEQ_BATCHES):
+    """Return a tuple *(tile_count, grid)* for a single-pass scan of *n*
+    items, with one tile of *wg_size*wg_seq_batches* items per work group.
+    The grid may have a few more work groups than tiles, which exit
+    immediately.
+    """
+    tile_size = wg_size*wg_seq_batches
+    tile_count = (n + tile_size - 1) // tile_size
+
+    grid_width = min(tile_count, MAX_GRID_DIM)
+    grid_height = (tile_count + grid_width - 1) // grid_width
+    return tile_count, (grid_width, grid_height)
+
+@context_dependent_memoize
+def _get_multiprocessor_count():
+    return driver.Context.get_device().get_attribute(
+            driver.device_attribute.MULTIPROCESSOR_COUNT)
+
+def _round_up_to_line(nbytes):
+    return (nbytes + 127) // 128 * 128
+
+# number of streams for which a single-pass scan kernel keeps scratch space
+# before releasing all of it
+MAX_TILE_STATUS_STREAMS = 8
+
+class _TileStatusBuffer(object):
+    """Scratch space of a single-pass scan kernel on one stream: the tile
+    counter, and a status word, aggregate and inclusive prefix per tile.
+
+    The counter and status words are only cleared on allocation. Later
+    launches instead start from the counter's current value and use a fresh
+    epoch for their status words. This requires that launches using the
+    same buffer do not overlap.
+    """
+
+    def __init__(self, item_size):
+        self.item_size = item_size
+        self.capacity = 0
+
+    def _get_offsets(self, capacity):
+        status_offset = 128
+        aggregates_offset = status_offset + _round_up_to_line(4*capacity)
+        prefixes_offset = aggregates_offset + _round_up_to_line(
+                self.item_size*capacity)
+        end = prefixes_offset + _round_up_to_line(self.item_size*capacity)
+        return status_offset, aggregates_offset, prefixes_offset, end
+
+    def get_launch_args(self, tile_count, grid):
+        """Return the scratch arguments of a single-pass scan kernel
+        launched on *grid* for *tile_count* tiles.
+        """
+        if self.capacity < tile_count:
+            nbytes = self._get_offsets(tile_count)[-1]
+            self.buffer = driver.mem_alloc(nbytes)
+            driver.memset_d32(self.buffer, 0, nbytes // 4)
+
+            self.capacity = tile_count
+            self.tickets_issued = 0
+            self.epoch = 0
+
+        status_offset, aggregates_offset, prefixes_offset, _ = \
+                self._get_offsets(self.capacity)
+
+        base = int(self.buffer)
+        ticket_base = self.tickets_issued
+
+        self.epoch = (self.epoch + 1) % 2**30
+        self.tickets_issued = (ticket_base + grid[0]*grid[1]) % 2**32
+
+        return [base, ticket_base, self.epoch,
+                base + status_offset,
+                base + aggregates_offset,
+                base + prefixes_offset]
+
+class _TileStatus(object):
+    """Scratch space of a single-pass scan kernel, with a separate
+    :class:`_TileStatusBuffer` for each stream, since launches on different
+    streams may run concurrently.
+
+    Each buffer keeps a reference to its stream, so that the stream's
+    handle is not reused by a new stream while the buffer is in use.
+    """
+
+    def __init__(self, item_size):
+        self.item_size = item_size
+        self.buffers = {}
+
+    def get_launch_args(self, tile_count, grid, stream=None):
+        if stream is None:
+            key = None
+        else:
+            key = stream.handle
+
+        entry = self.buffers.get(key)
+        if entry is None:
+            if len(self.buffers) >= MAX_TILE_STATUS_STREAMS:
+                self.buffers.clear()
+
+            entry = self.buffers[key] = (
+                    stream, _TileStatusBuffer(self.item_size))
+
+        _, buf = entry
+        return buf.get_launch_args(tile_count, grid)
+
+def _should_use_single_pass():
+    return driver.Context.get_device().compute_capability() >= (2, 0)
+
+# }}}
+
+
+
+
 class _ScanKernelBase(object):
     def __init__(self, dtype,
             scan_expr, neutral=None,
-            name_prefix="scan", options=[], preamble="", devices=None):
+            name_prefix="scan", options=[], preamble="", devices=None,
+            single_pass=None):
 
         if isinstance(self, ExclusiveScanKernel) and neutral is None:
             raise ValueError("neutral element is required for exclusive scan")
 
+        if single_pass is None:
+            single_pass = _should_use_single_pass()
+        self.single_pass = single_pass
+
         dtype = self.dtype = np.dtype(dtype)
         self.neutral = neutral
 
-        # Thrust says these are good for GT200
-        self.scan_wg_size = 128
-        self.update_wg_size = 256
-        self.scan_wg_seq_batches = 6
+        self.scan_wg_size = SCAN_WG_SIZE
+        self.update_wg_size = UPDATE_WG_SIZE
+        self.scan_wg_seq_batches = get_scan_wg_seq_batches(
+                dtype.itemsize, self.scan_wg_size)
 
         kw_values = dict(
             preamble=preamble,
             name_prefix=name_prefix,
             scan_type=dtype_to_ctype(dtype),
             scan_expr=scan_expr,
-            neutral=neutral)
+            neutral=neutral,
+            is_segmented=False)
+
+        if single_pass:
+            is_exclusive = isinstance(self, ExclusiveScanKernel)
+            single_pass_src = str(SINGLE_PASS_SCAN_SOURCE.render(
+                wg_size=self.scan_wg_size,
+                wg_seq_batches=self.scan_wg_seq_batches,
+                argument_signature="GLOBAL_MEM scan_type *input, "
+                    "GLOBAL_MEM scan_type *output",
+                input_expr="input[i]",
+                output_statement="output[i] = %s"
+                    % ("prev_item" if is_exclusive else "item"),
+                use_prev_item=is_exclusive,
+                **kw_values))
+            single_pass_prg = SourceModule(
+                    single_pass_src, options=options, no_extern_c=True)
+            self.single_pass_knl = single_pass_prg.get_function(
+                    name_prefix+"_scan_single_pass")
+            self.single_pass_knl.prepare("PPIPIIPPP")
+
+            self.tile_status = _TileStatus(dtype.itemsize)
+            return
 
         scan_intervals_src = str(SCAN_INTERVALS_SOURCE.render(
             wg_size=self.scan_wg_size,
             wg_seq_batches=self.scan_wg_seq_batches,
+            levels=[(name_prefix+"_scan_intervals",
+                "GLOBAL_MEM scan_type *input", "input[i]")],
             **kw_values))
         scan_intervals_prg = SourceModule(
                 scan_intervals_src, options=options, no_extern_c=True)
@@ -409,14 +942,21 @@ class _ScanKernelBase(object):
         if not n:
             return output_ary
 
-        unit_size  = self.scan_wg_size * self.scan_wg_seq_batches
-        dev = driver.Context.get_device()
-        max_groups = 3*dev.get_attribute(
-                driver.device_attribute.MULTIPROCESSOR_COUNT)
+        if self.single_pass:
+            tile_count, grid = get_single_pass_scan_plan(
+                    n, self.scan_wg_size, self.scan_wg_seq_batches)
+
+            self.single_pass_knl.prepared_async_call(
+                    grid, (self.scan_wg_size, 1, 1), stream,
+                    input_ary.gpudata, output_ary.gpudata, n,
+                    *self.tile_status.get_launch_args(
+                        tile_count, grid, stream))
+
+            return output_ary
 
-        from pytools import uniform_interval_splitting
-        interval_size, num_groups = uniform_interval_splitting(
-                n, unit_size, max_groups);
+        interval_size, num_groups = get_scan_launch_plan(n,
+                _get_multiprocessor_count(),
+                self.scan_wg_size, self.scan_wg_seq_batches)
 
         block_results = allocator(self.dtype.itemsize*num_groups)
         dummy_results = allocator(self.dtype.itemsize)
@@ -454,3 +994,227 @@ class InclusiveScanKernel(_ScanKernelBase):
 
 class ExclusiveScanKernel(_ScanKernelBase):
     final_update_tp = EXCLUSIVE_UPDATE_SOURCE
+
+
+
+
+# {{{ generic scan
+
+def _parse_scan_arguments(arguments):
+    if isinstance(arguments, str):
+        from pycuda.tools import parse_c_arg
+        return [parse_c_arg(arg) for arg in arguments.split(",")]
+    else:
+        return list(arguments)
+
+def get_generic_scan_sources(dtype, arguments, input_expr, scan_expr,
+        output_statement, neutral=None, is_segment_start_expr=None,
+        name_prefix="scan", preamble=""):
+    """Return a dictionary with the keys *scan_intervals* and
+    *final_update*, holding the source code of the three-launch kernels of
+    a :class:`GenericScanKernel` with the same arguments, *single_pass*,
+    holding that of the single-pass kernel (or *None* if *output_statement*
+    uses *last_item*), and *wg_seq_batches*, the number of items per work
+    item and unit. Needs no GPU.
+    """
+    dtype = np.dtype(dtype)
+    arguments = _parse_scan_arguments(arguments)
+    is_segmented = is_segment_start_expr is not None
+
+    use_prev_item = "prev_item" in output_statement
+    if use_prev_item and neutral is None:
+        raise ValueError("neutral element is required to use prev_item")
+
+    use_last_item = "last_item" in output_statement
+
+    if is_segmented:
+        item_expr = "pycuda_scan_make_item((%s), (%s) != 0)" % (
+                input_expr, is_segment_start_expr)
+    else:
+        item_expr = input_expr
+
+    wg_seq_batches = get_scan_wg_seq_batches(
+            _get_item_size_bound(dtype, is_segmented), SCAN_WG_SIZE)
+
+    argument_signature = ", ".join(arg.declarator() for arg in arguments)
+
+    kw_values = dict(
+        preamble=preamble,
+        name_prefix=name_prefix,
+        scan_type=dtype_to_ctype(dtype),
+        scan_expr=scan_expr,
+        neutral=neutral,
+        is_segmented=is_segmented,
+        argument_signature=argument_signature,
+        is_segment_start_expr=is_segment_start_expr,
+        output_statement=output_statement,
+        use_prev_item=use_prev_item)
+
+    scan_intervals_src = str(SCAN_INTERVALS_SOURCE.render(
+        wg_size=SCAN_WG_SIZE,
+        wg_seq_batches=wg_seq_batches,
+        levels=[
+            (name_prefix+"_scan_intervals", argument_signature, item_expr),
+            (name_prefix+"_scan_group_results",
+                "GLOBAL_MEM item_type *input", "input[i]"),
+            ],
+        **kw_values))
+
+    final_update_src = str(GENERIC_UPDATE_SOURCE.render(
+        wg_size=UPDATE_WG_SIZE,
+        use_last_item=use_last_item,
+        **kw_values))
+
+    # The total is not known to any tile before the last one finishes.
+    if use_last_item:
+        single_pass_src = None
+    else:
+        single_pass_src = str(SINGLE_PASS_SCAN_SOURCE.render(
+            wg_size=SCAN_WG_SIZE,
+            wg_seq_batches=wg_seq_batches,
+            input_expr=item_expr,
+            **kw_values))
+
+    return dict(
+            scan_intervals=scan_intervals_src,
+            final_update=final_update_src,
+            single_pass=single_pass_src,
+            wg_seq_batches=wg_seq_batches)
+
+class GenericScanKernel(object):
+    """Compute a scan of the values given by *input_expr* and hand the
+    results to *output_statement*. See the documentation for details.
+    """
+
+    def __init__(self, dtype, arguments, input_expr, scan_expr,
+            output_statement, neutral=None, is_segment_start_expr=None,
+            name_prefix="scan", options=None, preamble="",
+            single_pass=None):
+        dtype = self.dtype = np.dtype(dtype)
+        self.arguments = _parse_scan_arguments(arguments)
+        self.is_segmented = is_segment_start_expr is not None
+
+        sources = get_generic_scan_sources(dtype, self.arguments,
+                input_expr, scan_expr, output_statement,
+                neutral=neutral, is_segment_start_expr=is_segment_start_expr,
+                name_prefix=name_prefix, preamble=preamble)
+
+        if single_pass is None:
+            single_pass = (sources["single_pass"] is not None
+                    and _should_use_single_pass())
+        elif single_pass and sources["single_pass"] is None:
+            raise ValueError("last_item is not available in a single-pass scan")
+        self.single_pass = single_pass
+
+        self.item_size = _get_item_size_bound(dtype, self.is_segmented)
+        self.scan_wg_size = SCAN_WG_SIZE
+        self.update_wg_size = UPDATE_WG_SIZE
+        self.scan_wg_seq_batches = sources["wg_seq_batches"]
+
+        arg_types = "".join(arg.struct_char for arg in self.arguments)
+
+        if single_pass:
+            single_pass_prg = SourceModule(sources["single_pass"],
+                    options=options, no_extern_c=True)
+            self.single_pass_knl = single_pass_prg.get_function(
+                    name_prefix+"_scan_single_pass")
+            self.single_pass_knl.prepare(arg_types+"IPIIPPP")
+
+            self.tile_status = _TileStatus(self.item_size)
+            return
+
+        scan_intervals_prg = SourceModule(sources["scan_intervals"],
+                options=options, no_extern_c=True)
+        self.scan_intervals_knl = scan_intervals_prg.get_function(
+                name_prefix+"_scan_intervals")
+        self.scan_intervals_knl.prepare(arg_types+"IIPP")
+        self.scan_group_results_knl = scan_intervals_prg.get_function(
+                name_prefix+"_scan_group_results")
+        self.scan_group_results_knl.prepare("PIIPP")
+
+        final_update_prg = SourceModule(sources["final_update"],
+                options=options, no_extern_c=True)
+        self.final_update_knl = final_update_prg.get_function(
+                name_prefix+"_final_update")
+        self.final_update_knl.prepare(arg_types+"IIPPI")
+
+    def __call__(self, *args, **kwargs):
+        """Invoke the scan on *args*, which correspond to the *arguments*
+        given to the constructor. Accepts the keyword arguments *size*
+        (defaulting to the size of the first array argument), *allocator*
+        and *stream*.
+        """
+        size = kwargs.pop("size", None)
+        allocator = kwargs.pop("allocator", None)
+        stream = kwargs.pop("stream", None)
+        if kwargs:
+            raise TypeError("invalid keyword arguments: %s"
+                    % ", ".join(kwargs))
+
+        if len(args) != len(self.arguments):
+            raise TypeError("expected %d arguments, got %d"
+                    % (len(self.arguments), len(args)))
+
+        array_args = [arg for arg in args if isinstance(arg, gpuarray.GPUArray)]
+
+        if size is None:
+            if not array_args:
+                raise TypeError("size must be given "
+                        "if there are no array arguments")
+            size = array_args[0].size
+
+        if allocator is None:
+            if array_args:
+                allocator = array_args[0].allocator
+            else:
+                allocator = driver.mem_alloc
+
+        if not size:
+            return
+
+        call_args = [
+                arg.gpudata if isinstance(arg, gpuarray.GPUArray) else arg
+                for arg in args]
+
+        if self.single_pass:
+            tile_count, grid = get_single_pass_scan_plan(
+                    size, self.scan_wg_size, self.scan_wg_seq_batches)
+
+            self.single_pass_knl.prepared_async_call(
+                    grid, (self.scan_wg_size, 1, 1), stream,
+                    *(call_args + [size]
+                        + self.tile_status.get_launch_args(
+                            tile_count, grid, stream)))
+            return
+
+        interval_size, num_groups = get_scan_launch_plan(size,
+                _get_multiprocessor_count(),
+                self.scan_wg_size, self.scan_wg_seq_batches)
+
+        interval_results = allocator(self.item_size*size)
+        block_results = allocator(self.item_size*num_groups)
+        dummy_results = allocator(self.item_size)
+
+        # first level scan of interval (one interval per block)
+        self.scan_intervals_knl.prepared_async_call(
+                (num_groups, 1), (self.scan_wg_size, 1, 1), stream,
+                *(call_args + [size, interval_size,
+                    interval_results, block_results]))
+
+        # second level inclusive scan of per-block results
+        self.scan_group_results_knl.prepared_async_call(
+                (1, 1), (self.scan_wg_size, 1, 1), stream,
+                block_results,
+                num_groups, num_groups,
+                block_results,
+                dummy_results)
+
+        # combine both levels and hand the results to the output statement
+        self.final_update_knl.prepared_async_call(
+                (num_groups, 1), (self.update_wg_size, 1, 1), stream,
+                *(call_args + [size, interval_size,
+                    interval_results, block_results, num_groups]))
+
+# }}}
+
+# vim: foldmethod=marker
@@ -0,0 +1,67 @@
+from __future__ import division
+import numpy as np
+
+
+
+
+def choose_spmv_format(mat, warp_size=32):
+    """Pick a sparse matrix format for *mat* from its row length statistics.
+
+    Return one of ``"ell"``, ``"hyb"`` and ``"csr"``:
+
+    * ``"csr"`` if rows are long on average (at least *warp_size* entries),
+      where one warp per row works best, or if rows are too irregular for
+      ELL.
+    * ``"ell"`` if padding all rows to the maximum row length stores at most
+      50% more entries than there are nonzeros.
+    * ``"hyb"`` if an ELL part of the width given by
+      :func:`pycuda.sparse.ell.choose_ell_width` holds at least two thirds of
+      the nonzeros.
+    """
+    from scipy.sparse import csr_matrix
+    csr_mat = csr_matrix(mat)
+
+    row_count = csr_mat.shape[0]
+    nnz = csr_mat.nnz
+    if not row_count or not nnz:
+        return "csr"
+
+    row_lengths = np.diff(csr_mat.indptr)
+    if nnz / row_count >= warp_size:
+        return "csr"
+
+    if row_count*np.max(row_lengths) <= 1.5*nnz:
+        return "ell"
+
+    from pycuda.sparse.ell import choose_ell_width
+    width = choose_ell_width(row_lengths)
+    if 3*np.sum(np.minimum(row_lengths, width)) >= 2*nnz:
+        return "hyb"
+
+    return "csr"
+
+
+def make_spmv(mat, dtype, format=None):
+    """Return a sparse matrix-vector product operator for *mat* in the
+    given *format* (``"csr"``, ``"ell"`` or ``"hyb"``), or in the one
+    picked by :func:`choose_spmv_format` if *format* is *None*.
+
+    All of these are :class:`pycuda.sparse.operator.OperatorBase` instances
+    that can be passed to :func:`pycuda.sparse.cg.solve_pkt_with_cg`.
+    """
+    if format is None:
+        import pycuda.driver as drv
+        format = choose_spmv_format(mat,
+                drv.Context.get_device().warp_size)
+
+    if format == "csr":
+        from pycuda.sparse.csr import CSRSpMV
+        return CSRSpMV(mat, dtype)
+    elif format == "ell":
+        from pycuda.sparse.ell import ELLSpMV
+        return ELLSpMV(mat, dtype)
+    elif format == "hyb":
+        from pycuda.sparse.ell import HybridSpMV
+        return HybridSpMV(mat, dtype)
+    else:
+        raise ValueError("unknown sparse matrix format: %s" % format)
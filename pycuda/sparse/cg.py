@@ -1,6 +1,7 @@
 from __future__ import division
 from pycuda.sparse.inner import AsyncInnerProduct
 from pytools import memoize_method
+import pycuda.driver as drv
 import pycuda.gpuarray as gpuarray
 
 import numpy as np
@@ -201,8 +202,731 @@ class CGStateContainer:
 
 
 
+# {{{ pipelined cg
+
+PIPELINED_CG_KERNELS = """
+typedef %(value_type)s value_type;
+
+#define BLOCK_SIZE %(block_size)d
+
+// indices into the device-side scalar array
+#define GAMMA 0
+#define DELTA 1
+#define ALPHA 2
+#define BETA 3
+
+// Sums a and b across the block and stores the block's partial sums at
+// partials[blockIdx.x] and partials[gridDim.x+blockIdx.x].
+__device__ void block_sum2(value_type a, value_type b, value_type *partials)
+{
+  __shared__ value_type sdata_a[BLOCK_SIZE];
+  __shared__ value_type sdata_b[BLOCK_SIZE];
+
+  const unsigned tid = threadIdx.x;
+  sdata_a[tid] = a;
+  sdata_b[tid] = b;
+  __syncthreads();
+
+  #pragma unroll
+  for (unsigned s = BLOCK_SIZE/2; s > 0; s >>= 1)
+  {
+    if (tid < s)
+    {
+      sdata_a[tid] += sdata_a[tid+s];
+      sdata_b[tid] += sdata_b[tid+s];
+    }
+    __syncthreads();
+  }
+
+  if (tid == 0)
+  {
+    partials[blockIdx.x] = sdata_a[0];
+    partials[gridDim.x+blockIdx.x] = sdata_b[0];
+  }
+}
+
+// partial sums of (r, u) and (w, u)
+extern "C" __global__ void
+pcg_dots(const value_type *r, const value_type *u, const value_type *w,
+    value_type *partials, const unsigned n)
+{
+  value_type ru = 0, wu = 0;
+  for (unsigned i = BLOCK_SIZE*blockIdx.x + threadIdx.x; i < n;
+      i += BLOCK_SIZE*gridDim.x)
+  {
+    ru += r[i]*u[i];
+    wu += w[i]*u[i];
+  }
+
+  block_sum2(ru, wu, partials);
+}
+
+// Finishes the dot products and computes alpha and beta, in a single block.
+// The previous gamma and alpha are read from scalars before being replaced.
+extern "C" __global__ void
+pcg_scalars(const value_type *partials, const unsigned partial_count,
+    value_type *scalars, const int first)
+{
+  __shared__ value_type sdata_a[BLOCK_SIZE];
+  __shared__ value_type sdata_b[BLOCK_SIZE];
+
+  const unsigned tid = threadIdx.x;
+
+  value_type a = 0, b = 0;
+  for (unsigned i = tid; i < partial_count; i += BLOCK_SIZE)
+  {
+    a += partials[i];
+    b += partials[partial_count+i];
+  }
+  sdata_a[tid] = a;
+  sdata_b[tid] = b;
+  __syncthreads();
+
+  #pragma unroll
+  for (unsigned s = BLOCK_SIZE/2; s > 0; s >>= 1)
+  {
+    if (tid < s)
+    {
+      sdata_a[tid] += sdata_a[tid+s];
+      sdata_b[tid] += sdata_b[tid+s];
+    }
+    __syncthreads();
+  }
+
+  if (tid == 0)
+  {
+    const value_type gamma = sdata_a[0];
+    const value_type delta = sdata_b[0];
+
+    value_type alpha, beta;
+    if (first)
+    {
+      beta = 0;
+      alpha = delta == 0 ? 0 : gamma/delta;
+    }
+    else
+    {
+      const value_type gamma_old = scalars[GAMMA];
+      const value_type alpha_old = scalars[ALPHA];
+
+      beta = gamma_old == 0 ? 0 : gamma/gamma_old;
+      const value_type denom =
+        delta - (alpha_old == 0 ? 0 : beta*gamma/alpha_old);
+      alpha = denom == 0 ? 0 : gamma/denom;
+    }
+
+    scalars[GAMMA] = gamma;
+    scalars[DELTA] = delta;
+    scalars[ALPHA] = alpha;
+    scalars[BETA] = beta;
+  }
+}
+
+// All vector updates of one iteration, along with the partial sums of
+// the next iteration's dot products.
+extern "C" __global__ void
+pcg_update(const value_type *scalars,
+    value_type *x, value_type *r, value_type *u, value_type *w,
+    value_type *p, value_type *s, value_type *q, value_type *z,
+    const value_type *m, const value_type *nn,
+    value_type *partials, const unsigned n)
+{
+  const value_type alpha = scalars[ALPHA];
+  const value_type beta = scalars[BETA];
+
+  value_type ru = 0, wu = 0;
+  for (unsigned i = BLOCK_SIZE*blockIdx.x + threadIdx.x; i < n;
+      i += BLOCK_SIZE*gridDim.x)
+  {
+    const value_type z_i = nn[i] + beta*z[i];
+    const value_type q_i = m[i] + beta*q[i];
+    const value_type s_i = w[i] + beta*s[i];
+    const value_type p_i = u[i] + beta*p[i];
+    z[i] = z_i;
+    q[i] = q_i;
+    s[i] = s_i;
+    p[i] = p_i;
+
+    x[i] += alpha*p_i;
+    const value_type r_i = r[i] - alpha*s_i;
+    const value_type u_i = u[i] - alpha*q_i;
+    const value_type w_i = w[i] - alpha*z_i;
+    r[i] = r_i;
+    u[i] = u_i;
+    w[i] = w_i;
+
+    ru += r_i*u_i;
+    wu += w_i*u_i;
+  }
+
+  block_sum2(ru, wu, partials);
+}
+"""
+
+
+
+
+class PipelinedCGStateContainer:
+    """Preconditioned conjugate gradients in the pipelined formulation of
+    P. Ghysels and W. Vanroose, Hiding global synchronization latency in the
+    preconditioned Conjugate Gradient algorithm, Parallel Computing 40
+    (2014).
+
+    Both inner products of an iteration are computed in a single reduction,
+    fused with the vector updates of the previous iteration. The scalars
+    alpha and beta stay on the device, so that the host only waits for the
+    GPU in the convergence check, which is done asynchronously every
+    *check_interval* iterations.
+
+    Only real-valued operators are supported.
+    """
+
+    block_size = 256
+
+    def __init__(self, operator, precon=None, pagelocked_allocator=None):
+        if precon is None:
+            from pycuda.sparse.operator import IdentityOperator
+            precon = IdentityOperator(operator.dtype, operator.shape[0])
+
+        self.operator = operator
+        self.precon = precon
+        self.dtype = np.dtype(operator.dtype)
+
+        if self.dtype.kind == "c":
+            raise ValueError("pipelined cg does not support complex values")
+
+        if pagelocked_allocator is None:
+            pagelocked_allocator = drv.pagelocked_empty
+        self.pagelocked_allocator = pagelocked_allocator
+
+        n = operator.shape[0]
+        dev = drv.Context.get_device()
+        self.block_count = max(1, min(
+            (n + self.block_size - 1) // self.block_size,
+            8*dev.multiprocessor_count))
+
+    @memoize_method
+    def get_kernels(self):
+        from pycuda.compiler import SourceModule
+        from pycuda.tools import dtype_to_ctype
+
+        mod = SourceModule(PIPELINED_CG_KERNELS % {
+            "value_type": dtype_to_ctype(self.dtype),
+            "block_size": self.block_size,
+            }, no_extern_c=True)
+
+        dots = mod.get_function("pcg_dots")
+        dots.prepare("PPPPI")
+        scalars = mod.get_function("pcg_scalars")
+        scalars.prepare("PIPi")
+        update = mod.get_function("pcg_update")
+        update.prepare("P"*12 + "I")
+
+        return dots, scalars, update
+
+    def _zeros(self):
+        return gpuarray.zeros(self.operator.shape[0], dtype=self.dtype,
+                allocator=self.rhs.allocator)
+
+    def _start_dots(self):
+        dots, _, _ = self.get_kernels()
+        dots.prepared_call((self.block_count, 1), (self.block_size, 1, 1),
+                self.r.gpudata, self.u.gpudata, self.w.gpudata,
+                self.partials.gpudata, self.operator.shape[0])
+        self.first = True
+
+    def reset(self, rhs, x=None):
+        self.rhs = rhs
+
+        if x is None:
+            x = self._zeros()
+        self.x = x
+
+        self.r = rhs - self.operator(x)
+        self.u = self.precon(self.r)
+        self.w = self.operator(self.u)
+
+        self.p = self._zeros()
+        self.s = self._zeros()
+        self.q = self._zeros()
+        self.z = self._zeros()
+
+        self.partials = gpuarray.empty(2*self.block_count, self.dtype,
+                allocator=rhs.allocator)
+        self.scalars = gpuarray.zeros(4, self.dtype, allocator=rhs.allocator)
+        self.host_scalars = self.pagelocked_allocator((4,), self.dtype)
+        self.scalars_copied_evt = None
+
+        self._start_dots()
+
+    def replace_residual(self):
+        """Recompute the residual and the auxiliary vectors from their
+        definitions, to counter the rounding error accumulated by their
+        recurrences.
+        """
+        A = self.operator
+        M = self.precon
+
+        self.r = self.rhs - A(self.x)
+        self.u = M(self.r)
+        self.w = A(self.u)
+        self.s = A(self.p)
+        self.q = M(self.s)
+        self.z = A(self.q)
+
+        self._start_dots()
+        self.first = False
+
+    def one_iteration(self):
+        _, scalars, update = self.get_kernels()
+
+        m = self.precon(self.w)
+        n = self.operator(m)
+
+        scalars.prepared_call((1, 1), (self.block_size, 1, 1),
+                self.partials.gpudata, self.block_count,
+                self.scalars.gpudata, int(self.first))
+        self.first = False
+
+        update.prepared_call((self.block_count, 1), (self.block_size, 1, 1),
+                self.scalars.gpudata,
+                self.x.gpudata, self.r.gpudata, self.u.gpudata,
+                self.w.gpudata, self.p.gpudata, self.s.gpudata,
+                self.q.gpudata, self.z.gpudata,
+                m.gpudata, n.gpudata,
+                self.partials.gpudata, self.operator.shape[0])
+
+    def start_scalar_copy(self):
+        drv.memcpy_dtoh_async(self.host_scalars, self.scalars.gpudata)
+        self.scalars_copied_evt = drv.Event()
+        self.scalars_copied_evt.record()
+
+    def run(self, max_iterations=None, tol=1e-7, check_interval=20,
+            replace_interval=50, debug_callback=None):
+        """Iterate until the preconditioned residual norm (r, M r) has been
+        reduced by a factor of *tol* squared, checking every
+        *check_interval* iterations. Since the check does not wait for the
+        GPU, convergence may be detected up to *check_interval* iterations
+        late. Every *replace_interval* iterations, the residual is
+        recomputed from its definition.
+        """
+        if max_iterations is None:
+            max_iterations = max(
+                    3*check_interval+1, 10 * self.operator.shape[0])
+
+        gamma_0 = None
+        iterations = 0
+        while iterations < max_iterations:
+            replace = (replace_interval
+                    and iterations and iterations % replace_interval == 0)
+            if replace:
+                self.replace_residual()
+
+            self.one_iteration()
+
+            if debug_callback is not None:
+                if replace:
+                    what = "it+residual"
+                else:
+                    what = "it"
+                debug_callback(what, iterations, self.x, self.r, self.p,
+                        self.scalars)
+
+            if iterations % check_interval == 0:
+                evt = self.scalars_copied_evt
+                if evt is not None and evt.query():
+                    gamma = self.host_scalars[0]
+                    if gamma_0 is None:
+                        gamma_0 = gamma
+                    elif abs(gamma) < tol*tol * abs(gamma_0):
+                        if debug_callback is not None:
+                            debug_callback("end", iterations, self.x,
+                                    self.r, self.p, self.scalars)
+                        return self.x
+
+                    self.scalars_copied_evt = None
+
+                if self.scalars_copied_evt is None:
+                    self.start_scalar_copy()
+
+            iterations += 1
+
+        raise ConvergenceError("cg failed to converge")
+
+
+def pipelined_cg_reference(matvec, precon, b, x, iterations):
+    """Run *iterations* steps of the pipelined cg recurrence used by
+    :class:`PipelinedCGStateContainer` on the host, with :mod:`numpy`
+    arrays *b* and *x* and callables *matvec* and *precon*. Return the new
+    *x*. In exact arithmetic, the result equals that of preconditioned cg.
+    """
+    r = b - matvec(x)
+    u = precon(r)
+    w = matvec(u)
+    p = np.zeros_like(b)
+    s = np.zeros_like(b)
+    q = np.zeros_like(b)
+    z = np.zeros_like(b)
+
+    gamma_old = alpha_old = None
+    for i in range(iterations):
+        gamma = np.dot(r, u)
+        delta = np.dot(w, u)
+        m = precon(w)
+        n = matvec(m)
+
+        if i == 0:
+            beta = 0
+            alpha = gamma/delta
+        else:
+            beta = gamma/gamma_old
+            alpha = gamma/(delta - beta*gamma/alpha_old)
+
+        z = n + beta*z
+        q = m + beta*q
+        s = w + beta*s
+        p = u + beta*p
+
+        x = x + alpha*p
+        r = r - alpha*s
+        u = u - alpha*q
+        w = w - alpha*z
+
+        gamma_old = gamma
+        alpha_old = alpha
+
+    return x
+
+# }}}
+
+
+
+
+# {{{ batched cg
+
+BATCHED_CG_KERNELS = """
+typedef %(value_type)s value_type;
+
+#define BLOCK_SIZE %(block_size)d
+
+// Vectors are row-major blocks of shape (n, k), with one right-hand side
+// per column. Dot products of all columns are computed in two steps:
+// bcg_partial_dot has each block sum up the columns of its share of the
+// rows, and the other reduction kernels, run as a single block, add up
+// these partial sums.
+
+// partial[blockIdx.x*k + c] = sum of a[i*k+c]*b[i*k+c] over this block's
+// rows. The vectors are read with consecutive threads at consecutive
+// entries. Since the number of threads used, and hence the stride, is a
+// multiple of k, each thread only visits entries of column tid %% k.
+extern "C" __global__ void
+bcg_partial_dot(const value_type *a, const value_type *b,
+    value_type *partial, const unsigned size, const unsigned k)
+{
+  __shared__ value_type sdata[BLOCK_SIZE];
+
+  const unsigned tid = threadIdx.x;
+  const unsigned used_threads = BLOCK_SIZE / k * k;
+
+  value_type sum = 0;
+  if (tid < used_threads)
+    for (unsigned i = used_threads*blockIdx.x + tid; i < size;
+        i += used_threads*gridDim.x)
+      sum += a[i]*b[i];
+
+  sdata[tid] = sum;
+  __syncthreads();
+
+  // add up the groups of k entries
+  for (unsigned group_count = used_threads / k; group_count > 1; )
+  {
+    const unsigned half = (group_count + 1) / 2;
+    if (tid < (group_count - half) * k)
+      sdata[tid] += sdata[tid + half*k];
+    __syncthreads();
+    group_count = half;
+  }
+
+  if (tid < k)
+    partial[blockIdx.x*k + tid] = sdata[tid];
+}
+
+__device__ value_type column_sum(const value_type *partial,
+    const unsigned group_count, const unsigned k, const unsigned c)
+{
+  value_type sum = 0;
+  for (unsigned g = 0; g < group_count; ++g)
+    sum += partial[g*k + c];
+  return sum;
+}
+
+// rz[c] = (r_c, z_c)
+extern "C" __global__ void
+bcg_dot(const value_type *partial, const unsigned group_count,
+    value_type *rz, const unsigned k)
+{
+  for (unsigned c = threadIdx.x; c < k; c += BLOCK_SIZE)
+    rz[c] = column_sum(partial, group_count, k, c);
+}
+
+// alpha[c] = (r_c, z_c) / (p_c, A p_c), zero for converged columns
+extern "C" __global__ void
+bcg_alpha(const value_type *partial, const unsigned group_count,
+    const value_type *rz, const int *active, value_type *alpha,
+    const unsigned k)
+{
+  for (unsigned c = threadIdx.x; c < k; c += BLOCK_SIZE)
+  {
+    const value_type pq = column_sum(partial, group_count, k, c);
+    alpha[c] = (active[c] && pq != 0) ? rz[c] / pq : 0;
+  }
+}
+
+// beta[c] = (r_c, z_c)_new / (r_c, z_c)_old, and convergence check
+extern "C" __global__ void
+bcg_beta(const value_type *partial, const unsigned group_count,
+    value_type *rz, const value_type *rz0, int *active, value_type *beta,
+    const unsigned k, const value_type tol_sq)
+{
+  for (unsigned c = threadIdx.x; c < k; c += BLOCK_SIZE)
+  {
+    const value_type rz_new = column_sum(partial, group_count, k, c);
+    const int was_active = active[c];
+    beta[c] = (was_active && rz[c] != 0) ? rz_new / rz[c] : 0;
+    rz[c] = rz_new;
+    active[c] = was_active && fabs(rz_new) > tol_sq * fabs(rz0[c]);
+  }
+}
+
+// x += alpha p, r -= alpha q
+extern "C" __global__ void
+bcg_update_xr(const value_type *alpha, value_type *x, value_type *r,
+    const value_type *p, const value_type *q, const unsigned size,
+    const unsigned k)
+{
+  for (unsigned i = BLOCK_SIZE*blockIdx.x + threadIdx.x; i < size;
+      i += BLOCK_SIZE*gridDim.x)
+  {
+    const value_type a = alpha[i %% k];
+    x[i] += a*p[i];
+    r[i] -= a*q[i];
+  }
+}
+
+// p = z + beta p
+extern "C" __global__ void
+bcg_update_p(const value_type *beta, value_type *p, const value_type *z,
+    const unsigned size, const unsigned k)
+{
+  for (unsigned i = BLOCK_SIZE*blockIdx.x + threadIdx.x; i < size;
+      i += BLOCK_SIZE*gridDim.x)
+    p[i] = z[i] + beta[i %% k]*p[i];
+}
+"""
+
+
+
+
+class BatchedCGStateContainer:
+    """Preconditioned conjugate gradients for several right-hand sides at
+    once. Vectors are row-major blocks of shape *(n, k)*, and the operator
+    must provide a method *spmm* that multiplies such a block, so that one
+    product per iteration serves all right-hand sides. At most
+    :attr:`block_size` right-hand sides are supported.
+
+    Each column is iterated independently, with its scalars kept on the
+    device. Columns stop changing once they have converged. *precon*, if
+    given, is a callable taking and returning a block.
+
+    Only real-valued operators are supported.
+    """
+
+    block_size = 256
+
+    def __init__(self, operator, precon=None, pagelocked_allocator=None):
+        self.operator = operator
+        self.precon = precon
+        self.dtype = np.dtype(operator.dtype)
+
+        if self.dtype.kind == "c":
+            raise ValueError("batched cg does not support complex values")
+
+        if pagelocked_allocator is None:
+            pagelocked_allocator = drv.pagelocked_empty
+        self.pagelocked_allocator = pagelocked_allocator
+
+    @memoize_method
+    def get_kernels(self):
+        from pycuda.compiler import SourceModule
+        from pycuda.tools import dtype_to_ctype
+
+        mod = SourceModule(BATCHED_CG_KERNELS % {
+            "value_type": dtype_to_ctype(self.dtype),
+            "block_size": self.block_size,
+            }, no_extern_c=True)
+
+        partial_dot = mod.get_function("bcg_partial_dot")
+        partial_dot.prepare("PPPII")
+        dot = mod.get_function("bcg_dot")
+        dot.prepare("PIPI")
+        alpha = mod.get_function("bcg_alpha")
+        alpha.prepare("PIPPPI")
+        beta = mod.get_function("bcg_beta")
+        beta.prepare("PIPPPPI" + self.dtype.char)
+        update_xr = mod.get_function("bcg_update_xr")
+        update_xr.prepare("PPPPPII")
+        update_p = mod.get_function("bcg_update_p")
+        update_p.prepare("PPPII")
+
+        return partial_dot, dot, alpha, beta, update_xr, update_p
+
+    def _apply_precon(self, r):
+        # z is only read, so it may alias r
+        if self.precon is None:
+            return r
+        else:
+            return self.precon(r)
+
+    def _elementwise_grid(self):
+        dev = drv.Context.get_device()
+        return (max(1, min(
+            (self.rhs.size + self.block_size - 1) // self.block_size,
+            8*dev.multiprocessor_count)), 1)
+
+    def _partial_dot(self, a, b):
+        """Leave the per-block sums of the column dot products of *a* and
+        *b* in :attr:`partial_dots`.
+        """
+        partial_dot = self.get_kernels()[0]
+        partial_dot.prepared_call(self.elwise_grid, (self.block_size, 1, 1),
+                a.gpudata, b.gpudata, self.partial_dots.gpudata,
+                a.size, a.shape[1])
+
+    def reset(self, rhs, x=None):
+        if len(rhs.shape) != 2:
+            raise ValueError("rhs must have shape (n, rhs_count)")
+
+        self.rhs = rhs
+        n, k = rhs.shape
+
+        if k > self.block_size:
+            raise ValueError("at most %d right-hand sides are supported"
+                    % self.block_size)
+
+        self.elwise_grid = self._elementwise_grid()
+        self.partial_dots = gpuarray.empty(self.elwise_grid[0]*k, self.dtype,
+                allocator=rhs.allocator)
+
+        if x is None:
+            x = gpuarray.zeros(rhs.shape, dtype=self.dtype,
+                    allocator=rhs.allocator)
+        self.x = x
+
+        self.r = rhs - self.operator.spmm(x)
+        self.z = self._apply_precon(self.r)
+        self.p = self.z.copy()
+
+        dot = self.get_kernels()[1]
+
+        def column_vector():
+            return gpuarray.empty(k, self.dtype, allocator=rhs.allocator)
+
+        self.rz = column_vector()
+        self._partial_dot(self.r, self.z)
+        dot.prepared_call((1, 1), (self.block_size, 1, 1),
+                self.partial_dots.gpudata, self.elwise_grid[0],
+                self.rz.gpudata, k)
+        self.rz0 = self.rz.copy()
+
+        self.alpha = column_vector()
+        self.beta = column_vector()
+
+        self.active = gpuarray.empty(k, np.int32, allocator=rhs.allocator)
+        self.active.fill(1)
+        self.host_active = self.pagelocked_allocator((k,), np.int32)
+        self.active_copied_evt = None
+
+    def one_iteration(self, tol):
+        _, _, alpha, beta, update_xr, update_p = self.get_kernels()
+        n, k = self.rhs.shape
+        block = (self.block_size, 1, 1)
+        elwise_grid = self.elwise_grid
+        group_count = elwise_grid[0]
+
+        q = self.operator.spmm(self.p)
+
+        self._partial_dot(self.p, q)
+        alpha.prepared_call((1, 1), block,
+                self.partial_dots.gpudata, group_count, self.rz.gpudata,
+                self.active.gpudata, self.alpha.gpudata, k)
+        update_xr.prepared_call(elwise_grid, block,
+                self.alpha.gpudata, self.x.gpudata, self.r.gpudata,
+                self.p.gpudata, q.gpudata, self.rhs.size, k)
+
+        self.z = self._apply_precon(self.r)
+
+        self._partial_dot(self.r, self.z)
+        beta.prepared_call((1, 1), block,
+                self.partial_dots.gpudata, group_count, self.rz.gpudata,
+                self.rz0.gpudata, self.active.gpudata, self.beta.gpudata,
+                k, tol*tol)
+        update_p.prepared_call(elwise_grid, block,
+                self.beta.gpudata, self.p.gpudata, self.z.gpudata,
+                self.rhs.size, k)
+
+    def start_active_copy(self):
+        drv.memcpy_dtoh_async(self.host_active, self.active.gpudata)
+        self.active_copied_evt = drv.Event()
+        self.active_copied_evt.record()
+
+    def run(self, max_iterations=None, tol=1e-7, check_interval=20,
+            debug_callback=None):
+        """Iterate until, for every column, the preconditioned residual norm
+        (r, M r) has been reduced by a factor of *tol* squared. Return the
+        number of iterations performed. As in
+        :class:`PipelinedCGStateContainer`, the check is done asynchronously
+        every *check_interval* iterations.
+        """
+        if max_iterations is None:
+            max_iterations = max(
+                    3*check_interval+1, 10 * self.operator.shape[0])
+
+        iterations = 0
+        while iterations < max_iterations:
+            self.one_iteration(tol)
+
+            if debug_callback is not None:
+                debug_callback("it", iterations, self.x, self.r, self.p,
+                        self.active)
+
+            if iterations % check_interval == 0:
+                evt = self.active_copied_evt
+                if evt is not None and evt.query():
+                    if not self.host_active.any():
+                        if debug_callback is not None:
+                            debug_callback("end", iterations, self.x,
+                                    self.r, self.p, self.active)
+                        return self.x
+
+                    self.active_copied_evt = None
+
+                if self.active_copied_evt is None:
+                    self.start_active_copy()
+
+            iterations += 1
+
+        raise ConvergenceError("cg failed to converge")
+
+# }}}
+
+
+
+
 def solve_pkt_with_cg(pkt_spmv, b, precon=None, x=None, tol=1e-7, max_iterations=None,
-        debug=False, pagelocked_allocator=None):
+        debug=False, pagelocked_allocator=None, pipelined=False):
+    """If *pipelined* is *True*, :class:`PipelinedCGStateContainer` is used
+    instead of :class:`CGStateContainer`.
+    """
     if x is None:
         x = gpuarray.zeros(pkt_spmv.shape[0], dtype=pkt_spmv.dtype,
                 allocator=b.allocator)
@@ -212,7 +936,12 @@ def solve_pkt_with_cg(pkt_spmv, b, precon=None, x=None, tol=1e-7, max_iterations
     if pagelocked_allocator is None:
         pagelocked_allocator = drv.pagelocked_empty
 
-    cg = CGStateContainer(pkt_spmv, precon,
+    if pipelined:
+        cg_class = PipelinedCGStateContainer
+    else:
+        cg_class = CGStateContainer
+
+    cg = cg_class(pkt_spmv, precon,
             pagelocked_allocator=pagelocked_allocator)
 
     cg.reset(pkt_spmv.permute(b), x)
@@ -234,3 +963,109 @@ def solve_pkt_with_cg(pkt_spmv, b, precon=None, x=None, tol=1e-7, max_iterations
 
 
 
+def solve_batched_with_cg(spmv, b, precon=None, x=None, tol=1e-7,
+        max_iterations=None, pagelocked_allocator=None):
+    """Solve for the columns of the row-major block *b* of shape
+    *(n, rhs_count)* at once, using :class:`BatchedCGStateContainer`.
+    *spmv* must provide *spmm*, *permute_block* and *unpermute_block*, like
+    :class:`pycuda.sparse.packeted.PacketedSpMV`. *precon* acts on permuted
+    blocks.
+
+    Return a tuple *(x, iteration_count)*.
+    """
+    if x is not None:
+        x = spmv.permute_block(x)
+
+    cg = BatchedCGStateContainer(spmv, precon,
+            pagelocked_allocator=pagelocked_allocator)
+
+    cg.reset(spmv.permute_block(b), x)
+
+    it_count = [0]
+    def debug_callback(what, it_number, x, resid, d, active):
+        if what == "it":
+            it_count[0] += 1
+
+    result = cg.run(max_iterations, tol,
+            debug_callback=debug_callback)
+
+    return spmv.unpermute_block(result), it_count[0]
+
+
+
+
+def solve_with_iterative_refinement(operator, b, precon=None, x=None,
+        tol=1e-12, inner_dtype=np.float32, inner_operator=None,
+        inner_tol=1e-4, max_refinements=50, inner_max_iterations=None,
+        pagelocked_allocator=None, pipelined=False):
+    """Solve *operator* x = *b* to a relative residual of *tol* by mixed
+    precision iterative refinement: the residual is computed with
+    *operator* (typically double precision), and each correction is found
+    by cg in *inner_dtype* to a relative accuracy of *inner_tol*, so that
+    most of the matrix traffic is single precision.
+
+    *operator* may be a :class:`pycuda.sparse.packeted.PacketedSpMV`, a
+    :class:`pycuda.sparse.coordinate.CoordinateSpMV` or any other operator
+    providing *permute* and *unpermute*. *inner_operator*
+    must use the same ordering of unknowns. If it is not given, it is
+    obtained as *operator.astype(inner_dtype)*. *precon* (e.g. a
+    :class:`pycuda.sparse.operator.DiagonalPreconditioner`) is converted in
+    the same way. If *pipelined* is *True*, the inner solves use
+    :class:`PipelinedCGStateContainer`.
+
+    Return a tuple *(x, refinement_count, inner_iteration_count)*.
+    """
+    inner_dtype = np.dtype(inner_dtype)
+
+    if inner_operator is None:
+        inner_operator = operator.astype(inner_dtype)
+    if precon is not None and precon.dtype != inner_dtype:
+        precon = precon.astype(inner_dtype)
+
+    if pagelocked_allocator is None:
+        pagelocked_allocator = drv.pagelocked_empty
+
+    if pipelined:
+        cg_class = PipelinedCGStateContainer
+    else:
+        cg_class = CGStateContainer
+
+    b = operator.permute(b)
+    if x is None:
+        x = gpuarray.zeros(operator.shape[0], dtype=operator.dtype,
+                allocator=b.allocator)
+    else:
+        x = operator.permute(x)
+
+    from math import sqrt
+    b_norm = sqrt(abs(gpuarray.dot(b, b).get()))
+
+    it_count = [0]
+    def debug_callback(what, it_number, x, resid, d, delta):
+        if what in ["it", "it+residual"]:
+            it_count[0] += 1
+
+    for refinement in xrange(max_refinements+1):
+        residual = b - operator(x)
+        resid_norm = sqrt(abs(gpuarray.dot(residual, residual).get()))
+
+        if resid_norm <= tol * b_norm:
+            return operator.unpermute(x), refinement, it_count[0]
+
+        if refinement == max_refinements:
+            break
+
+        # scale the residual to unit norm to keep it within the range of
+        # the inner precision
+        inner_rhs = (residual * (1/resid_norm)).astype(inner_dtype)
+
+        cg = cg_class(inner_operator, precon,
+                pagelocked_allocator=pagelocked_allocator)
+        cg.reset(inner_rhs, gpuarray.zeros(inner_operator.shape[0],
+            dtype=inner_dtype, allocator=b.allocator))
+        correction = cg.run(inner_max_iterations, inner_tol,
+                debug_callback=debug_callback)
+
+        x += correction.astype(operator.dtype) * resid_norm
+
+    raise ConvergenceError("iterative refinement failed to converge")
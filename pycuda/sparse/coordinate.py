@@ -17,7 +17,7 @@ COO_FLAT_KERNEL_TEMPLATE = """
 typedef %(value_type)s value_type;
 typedef %(index_type)s index_type;
 
-texture<%(tex_value_type)s, 1, cudaReadModeElementType> tex_x;
+%(x_source)s
 
 static __inline__ __device__ float atomicAdd(float *addr, float val)
 {
@@ -50,12 +50,12 @@ static __attribute__ ((unused)) __inline__ __device__ double atomicAdd(double *a
 #endif
 
 __global__ void
-spmv_coo_flat_kernel(const index_type num_nonzeros,
+%(kernel_name)s(const index_type num_nonzeros,
                      const index_type interval_size,
                      const index_type *I,
                      const index_type *J,
                      const value_type *V,
-                           value_type *y)
+                           value_type *y%(extra_parameters)s)
 {
   __shared__ index_type idx[BLOCK_SIZE];
   __shared__ value_type val[BLOCK_SIZE];
@@ -83,15 +83,15 @@ spmv_coo_flat_kernel(const index_type num_nonzeros,
   for(index_type n = begin; n < end; n += WARP_SIZE)
   {
     idx[threadIdx.x] = I[n];                                             // row index
-    val[threadIdx.x] = V[n] * fp_tex1Dfetch(tex_x, J[n]);                // val = A[row,col] * x[col]
+    val[threadIdx.x] = V[n] * X_VALUE(J[n]);                             // val = A[row,col] * x[col]
 
     if (thread_lane == 0){
       if(idx[threadIdx.x] == carry_idx[warp_lane])
           val[threadIdx.x] += carry_val[warp_lane];                    // row continues into this warp's span
       else if(carry_idx[warp_lane] != first_idx)
-          y[carry_idx[warp_lane]] += carry_val[warp_lane];             // row terminated, does not span boundary
+          *Y_PTR(carry_idx[warp_lane]) += carry_val[warp_lane];        // row terminated, does not span boundary
       else
-          atomicAdd(y + carry_idx[warp_lane], carry_val[warp_lane]);   // row terminated, but spans iter-warp boundary
+          atomicAdd(Y_PTR(carry_idx[warp_lane]), carry_val[warp_lane]); // row terminated, but spans iter-warp boundary
     }
 
     // segmented reduction in shared memory
@@ -107,21 +107,47 @@ spmv_coo_flat_kernel(const index_type num_nonzeros,
     }
     else if ( idx[threadIdx.x] != idx[threadIdx.x+1] ) {                 // row terminates here
       if(idx[threadIdx.x] != first_idx)
-          y[idx[threadIdx.x]] += val[threadIdx.x];                     // row terminated, does not span inter-warp boundary
+          *Y_PTR(idx[threadIdx.x]) += val[threadIdx.x];                // row terminated, does not span inter-warp boundary
       else
-          atomicAdd(y + idx[threadIdx.x], val[threadIdx.x]);           // row terminated, but spans iter-warp boundary
+          atomicAdd(Y_PTR(idx[threadIdx.x]), val[threadIdx.x]);        // row terminated, but spans iter-warp boundary
     }
   }
 
   // final carry
   if(thread_lane == 31){
-    atomicAdd(y + carry_idx[warp_lane], carry_val[warp_lane]);
+    atomicAdd(Y_PTR(carry_idx[warp_lane]), carry_val[warp_lane]);
   }
 }
 """
 
 
 
+# The flat kernel reads x through a texture. Its multi-vector variant runs
+# one segmented reduction per right-hand side, selected by blockIdx.y, on
+# row-major blocks of vectors.
+COO_SPMV_SOURCES = dict(
+        kernel_name="spmv_coo_flat_kernel",
+        x_source="""
+texture<%(tex_value_type)s, 1, cudaReadModeElementType> tex_x;
+
+#define X_VALUE(col) fp_tex1Dfetch(tex_x, col)
+#define Y_PTR(row) (y + (row))
+""",
+        extra_parameters="")
+
+COO_SPMM_SOURCES = dict(
+        kernel_name="spmm_coo_flat_kernel",
+        x_source="""
+#define X_VALUE(col) x[(size_t) (col) * rhs_count + blockIdx.y]
+#define Y_PTR(row) (y + (size_t) (row) * rhs_count + blockIdx.y)
+""",
+        extra_parameters=""",
+                     const value_type *x,
+                     const index_type rhs_count""")
+
+
+
+
 COO_SERIAL_KERNEL_TEMPLATE = """
 typedef %(value_type)s value_type;
 typedef %(index_type)s index_type;
@@ -142,13 +168,66 @@ spmv_coo_serial_kernel(const index_type num_nonzeros,
 
 
 
-class CoordinateSpMV:
+COO_SPMM_SERIAL_KERNEL_TEMPLATE = """
+typedef %(value_type)s value_type;
+typedef %(index_type)s index_type;
+
+// x and y are row-major blocks of rhs_count vectors, one thread per column
+__global__ void
+spmm_coo_serial_kernel(const index_type num_nonzeros,
+                       const index_type rhs_count,
+                       const index_type *I,
+                       const index_type *J,
+                       const value_type *V,
+                       const value_type *x,
+                             value_type *y)
+{
+  for (index_type c = threadIdx.x; c < rhs_count; c += blockDim.x)
+    for (index_type n = 0; n < num_nonzeros; n++)
+      y[(size_t) I[n]*rhs_count + c] += V[n] * x[(size_t) J[n]*rhs_count + c];
+}
+"""
+
+
+
+
+def _is_pagelocked(ary):
+    base = ary
+    while isinstance(base, np.ndarray):
+        base = base.base
+
+    pinned_types = [drv.PagelockedHostAllocation]
+    if hasattr(drv, "RegisteredHostMemory"):
+        pinned_types.append(drv.RegisteredHostMemory)
+
+    return isinstance(base, tuple(pinned_types))
+
+
+def _as_pagelocked(ary, dtype):
+    """Return *ary* if it is a contiguous page-locked array of type *dtype*,
+    or else a page-locked copy of it.
+    """
+    ary = np.asarray(ary)
+    if (ary.dtype == dtype and ary.flags.c_contiguous
+            and _is_pagelocked(ary)):
+        return ary
+
+    result = drv.pagelocked_empty(ary.shape, dtype)
+    result[...] = ary
+    return result
+
+
+
+
+class CoordinateSpMV(object):
     def __init__(self, mat, dtype):
-        self.dtype = np.dtype(dtype)
-        self.index_dtype = np.dtype(np.int32)
-        self.shape = mat.shape
+        from scipy.sparse import isspmatrix_csr
+        if isspmatrix_csr(mat):
+            self._init_from_csr(mat.shape, mat.indptr, mat.indices, mat.data,
+                    dtype)
+            return
 
-        self.block_size = 128
+        self._set_parameters(mat.shape, dtype)
 
         from scipy.sparse import coo_matrix
         coo_mat = coo_matrix(mat, dtype=self.dtype)
@@ -158,6 +237,66 @@ class CoordinateSpMV:
         self.data_gpu = gpuarray.to_gpu(coo_mat.data)
         self.nnz = coo_mat.nnz
 
+        self._find_partition()
+
+    @classmethod
+    def from_csr(cls, shape, indptr, indices, data, dtype):
+        """Build the operator directly from the arrays of a matrix of shape
+        *shape* in compressed sparse row format, without going through
+        :mod:`scipy.sparse`.
+
+        The row indices are computed by native code while *indices* and
+        *data* are being copied to the device. If these are contiguous
+        page-locked arrays (see :func:`pycuda.driver.pagelocked_empty`) of
+        types :class:`numpy.int32` and *dtype*, they are copied without an
+        intermediate host copy.
+        """
+        result = cls.__new__(cls)
+        result._init_from_csr(shape, indptr, indices, data, dtype)
+        return result
+
+    def _set_parameters(self, shape, dtype):
+        self.dtype = np.dtype(dtype)
+        self.index_dtype = np.dtype(np.int32)
+        self.shape = shape
+
+        self.block_size = 128
+
+    def _init_from_csr(self, shape, indptr, indices, data, dtype):
+        self._set_parameters(shape, dtype)
+
+        indptr = np.ascontiguousarray(indptr, dtype=self.index_dtype)
+        if len(indptr) != shape[0] + 1:
+            raise ValueError("indptr must have one entry per row plus one")
+        self.nnz = nnz = int(indptr[-1])
+
+        if len(indices) < nnz or len(data) < nnz:
+            raise ValueError("indices and data must have indptr[-1] entries")
+
+        self.row_gpu = gpuarray.empty(nnz, self.index_dtype)
+        self.col_gpu = gpuarray.empty(nnz, self.index_dtype)
+        self.data_gpu = gpuarray.empty(nnz, self.dtype)
+
+        if nnz:
+            stream = drv.Stream()
+
+            indices = _as_pagelocked(indices[:nnz], self.index_dtype)
+            data = _as_pagelocked(data[:nnz], self.dtype)
+            self.col_gpu.set_async(indices, stream)
+            self.data_gpu.set_async(data, stream)
+
+            # overlaps with the copies above
+            from pycuda._driver import _expand_csr_rows
+            rows = drv.pagelocked_empty(nnz, self.index_dtype)
+            _expand_csr_rows(indptr, rows)
+            self.row_gpu.set_async(rows, stream)
+
+            # keep the host buffers alive until the copies are done
+            stream.synchronize()
+
+        self._find_partition()
+
+    def _find_partition(self):
         from pycuda.tools import DeviceData
         dev = drv.Context.get_device()
         devdata = DeviceData()
@@ -173,25 +312,31 @@ class CoordinateSpMV:
             num_units  = self.nnz // dev.warp_size
             num_warps  = min(num_units, warps_per_block * max_blocks)
             self.num_blocks = divide_into(num_warps, warps_per_block)
-            num_iters  = divide_into(num_units, num_warps)
 
-            self.interval_size = dev.warp_size * num_iters
+            if num_units:
+                num_iters  = divide_into(num_units, num_warps)
+                self.interval_size = dev.warp_size * num_iters
             self.tail = num_units * dev.warp_size
 
+    def _get_flat_module(self, sources):
+        from pycuda.tools import dtype_to_ctype
+
+        params = {
+                "value_type": dtype_to_ctype(self.dtype),
+                "tex_value_type": dtype_to_ctype(
+                    self.dtype, with_fp_tex_hack=True),
+                "index_type": dtype_to_ctype(self.index_dtype),
+                "block_size": self.block_size,
+                "warp_size": drv.Context.get_device().warp_size,
+                }
+        params.update(sources)
+        params["x_source"] = sources["x_source"] % params
+
+        return SourceModule(COO_FLAT_KERNEL_TEMPLATE % params)
 
     @memoize_method
     def get_flat_kernel(self):
-        from pycuda.tools import dtype_to_ctype
-
-        mod = SourceModule(
-                COO_FLAT_KERNEL_TEMPLATE % {
-                    "value_type": dtype_to_ctype(self.dtype),
-                    "tex_value_type": dtype_to_ctype(
-                        self.dtype, with_fp_tex_hack=True),
-                    "index_type": dtype_to_ctype(self.index_dtype),
-                    "block_size": self.block_size,
-                    "warp_size": drv.Context.get_device().warp_size,
-                    })
+        mod = self._get_flat_module(COO_SPMV_SOURCES)
         func = mod.get_function("spmv_coo_flat_kernel")
         x_texref = mod.get_texref("tex_x")
         func.prepare(self.index_dtype.char*2 + "PPPP",
@@ -219,14 +364,15 @@ class CoordinateSpMV:
         if self.nnz == 0:
             return y
 
-        flat_func, x_texref = self.get_flat_kernel()
-        x.bind_to_texref_ext(x_texref, allow_double_hack=True)
-        flat_func.prepared_call((self.num_blocks, 1),
-                self.tail, self.interval_size,
-                self.row_gpu.gpudata,
-                self.col_gpu.gpudata,
-                self.data_gpu.gpudata,
-                y.gpudata)
+        if self.tail:
+            flat_func, x_texref = self.get_flat_kernel()
+            x.bind_to_texref_ext(x_texref, allow_double_hack=True)
+            flat_func.prepared_call((self.num_blocks, 1),
+                    self.tail, self.interval_size,
+                    self.row_gpu.gpudata,
+                    self.col_gpu.gpudata,
+                    self.data_gpu.gpudata,
+                    y.gpudata)
 
         self.get_serial_kernel().prepared_call(
                 (1, 1),
@@ -237,3 +383,88 @@ class CoordinateSpMV:
                 x.gpudata, y.gpudata)
 
         return y
+
+    def astype(self, dtype):
+        """Return a copy of this operator with values of type *dtype*."""
+        from scipy.sparse import coo_matrix
+        return CoordinateSpMV(
+                coo_matrix((self.data_gpu.get(),
+                    (self.row_gpu.get(), self.col_gpu.get())),
+                    shape=self.shape),
+                dtype)
+
+    # The unknowns keep their original order. permute returns a copy, as
+    # the solvers update their vectors in place.
+    def permute(self, x):
+        return x.copy()
+
+    def unpermute(self, x):
+        return x
+
+    def permute_block(self, x):
+        return x.copy()
+
+    def unpermute_block(self, x):
+        return x
+
+    @memoize_method
+    def get_spmm_kernels(self):
+        from pycuda.tools import dtype_to_ctype
+
+        if self.dtype not in [np.float32, np.float64]:
+            raise TypeError("spmm is only supported for float32 and float64")
+
+        flat_func = self._get_flat_module(COO_SPMM_SOURCES).get_function(
+                "spmm_coo_flat_kernel")
+        flat_func.prepare(self.index_dtype.char*2 + "PPPPP"
+                + self.index_dtype.char)
+
+        mod = SourceModule(
+                COO_SPMM_SERIAL_KERNEL_TEMPLATE % {
+                    "value_type": dtype_to_ctype(self.dtype),
+                    "index_type": dtype_to_ctype(self.index_dtype),
+                    })
+        serial_func = mod.get_function("spmm_coo_serial_kernel")
+        serial_func.prepare(self.index_dtype.char*2 + "PPPPP")
+
+        return flat_func, serial_func
+
+    def spmm(self, x, y=None):
+        """Multiply the row-major block of vectors *x* of shape
+        *(n, rhs_count)* by the matrix, adding the result to *y*.
+        """
+        if len(x.shape) != 2 or x.shape[0] != self.shape[1] \
+                or not x.flags.c_contiguous:
+            raise ValueError("x must be a C-contiguous block of shape "
+                    "(n, rhs_count)")
+
+        rhs_count = x.shape[1]
+        if y is None:
+            y = gpuarray.zeros((self.shape[0], rhs_count), dtype=self.dtype,
+                    allocator=x.allocator)
+
+        if self.nnz == 0 or rhs_count == 0:
+            return y
+
+        flat_func, serial_func = self.get_spmm_kernels()
+
+        # the same segmented reduction as in __call__, once per column
+        if self.tail:
+            flat_func.prepared_call((self.num_blocks, rhs_count),
+                    (self.block_size, 1, 1),
+                    self.tail, self.interval_size,
+                    self.row_gpu.gpudata,
+                    self.col_gpu.gpudata,
+                    self.data_gpu.gpudata,
+                    y.gpudata, x.gpudata, rhs_count)
+
+        if self.nnz > self.tail:
+            serial_func.prepared_call((1, 1),
+                    (min(rhs_count, self.block_size), 1, 1),
+                    self.nnz - self.tail, rhs_count,
+                    self.row_gpu[self.tail:].gpudata,
+                    self.col_gpu[self.tail:].gpudata,
+                    self.data_gpu[self.tail:].gpudata,
+                    x.gpudata, y.gpudata)
+
+        return y
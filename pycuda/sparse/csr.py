@@ -0,0 +1,193 @@
+from __future__ import division
+from pytools import memoize_method
+import pycuda.gpuarray as gpuarray
+from pycuda.compiler import SourceModule
+from pycuda.sparse.operator import SpMVOperatorBase
+import numpy as np
+
+
+
+
+CSR_SCALAR_KERNEL_TEMPLATE = """
+typedef %(value_type)s value_type;
+typedef %(index_type)s index_type;
+
+// one thread per row
+__global__ void
+spmv_csr_scalar_kernel(const index_type num_rows,
+                       const index_type *row_ptr,
+                       const index_type *col_idx,
+                       const value_type *data,
+                       const value_type *x,
+                             value_type *y)
+{
+  for (index_type row = blockDim.x * blockIdx.x + threadIdx.x;
+      row < num_rows; row += blockDim.x * gridDim.x)
+  {
+    value_type sum = y[row];
+
+    const index_type row_end = row_ptr[row+1];
+    for (index_type jj = row_ptr[row]; jj < row_end; jj++)
+      sum += data[jj] * x[col_idx[jj]];
+
+    y[row] = sum;
+  }
+}
+"""
+
+
+
+
+CSR_VECTOR_KERNEL_TEMPLATE = """
+typedef %(value_type)s value_type;
+typedef %(index_type)s index_type;
+
+#define BLOCK_SIZE %(block_size)d
+#define THREADS_PER_ROW %(threads_per_row)d
+#define ROWS_PER_BLOCK (BLOCK_SIZE / THREADS_PER_ROW)
+
+// THREADS_PER_ROW threads (up to a warp) per row
+__global__ void
+spmv_csr_vector_kernel(const index_type num_rows,
+                       const index_type *row_ptr,
+                       const index_type *col_idx,
+                       const value_type *data,
+                       const value_type *x,
+                             value_type *y)
+{
+  __shared__ value_type sdata[BLOCK_SIZE];
+
+  const index_type thread_lane = threadIdx.x & (THREADS_PER_ROW-1);
+
+  // The loop condition is uniform across the block, so that
+  // __syncthreads() may be used inside.
+  for (index_type block_row = ROWS_PER_BLOCK * blockIdx.x;
+      block_row < num_rows; block_row += ROWS_PER_BLOCK * gridDim.x)
+  {
+    const index_type row = block_row + threadIdx.x / THREADS_PER_ROW;
+
+    value_type sum = 0;
+    if (row < num_rows)
+    {
+      const index_type row_end = row_ptr[row+1];
+      for (index_type jj = row_ptr[row] + thread_lane; jj < row_end;
+          jj += THREADS_PER_ROW)
+        sum += data[jj] * x[col_idx[jj]];
+    }
+
+    sdata[threadIdx.x] = sum;
+    __syncthreads();
+
+    #pragma unroll
+    for (unsigned offset = THREADS_PER_ROW/2; offset > 0; offset >>= 1)
+    {
+      if (thread_lane < offset)
+        sdata[threadIdx.x] = sum = sum + sdata[threadIdx.x + offset];
+      __syncthreads();
+    }
+
+    if (thread_lane == 0 && row < num_rows)
+      y[row] += sum;
+  }
+}
+"""
+
+
+
+
+def get_csr_threads_per_row(row_lengths, warp_size=32):
+    """Return the number of threads to be used per row by the CSR vector
+    kernel, the smallest power of two not less than the mean row length,
+    but at most *warp_size*. A return value of 1 means that the scalar
+    kernel should be used.
+    """
+    if not len(row_lengths):
+        return 1
+
+    mean_row_length = np.sum(row_lengths) / len(row_lengths)
+
+    threads_per_row = 1
+    while threads_per_row < min(mean_row_length, warp_size):
+        threads_per_row *= 2
+
+    return threads_per_row
+
+
+
+
+class CSRSpMV(SpMVOperatorBase):
+    """Sparse matrix-vector product for a matrix stored in compressed sparse
+    row format.
+
+    *threads_per_row* may be a power of two up to the warp size. If it is 1,
+    one thread handles each row ("CSR scalar"). Otherwise, groups of that
+    many threads handle each row ("CSR vector"). If *None*, it is chosen
+    from the mean row length.
+    """
+
+    def __init__(self, mat, dtype, threads_per_row=None):
+        from scipy.sparse import csr_matrix
+        csr_mat = csr_matrix(mat, dtype=dtype)
+
+        SpMVOperatorBase.__init__(self, csr_mat.shape, csr_mat.dtype)
+        self.index_dtype = np.dtype(np.int32)
+
+        if threads_per_row is None:
+            import pycuda.driver as drv
+            threads_per_row = get_csr_threads_per_row(
+                    np.diff(csr_mat.indptr),
+                    drv.Context.get_device().warp_size)
+
+        if threads_per_row & (threads_per_row-1) \
+                or not 1 <= threads_per_row <= self.block_size:
+            raise ValueError("threads_per_row must be a power of two "
+                    "between 1 and %d" % self.block_size)
+
+        self.threads_per_row = threads_per_row
+
+        self.row_ptr_gpu = gpuarray.to_gpu(
+                csr_mat.indptr.astype(self.index_dtype))
+        self.col_idx_gpu = gpuarray.to_gpu(
+                csr_mat.indices.astype(self.index_dtype))
+        self.data_gpu = gpuarray.to_gpu(csr_mat.data)
+
+    @memoize_method
+    def get_kernel(self):
+        from pycuda.tools import dtype_to_ctype
+
+        if self.threads_per_row == 1:
+            template = CSR_SCALAR_KERNEL_TEMPLATE
+            name = "spmv_csr_scalar_kernel"
+        else:
+            template = CSR_VECTOR_KERNEL_TEMPLATE
+            name = "spmv_csr_vector_kernel"
+
+        mod = SourceModule(
+                template % {
+                    "value_type": dtype_to_ctype(self.dtype),
+                    "index_type": dtype_to_ctype(self.index_dtype),
+                    "block_size": self.block_size,
+                    "threads_per_row": self.threads_per_row,
+                    })
+        func = mod.get_function(name)
+        func.prepare(self.index_dtype.char + "PPPPP")
+        return func
+
+    def __call__(self, x, y=None):
+        if y is None:
+            y = gpuarray.zeros(self.shape[0], dtype=self.dtype,
+                    allocator=x.allocator)
+
+        if self.shape[0] == 0:
+            return y
+
+        self.get_kernel().prepared_call(
+                (self.get_block_count(self.shape[0]*self.threads_per_row), 1),
+                (self.block_size, 1, 1),
+                self.shape[0],
+                self.row_ptr_gpu.gpudata,
+                self.col_idx_gpu.gpudata,
+                self.data_gpu.gpudata,
+                x.gpudata, y.gpudata)
+
+        return y
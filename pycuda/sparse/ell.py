@@ -0,0 +1,205 @@
+from __future__ import division
+from pytools import memoize_method
+import pycuda.gpuarray as gpuarray
+from pycuda.compiler import SourceModule
+from pycuda.sparse.operator import SpMVOperatorBase
+import numpy as np
+
+
+
+
+ELL_KERNEL_TEMPLATE = """
+typedef %(value_type)s value_type;
+typedef %(index_type)s index_type;
+
+// one thread per row, entries stored column-major, padding has col < 0
+__global__ void
+spmv_ell_kernel(const index_type num_rows,
+                const index_type num_cols_per_row,
+                const index_type pitch,
+                const index_type *col_idx,
+                const value_type *data,
+                const value_type *x,
+                      value_type *y)
+{
+  for (index_type row = blockDim.x * blockIdx.x + threadIdx.x;
+      row < num_rows; row += blockDim.x * gridDim.x)
+  {
+    value_type sum = y[row];
+
+    index_type offset = row;
+    for (index_type n = 0; n < num_cols_per_row; n++, offset += pitch)
+    {
+      const index_type col = col_idx[offset];
+      if (col >= 0)
+        sum += data[offset] * x[col];
+    }
+
+    y[row] = sum;
+  }
+}
+"""
+
+
+
+
+# {{{ format conversion
+
+def choose_ell_width(row_lengths, relative_speed=3, breakeven_threshold=4096):
+    """Return the number of entries per row to be stored in the ELL part of
+    a hybrid ELL/COO matrix with the given *row_lengths*.
+
+    The width is increased as long as at least *breakeven_threshold* rows and
+    at least a fraction of 1/*relative_speed* of all rows still have an entry
+    in the next column. This reflects that the ELL kernel is about
+    *relative_speed* times faster per entry than the COO kernel, but pays for
+    padding.
+    """
+    row_lengths = np.asarray(row_lengths)
+    row_count = len(row_lengths)
+    if not row_count:
+        return 0
+
+    max_row_length = int(np.max(row_lengths))
+
+    # rows_longer_than[i]: number of rows with more than i entries
+    rows_longer_than = row_count - np.cumsum(
+            np.bincount(row_lengths, minlength=max_row_length+1))
+
+    for i in range(max_row_length):
+        rows = rows_longer_than[i]
+        if relative_speed*rows < row_count or rows < breakeven_threshold:
+            return i
+
+    return max_row_length
+
+
+def csr_to_ell(csr_mat, width, pitch=None):
+    """Split the :class:`scipy.sparse.csr_matrix` *csr_mat* into an ELL part
+    holding up to *width* entries per row and a remainder.
+
+    Return a tuple *(col_idx, data, remainder)*, where *col_idx* and *data*
+    have *width* columns of *pitch* entries each (stored column after
+    column), with column index -1 for padding. *remainder* is a
+    :class:`scipy.sparse.coo_matrix`.
+    """
+    from scipy.sparse import coo_matrix
+
+    row_count = csr_mat.shape[0]
+    if pitch is None:
+        pitch = row_count
+    if pitch < row_count:
+        raise ValueError("pitch must be at least the number of rows")
+
+    indptr = csr_mat.indptr
+    row_lengths = np.diff(indptr)
+    rows = np.repeat(np.arange(row_count, dtype=np.int32), row_lengths)
+    pos_in_row = np.arange(csr_mat.nnz) - np.repeat(indptr[:-1], row_lengths)
+
+    in_ell = pos_in_row < width
+    ell_offsets = pos_in_row[in_ell]*pitch + rows[in_ell]
+
+    col_idx = np.empty(width*pitch, dtype=np.int32)
+    col_idx.fill(-1)
+    col_idx[ell_offsets] = csr_mat.indices[in_ell]
+
+    data = np.zeros(width*pitch, dtype=csr_mat.dtype)
+    data[ell_offsets] = csr_mat.data[in_ell]
+
+    rest = ~in_ell
+    remainder = coo_matrix(
+            (csr_mat.data[rest], (rows[rest], csr_mat.indices[rest])),
+            shape=csr_mat.shape, dtype=csr_mat.dtype)
+
+    return col_idx, data, remainder
+
+# }}}
+
+
+
+
+class ELLSpMV(SpMVOperatorBase):
+    """Sparse matrix-vector product for a matrix in ELLPACK format, i.e.
+    with the same number of (possibly padded) entries stored for each row.
+
+    If *width* is *None*, the maximum row length is used. Entries beyond
+    *width* in any row are handled by a
+    :class:`pycuda.sparse.coordinate.CoordinateSpMV`, making this the
+    hybrid ELL/COO format.
+    """
+
+    def __init__(self, mat, dtype, width=None):
+        from scipy.sparse import csr_matrix
+        csr_mat = csr_matrix(mat, dtype=dtype)
+
+        SpMVOperatorBase.__init__(self, csr_mat.shape, csr_mat.dtype)
+        self.index_dtype = np.dtype(np.int32)
+
+        if width is None:
+            row_lengths = np.diff(csr_mat.indptr)
+            width = int(np.max(row_lengths)) if len(row_lengths) else 0
+
+        self.width = width
+
+        # align columns for coalesced access
+        self.pitch = (self.shape[0] + 31) // 32 * 32
+
+        col_idx, data, remainder = csr_to_ell(csr_mat, width, self.pitch)
+        self.col_idx_gpu = gpuarray.to_gpu(col_idx)
+        self.data_gpu = gpuarray.to_gpu(data)
+
+        if remainder.nnz:
+            from pycuda.sparse.coordinate import CoordinateSpMV
+            self.remainder = CoordinateSpMV(remainder, dtype)
+        else:
+            self.remainder = None
+
+    @memoize_method
+    def get_kernel(self):
+        from pycuda.tools import dtype_to_ctype
+
+        mod = SourceModule(
+                ELL_KERNEL_TEMPLATE % {
+                    "value_type": dtype_to_ctype(self.dtype),
+                    "index_type": dtype_to_ctype(self.index_dtype),
+                    })
+        func = mod.get_function("spmv_ell_kernel")
+        func.prepare(self.index_dtype.char*3 + "PPPP")
+        return func
+
+    def __call__(self, x, y=None):
+        if y is None:
+            y = gpuarray.zeros(self.shape[0], dtype=self.dtype,
+                    allocator=x.allocator)
+
+        if self.width and self.shape[0]:
+            self.get_kernel().prepared_call(
+                    (self.get_block_count(self.shape[0]), 1),
+                    (self.block_size, 1, 1),
+                    self.shape[0], self.width, self.pitch,
+                    self.col_idx_gpu.gpudata,
+                    self.data_gpu.gpudata,
+                    x.gpudata, y.gpudata)
+
+        if self.remainder is not None:
+            self.remainder(x, y)
+
+        return y
+
+
+
+
+class HybridSpMV(ELLSpMV):
+    """Hybrid ELL/COO sparse matrix-vector product, with the ELL width
+    chosen by :func:`choose_ell_width` unless *width* is given.
+    """
+
+    def __init__(self, mat, dtype, width=None):
+        if width is None:
+            from scipy.sparse import csr_matrix
+            mat = csr_matrix(mat, dtype=dtype)
+            width = choose_ell_width(np.diff(mat.indptr))
+
+        ELLSpMV.__init__(self, mat, dtype, width)
+
+# vim: foldmethod=marker
@@ -29,6 +29,9 @@ class IdentityOperator(OperatorBase):
     def __call__(self, operand):
         return operand
 
+    def astype(self, dtype):
+        return IdentityOperator(dtype, self.n)
+
 
 
 
@@ -48,6 +51,54 @@ class DiagonalPreconditioner(OperatorBase):
     def __call__(self, operand):
         return self.diagonal*operand
 
+    def astype(self, dtype):
+        return DiagonalPreconditioner(self.diagonal.astype(dtype))
+
+
+
 
+class SpMVOperatorBase(OperatorBase):
+    """Base class for sparse matrix-vector products that keep the original
+    ordering of the unknowns. :meth:`permute` and :meth:`unpermute` are
+    provided so that these can be used in place of
+    :class:`pycuda.sparse.packeted.PacketedSpMV`.
 
+    Calling the operator as *op(x, y)* computes *y += A x*.
+    """
+
+    block_size = 128
+
+    def __init__(self, shape, dtype):
+        self.my_shape = shape
+        self.my_dtype = dtype
 
+    @property
+    def dtype(self):
+        return self.my_dtype
+
+    @property
+    def shape(self):
+        return self.my_shape
+
+    def permute(self, x):
+        # returns a copy, as the solvers update their vectors in place
+        return x.copy()
+
+    def unpermute(self, x):
+        return x
+
+    def get_block_count(self, thread_count):
+        """Return a grid size for kernels that loop over *thread_count*
+        work items with a grid-sized stride.
+        """
+        import pycuda.driver as drv
+        from pycuda.tools import DeviceData
+
+        dev = drv.Context.get_device()
+        devdata = DeviceData()
+        max_threads = (devdata.warps_per_mp*devdata.warp_size*
+                dev.multiprocessor_count)
+        max_blocks = 4*max_threads // self.block_size
+
+        return max(1, min(max_blocks,
+            (thread_count + self.block_size - 1) // self.block_size))
@@ -3,6 +3,7 @@ from pytools import memoize_method
 import pycuda.driver as drv
 import pycuda.gpuarray as gpuarray
 from pycuda.compiler import SourceModule
+from pycuda.tools import context_dependent_memoize
 import numpy as np
 
 
@@ -86,210 +87,363 @@ spmv_pkt_kernel(const index_type *row_ptr,
 
 
 
-class PacketedSpMV:
-    def __init__(self, mat, is_symmetric, dtype):
-        from pycuda.tools import DeviceData
-        devdata = DeviceData()
+PKT_SPMM_KERNEL_TEMPLATE = """
+typedef %(index_type)s index_type;
+typedef %(value_type)s value_type;
+typedef %(packed_index_type)s packed_index_type;
 
-        # all row indices in the data structure generation code are
-        # "unpermuted" unless otherwise specified
-        self.dtype = np.dtype(dtype)
-        self.index_dtype = np.int32
-        self.packed_index_dtype = np.uint32
-        self.threads_per_packet = devdata.max_threads
+#define ROWS_PER_PACKET %(rows_per_packet)d
+#define THREADS_PER_PACKET %(threads_per_packet)d
 
-        h, w = self.shape = mat.shape
-        if h != w:
-            raise ValueError("only square matrices are supported")
+#define pkt_unpack_row_index(packed_index) ( packed_index >> 16  )
+#define pkt_unpack_col_index(packed_index) (packed_index & 0xFFFF)
 
-        self.rows_per_packet = (devdata.shared_memory - 100) \
-                // (2*self.dtype.itemsize)
+// x and y are row-major blocks of rhs_count vectors. Like spmv_pkt_kernel,
+// each block stages the x and y values of its packet's rows in shared
+// memory, for as many columns at a time as fit into the space of one
+// column of x and y each. All local entries of a row belong to the same
+// thread, so no atomics are needed.
+extern "C" {
+__global__ void
+spmm_pkt_kernel(const index_type *row_ptr,
+                const index_type *pos_start,
+                const index_type *pos_end,
+                const packed_index_type *index_array,
+                const value_type *data_array,
+                const value_type *x,
+                      value_type *y,
+                const index_type rhs_count)
+{
+  __shared__ value_type s_xy[2*ROWS_PER_PACKET];
 
-        self.block_count = \
-                (h + self.rows_per_packet - 1) // self.rows_per_packet
+  const index_type thread_id =
+    __umul24(THREADS_PER_PACKET, blockIdx.x) + threadIdx.x;
 
-        # get metis partition -------------------------------------------------
-        from scipy.sparse import csr_matrix
-        csr_mat = csr_matrix(mat, dtype=self.dtype)
+  const index_type packet_base_row = row_ptr[blockIdx.x];
+  const index_type packet_num_rows = row_ptr[blockIdx.x+1] - packet_base_row;
+  if (packet_num_rows == 0)
+    return;
 
-        from pymetis import part_graph
-        if not is_symmetric:
-            # make sure adjacency graph is undirected
-            adj_mat = csr_mat + csr_mat.T
-        else:
-            adj_mat = csr_mat
+  const index_type cols_per_pass =
+    min(rhs_count, ROWS_PER_PACKET / packet_num_rows);
+  value_type *s_x = s_xy;
+  value_type *s_y = s_xy + packet_num_rows*cols_per_pass;
 
-        while True:
-            cut_count, dof_to_packet_nr = part_graph(int(self.block_count),
-                    xadj=adj_mat.indptr, adjncy=adj_mat.indices)
+  // offsets into x and y may exceed the range of index_type
+  const size_t block_start = (size_t) packet_base_row * rhs_count;
 
-            # build packet_nr_to_dofs
-            packet_nr_to_dofs = {}
-            for i, packet_nr in enumerate(dof_to_packet_nr):
-                try:
-                    dof_packet = packet_nr_to_dofs[packet_nr]
-                except KeyError:
-                    packet_nr_to_dofs[packet_nr] = dof_packet = []
+  const index_type packet_start = pos_start[thread_id];
+  const index_type packet_end = pos_end[thread_id];
 
-                dof_packet.append(i)
+  for (index_type col_start = 0; col_start < rhs_count;
+      col_start += cols_per_pass)
+  {
+    const index_type width = min(cols_per_pass, rhs_count - col_start);
+    const index_type staged_count = packet_num_rows * width;
+
+    for (index_type i = threadIdx.x; i < staged_count; i += blockDim.x)
+    {
+      const index_type r = i / width;
+      const size_t src = block_start + (size_t) r * rhs_count
+        + col_start + (i - r*width);
+      s_x[i] = x[src];
+      s_y[i] = y[src];
+    }
+
+    __syncthreads();
+
+    for(index_type pos = packet_start; pos != packet_end; pos += THREADS_PER_PACKET)
+    {
+      const index_type packed_index = index_array[pos];
+
+      const index_type row = pkt_unpack_row_index(packed_index);
+      const index_type col = pkt_unpack_col_index(packed_index);
+      const value_type val = data_array[pos];
+
+      for (index_type j = 0; j < width; ++j)
+        s_y[row*width + j] += val * s_x[col*width + j];
+    }
+
+    __syncthreads();
+
+    for (index_type i = threadIdx.x; i < staged_count; i += blockDim.x)
+    {
+      const index_type r = i / width;
+      y[block_start + (size_t) r * rhs_count + col_start + (i - r*width)]
+        = s_y[i];
+    }
+
+    __syncthreads();
+  }
+}
+}
+"""
 
-            packet_nr_to_dofs = [packet_nr_to_dofs.get(i)
-                    for i in range(len(packet_nr_to_dofs))]
 
-            too_big = False
-            for packet_dofs in packet_nr_to_dofs:
-                if len(packet_dofs) >= self.rows_per_packet:
-                    too_big = True
-                    break
 
-            if too_big:
-                old_block_count = self.block_count
-                self.block_count = int(2+1.05*self.block_count)
-                print ("Metis produced a big block at block count "
-                        "%d--retrying with %d"
-                        % (old_block_count, self.block_count))
-                continue
 
-            break
+@context_dependent_memoize
+def get_take_rows_kernel(dtype):
+    from pycuda.elementwise import ElementwiseKernel
+    from pycuda.tools import dtype_to_ctype
+    return ElementwiseKernel(
+            "%(tp)s *dest, const %(tp)s *src, const int *indices, "
+            "unsigned rhs_count" % {"tp": dtype_to_ctype(dtype)},
+            "dest[i] = src[indices[i / rhs_count]*rhs_count + i % rhs_count]",
+            "take_rows")
 
-        assert len(packet_nr_to_dofs) == self.block_count
 
-        # permutations, base rows ---------------------------------------------
-        new2old_fetch_indices, \
-                old2new_fetch_indices, \
-                packet_base_rows = self.find_simple_index_stuff(
-                        packet_nr_to_dofs)
+@context_dependent_memoize
+def get_gather_kernel(dtype):
+    from pycuda.elementwise import ElementwiseKernel
+    from pycuda.tools import dtype_to_ctype
+    return ElementwiseKernel(
+            "%(tp)s *dest, const %(tp)s *src, const int *sources"
+            % {"tp": dtype_to_ctype(dtype)},
+            "if (sources[i] >= 0) dest[i] = src[sources[i]]",
+            "gather_values")
 
-        # find local row cost and remaining_coo -------------------------------
-        local_row_costs, remaining_coo = \
-                self.find_local_row_costs_and_remaining_coo(
-                        csr_mat, dof_to_packet_nr, old2new_fetch_indices)
-        local_nnz = np.sum(local_row_costs)
 
-        assert remaining_coo.nnz == csr_mat.nnz - local_nnz
+def take_rows(block, indices):
+    """Return the row-major block of vectors with rows *block[indices[i]]*."""
+    result = gpuarray.empty(block.shape, block.dtype,
+            allocator=block.allocator)
+    get_take_rows_kernel(block.dtype)(result, block, indices, block.shape[1])
+    return result
 
-        # find thread assignment for each block -------------------------------
-        thread_count = len(packet_nr_to_dofs)*self.threads_per_packet
-        thread_assignments, thread_costs = self.find_thread_assignment(
-                packet_nr_to_dofs, local_row_costs, thread_count)
 
-        max_thread_costs = np.max(thread_costs)
 
-        # build data structure ------------------------------------------------
-        from pkt_build import build_pkt_data_structure
-        build_pkt_data_structure(self, packet_nr_to_dofs, max_thread_costs,
-            old2new_fetch_indices, csr_mat, thread_count, thread_assignments,
-            local_row_costs)
 
-        self.packet_base_rows = gpuarray.to_gpu(packet_base_rows)
-        self.new2old_fetch_indices = gpuarray.to_gpu(
-                new2old_fetch_indices)
-        self.old2new_fetch_indices = gpuarray.to_gpu(
-                old2new_fetch_indices)
+PKT_DEVICE_ARRAY_NAMES = [
+        "thread_starts", "thread_ends", "index_array", "data_array",
+        "packet_base_rows", "new2old_fetch_indices", "old2new_fetch_indices",
+        "data_sources", "remaining_sources"]
 
-        from coordinate import CoordinateSpMV
-        self.remaining_coo_gpu = CoordinateSpMV(
-                remaining_coo, dtype)
-
-    def find_simple_index_stuff(self, packet_nr_to_dofs):
-        new2old_fetch_indices = np.zeros(
-                self.shape[0], dtype=self.index_dtype)
-        old2new_fetch_indices = np.zeros(
-                self.shape[0], dtype=self.index_dtype)
-
-        packet_base_rows = np.zeros(
-                self.block_count+1,
-                dtype=self.index_dtype)
-
-        row_start = 0
-        for packet_nr, packet in enumerate(packet_nr_to_dofs):
-            packet_base_rows[packet_nr] = row_start
-            row_end = row_start + len(packet)
-
-            pkt_indices = np.array(packet, dtype=self.index_dtype)
-            new2old_fetch_indices[row_start:row_end] = \
-                    pkt_indices
-            old2new_fetch_indices[pkt_indices] = \
-                    np.arange(row_start, row_end, dtype=self.index_dtype)
-
-            row_start += len(packet)
-
-        packet_base_rows[self.block_count] = row_start
-
-        return (new2old_fetch_indices, old2new_fetch_indices,
-                packet_base_rows)
-
-    def find_local_row_costs_and_remaining_coo(self, csr_mat, dof_to_packet_nr,
-            old2new_fetch_indices):
-        h, w = self.shape
-        local_row_costs = [0]*h
-        rem_coo_values = []
-        rem_coo_i = []
-        rem_coo_j = []
-
-        iptr = csr_mat.indptr
-        indices = csr_mat.indices
-        data = csr_mat.data
-
-        for i in xrange(h):
-            for idx in xrange(iptr[i], iptr[i+1]):
-                j = indices[idx]
-
-                if dof_to_packet_nr[i] == dof_to_packet_nr[j]:
-                    local_row_costs[i] += 1
-                else:
-                    rem_coo_values.append(data[idx])
-                    rem_coo_i.append(old2new_fetch_indices[i])
-                    rem_coo_j.append(old2new_fetch_indices[j])
 
-        from scipy.sparse import coo_matrix
-        remaining_coo = coo_matrix(
-                (rem_coo_values, (rem_coo_i, rem_coo_j)), self.shape,
-                dtype=self.dtype)
 
-        return local_row_costs, remaining_coo
 
-    def find_thread_assignment(self, packet_nr_to_dofs, local_row_cost,
-            thread_count):
-        thread_assignments = [[] for i in range(thread_count)]
-        thread_costs = np.zeros(thread_count)
+class PacketedSpMV(object):
+    def __init__(self, mat, is_symmetric, dtype, native=True,
+            partitioner=None):
+        # all row indices in the data structure generation code are
+        # "unpermuted" unless otherwise specified
+        self._set_parameters(dtype)
 
-        for packet_nr, packet_dofs in enumerate(packet_nr_to_dofs):
-            row_costs_and_numbers = sorted(
-                    [(local_row_cost[i], i) for i in packet_dofs],
-                    reverse=True)
+        h, w = self.shape = mat.shape
+        if h != w:
+            raise ValueError("only square matrices are supported")
 
-            base_thread_nr = packet_nr*self.threads_per_packet
-            thread_offset = 0
+        # get partition -------------------------------------------------------
+        from scipy.sparse import csr_matrix
+        csr_mat = csr_matrix(mat, dtype=self.dtype)
+
+        from pycuda.sparse.pkt_build import get_structure_hash
+        self.structure_hash = get_structure_hash(csr_mat)
+
+        if not is_symmetric:
+            # make sure adjacency graph is undirected
+            adj_mat = csr_mat + csr_mat.T
+        else:
+            adj_mat = csr_mat
+
+        from pycuda.sparse.pkt_build import partition_rows
+        self.block_count, dof_to_packet_nr = partition_rows(
+                adj_mat, self.rows_per_packet, partitioner)
+
+        # build data structure ------------------------------------------------
+        from pycuda.sparse.pkt_build import build_packet_structure
+        host_data = build_packet_structure(csr_mat, dof_to_packet_nr,
+                self.block_count, self.threads_per_packet, self.dtype,
+                native=native)
 
-            # zigzag assignment
-            step = 1
-            for row_cost, row_number in row_costs_and_numbers:
-                ti = base_thread_nr+thread_offset
-                thread_assignments[ti].append(row_number)
-                thread_costs[ti] += row_cost
+        remaining_coo = host_data["remaining_coo"]
+        assert remaining_coo.nnz == \
+                csr_mat.nnz - np.sum(host_data["local_row_costs"])
 
-                if thread_offset + step >= self.threads_per_packet:
-                    step = -1
-                elif thread_offset + step < 0:
-                    step = 1
-                else:
-                    thread_offset += step
+        self.nnz = csr_mat.nnz
+        self._upload(host_data, remaining_coo)
+
+    def _set_parameters(self, dtype):
+        from pycuda.tools import DeviceData
+        devdata = DeviceData()
 
-        return thread_assignments, thread_costs
+        self.dtype = np.dtype(dtype)
+        self.index_dtype = np.int32
+        self.packed_index_dtype = np.uint32
+        self.threads_per_packet = devdata.max_threads
+        self.rows_per_packet = (devdata.shared_memory - 100) \
+                // (2*self.dtype.itemsize)
 
-    def build_gpu_data_structure(self, packet_nr_to_dofs, max_thread_costs,
-            old2new_fetch_indices, csr_mat, thread_count, thread_assignments,
-            local_row_costs):
-        # these arrays will likely be too long, but that's ok
+    def _upload(self, host_data, remaining_coo):
+        for name in PKT_DEVICE_ARRAY_NAMES:
+            setattr(self, name, gpuarray.to_gpu(host_data[name]))
 
-        from pkt_build import build_pkt_structure
-        build_pkt_structure(self, packet_nr_to_dofs, thread_assignments,
-                thread_starts, thread_ends, index_array, data_array)
+        from coordinate import CoordinateSpMV
+        self.remaining_coo_gpu = CoordinateSpMV(
+                remaining_coo, self.dtype)
+
+    def astype(self, dtype):
+        """Return an operator for the same matrix with values of type
+        *dtype*. It shares the partition, the permutation and the index
+        arrays with this one, so that vectors may be passed between the two
+        without permuting.
+        """
+        result = self.__class__.__new__(self.__class__)
+        result._set_parameters(dtype)
+
+        if self.rows_per_packet > result.rows_per_packet:
+            raise ValueError("packets are too big for values of type %s"
+                    % result.dtype)
+
+        for name in ["shape", "nnz", "structure_hash", "block_count",
+                "threads_per_packet", "rows_per_packet"]:
+            setattr(result, name, getattr(self, name))
+
+        for name in PKT_DEVICE_ARRAY_NAMES:
+            if name != "data_array":
+                setattr(result, name, getattr(self, name))
+
+        result.data_array = self.data_array.astype(result.dtype)
+        result.remaining_coo_gpu = self.remaining_coo_gpu.astype(result.dtype)
+
+        return result
+
+    # {{{ serialization
+
+    def save(self, filename):
+        """Write the built operator to *filename*, in the file format of
+        :func:`pycuda.sparse.pkt_build.write_packet_file`.
+        """
+        arrays = dict((name, getattr(self, name).get())
+                for name in PKT_DEVICE_ARRAY_NAMES)
+
+        coo = self.remaining_coo_gpu
+        arrays["remaining_rows"] = coo.row_gpu.get()
+        arrays["remaining_cols"] = coo.col_gpu.get()
+        arrays["remaining_data"] = coo.data_gpu.get()
+
+        from pycuda.sparse.pkt_build import write_packet_file
+        write_packet_file(filename, {
+            "structure_hash": self.structure_hash,
+            "shape": list(self.shape),
+            "nnz": self.nnz,
+            "dtype": self.dtype.str,
+            "threads_per_packet": self.threads_per_packet,
+            "rows_per_packet": self.rows_per_packet,
+            "block_count": self.block_count,
+            }, arrays)
+
+    @classmethod
+    def load(cls, filename, structure_hash=None):
+        """Return an operator read from *filename*, as written by
+        :meth:`save`. The arrays are memory-mapped and copied to the device
+        directly. If *structure_hash* is given, a :exc:`ValueError` is raised
+        unless the file was built for a matrix with that structure hash (see
+        :func:`pycuda.sparse.pkt_build.get_structure_hash`).
+        """
+        from pycuda.sparse.pkt_build import read_packet_file
+        header, arrays = read_packet_file(filename)
+
+        if (structure_hash is not None
+                and header["structure_hash"] != structure_hash):
+            raise ValueError("'%s' was built for a different matrix structure"
+                    % filename)
+
+        result = cls.__new__(cls)
+        result._set_parameters(np.dtype(str(header["dtype"])))
+
+        if (header["threads_per_packet"] > result.threads_per_packet
+                or header["rows_per_packet"] > result.rows_per_packet):
+            raise ValueError("'%s' was built for a device with larger packets"
+                    % filename)
+
+        result.threads_per_packet = header["threads_per_packet"]
+        result.rows_per_packet = header["rows_per_packet"]
+        result.block_count = header["block_count"]
+        result.shape = tuple(header["shape"])
+        result.nnz = header["nnz"]
+        result.structure_hash = str(header["structure_hash"])
 
+        from scipy.sparse import coo_matrix
+        remaining_coo = coo_matrix(
+                (arrays["remaining_data"],
+                    (arrays["remaining_rows"], arrays["remaining_cols"])),
+                result.shape, dtype=result.dtype)
+
+        result._upload(arrays, remaining_coo)
+        return result
+
+    @classmethod
+    def from_cache(cls, cache_dir, mat, is_symmetric, dtype, **kwargs):
+        """Return an operator for *mat*, loaded from *cache_dir* if an
+        operator for a matrix with the same structure has been saved there,
+        and built and saved otherwise. The values of *mat* are applied with
+        :meth:`update_values` after loading. *kwargs* are passed to the
+        constructor.
+        """
+        from scipy.sparse import csr_matrix
+        csr_mat = csr_matrix(mat, dtype=dtype)
+
+        from pycuda.sparse.pkt_build import get_structure_hash
+        structure_hash = get_structure_hash(csr_mat)
+
+        probe = cls.__new__(cls)
+        probe._set_parameters(dtype)
+
+        import os.path
+        filename = os.path.join(cache_dir, "%s-%s-%d-%d.pkt" % (
+            structure_hash, probe.dtype.name,
+            probe.threads_per_packet, probe.rows_per_packet))
+
+        if os.path.exists(filename):
+            result = cls.load(filename, structure_hash)
+            result.update_values(csr_mat.data)
+            return result
+
+        result = cls(csr_mat, is_symmetric, dtype, **kwargs)
+
+        # write to a temporary file first, so that concurrent readers never
+        # see a partial file
+        import os
+        tmp_filename = "%s.tmp-%d" % (filename, os.getpid())
+        result.save(tmp_filename)
+        try:
+            os.rename(tmp_filename, filename)
+        except OSError:
+            # another process saved it first
+            os.unlink(tmp_filename)
+
+        return result
+
+    # }}}
+
+    def update_values(self, csr_data):
+        """Replace the matrix entries by *csr_data*, which holds the values of
+        a matrix with the same sparsity pattern in the order of
+        :attr:`scipy.sparse.csr_matrix.data` of the matrix passed to the
+        constructor. *csr_data* may be a :mod:`numpy` array or a
+        :class:`pycuda.gpuarray.GPUArray`.
+
+        The partition and the packed structure are kept, and the new values
+        are gathered into place on the device.
+        """
+        if isinstance(csr_data, gpuarray.GPUArray):
+            if csr_data.dtype != self.dtype:
+                csr_data = csr_data.astype(self.dtype)
+        else:
+            csr_data = gpuarray.to_gpu(
+                    np.ascontiguousarray(csr_data, dtype=self.dtype))
 
+        if csr_data.shape != (self.nnz,):
+            raise ValueError("expected %d values, got shape %s"
+                    % (self.nnz, csr_data.shape))
 
-        # copy data to the gpu ------------------------------------------------
+        gather = get_gather_kernel(self.dtype)
+        if self.data_array.size:
+            gather(self.data_array, csr_data, self.data_sources)
+        if self.remaining_sources.size:
+            gather(self.remaining_coo_gpu.data_gpu, csr_data,
+                    self.remaining_sources)
 
     # execution ---------------------------------------------------------------
     @memoize_method
@@ -314,6 +468,59 @@ class PacketedSpMV:
     def unpermute(self, x):
         return gpuarray.take(x, self.old2new_fetch_indices)
 
+    def permute_block(self, x):
+        return take_rows(x, self.new2old_fetch_indices)
+
+    def unpermute_block(self, x):
+        return take_rows(x, self.old2new_fetch_indices)
+
+    @memoize_method
+    def get_spmm_kernel(self):
+        from pycuda.tools import dtype_to_ctype
+
+        mod = SourceModule(
+                PKT_SPMM_KERNEL_TEMPLATE % {
+                    "value_type": dtype_to_ctype(self.dtype),
+                    "index_type": dtype_to_ctype(self.index_dtype),
+                    "packed_index_type": dtype_to_ctype(self.packed_index_dtype),
+                    "threads_per_packet": self.threads_per_packet,
+                    "rows_per_packet": self.rows_per_packet,
+                    }, no_extern_c=True)
+        func = mod.get_function("spmm_pkt_kernel")
+        func.prepare("PPPPPPP" + np.dtype(self.index_dtype).char)
+        return func
+
+    def spmm(self, x, y=None):
+        """Multiply the (permuted) row-major block of vectors *x* of shape
+        *(n, rhs_count)* by the matrix, adding the result to *y*. Each packet
+        is applied to as many right-hand sides at a time as fit into shared
+        memory alongside it.
+        """
+        if len(x.shape) != 2 or x.shape[0] != self.shape[1] \
+                or not x.flags.c_contiguous:
+            raise ValueError("x must be a C-contiguous block of shape "
+                    "(n, rhs_count)")
+
+        if y is None:
+            y = gpuarray.zeros(x.shape, dtype=self.dtype,
+                    allocator=x.allocator)
+
+        self.get_spmm_kernel().prepared_call(
+                (self.block_count, 1),
+                (self.threads_per_packet, 1, 1),
+                self.packet_base_rows.gpudata,
+                self.thread_starts.gpudata,
+                self.thread_ends.gpudata,
+                self.index_array.gpudata,
+                self.data_array.gpudata,
+                x.gpudata,
+                y.gpudata,
+                x.shape[1])
+
+        self.remaining_coo_gpu.spmm(x, y)
+
+        return y
+
     def __call__(self, x, y=None):
         if y is None:
             y = gpuarray.zeros(self.shape[0], dtype=self.dtype,
@@ -334,3 +541,4 @@ class PacketedSpMV:
 
         return y
 
+# vim: foldmethod=marker
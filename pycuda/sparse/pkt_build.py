@@ -1,29 +1,125 @@
 import numpy as np
-import pycuda.gpuarray as gpuarray
 
 
 
 
-def build_pkt_data_structure(spmv, packet_nr_to_dofs, max_thread_costs,
+# {{{ pure-Python builder
+
+def find_simple_index_stuff(packet_nr_to_dofs, index_dtype):
+    row_count = sum(len(packet_dofs) for packet_dofs in packet_nr_to_dofs)
+    new2old_fetch_indices = np.zeros(row_count, dtype=index_dtype)
+    old2new_fetch_indices = np.zeros(row_count, dtype=index_dtype)
+
+    packet_base_rows = np.zeros(len(packet_nr_to_dofs)+1, dtype=index_dtype)
+
+    row_start = 0
+    for packet_nr, packet in enumerate(packet_nr_to_dofs):
+        packet_base_rows[packet_nr] = row_start
+        row_end = row_start + len(packet)
+
+        pkt_indices = np.array(packet, dtype=index_dtype)
+        new2old_fetch_indices[row_start:row_end] = \
+                pkt_indices
+        old2new_fetch_indices[pkt_indices] = \
+                np.arange(row_start, row_end, dtype=index_dtype)
+
+        row_start += len(packet)
+
+    packet_base_rows[len(packet_nr_to_dofs)] = row_start
+
+    return (new2old_fetch_indices, old2new_fetch_indices,
+            packet_base_rows)
+
+
+def find_local_row_costs_and_remaining_coo(csr_mat, dof_to_packet_nr,
+        old2new_fetch_indices, dtype):
+    h, w = csr_mat.shape
+    local_row_costs = [0]*h
+    rem_coo_values = []
+    rem_coo_i = []
+    rem_coo_j = []
+    rem_coo_sources = []
+
+    iptr = csr_mat.indptr
+    indices = csr_mat.indices
+    data = csr_mat.data
+
+    for i in xrange(h):
+        for idx in xrange(iptr[i], iptr[i+1]):
+            j = indices[idx]
+
+            if dof_to_packet_nr[i] == dof_to_packet_nr[j]:
+                local_row_costs[i] += 1
+            else:
+                rem_coo_values.append(data[idx])
+                rem_coo_i.append(old2new_fetch_indices[i])
+                rem_coo_j.append(old2new_fetch_indices[j])
+                rem_coo_sources.append(idx)
+
+    from scipy.sparse import coo_matrix
+    remaining_coo = coo_matrix(
+            (rem_coo_values, (rem_coo_i, rem_coo_j)), csr_mat.shape,
+            dtype=dtype)
+
+    return (local_row_costs, remaining_coo,
+            np.array(rem_coo_sources, dtype=np.int32))
+
+
+def find_thread_assignment(packet_nr_to_dofs, local_row_cost,
+        threads_per_packet):
+    thread_count = len(packet_nr_to_dofs)*threads_per_packet
+    thread_assignments = [[] for i in range(thread_count)]
+    thread_costs = np.zeros(thread_count, dtype=np.int32)
+
+    for packet_nr, packet_dofs in enumerate(packet_nr_to_dofs):
+        row_costs_and_numbers = sorted(
+                [(local_row_cost[i], i) for i in packet_dofs],
+                reverse=True)
+
+        base_thread_nr = packet_nr*threads_per_packet
+        thread_offset = 0
+
+        # zigzag assignment
+        step = 1
+        for row_cost, row_number in row_costs_and_numbers:
+            ti = base_thread_nr+thread_offset
+            thread_assignments[ti].append(row_number)
+            thread_costs[ti] += row_cost
+
+            if thread_offset + step >= threads_per_packet:
+                step = -1
+            elif thread_offset + step < 0:
+                step = 1
+            else:
+                thread_offset += step
+
+    return thread_assignments, thread_costs
+
+
+def build_pkt_data_structure(packet_nr_to_dofs, max_thread_costs,
         old2new_fetch_indices, csr_mat, thread_count, thread_assignments,
-        local_row_costs):
+        local_row_costs, threads_per_packet, dtype,
+        index_dtype=np.int32, packed_index_dtype=np.uint32):
     packet_start = 0
     base_dof_nr = 0
 
     index_array = np.zeros(
-            max_thread_costs*thread_count, dtype=spmv.packed_index_dtype)
+            max_thread_costs*thread_count, dtype=packed_index_dtype)
     data_array = np.zeros(
-            max_thread_costs*thread_count, dtype=spmv.dtype)
+            max_thread_costs*thread_count, dtype=dtype)
+    data_sources = np.empty(
+            max_thread_costs*thread_count, dtype=index_dtype)
+    data_sources.fill(-1)
     thread_starts = np.zeros(
-            thread_count, dtype=spmv.index_dtype)
+            thread_count, dtype=index_dtype)
     thread_ends = np.zeros(
-            thread_count, dtype=spmv.index_dtype)
+            thread_count, dtype=index_dtype)
 
     for packet_nr, packet_dofs in enumerate(packet_nr_to_dofs):
-        base_thread_nr = packet_nr*spmv.threads_per_packet
+        base_thread_nr = packet_nr*threads_per_packet
         max_packet_items = 0
 
-        for thread_offset in range(spmv.threads_per_packet):
+        for thread_offset in range(threads_per_packet):
             thread_write_idx = packet_start+thread_offset
             thread_start = packet_start+thread_offset
             thread_starts[base_thread_nr+thread_offset] = thread_write_idx
@@ -44,24 +140,22 @@ def build_pkt_data_structure(spmv, packet_nr_to_dofs, max_thread_costs,
                     if 0 <= rel_col_nr < len(packet_dofs):
                         index_array[thread_write_idx] = (rel_row_nr << 16) + rel_col_nr
                         data_array[thread_write_idx] = csr_mat.data[idx]
-                        thread_write_idx += spmv.threads_per_packet
+                        data_sources[thread_write_idx] = idx
+                        thread_write_idx += threads_per_packet
                         row_entries += 1
 
                 assert row_entries == local_row_costs[row_nr]
 
             thread_ends[base_thread_nr+thread_offset] = thread_write_idx
 
-            thread_items = (thread_write_idx - thread_start)//spmv.threads_per_packet
+            thread_items = (thread_write_idx - thread_start)//threads_per_packet
             max_packet_items = max(
                     max_packet_items, thread_items)
 
         base_dof_nr += len(packet_dofs)
-        packet_start += max_packet_items*spmv.threads_per_packet
+        packet_start += max_packet_items*threads_per_packet
 
-    spmv.thread_starts = gpuarray.to_gpu(thread_starts)
-    spmv.thread_ends = gpuarray.to_gpu(thread_ends)
-    spmv.index_array = gpuarray.to_gpu(index_array)
-    spmv.data_array = gpuarray.to_gpu(data_array)
+    return thread_starts, thread_ends, index_array, data_array, data_sources
 
 
 
@@ -73,3 +167,252 @@ except ImportError:
 else:
     pyximport.install()
     from pycuda.sparse.pkt_build_cython import build_pkt_data_structure
+
+# }}}
+
+
+
+
+def partition_rows(adj_mat, rows_per_packet, partitioner=None):
+    """Partition the rows of a matrix with the symmetric adjacency structure
+    *adj_mat* (a :class:`scipy.sparse.csr_matrix`) into packets of fewer than
+    *rows_per_packet* rows each.
+
+    *partitioner* may be ``"metis"``, which uses :mod:`pymetis` and
+    repartitions with more packets until all of them are small enough, or
+    ``"bisection"``, which uses a built-in recursive bisection that meets the
+    size limit in one pass. If *None*, METIS is used if it is available.
+
+    Return a tuple *(packet_count, dof_to_packet_nr)*.
+    """
+    if partitioner is None:
+        try:
+            import pymetis
+        except ImportError:
+            partitioner = "bisection"
+        else:
+            partitioner = "metis"
+
+    if partitioner == "bisection":
+        from pycuda._driver import _partition_graph
+        return _partition_graph(
+                np.ascontiguousarray(adj_mat.indptr, dtype=np.int32),
+                np.ascontiguousarray(adj_mat.indices, dtype=np.int32),
+                rows_per_packet-1)
+
+    elif partitioner == "metis":
+        from pymetis import part_graph
+
+        h = adj_mat.shape[0]
+        block_count = max(1, (h + rows_per_packet - 1) // rows_per_packet)
+
+        while True:
+            cut_count, dof_to_packet_nr = part_graph(int(block_count),
+                    xadj=adj_mat.indptr, adjncy=adj_mat.indices)
+
+            packet_sizes = np.bincount(dof_to_packet_nr,
+                    minlength=block_count)
+
+            if np.max(packet_sizes) >= rows_per_packet:
+                old_block_count = block_count
+                block_count = int(2+1.05*block_count)
+                print ("Metis produced a big block at block count "
+                        "%d--retrying with %d"
+                        % (old_block_count, block_count))
+                continue
+
+            return block_count, dof_to_packet_nr
+
+    else:
+        raise ValueError("unknown partitioner: %s" % partitioner)
+
+
+
+
+def build_packet_structure(csr_mat, dof_to_packet_nr, packet_count,
+        threads_per_packet, dtype, native=True):
+    """Build the host-side arrays of a :class:`PacketedSpMV` for the
+    square :class:`scipy.sparse.csr_matrix` *csr_mat*, where row *i* is
+    assigned to packet *dof_to_packet_nr[i]*.
+
+    Return a :class:`dict` of :mod:`numpy` arrays, along with the
+    :class:`scipy.sparse.coo_matrix` of entries outside of the packets
+    under the key ``"remaining_coo"``. The index arrays ``"data_sources"``
+    and ``"remaining_sources"`` give the position in *csr_mat.data* of each
+    entry of ``"data_array"`` and of the remaining entries, or -1 for
+    padding, so that values for the same sparsity pattern can be gathered
+    without rebuilding.
+
+    If *native* is *True*, the multithreaded C++ builder is used. Its output
+    is identical to that of the pure-Python builder used otherwise.
+    """
+    dtype = np.dtype(dtype)
+
+    if native:
+        from pycuda._driver import _build_packet_structure
+        result = _build_packet_structure(
+                np.ascontiguousarray(csr_mat.indptr, dtype=np.int32),
+                np.ascontiguousarray(csr_mat.indices, dtype=np.int32),
+                np.ascontiguousarray(csr_mat.data, dtype=dtype),
+                dtype,
+                np.ascontiguousarray(dof_to_packet_nr, dtype=np.int32),
+                packet_count, threads_per_packet)
+
+        from scipy.sparse import coo_matrix
+        result["remaining_coo"] = coo_matrix(
+                (result.pop("remaining_data"),
+                    (result.pop("remaining_rows"),
+                        result.pop("remaining_cols"))),
+                csr_mat.shape, dtype=dtype)
+
+        return result
+
+    packet_nr_to_dofs = [[] for i in range(packet_count)]
+    for i, packet_nr in enumerate(dof_to_packet_nr):
+        packet_nr_to_dofs[packet_nr].append(i)
+
+    new2old_fetch_indices, \
+            old2new_fetch_indices, \
+            packet_base_rows = find_simple_index_stuff(
+                    packet_nr_to_dofs, np.int32)
+
+    local_row_costs, remaining_coo, remaining_sources = \
+            find_local_row_costs_and_remaining_coo(
+                    csr_mat, dof_to_packet_nr, old2new_fetch_indices, dtype)
+
+    thread_count = packet_count*threads_per_packet
+    thread_assignments, thread_costs = find_thread_assignment(
+            packet_nr_to_dofs, local_row_costs, threads_per_packet)
+
+    max_thread_costs = int(np.max(thread_costs))
+
+    thread_starts, thread_ends, index_array, data_array, data_sources = \
+            build_pkt_data_structure(packet_nr_to_dofs, max_thread_costs,
+                old2new_fetch_indices, csr_mat, thread_count,
+                thread_assignments, local_row_costs, threads_per_packet,
+                dtype)
+
+    return {
+            "new2old_fetch_indices": new2old_fetch_indices,
+            "old2new_fetch_indices": old2new_fetch_indices,
+            "packet_base_rows": packet_base_rows,
+            "local_row_costs": np.array(local_row_costs, dtype=np.int32),
+            "remaining_coo": remaining_coo,
+            "remaining_sources": remaining_sources,
+            "thread_costs": thread_costs,
+            "max_thread_costs": max_thread_costs,
+            "thread_starts": thread_starts,
+            "thread_ends": thread_ends,
+            "index_array": index_array,
+            "data_array": data_array,
+            "data_sources": data_sources,
+            }
+
+# {{{ serialization
+
+PKT_FILE_MAGIC = b"PYCUDA-PKT\n"
+PKT_FILE_VERSION = 1
+PKT_FILE_ALIGNMENT = 64
+
+
+def get_structure_hash(csr_mat):
+    """Return a hex digest identifying the shape and sparsity pattern (but not
+    the values) of the :class:`scipy.sparse.csr_matrix` *csr_mat*.
+    """
+    from hashlib import sha1
+    h = sha1()
+    h.update(("%d,%d;" % csr_mat.shape).encode("ascii"))
+    h.update(np.ascontiguousarray(csr_mat.indptr, dtype="<i4").tostring())
+    h.update(np.ascontiguousarray(csr_mat.indices, dtype="<i4").tostring())
+    return h.hexdigest()
+
+
+def _align(offset):
+    return (offset + PKT_FILE_ALIGNMENT - 1) \
+            // PKT_FILE_ALIGNMENT * PKT_FILE_ALIGNMENT
+
+
+def write_packet_file(filename, header, arrays):
+    """Write the :class:`dict` *header* of JSON-compatible values and the
+    :class:`dict` *arrays* of one-dimensional :mod:`numpy` arrays to
+    *filename*.
+
+    The file consists of a magic string, the length of a JSON header as a
+    little-endian 64-bit integer, the header, and the raw array data, each
+    array aligned to :data:`PKT_FILE_ALIGNMENT` bytes so that it can be
+    memory-mapped.
+    """
+    import json
+    import struct
+
+    header = dict(header)
+    header["version"] = PKT_FILE_VERSION
+    header["arrays"] = array_info = {}
+
+    arrays = dict((name, np.ascontiguousarray(ary))
+            for name, ary in arrays.items())
+
+    offset = 0
+    for name in sorted(arrays):
+        ary = arrays[name]
+        array_info[name] = {
+                "dtype": ary.dtype.str,
+                "offset": offset,
+                "size": ary.size,
+                }
+        offset = _align(offset + ary.nbytes)
+
+    header_bytes = json.dumps(header, sort_keys=True).encode("ascii")
+    data_start = _align(len(PKT_FILE_MAGIC) + 8 + len(header_bytes))
+
+    outf = open(filename, "wb")
+    try:
+        outf.write(PKT_FILE_MAGIC)
+        outf.write(struct.pack("<Q", len(header_bytes)))
+        outf.write(header_bytes)
+
+        for name in sorted(arrays):
+            outf.seek(data_start + array_info[name]["offset"])
+            outf.write(arrays[name].tostring())
+    finally:
+        outf.close()
+
+
+def read_packet_file(filename):
+    """Return a tuple *(header, arrays)* as written by
+    :func:`write_packet_file`, with *arrays* memory-mapped read-only.
+    """
+    import json
+    import struct
+
+    inf = open(filename, "rb")
+    try:
+        if inf.read(len(PKT_FILE_MAGIC)) != PKT_FILE_MAGIC:
+            raise ValueError("'%s' is not a packeted matrix file" % filename)
+
+        header_len, = struct.unpack("<Q", inf.read(8))
+        header = json.loads(inf.read(header_len).decode("ascii"))
+    finally:
+        inf.close()
+
+    if header.get("version") != PKT_FILE_VERSION:
+        raise ValueError("'%s' has unsupported format version %s"
+                % (filename, header.get("version")))
+
+    data_start = _align(len(PKT_FILE_MAGIC) + 8 + header_len)
+
+    arrays = {}
+    for name, info in header.pop("arrays").items():
+        dtype = np.dtype(str(info["dtype"]))
+        if info["size"]:
+            arrays[str(name)] = np.memmap(filename, dtype=dtype, mode="r",
+                    offset=data_start + info["offset"],
+                    shape=(info["size"],))
+        else:
+            arrays[str(name)] = np.empty(0, dtype=dtype)
+
+    return header, arrays
+
+# }}}
+
+# vim: foldmethod=marker
@@ -1,12 +1,12 @@
 import numpy
-import pycuda.gpuarray as gpuarray
 
 
 
 
-def build_pkt_data_structure(spmv, packet_nr_to_dofs, max_thread_costs,
+def build_pkt_data_structure(packet_nr_to_dofs, max_thread_costs,
         old2new_fetch_indices, csr_mat, thread_count, thread_assignments,
-        local_row_costs):
+        local_row_costs, int threads_per_packet, dtype,
+        index_dtype=numpy.int32, packed_index_dtype=numpy.uint32):
     cdef int packet_start, base_dof_nr
     cdef int packet_nr
     cdef int max_packet_items 
@@ -20,19 +20,22 @@ def build_pkt_data_structure(spmv, packet_nr_to_dofs, max_thread_costs,
     base_dof_nr = 0
 
     index_array = numpy.zeros(
-            max_thread_costs*thread_count, dtype=spmv.packed_index_dtype)
+            max_thread_costs*thread_count, dtype=packed_index_dtype)
     data_array = numpy.zeros(
-            max_thread_costs*thread_count, dtype=spmv.dtype)
+            max_thread_costs*thread_count, dtype=dtype)
+    data_sources = numpy.empty(
+            max_thread_costs*thread_count, dtype=index_dtype)
+    data_sources.fill(-1)
     thread_starts = numpy.zeros(
-            thread_count, dtype=spmv.index_dtype)
+            thread_count, dtype=index_dtype)
     thread_ends = numpy.zeros(
-            thread_count, dtype=spmv.index_dtype)
+            thread_count, dtype=index_dtype)
 
     for packet_nr, packet_dofs in enumerate(packet_nr_to_dofs):
-        base_thread_nr = packet_nr*spmv.threads_per_packet
+        base_thread_nr = packet_nr*threads_per_packet
         max_packet_items = 0
 
-        for thread_offset in range(spmv.threads_per_packet):
+        for thread_offset in range(threads_per_packet):
             thread_write_idx = packet_start+thread_offset
             thread_start = packet_start+thread_offset
             thread_starts[base_thread_nr+thread_offset] = thread_write_idx
@@ -53,22 +56,20 @@ def build_pkt_data_structure(spmv, packet_nr_to_dofs, max_thread_costs,
                     if 0 <= rel_col_nr < len(packet_dofs):
                         index_array[thread_write_idx] = (rel_row_nr << 16) + rel_col_nr
                         data_array[thread_write_idx] = csr_mat.data[idx]
-                        thread_write_idx += spmv.threads_per_packet
+                        data_sources[thread_write_idx] = idx
+                        thread_write_idx += threads_per_packet
                         row_entries += 1
 
                 assert row_entries == local_row_costs[row_nr]
 
             thread_ends[base_thread_nr+thread_offset] = thread_write_idx
 
-            thread_items = (thread_write_idx - thread_start)//spmv.threads_per_packet
+            thread_items = (thread_write_idx - thread_start)//threads_per_packet
             max_packet_items = max(
                     max_packet_items, thread_items)
 
         base_dof_nr += len(packet_dofs)
-        packet_start += max_packet_items*spmv.threads_per_packet
+        packet_start += max_packet_items*threads_per_packet
 
-    spmv.thread_starts = gpuarray.to_gpu(thread_starts)
-    spmv.thread_ends = gpuarray.to_gpu(thread_ends)
-    spmv.index_array = gpuarray.to_gpu(index_array)
-    spmv.data_array = gpuarray.to_gpu(data_array)
+    return thread_starts, thread_ends, index_array, data_array, data_sources
 
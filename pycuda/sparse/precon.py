@@ -0,0 +1,334 @@
+from __future__ import division
+from pytools import memoize_method
+import pycuda.gpuarray as gpuarray
+from pycuda.compiler import SourceModule
+from pycuda.tools import context_dependent_memoize
+from pycuda.sparse.operator import OperatorBase
+import numpy as np
+
+
+
+
+BLOCK_JACOBI_KERNEL_TEMPLATE = """
+typedef %(value_type)s value_type;
+typedef %(index_type)s index_type;
+
+#define BLOCK_SIZE %(block_size)d
+
+// One thread block per diagonal block, one thread per row. The inverse
+// blocks are stored transposed, so that the threads read them coalesced.
+__global__ void
+block_jacobi_apply(const index_type block_count,
+                   const index_type *block_starts,
+                   const value_type *inv_blocks,
+                   const value_type *x,
+                         value_type *y)
+{
+  __shared__ value_type x_block[BLOCK_SIZE];
+
+  // The loop condition is uniform across the block, so that
+  // __syncthreads() may be used inside.
+  for (index_type block = blockIdx.x; block < block_count;
+      block += gridDim.x)
+  {
+    const index_type start = block_starts[block];
+    const index_type size = block_starts[block+1] - start;
+
+    if (threadIdx.x < size)
+      x_block[threadIdx.x] = x[start + threadIdx.x];
+    __syncthreads();
+
+    if (threadIdx.x < size)
+    {
+      const value_type *inv = inv_blocks
+        + block*BLOCK_SIZE*BLOCK_SIZE + threadIdx.x;
+
+      value_type sum = 0;
+      for (index_type j = 0; j < size; ++j)
+        sum += inv[j*BLOCK_SIZE] * x_block[j];
+
+      y[start + threadIdx.x] = sum;
+    }
+    __syncthreads();
+  }
+}
+"""
+
+
+
+
+# {{{ block jacobi
+
+def find_block_starts(packet_boundaries, block_size):
+    """Split each range *packet_boundaries[i]:packet_boundaries[i+1]* into
+    consecutive blocks of at most *block_size* rows, and return the array of
+    block boundaries.
+    """
+    block_starts = [0]
+    for start, end in zip(packet_boundaries[:-1], packet_boundaries[1:]):
+        block_starts.extend(range(start+block_size, end, block_size))
+        if end > block_starts[-1]:
+            block_starts.append(end)
+
+    return np.array(block_starts, dtype=np.int32)
+
+
+def invert_diagonal_blocks(csr_mat, block_starts, block_size, new2old=None):
+    """Return the inverses of the diagonal blocks of the
+    :class:`scipy.sparse.csr_matrix` *csr_mat* given by *block_starts*, as an
+    array of shape *(block_count, block_size, block_size)* in which each
+    inverse is transposed and padded with zeros.
+
+    If *new2old* is given, the blocks are taken from the matrix with rows
+    and columns permuted by *new2old*.
+    """
+    if new2old is not None:
+        csr_mat = csr_mat[new2old][:, new2old]
+    else:
+        csr_mat = csr_mat.copy()
+    csr_mat.sum_duplicates()
+    coo_mat = csr_mat.tocoo()
+
+    block_starts = np.asarray(block_starts)
+    block_count = len(block_starts) - 1
+
+    row_block = np.searchsorted(block_starts, coo_mat.row, side="right") - 1
+    col_block = np.searchsorted(block_starts, coo_mat.col, side="right") - 1
+    in_block = row_block == col_block
+    blk = row_block[in_block]
+
+    blocks = np.zeros((block_count, block_size, block_size),
+            dtype=csr_mat.dtype)
+    blocks[blk,
+            coo_mat.row[in_block] - block_starts[blk],
+            coo_mat.col[in_block] - block_starts[blk]] = coo_mat.data[in_block]
+
+    # pad short blocks with the identity to keep them invertible
+    sizes = np.diff(block_starts)
+    for i in range(block_size):
+        blocks[sizes <= i, i, i] = 1
+
+    inv_blocks = np.linalg.inv(blocks)
+
+    result = inv_blocks.transpose(0, 2, 1).copy()
+    for i in range(block_size):
+        result[sizes <= i, i, i] = 0
+
+    return result
+
+
+class BlockJacobiPreconditioner(OperatorBase):
+    """Block-Jacobi preconditioner, applying the inverses of diagonal blocks
+    of at most *block_size* rows of *mat*.
+
+    If *spmv* is a :class:`pycuda.sparse.packeted.PacketedSpMV`, the
+    preconditioner acts on vectors in its permuted ordering, and the blocks
+    are taken from within the packets of *spmv*, which its partitioner has
+    chosen to be strongly coupled. Otherwise, consecutive rows of *mat* are
+    grouped.
+    """
+
+    def __init__(self, mat, dtype, spmv=None, block_size=32):
+        from scipy.sparse import csr_matrix
+        csr_mat = csr_matrix(mat, dtype=dtype)
+
+        self.my_dtype = csr_mat.dtype
+        self.n = csr_mat.shape[0]
+        self.index_dtype = np.dtype(np.int32)
+        self.block_size = block_size
+
+        if hasattr(spmv, "packet_base_rows"):
+            new2old = spmv.new2old_fetch_indices.get()
+            packet_boundaries = spmv.packet_base_rows.get()
+        else:
+            new2old = None
+            packet_boundaries = [0, self.n]
+
+        block_starts = find_block_starts(packet_boundaries, block_size)
+        self.block_count = len(block_starts) - 1
+
+        self.block_starts_gpu = gpuarray.to_gpu(block_starts)
+        self.inv_blocks_gpu = gpuarray.to_gpu(invert_diagonal_blocks(
+            csr_mat, block_starts, block_size, new2old))
+
+    @property
+    def dtype(self):
+        return self.my_dtype
+
+    @property
+    def shape(self):
+        return self.n, self.n
+
+    @memoize_method
+    def get_kernel(self):
+        from pycuda.tools import dtype_to_ctype
+
+        mod = SourceModule(
+                BLOCK_JACOBI_KERNEL_TEMPLATE % {
+                    "value_type": dtype_to_ctype(self.dtype),
+                    "index_type": dtype_to_ctype(self.index_dtype),
+                    "block_size": self.block_size,
+                    })
+        func = mod.get_function("block_jacobi_apply")
+        func.prepare(self.index_dtype.char + "PPPP")
+        return func
+
+    def __call__(self, operand):
+        result = gpuarray.empty(operand.shape, self.dtype,
+                allocator=operand.allocator)
+
+        if self.block_count:
+            self.get_kernel().prepared_call(
+                    (min(self.block_count, 65535), 1),
+                    (self.block_size, 1, 1),
+                    self.block_count,
+                    self.block_starts_gpu.gpudata,
+                    self.inv_blocks_gpu.gpudata,
+                    operand.gpudata, result.gpudata)
+
+        return result
+
+# }}}
+
+
+
+
+# {{{ polynomial preconditioners
+
+@context_dependent_memoize
+def get_poly_step_kernel(dtype):
+    from pycuda.elementwise import ElementwiseKernel
+    from pycuda.tools import dtype_to_ctype
+    return ElementwiseKernel(
+            "%(tp)s a, %(tp)s b, %(tp)s *d, %(tp)s *z, %(tp)s *s"
+            % {"tp": dtype_to_ctype(dtype)},
+            "d[i] = a*d[i] + b*s[i]; z[i] += d[i]",
+            "poly_precon_step")
+
+
+def chebyshev_coefficients(degree, lambda_min, lambda_max):
+    """Return the coefficients *(a, b)* of the steps *d = a d + b M r*,
+    *z = z + d*, *r = r - A d* of *degree* steps of Chebyshev iteration for
+    a matrix with eigenvalues in *[lambda_min, lambda_max]*, starting from
+    *z = 0*.
+    """
+    if not 0 < lambda_min < lambda_max:
+        raise ValueError("need 0 < lambda_min < lambda_max")
+
+    theta = (lambda_max + lambda_min)/2
+    delta = (lambda_max - lambda_min)/2
+    sigma = theta/delta
+
+    result = [(0, 1/theta)]
+    rho = 1/sigma
+    for i in range(1, degree):
+        rho_new = 1/(2*sigma - rho)
+        result.append((rho_new*rho, 2*rho_new/delta))
+        rho = rho_new
+
+    return result
+
+
+def estimate_lambda_max(operator, precon=None, iterations=20):
+    """Estimate the largest eigenvalue of *precon* times *operator* by power
+    iteration.
+    """
+    n = operator.shape[0]
+    x = gpuarray.to_gpu(
+            np.random.rand(n).astype(operator.dtype))
+
+    from math import sqrt
+    lambda_max = 0
+    for i in range(iterations):
+        norm = sqrt(abs(gpuarray.dot(x, x).get()))
+        if norm == 0:
+            break
+        x = x * (1/norm)
+
+        y = operator(x)
+        if precon is not None:
+            y = precon(y)
+
+        lambda_max = abs(gpuarray.dot(x, y).get())
+        x = y
+
+    return lambda_max
+
+
+class PolynomialPreconditioner(OperatorBase):
+    """Applies a fixed polynomial in *precon* times *operator* (times
+    *precon*), given by the step coefficients *coefficients* as returned by
+    :func:`chebyshev_coefficients`. Only products with *operator* and
+    *precon* are used.
+    """
+
+    def __init__(self, operator, coefficients, precon=None):
+        self.operator = operator
+        self.coefficients = coefficients
+        self.precon = precon
+
+    @property
+    def dtype(self):
+        return self.operator.dtype
+
+    @property
+    def shape(self):
+        return self.operator.shape
+
+    def __call__(self, operand):
+        step = get_poly_step_kernel(self.dtype)
+
+        z = gpuarray.zeros_like(operand)
+        d = gpuarray.zeros_like(operand)
+        residual = operand
+
+        for i, (a, b) in enumerate(self.coefficients):
+            if self.precon is not None:
+                s = self.precon(residual)
+            else:
+                s = residual
+
+            step(a, b, d, z, s)
+
+            if i + 1 < len(self.coefficients):
+                residual = residual - self.operator(d)
+
+        return z
+
+
+class ChebyshevPreconditioner(PolynomialPreconditioner):
+    """Approximates the inverse of *operator* by *degree* steps of Chebyshev
+    iteration, preconditioned by *precon*, e.g. a
+    :class:`pycuda.sparse.operator.DiagonalPreconditioner`.
+
+    If *lambda_max* is not given, it is estimated by
+    :func:`estimate_lambda_max` and enlarged by 10%. *lambda_min* defaults
+    to *lambda_max/eigenvalue_ratio*.
+    """
+
+    def __init__(self, operator, degree, precon=None, lambda_min=None,
+            lambda_max=None, eigenvalue_ratio=30):
+        if lambda_max is None:
+            lambda_max = 1.1*estimate_lambda_max(operator, precon)
+        if lambda_min is None:
+            lambda_min = lambda_max/eigenvalue_ratio
+
+        PolynomialPreconditioner.__init__(self, operator,
+                chebyshev_coefficients(degree, lambda_min, lambda_max),
+                precon)
+
+
+class NeumannPreconditioner(PolynomialPreconditioner):
+    """Approximates the inverse of *operator* by the Neumann series
+    *omega sum((I - omega M A)^k, k < degree) M*, i.e. by *degree* steps of
+    damped Jacobi iteration if *precon* is a
+    :class:`pycuda.sparse.operator.DiagonalPreconditioner` *M*.
+    """
+
+    def __init__(self, operator, degree, precon=None, omega=1):
+        PolynomialPreconditioner.__init__(self, operator,
+                [(0, omega)]*degree, precon)
+
+# }}}
+
+# vim: foldmethod=marker
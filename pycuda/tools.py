@@ -397,6 +397,70 @@ def get_arg_type(c_arg):
 
 # }}}
 
+# {{{ kernel specialization
+
+class SpecializationPolicy(object):
+    """Decides when a generated kernel is worth specializing for a fixed
+    problem size, i.e. recompiling it with the size baked in as a
+    compile-time constant.
+
+    A size is specialized once it has been seen *threshold* times. At most
+    *max_specializations* sizes are specialized per policy object, so that
+    the number of compiled variants of one kernel stays bounded.
+    """
+
+    # forget usage counts beyond this many distinct keys
+    max_tracked_keys = 1024
+
+    def __init__(self, threshold=8, max_specializations=4):
+        if threshold < 1:
+            raise ValueError("threshold must be positive")
+
+        self.threshold = threshold
+        self.max_specializations = max_specializations
+
+        self.usage_counts = {}
+        self.specialized_keys = set()
+
+    def should_specialize(self, key):
+        """Record one use of *key* and return whether a specialized kernel
+        should be used for it.
+        """
+        if key in self.specialized_keys:
+            return True
+
+        if len(self.specialized_keys) >= self.max_specializations:
+            return False
+
+        count = self.usage_counts.get(key, 0) + 1
+
+        if count >= self.threshold:
+            self.specialized_keys.add(key)
+            self.usage_counts.pop(key, None)
+            return True
+
+        if len(self.usage_counts) >= self.max_tracked_keys:
+            self.usage_counts.clear()
+
+        self.usage_counts[key] = count
+        return False
+
+
+def get_specialization_policy(specialize):
+    """Turn the *specialize* argument accepted by the kernel generators into
+    a :class:`SpecializationPolicy` or *None*.
+    """
+    if specialize is None or specialize is False:
+        return None
+    elif specialize is True:
+        return SpecializationPolicy()
+    elif isinstance(specialize, SpecializationPolicy):
+        return specialize
+    else:
+        raise TypeError("specialize must be a bool or a SpecializationPolicy")
+
+# }}}
+
 # {{{ context-dep memoization
 
 context_dependent_memoized_functions = []
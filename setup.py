@@ -186,6 +186,8 @@ def main():
                         "src/cpp/bitlog.cpp",
                         "src/wrapper/wrap_cudadrv.cpp",
                         "src/wrapper/mempool.cpp",
+                        "src/wrapper/wrap_sparse.cpp",
+                        "src/wrapper/wrap_sobol.cpp",
                         ]+EXTRA_SOURCES,
                     include_dirs=INCLUDE_DIRS,
                     library_dirs=LIBRARY_DIRS,
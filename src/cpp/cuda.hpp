@@ -25,12 +25,14 @@
 #include <stdint.h>
 #endif
 #include <stdexcept>
+#include <cstring>
 #include <boost/shared_ptr.hpp>
 #include <boost/foreach.hpp>
 #include <utility>
 #include <stack>
 #include <iostream>
 #include <vector>
+#include <map>
 #include <boost/python.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/thread/tss.hpp>
@@ -1188,6 +1190,20 @@ namespace pycuda
     private:
       CUmodule m_module;
 
+      struct c_str_less
+      {
+        bool operator()(const char *a, const char *b) const
+        { return strcmp(a, b) < 0; }
+      };
+
+      // function handles stay valid for the lifetime of the module,
+      // so each symbol only needs to be resolved once. Keys point to the
+      // symbol stored in the cached function, so that a lookup does not
+      // copy the name.
+      typedef std::map<const char *, boost::shared_ptr<function>, c_str_less>
+        function_cache_t;
+      function_cache_t m_function_cache;
+
     public:
       module(CUmodule mod)
         : m_module(mod)
@@ -1206,7 +1222,7 @@ namespace pycuda
       CUmodule handle() const
       { return m_module; }
 
-      function get_function(const char *name);
+      function &get_function(const char *name);
       py::tuple get_global(const char *name)
       {
         CUdeviceptr devptr;
@@ -1264,6 +1280,9 @@ namespace pycuda
         : m_function(func), m_symbol(sym)
       { }
 
+      std::string const &symbol() const
+      { return m_symbol; }
+
       void set_block_shape(int x, int y, int z)
       {
         CUDAPP_CALL_GUARDED_WITH_TRACE_INFO(
@@ -1403,11 +1422,18 @@ namespace pycuda
   };
 
   inline
-  function module::get_function(const char *name)
+  function &module::get_function(const char *name)
   {
+    function_cache_t::const_iterator it = m_function_cache.find(name);
+    if (it != m_function_cache.end())
+      return *it->second;
+
     CUfunction func;
     CUDAPP_CALL_GUARDED(cuModuleGetFunction, (&func, m_module, name));
-    return function(func, name);
+    boost::shared_ptr<function> result(new function(func, name));
+    m_function_cache.insert(
+        std::make_pair(result->symbol().c_str(), result));
+    return *result;
   }
 
   // }}}
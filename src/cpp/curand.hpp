@@ -2,6 +2,11 @@
 #define _AFJDFJSDFSD_PYCUDA_HEADER_SEEN_CURAND_HPP
 
 
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+
 #if CUDAPP_CUDA_VERSION >= 3020
   #include <curand.h>
 
@@ -43,15 +48,36 @@ namespace pycuda { namespace curandom {
   }
 
 #if CUDAPP_CUDA_VERSION >= 3020
-  void py_curand_get_direction_vectors(
-      curandDirectionVectorSet_t set, py::object dst, int count)
+  // curand provides its tables for this many dimensions
+  const int curand_table_dimension_count = 20000;
+
+  /* Copy count entries of the curand table to the writable buffer dst.
+   * Entries beyond curand_table_dimension_count repeat the table.
+   */
+  template <class T>
+  void copy_curand_table(py::object dst, const T *table, int count)
   {
+    if (count < 0)
+      throw std::invalid_argument("count must not be negative");
+
     void *buf;
     PYCUDA_BUFFER_SIZE_T len;
-    int n = 0;
-
     if (PyObject_AsWriteBuffer(dst.ptr(), &buf, &len))
       throw py::error_already_set();
+    if (size_t(len) < size_t(count)*sizeof(T))
+      throw std::invalid_argument("destination buffer too small");
+
+    T *dest = reinterpret_cast<T *>(buf);
+    for (int start = 0; start < count; start += curand_table_dimension_count)
+    {
+      const int chunk = std::min(count - start, curand_table_dimension_count);
+      memcpy(dest + start, table, chunk*sizeof(T));
+    }
+  }
+
+  void py_curand_get_direction_vectors(
+      curandDirectionVectorSet_t set, py::object dst, int count)
+  {
     if (CURAND_DIRECTION_VECTORS_32_JOEKUO6 == set
 #if CUDAPP_CUDA_VERSION >= 4000
       || CURAND_SCRAMBLED_DIRECTION_VECTORS_32_JOEKUO6 == set
@@ -59,68 +85,34 @@ namespace pycuda { namespace curandom {
     ) {
       curandDirectionVectors32_t *vectors;
       CURAND_CALL_GUARDED(curandGetDirectionVectors32, (&vectors, set));
-      while (count > 0) {
-        int size = ((count > 20000) ? 20000 : count)*sizeof(curandDirectionVectors32_t);
-        memcpy((unsigned int *)buf+n*20000*sizeof(curandDirectionVectors32_t)/sizeof(unsigned int), vectors, size);
-	count -= size/sizeof(curandDirectionVectors32_t);
-        n++;
-      }
+      copy_curand_table(dst, vectors, count);
     }
 #if CUDAPP_CUDA_VERSION >= 4000
     if (CURAND_DIRECTION_VECTORS_64_JOEKUO6 == set
       || CURAND_SCRAMBLED_DIRECTION_VECTORS_64_JOEKUO6 == set) {
       curandDirectionVectors64_t *vectors;
       CURAND_CALL_GUARDED(curandGetDirectionVectors64, (&vectors, set));
-      while (count > 0) {
-        int size = ((count > 20000) ? 20000 : count)*sizeof(curandDirectionVectors64_t);
-        memcpy((unsigned long long *)buf+n*20000*sizeof(curandDirectionVectors64_t)/sizeof(unsigned long long), vectors, size);
-	count -= size/sizeof(curandDirectionVectors64_t);
-        n++;
-      }
+      copy_curand_table(dst, vectors, count);
     }
 #endif
   }
 #endif
 
 #if CUDAPP_CUDA_VERSION >= 4000
+  // Documentation does not mention number of dimensions
+  // Assuming the same as in getDirectionVectors*
   void py_curand_get_scramble_constants32(py::object dst, int count)
   {
-    void *buf;
-    PYCUDA_BUFFER_SIZE_T len;
-    int n = 0;
-
-    if (PyObject_AsWriteBuffer(dst.ptr(), &buf, &len))
-      throw py::error_already_set();
-    unsigned int *vectors;
-    CURAND_CALL_GUARDED(curandGetScrambleConstants32, (&vectors));
-// Documentation does not mention number of dimensions
-// Assuming the same as in getDirectionVectors*
-    while (count > 0) {
-      int size = ((count > 20000) ? 20000 : count)*sizeof(unsigned int);
-      memcpy((unsigned int *)buf+n*20000, vectors, size);
-      count -= size/sizeof(unsigned int);
-      n++;
-    }
+    unsigned int *constants;
+    CURAND_CALL_GUARDED(curandGetScrambleConstants32, (&constants));
+    copy_curand_table(dst, constants, count);
   }
 
   void py_curand_get_scramble_constants64(py::object dst, int count)
   {
-    void *buf;
-    PYCUDA_BUFFER_SIZE_T len;
-    int n = 0;
-
-    if (PyObject_AsWriteBuffer(dst.ptr(), &buf, &len))
-      throw py::error_already_set();
-    unsigned long long *vectors;
-    CURAND_CALL_GUARDED(curandGetScrambleConstants64, (&vectors));
-// Documentation does not mention number of dimensions
-// Assuming the same as in getDirectionVectors*
-    while (count > 0) {
-      int size = ((count > 20000) ? 20000 : count)*sizeof(unsigned long long);
-      memcpy((unsigned long long *)buf+n*20000, vectors, size);
-      count -= size/sizeof(unsigned long long);
-      n++;
-    }
+    unsigned long long *constants;
+    CURAND_CALL_GUARDED(curandGetScrambleConstants64, (&constants));
+    copy_curand_table(dst, constants, count);
   }
 #endif
 } }
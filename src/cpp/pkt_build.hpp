@@ -0,0 +1,760 @@
+// Host-side construction of the packeted sparse matrix format
+
+
+
+
+#ifndef _AFJDFJSDFSD_PYCUDA_HEADER_SEEN_PKT_BUILD_HPP
+#define _AFJDFJSDFSD_PYCUDA_HEADER_SEEN_PKT_BUILD_HPP
+
+
+
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <boost/thread/thread.hpp>
+
+
+
+
+namespace pycuda { namespace sparse
+{
+  typedef int index_type;
+  typedef unsigned packed_index_type;
+
+  // {{{ parallel loop helper
+
+  template <class Functor>
+  class range_task
+  {
+    private:
+      const Functor *m_functor;
+      index_type m_begin, m_end;
+
+    public:
+      range_task(const Functor &f, index_type begin, index_type end)
+        : m_functor(&f), m_begin(begin), m_end(end)
+      { }
+
+      void operator()() const
+      {
+        (*m_functor)(m_begin, m_end);
+      }
+  };
+
+  /* Call f(begin, end) on contiguous chunks of [0, count), one per worker
+   * thread. f must not throw.
+   */
+  template <class Functor>
+  inline void parallel_for(index_type count, unsigned worker_count,
+      const Functor &f)
+  {
+    if (worker_count > unsigned(count))
+      worker_count = count;
+
+    if (worker_count <= 1)
+    {
+      f(0, count);
+      return;
+    }
+
+    boost::thread_group workers;
+    for (unsigned w = 1; w < worker_count; ++w)
+      workers.create_thread(range_task<Functor>(f,
+            index_type((long long) count*w/worker_count),
+            index_type((long long) count*(w+1)/worker_count)));
+
+    f(0, index_type(count/worker_count));
+    workers.join_all();
+  }
+
+  // }}}
+
+  // {{{ result
+
+  struct packet_structure
+  {
+    // permutation
+    std::vector<index_type> new2old_fetch_indices;
+    std::vector<index_type> old2new_fetch_indices;
+    std::vector<index_type> packet_base_rows;
+
+    // entries inside/outside of the diagonal packet blocks
+    std::vector<index_type> local_row_costs;
+    std::vector<index_type> remaining_rows;
+    std::vector<index_type> remaining_cols;
+    std::vector<char> remaining_data;
+    // position of each remaining entry in the CSR data
+    std::vector<index_type> remaining_sources;
+
+    // thread assignment, rows of thread t are
+    // thread_rows[thread_row_starts[t]:thread_row_starts[t+1]]
+    std::vector<index_type> thread_row_starts;
+    std::vector<index_type> thread_rows;
+    std::vector<index_type> thread_costs;
+    index_type max_thread_costs;
+
+    // packed device arrays
+    std::vector<index_type> thread_starts;
+    std::vector<index_type> thread_ends;
+    std::vector<packed_index_type> index_array;
+    std::vector<char> data_array;
+    // position of each data_array entry in the CSR data, -1 for padding
+    std::vector<index_type> data_sources;
+  };
+
+  // }}}
+
+  // {{{ workers
+
+  struct csr_view
+  {
+    index_type row_count;
+    const index_type *indptr;
+    const index_type *indices;
+    const char *data;
+    size_t value_size;
+  };
+
+  class row_cost_finder
+  {
+    private:
+      const csr_view &m_mat;
+      const index_type *m_dof_to_packet_nr;
+      packet_structure &m_result;
+      std::vector<index_type> &m_remaining_counts;
+
+    public:
+      row_cost_finder(const csr_view &mat, const index_type *dof_to_packet_nr,
+          packet_structure &result, std::vector<index_type> &remaining_counts)
+        : m_mat(mat), m_dof_to_packet_nr(dof_to_packet_nr), m_result(result),
+        m_remaining_counts(remaining_counts)
+      { }
+
+      void operator()(index_type begin, index_type end) const
+      {
+        for (index_type i = begin; i < end; ++i)
+        {
+          const index_type packet_nr = m_dof_to_packet_nr[i];
+          index_type local_count = 0;
+
+          for (index_type idx = m_mat.indptr[i]; idx < m_mat.indptr[i+1]; ++idx)
+            if (m_dof_to_packet_nr[m_mat.indices[idx]] == packet_nr)
+              ++local_count;
+
+          m_result.local_row_costs[i] = local_count;
+          m_remaining_counts[i] =
+            m_mat.indptr[i+1] - m_mat.indptr[i] - local_count;
+        }
+      }
+  };
+
+  class remaining_coo_finder
+  {
+    private:
+      const csr_view &m_mat;
+      const index_type *m_dof_to_packet_nr;
+      packet_structure &m_result;
+      const std::vector<index_type> &m_remaining_starts;
+
+    public:
+      remaining_coo_finder(const csr_view &mat,
+          const index_type *dof_to_packet_nr, packet_structure &result,
+          const std::vector<index_type> &remaining_starts)
+        : m_mat(mat), m_dof_to_packet_nr(dof_to_packet_nr), m_result(result),
+        m_remaining_starts(remaining_starts)
+      { }
+
+      void operator()(index_type begin, index_type end) const
+      {
+        const std::vector<index_type> &old2new = m_result.old2new_fetch_indices;
+
+        for (index_type i = begin; i < end; ++i)
+        {
+          const index_type packet_nr = m_dof_to_packet_nr[i];
+          index_type write_idx = m_remaining_starts[i];
+
+          for (index_type idx = m_mat.indptr[i]; idx < m_mat.indptr[i+1]; ++idx)
+          {
+            const index_type j = m_mat.indices[idx];
+            if (m_dof_to_packet_nr[j] == packet_nr)
+              continue;
+
+            m_result.remaining_rows[write_idx] = old2new[i];
+            m_result.remaining_cols[write_idx] = old2new[j];
+            m_result.remaining_sources[write_idx] = idx;
+            memcpy(&m_result.remaining_data[write_idx*m_mat.value_size],
+                m_mat.data + idx*m_mat.value_size, m_mat.value_size);
+            ++write_idx;
+          }
+        }
+      }
+  };
+
+  // sorts by decreasing cost, ties by decreasing row number
+  struct cost_and_row_greater
+  {
+    bool operator()(
+        const std::pair<index_type, index_type> &a,
+        const std::pair<index_type, index_type> &b) const
+    {
+      return a > b;
+    }
+  };
+
+  class thread_assigner
+  {
+    private:
+      const index_type m_threads_per_packet;
+      packet_structure &m_result;
+
+    public:
+      thread_assigner(index_type threads_per_packet, packet_structure &result)
+        : m_threads_per_packet(threads_per_packet), m_result(result)
+      { }
+
+      void operator()(index_type begin, index_type end) const
+      {
+        std::vector<std::pair<index_type, index_type> > costs_and_rows;
+        std::vector<index_type> thread_offsets;
+
+        for (index_type packet_nr = begin; packet_nr < end; ++packet_nr)
+        {
+          const index_type row_start = m_result.packet_base_rows[packet_nr];
+          const index_type row_end = m_result.packet_base_rows[packet_nr+1];
+          const index_type base_thread_nr = packet_nr*m_threads_per_packet;
+
+          costs_and_rows.clear();
+          for (index_type new_row = row_start; new_row < row_end; ++new_row)
+          {
+            const index_type row = m_result.new2old_fetch_indices[new_row];
+            costs_and_rows.push_back(std::make_pair(
+                  m_result.local_row_costs[row], row));
+          }
+          std::sort(costs_and_rows.begin(), costs_and_rows.end(),
+              cost_and_row_greater());
+
+          // zigzag assignment, first pass: find thread of each row
+          thread_offsets.resize(costs_and_rows.size());
+          std::vector<index_type> rows_per_thread(m_threads_per_packet, 0);
+
+          index_type thread_offset = 0;
+          index_type step = 1;
+          for (size_t k = 0; k < costs_and_rows.size(); ++k)
+          {
+            thread_offsets[k] = thread_offset;
+            ++rows_per_thread[thread_offset];
+
+            if (thread_offset + step >= m_threads_per_packet)
+              step = -1;
+            else if (thread_offset + step < 0)
+              step = 1;
+            else
+              thread_offset += step;
+          }
+
+          index_type thread_row_start = row_start;
+          for (index_type t = 0; t < m_threads_per_packet; ++t)
+          {
+            m_result.thread_row_starts[base_thread_nr+t] = thread_row_start;
+            m_result.thread_costs[base_thread_nr+t] = 0;
+            thread_row_start += rows_per_thread[t];
+          }
+
+          // second pass: fill in rows, in order of assignment
+          std::fill(rows_per_thread.begin(), rows_per_thread.end(), 0);
+          for (size_t k = 0; k < costs_and_rows.size(); ++k)
+          {
+            const index_type ti = base_thread_nr+thread_offsets[k];
+            m_result.thread_rows[
+              m_result.thread_row_starts[ti]
+              + rows_per_thread[thread_offsets[k]]++] = costs_and_rows[k].second;
+            m_result.thread_costs[ti] += costs_and_rows[k].first;
+          }
+        }
+      }
+  };
+
+  class packet_filler
+  {
+    private:
+      const csr_view &m_mat;
+      const index_type m_threads_per_packet;
+      const std::vector<index_type> &m_packet_starts;
+      packet_structure &m_result;
+
+    public:
+      packet_filler(const csr_view &mat, index_type threads_per_packet,
+          const std::vector<index_type> &packet_starts,
+          packet_structure &result)
+        : m_mat(mat), m_threads_per_packet(threads_per_packet),
+        m_packet_starts(packet_starts), m_result(result)
+      { }
+
+      void operator()(index_type begin, index_type end) const
+      {
+        const std::vector<index_type> &old2new = m_result.old2new_fetch_indices;
+
+        for (index_type packet_nr = begin; packet_nr < end; ++packet_nr)
+        {
+          const index_type base_dof_nr = m_result.packet_base_rows[packet_nr];
+          const index_type packet_size =
+            m_result.packet_base_rows[packet_nr+1] - base_dof_nr;
+          const index_type base_thread_nr = packet_nr*m_threads_per_packet;
+
+          for (index_type thread_offset = 0;
+              thread_offset < m_threads_per_packet; ++thread_offset)
+          {
+            const index_type ti = base_thread_nr+thread_offset;
+            index_type thread_write_idx =
+              m_packet_starts[packet_nr]+thread_offset;
+            m_result.thread_starts[ti] = thread_write_idx;
+
+            for (index_type k = m_result.thread_row_starts[ti];
+                k < m_result.thread_row_starts[ti+1]; ++k)
+            {
+              const index_type row_nr = m_result.thread_rows[k];
+              const packed_index_type rel_row_nr =
+                old2new[row_nr] - base_dof_nr;
+
+              for (index_type idx = m_mat.indptr[row_nr];
+                  idx < m_mat.indptr[row_nr+1]; ++idx)
+              {
+                const index_type rel_col_nr =
+                  old2new[m_mat.indices[idx]] - base_dof_nr;
+
+                if (0 <= rel_col_nr && rel_col_nr < packet_size)
+                {
+                  m_result.index_array[thread_write_idx] =
+                    (rel_row_nr << 16) + packed_index_type(rel_col_nr);
+                  memcpy(&m_result.data_array[
+                      size_t(thread_write_idx)*m_mat.value_size],
+                      m_mat.data + size_t(idx)*m_mat.value_size,
+                      m_mat.value_size);
+                  m_result.data_sources[thread_write_idx] = idx;
+                  thread_write_idx += m_threads_per_packet;
+                }
+              }
+            }
+
+            m_result.thread_ends[ti] = thread_write_idx;
+          }
+        }
+      }
+  };
+
+  // }}}
+
+  /* Build the packeted format for the square CSR matrix given by indptr,
+   * indices and data (row_count rows, values of value_size bytes each),
+   * where row i belongs to packet dof_to_packet_nr[i].
+   *
+   * The result is identical to that of the pure-Python builder in
+   * pycuda.sparse.packeted, including the order of the remaining
+   * (off-packet) entries and of the rows assigned to each thread.
+   */
+  inline void build_packet_structure(packet_structure &result,
+      index_type row_count, const index_type *indptr,
+      const index_type *indices, const char *data, size_t value_size,
+      const index_type *dof_to_packet_nr, index_type packet_count,
+      index_type threads_per_packet, unsigned worker_count)
+  {
+    // {{{ validate input
+
+    // The workers assume valid input, as they cannot report errors.
+    if (row_count < 0 || packet_count <= 0 || threads_per_packet <= 0)
+      throw std::invalid_argument("invalid matrix or packet dimensions");
+    if (indptr[0] != 0)
+      throw std::invalid_argument("indptr must start at zero");
+
+    for (index_type i = 0; i < row_count; ++i)
+    {
+      if (indptr[i+1] < indptr[i])
+        throw std::invalid_argument("indptr must be non-decreasing");
+      if (dof_to_packet_nr[i] < 0 || dof_to_packet_nr[i] >= packet_count)
+        throw std::invalid_argument("packet number out of range");
+    }
+
+    const index_type nnz = indptr[row_count];
+    for (index_type idx = 0; idx < nnz; ++idx)
+      if (indices[idx] < 0 || indices[idx] >= row_count)
+        throw std::invalid_argument("column index out of range");
+
+    if ((long long) packet_count*threads_per_packet > 0x7fffffffll)
+      throw std::invalid_argument("too many threads");
+
+    // }}}
+
+    csr_view mat;
+    mat.row_count = row_count;
+    mat.indptr = indptr;
+    mat.indices = indices;
+    mat.data = data;
+    mat.value_size = value_size;
+
+    // {{{ permutation, base rows
+
+    result.packet_base_rows.assign(packet_count+1, 0);
+    for (index_type i = 0; i < row_count; ++i)
+      ++result.packet_base_rows[dof_to_packet_nr[i]+1];
+
+    for (index_type packet_nr = 0; packet_nr < packet_count; ++packet_nr)
+    {
+      if (result.packet_base_rows[packet_nr+1] > 0x10000)
+        throw std::invalid_argument(
+            "packet too big for 16-bit packed indices");
+      result.packet_base_rows[packet_nr+1] +=
+        result.packet_base_rows[packet_nr];
+    }
+
+    result.new2old_fetch_indices.resize(row_count);
+    result.old2new_fetch_indices.resize(row_count);
+    {
+      // stable counting sort keeps dofs in ascending order within packets
+      std::vector<index_type> write_idx(
+          result.packet_base_rows.begin(), result.packet_base_rows.end()-1);
+      for (index_type i = 0; i < row_count; ++i)
+      {
+        const index_type new_i = write_idx[dof_to_packet_nr[i]]++;
+        result.new2old_fetch_indices[new_i] = i;
+        result.old2new_fetch_indices[i] = new_i;
+      }
+    }
+
+    // }}}
+
+    // {{{ local row costs, remaining coo
+
+    result.local_row_costs.resize(row_count);
+    {
+      std::vector<index_type> remaining_starts(row_count+1, 0);
+      parallel_for(row_count, worker_count,
+          row_cost_finder(mat, dof_to_packet_nr, result, remaining_starts));
+
+      index_type remaining_nnz = 0;
+      for (index_type i = 0; i < row_count; ++i)
+      {
+        const index_type count = remaining_starts[i];
+        remaining_starts[i] = remaining_nnz;
+        remaining_nnz += count;
+      }
+      remaining_starts[row_count] = remaining_nnz;
+
+      result.remaining_rows.resize(remaining_nnz);
+      result.remaining_cols.resize(remaining_nnz);
+      result.remaining_data.resize(size_t(remaining_nnz)*value_size);
+      result.remaining_sources.resize(remaining_nnz);
+
+      parallel_for(row_count, worker_count,
+          remaining_coo_finder(mat, dof_to_packet_nr, result,
+            remaining_starts));
+    }
+
+    // }}}
+
+    // {{{ thread assignment
+
+    const index_type thread_count = packet_count*threads_per_packet;
+
+    result.thread_row_starts.resize(thread_count+1);
+    result.thread_rows.resize(row_count);
+    result.thread_costs.resize(thread_count);
+
+    parallel_for(packet_count, worker_count,
+        thread_assigner(threads_per_packet, result));
+    result.thread_row_starts[thread_count] = row_count;
+
+    result.max_thread_costs = 0;
+    if (thread_count)
+      result.max_thread_costs = *std::max_element(
+          result.thread_costs.begin(), result.thread_costs.end());
+
+    // }}}
+
+    // {{{ packed arrays
+
+    std::vector<index_type> packet_starts(packet_count);
+    {
+      long long packet_start = 0;
+      for (index_type packet_nr = 0; packet_nr < packet_count; ++packet_nr)
+      {
+        packet_starts[packet_nr] = index_type(packet_start);
+
+        const std::vector<index_type>::const_iterator thread_costs_begin =
+          result.thread_costs.begin() + packet_nr*threads_per_packet;
+        packet_start += (long long) threads_per_packet * *std::max_element(
+            thread_costs_begin, thread_costs_begin+threads_per_packet);
+      }
+
+      if ((long long) result.max_thread_costs*thread_count > 0x7fffffffll)
+        throw std::invalid_argument("packed arrays too big for index type");
+    }
+
+    const size_t packed_size = size_t(result.max_thread_costs)*thread_count;
+    result.thread_starts.resize(thread_count);
+    result.thread_ends.resize(thread_count);
+    result.index_array.assign(packed_size, 0);
+    result.data_array.assign(packed_size*value_size, 0);
+    result.data_sources.assign(packed_size, -1);
+
+    parallel_for(packet_count, worker_count,
+        packet_filler(mat, threads_per_packet, packet_starts, result));
+
+    // }}}
+  }
+
+
+
+
+  // {{{ partitioning
+
+  struct vertex_range
+  {
+    index_type begin, end;
+    index_type part_count;
+  };
+
+  /* Splits each vertex range of one bisection level in two, by reordering
+   * it according to a breadth-first search from a pseudo-peripheral vertex
+   * and cutting the resulting order proportionally to the part counts of
+   * the two halves.
+   */
+  class range_bisector
+  {
+    private:
+      const index_type *m_xadj;
+      const index_type *m_adjncy;
+      const std::vector<vertex_range> &m_ranges;
+      const std::vector<index_type> &m_labels;
+      std::vector<index_type> &m_order;
+      std::vector<char> &m_visited;
+
+    public:
+      range_bisector(const index_type *xadj, const index_type *adjncy,
+          const std::vector<vertex_range> &ranges,
+          const std::vector<index_type> &labels,
+          std::vector<index_type> &order, std::vector<char> &visited)
+        : m_xadj(xadj), m_adjncy(adjncy), m_ranges(ranges), m_labels(labels),
+        m_order(order), m_visited(visited)
+      { }
+
+      /* Write the vertices of range_nr in breadth-first order into bfs_order,
+       * starting at start. Components not reachable from start are appended
+       * in their current order. Return the last vertex reached from start.
+       */
+      index_type breadth_first_order(index_type range_nr, index_type start,
+          std::vector<index_type> &bfs_order) const
+      {
+        const vertex_range &rng = m_ranges[range_nr];
+        bfs_order.clear();
+
+        index_type last_reached = start;
+        bool first_component = true;
+        index_type scan_idx = rng.begin;
+
+        while (true)
+        {
+          size_t queue_head = bfs_order.size();
+          bfs_order.push_back(start);
+          m_visited[start] = 1;
+
+          while (queue_head < bfs_order.size())
+          {
+            const index_type v = bfs_order[queue_head++];
+            for (index_type idx = m_xadj[v]; idx < m_xadj[v+1]; ++idx)
+            {
+              const index_type w = m_adjncy[idx];
+              if (m_labels[w] == range_nr && !m_visited[w])
+              {
+                m_visited[w] = 1;
+                bfs_order.push_back(w);
+              }
+            }
+          }
+
+          if (first_component)
+          {
+            last_reached = bfs_order.back();
+            first_component = false;
+          }
+
+          if (bfs_order.size() == size_t(rng.end - rng.begin))
+            break;
+
+          // find the next component
+          while (m_visited[m_order[scan_idx]])
+            ++scan_idx;
+          start = m_order[scan_idx];
+        }
+
+        for (size_t k = 0; k < bfs_order.size(); ++k)
+          m_visited[bfs_order[k]] = 0;
+
+        return last_reached;
+      }
+
+      void operator()(index_type begin, index_type end) const
+      {
+        std::vector<index_type> bfs_order;
+
+        for (index_type range_nr = begin; range_nr < end; ++range_nr)
+        {
+          const vertex_range &rng = m_ranges[range_nr];
+          if (rng.part_count <= 1)
+            continue;
+
+          const index_type peripheral = breadth_first_order(
+              range_nr, m_order[rng.begin], bfs_order);
+          breadth_first_order(range_nr, peripheral, bfs_order);
+
+          std::copy(bfs_order.begin(), bfs_order.end(),
+              m_order.begin() + rng.begin);
+        }
+      }
+  };
+
+  /* Partition the graph given by the adjacency structure xadj, adjncy (in
+   * the format used by METIS) into parts of at most max_part_size vertices
+   * each by recursive bisection, and store the part number of each vertex
+   * in part_of_vertex. Return the number of parts, which is the smallest
+   * possible one, ceil(vertex_count/max_part_size).
+   */
+  inline index_type partition_graph(
+      index_type vertex_count, const index_type *xadj,
+      const index_type *adjncy, index_type max_part_size,
+      unsigned worker_count, std::vector<index_type> &part_of_vertex)
+  {
+    // {{{ validate input
+
+    if (vertex_count < 0 || max_part_size <= 0)
+      throw std::invalid_argument("invalid vertex count or part size");
+    if (xadj[0] != 0)
+      throw std::invalid_argument("xadj must start at zero");
+
+    for (index_type v = 0; v < vertex_count; ++v)
+      if (xadj[v+1] < xadj[v])
+        throw std::invalid_argument("xadj must be non-decreasing");
+
+    for (index_type idx = 0; idx < xadj[vertex_count]; ++idx)
+      if (adjncy[idx] < 0 || adjncy[idx] >= vertex_count)
+        throw std::invalid_argument("adjacency index out of range");
+
+    // }}}
+
+    const index_type part_count = std::max(index_type(1), index_type(
+          (vertex_count + (long long) max_part_size - 1) / max_part_size));
+
+    std::vector<index_type> order(vertex_count);
+    for (index_type v = 0; v < vertex_count; ++v)
+      order[v] = v;
+
+    std::vector<index_type> labels(vertex_count, 0);
+    std::vector<char> visited(vertex_count, 0);
+
+    std::vector<vertex_range> ranges;
+    {
+      vertex_range rng;
+      rng.begin = 0;
+      rng.end = vertex_count;
+      rng.part_count = part_count;
+      ranges.push_back(rng);
+    }
+
+    bool done = part_count == 1;
+    while (!done)
+    {
+      parallel_for(ranges.size(), worker_count,
+          range_bisector(xadj, adjncy, ranges, labels, order, visited));
+
+      // Each half gets a share of the vertices proportional to its number
+      // of parts, so that neither exceeds part_count*max_part_size.
+      std::vector<vertex_range> new_ranges;
+      done = true;
+      for (size_t range_nr = 0; range_nr < ranges.size(); ++range_nr)
+      {
+        const vertex_range &rng = ranges[range_nr];
+        if (rng.part_count <= 1)
+        {
+          new_ranges.push_back(rng);
+          continue;
+        }
+
+        vertex_range left, right;
+        left.part_count = rng.part_count / 2;
+        right.part_count = rng.part_count - left.part_count;
+        left.begin = rng.begin;
+        left.end = right.begin = rng.begin + index_type(
+            (long long) (rng.end - rng.begin)*left.part_count/rng.part_count);
+        right.end = rng.end;
+
+        new_ranges.push_back(left);
+        new_ranges.push_back(right);
+        if (left.part_count > 1 || right.part_count > 1)
+          done = false;
+      }
+
+      ranges.swap(new_ranges);
+      for (size_t range_nr = 0; range_nr < ranges.size(); ++range_nr)
+        for (index_type k = ranges[range_nr].begin;
+            k < ranges[range_nr].end; ++k)
+          labels[order[k]] = range_nr;
+    }
+
+    part_of_vertex.resize(vertex_count);
+    for (size_t range_nr = 0; range_nr < ranges.size(); ++range_nr)
+      for (index_type k = ranges[range_nr].begin;
+          k < ranges[range_nr].end; ++k)
+        part_of_vertex[order[k]] = range_nr;
+
+    return part_count;
+  }
+
+  // }}}
+
+  // {{{ coordinate format
+
+  class csr_row_expander
+  {
+    private:
+      const index_type *m_indptr;
+      index_type *m_rows;
+
+    public:
+      csr_row_expander(const index_type *indptr, index_type *rows)
+        : m_indptr(indptr), m_rows(rows)
+      { }
+
+      void operator()(index_type begin, index_type end) const
+      {
+        for (index_type i = begin; i < end; ++i)
+          std::fill(m_rows + m_indptr[i], m_rows + m_indptr[i+1], i);
+      }
+  };
+
+  /* Write the row index of each of the indptr[row_count] entries of a CSR
+   * matrix to rows, i.e. the row array of the equivalent row-sorted
+   * coordinate format.
+   */
+  inline void expand_csr_rows(index_type row_count, const index_type *indptr,
+      index_type *rows, unsigned worker_count)
+  {
+    if (row_count < 0)
+      throw std::invalid_argument("invalid row count");
+    if (indptr[0] != 0)
+      throw std::invalid_argument("indptr must start at zero");
+    for (index_type i = 0; i < row_count; ++i)
+      if (indptr[i+1] < indptr[i])
+        throw std::invalid_argument("indptr must be non-decreasing");
+
+    parallel_for(row_count, worker_count, csr_row_expander(indptr, rows));
+  }
+
+  // }}}
+}}
+
+
+
+
+#endif
+// vim: foldmethod=marker
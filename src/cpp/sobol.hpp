@@ -0,0 +1,309 @@
+// Host-side generation of Sobol direction numbers and scrambling tables
+
+
+
+
+#ifndef _AFJDFJSDFSD_PYCUDA_HEADER_SEEN_SOBOL_HPP
+#define _AFJDFJSDFSD_PYCUDA_HEADER_SEEN_SOBOL_HPP
+
+
+
+
+#include <vector>
+#include <stdexcept>
+
+
+
+
+namespace pycuda { namespace sobol
+{
+  // Polynomials over GF(2), with bit i holding the coefficient of x^i.
+  typedef unsigned long long poly_type;
+
+  // {{{ GF(2) polynomial arithmetic
+
+  inline int degree(poly_type p)
+  {
+    int result = -1;
+    while (p)
+    {
+      p >>= 1;
+      ++result;
+    }
+    return result;
+  }
+
+  // a*b mod p, for a, b of degree less than deg = degree(p)
+  inline poly_type mulmod(poly_type a, poly_type b, poly_type p, int deg)
+  {
+    const poly_type top = poly_type(1) << deg;
+
+    poly_type result = 0;
+    while (b)
+    {
+      if (b & 1)
+        result ^= a;
+      b >>= 1;
+
+      a <<= 1;
+      if (a & top)
+        a ^= p;
+    }
+    return result;
+  }
+
+  // x^e mod p
+  inline poly_type powmod_x(unsigned long long e, poly_type p, int deg)
+  {
+    poly_type result = 1;
+    poly_type base = 2 % p;
+    if (deg == 1)
+      base = 1; // x = 1 mod (x+1)
+
+    while (e)
+    {
+      if (e & 1)
+        result = mulmod(result, base, p, deg);
+      e >>= 1;
+      base = mulmod(base, base, p, deg);
+    }
+    return result;
+  }
+
+  inline void find_prime_factors(unsigned long long n,
+      std::vector<unsigned long long> &factors)
+  {
+    factors.clear();
+    for (unsigned long long q = 2; q*q <= n; ++q)
+      if (n % q == 0)
+      {
+        factors.push_back(q);
+        while (n % q == 0)
+          n /= q;
+      }
+    if (n > 1)
+      factors.push_back(n);
+  }
+
+  /* p of degree deg is primitive iff x has multiplicative order 2^deg-1
+   * modulo p.
+   */
+  inline bool is_primitive(poly_type p, int deg,
+      const std::vector<unsigned long long> &order_factors)
+  {
+    if (!(p & 1))
+      return false;
+
+    const unsigned long long order = (1ull << deg) - 1;
+    if (powmod_x(order, p, deg) != 1)
+      return false;
+
+    for (unsigned i = 0; i < order_factors.size(); ++i)
+      if (powmod_x(order / order_factors[i], p, deg) == 1)
+        return false;
+
+    return true;
+  }
+
+  inline bool has_even_weight(poly_type p)
+  {
+    bool result = true;
+    while (p)
+    {
+      result = !result;
+      p &= p - 1;
+    }
+    return result;
+  }
+
+  // }}}
+
+  // {{{ primitive polynomials
+
+  /* Return the first count primitive polynomials, in order of increasing
+   * degree and, within a degree, increasing value. The list is computed
+   * once per process and extended as needed. Not thread-safe; callers
+   * from Python hold the GIL.
+   */
+  inline const std::vector<poly_type> &get_primitive_polynomials(
+      unsigned count, int max_degree)
+  {
+    static std::vector<poly_type> polys;
+    static int searched_degree = 0;
+
+    std::vector<unsigned long long> order_factors;
+    while (polys.size() < count)
+    {
+      const int deg = searched_degree + 1;
+      if (deg > max_degree)
+        throw std::invalid_argument(
+            "too many dimensions for the number of bits");
+
+      find_prime_factors((1ull << deg) - 1, order_factors);
+
+      for (poly_type p = (poly_type(1) << deg) | 1;
+          p < (poly_type(1) << (deg + 1)); p += 2)
+      {
+        // divisible by x+1 unless the weight is odd
+        if (deg > 1 && has_even_weight(p))
+          continue;
+        if (is_primitive(p, deg, order_factors))
+          polys.push_back(p);
+      }
+
+      searched_degree = deg;
+    }
+
+    return polys;
+  }
+
+  // }}}
+
+  // {{{ pseudorandom initialization
+
+  inline unsigned long long splitmix64(unsigned long long &state)
+  {
+    unsigned long long z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  // }}}
+
+  // {{{ direction vectors
+
+  /* Write bits direction vectors for each of dim_count dimensions to
+   * result, in the layout of curandDirectionVectors32_t (bits == 32, T
+   * unsigned int) and curandDirectionVectors64_t (bits == 64, T unsigned
+   * long long).
+   *
+   * Dimension 0 is the van der Corput sequence. Dimension d > 0 uses the
+   * d-th primitive polynomial, with the initial direction numbers m_k
+   * (odd, less than 2^k) drawn from a fixed pseudorandom sequence, as
+   * opposed to the search-optimized values of Joe and Kuo.
+   */
+  template <class T>
+  void find_direction_vectors(unsigned dim_count, unsigned bits, T *result)
+  {
+    if (bits != 8*sizeof(T))
+      throw std::invalid_argument("bits does not match the element size");
+
+    if (dim_count == 0)
+      return;
+
+    const std::vector<poly_type> &polys =
+      get_primitive_polynomials(dim_count-1, bits-1);
+
+    std::vector<T> m(bits+1);
+
+    for (unsigned dim = 0; dim < dim_count; ++dim)
+    {
+      T *v = result + size_t(dim)*bits;
+
+      if (dim == 0)
+      {
+        for (unsigned k = 1; k <= bits; ++k)
+          v[k-1] = T(1) << (bits - k);
+        continue;
+      }
+
+      const poly_type p = polys[dim-1];
+      const unsigned s = degree(p);
+
+      unsigned long long rng_state = dim;
+      for (unsigned k = 1; k <= s; ++k)
+        m[k] = (T(splitmix64(rng_state)) & ((T(1) << k) - 1)) | 1;
+
+      // m_k = 2 a_1 m_{k-1} ^ ... ^ 2^(s-1) a_{s-1} m_{k-s+1}
+      //       ^ 2^s m_{k-s} ^ m_{k-s}
+      // where p = x^s + a_1 x^(s-1) + ... + a_(s-1) x + 1
+      for (unsigned k = s+1; k <= bits; ++k)
+      {
+        T mk = m[k-s] ^ (m[k-s] << s);
+        for (unsigned j = 1; j < s; ++j)
+          if ((p >> (s - j)) & 1)
+            mk ^= m[k-j] << j;
+        m[k] = mk;
+      }
+
+      for (unsigned k = 1; k <= bits; ++k)
+        v[k-1] = m[k] << (bits - k);
+    }
+  }
+
+  // }}}
+
+  // {{{ scrambling
+
+  /* Apply a random linear matrix scramble (J. Matousek, On the L2-
+   * discrepancy for anchored boxes, J. Complexity 14 (1998)) to the
+   * direction vectors of each dimension. This multiplies the digits of
+   * every point by a random nonsingular lower triangular matrix, which
+   * randomizes the sequence like Owen's nested scrambling while keeping
+   * the generation a plain Gray code update with modified direction
+   * vectors.
+   */
+  template <class T>
+  void scramble_direction_vectors(unsigned dim_count, unsigned bits,
+      T *vectors, unsigned long long seed)
+  {
+    if (bits != 8*sizeof(T))
+      throw std::invalid_argument("bits does not match the element size");
+
+    // row i of the matrix acts on the bit of weight 2^(bits-1-i)
+    std::vector<T> rows(bits);
+
+    for (unsigned dim = 0; dim < dim_count; ++dim)
+    {
+      unsigned long long rng_state = seed ^ (0x5851f42d4c957f2dull * (dim+1));
+
+      for (unsigned i = 0; i < bits; ++i)
+      {
+        const T high_mask = i ? T(~T(0)) << (bits - i) : T(0);
+        rows[i] = (T(splitmix64(rng_state)) & high_mask)
+          | (T(1) << (bits - 1 - i));
+      }
+
+      T *v = vectors + size_t(dim)*bits;
+      for (unsigned k = 0; k < bits; ++k)
+      {
+        T scrambled = 0;
+        for (unsigned i = 0; i < bits; ++i)
+        {
+          // parity of rows[i] & v[k]
+          T x = rows[i] & v[k];
+          unsigned parity = 0;
+          while (x)
+          {
+            parity ^= 1;
+            x &= x - 1;
+          }
+          if (parity)
+            scrambled |= T(1) << (bits - 1 - i);
+        }
+        v[k] = scrambled;
+      }
+    }
+  }
+
+  /* Write one random digital shift per dimension, to be XORed into each
+   * point, as consumed by curand's scrambled Sobol generators.
+   */
+  template <class T>
+  void find_digital_shifts(unsigned dim_count, T *result,
+      unsigned long long seed)
+  {
+    unsigned long long rng_state = seed;
+    for (unsigned dim = 0; dim < dim_count; ++dim)
+      result[dim] = T(splitmix64(rng_state));
+  }
+
+  // }}}
+}}
+
+
+
+
+#endif
+// vim: foldmethod=marker
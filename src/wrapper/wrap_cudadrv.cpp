@@ -308,6 +308,119 @@ namespace
 
 
 
+  // {{{ jit options
+
+#if CUDAPP_CUDA_VERSION >= 2010
+  // Log buffers start out small and live on the heap. When a failed load
+  // fills the error log completely, the load is retried with bigger logs,
+  // so that the full error message reaches the user.
+  const size_t jit_initial_log_size = 8*1024;
+  const size_t jit_max_log_size = 4*1024*1024;
+
+  class jit_option_list : public boost::noncopyable
+  {
+    private:
+      std::vector<CUjit_option> m_options;
+      std::vector<void *> m_values;
+      std::vector<char> m_info_buf, m_error_buf;
+
+      // positions of the log entries in m_options/m_values
+      enum {
+        INFO_BUF_IDX = 0, INFO_SIZE_IDX = 1,
+        ERROR_BUF_IDX = 2, ERROR_SIZE_IDX = 3 };
+
+      void add(CUjit_option key, void *value)
+      {
+        m_options.push_back(key);
+        m_values.push_back(value);
+      }
+
+      static std::string log_contents(std::vector<char> const &buf, void *size_value)
+      {
+        size_t size = std::min(size_t(size_value), buf.size());
+        // the reported size may or may not include the terminating NUL
+        while (size && buf[size-1] == '\0')
+          --size;
+        return std::string(&buf.front(), size);
+      }
+
+    public:
+      jit_option_list(py::object py_options, const char *routine,
+          size_t log_size=jit_initial_log_size)
+      {
+        add(CU_JIT_INFO_LOG_BUFFER, 0);
+        add(CU_JIT_INFO_LOG_BUFFER_SIZE_BYTES, 0);
+        add(CU_JIT_ERROR_LOG_BUFFER, 0);
+        add(CU_JIT_ERROR_LOG_BUFFER_SIZE_BYTES, 0);
+        reset_logs(log_size);
+
+        PYTHON_FOREACH(key_value, py_options)
+        {
+          CUjit_option key = py::extract<CUjit_option>(key_value[0]);
+
+          switch (key)
+          {
+            case CU_JIT_INFO_LOG_BUFFER:
+            case CU_JIT_INFO_LOG_BUFFER_SIZE_BYTES:
+            case CU_JIT_ERROR_LOG_BUFFER:
+            case CU_JIT_ERROR_LOG_BUFFER_SIZE_BYTES:
+              throw pycuda::error(routine, CUDA_ERROR_INVALID_VALUE,
+                  "JIT log buffers are managed by PyCUDA--"
+                  "use the message_handler argument instead");
+            case CU_JIT_WALL_TIME:
+              throw pycuda::error(routine, CUDA_ERROR_INVALID_VALUE,
+                  "WALL_TIME is an output-only JIT option");
+            default:
+              // all remaining (documented) options take an unsigned int
+              {
+                unsigned value = py::extract<unsigned>(key_value[1]);
+                add(key, (void *) (uintptr_t) value);
+              }
+          }
+        }
+      }
+
+      void reset_logs(size_t log_size)
+      {
+        m_info_buf.assign(log_size, '\0');
+        m_error_buf.assign(log_size, '\0');
+        m_values[INFO_BUF_IDX] = &m_info_buf.front();
+        m_values[INFO_SIZE_IDX] = (void *) log_size;
+        m_values[ERROR_BUF_IDX] = &m_error_buf.front();
+        m_values[ERROR_SIZE_IDX] = (void *) log_size;
+      }
+
+      size_t log_size() const
+      { return m_error_buf.size(); }
+
+      bool error_log_full() const
+      { return size_t(m_values[ERROR_SIZE_IDX]) + 1 >= m_error_buf.size(); }
+
+      unsigned int size() const
+      { return (unsigned int) m_options.size(); }
+
+      CUjit_option *options()
+      { return &m_options.front(); }
+
+      void **values()
+      { return &m_values.front(); }
+
+      std::string info_log() const
+      { return log_contents(m_info_buf, m_values[INFO_SIZE_IDX]); }
+
+      std::string error_log() const
+      { return log_contents(m_error_buf, m_values[ERROR_SIZE_IDX]); }
+
+      void report(py::object message_handler, bool success) const
+      {
+        if (message_handler != py::object())
+          message_handler(success, info_log(), error_log());
+      }
+  };
+#endif
+
+  // }}}
+
   // {{{ module_from_buffer
 
   module *module_from_buffer(py::object buffer, py::object py_options,
@@ -320,46 +433,28 @@ namespace
     CUmodule mod;
 
 #if CUDAPP_CUDA_VERSION >= 2010
-    const size_t buf_size = 32768;
-    char info_buf[buf_size], error_buf[buf_size];
+    jit_option_list options(py_options, "module_from_buffer");
 
-    std::vector<CUjit_option> options;
-    std::vector<void *> option_values;
-
-#define ADD_OPTION_PTR(KEY, PTR) \
-    { \
-      options.push_back(KEY); \
-      option_values.push_back(PTR); \
-    }
+    CUresult cu_status_code;
+    while (true)
+    {
+      CUDAPP_PRINT_CALL_TRACE("cuModuleLoadDataEx");
+      cu_status_code = cuModuleLoadDataEx(&mod, mod_buf,
+          options.size(), options.options(), options.values());
 
-    ADD_OPTION_PTR(CU_JIT_INFO_LOG_BUFFER, info_buf);
-    ADD_OPTION_PTR(CU_JIT_INFO_LOG_BUFFER_SIZE_BYTES, (void *) buf_size);
-    ADD_OPTION_PTR(CU_JIT_ERROR_LOG_BUFFER, error_buf);
-    ADD_OPTION_PTR(CU_JIT_ERROR_LOG_BUFFER_SIZE_BYTES, (void *) buf_size);
+      if (cu_status_code == CUDA_SUCCESS
+          || !options.error_log_full()
+          || options.log_size() >= jit_max_log_size)
+        break;
 
-    PYTHON_FOREACH(key_value, py_options)
-      ADD_OPTION_PTR(
-          py::extract<CUjit_option>(key_value[0]),
-          (void *) py::extract<intptr_t>(key_value[1])());
-#undef ADD_OPTION
-
-    CUDAPP_PRINT_CALL_TRACE("cuModuleLoadDataEx");
-    CUresult cu_status_code; \
-    cu_status_code = cuModuleLoadDataEx(&mod, mod_buf, (unsigned int) options.size(),
-         const_cast<CUjit_option *>(&*options.begin()),
-         const_cast<void **>(&*option_values.begin()));
-
-    size_t info_buf_size = size_t(option_values[1]);
-    size_t error_buf_size = size_t(option_values[3]);
+      options.reset_logs(2*options.log_size());
+    }
 
-    if (message_handler != py::object())
-      message_handler(cu_status_code == CUDA_SUCCESS,
-          std::string(info_buf, info_buf_size),
-          std::string(error_buf, error_buf_size));
+    options.report(message_handler, cu_status_code == CUDA_SUCCESS);
 
     if (cu_status_code != CUDA_SUCCESS)
       throw pycuda::error("cuModuleLoadDataEx", cu_status_code,
-          std::string(error_buf, error_buf_size).c_str());
+          options.error_log().c_str());
 #else
     if (py::len(py_options))
       throw pycuda::error("module_from_buffer", CUDA_ERROR_INVALID_VALUE,
@@ -373,6 +468,90 @@ namespace
 
   // }}}
 
+  // {{{ linker
+
+#if CUDAPP_CUDA_VERSION >= 5050
+  // The driver hangs on to the option arrays and log buffers until
+  // cuLinkDestroy, so the logs cannot be grown here. They are sized
+  // generously up front instead.
+  const size_t linker_log_size = 256*1024;
+
+  class linker : public boost::noncopyable
+  {
+    private:
+      jit_option_list m_options;
+      py::object m_message_handler;
+      CUlinkState m_link_state;
+
+      void check(CUresult status, const char *routine)
+      {
+        if (status != CUDA_SUCCESS)
+        {
+          m_options.report(m_message_handler, false);
+          throw pycuda::error(routine, status, m_options.error_log().c_str());
+        }
+      }
+
+    public:
+      linker(py::object py_options, py::object message_handler)
+        : m_options(py_options, "Linker", linker_log_size),
+        m_message_handler(message_handler)
+      {
+        CUDAPP_CALL_GUARDED(cuLinkCreate, (m_options.size(),
+              m_options.options(), m_options.values(), &m_link_state));
+      }
+
+      ~linker()
+      {
+        CUDAPP_CALL_GUARDED_CLEANUP(cuLinkDestroy, (m_link_state));
+      }
+
+      void add_data(py::object buffer, CUjitInputType input_type,
+          std::string const &name)
+      {
+        const char *data;
+        PYCUDA_BUFFER_SIZE_T len;
+        if (PyObject_AsCharBuffer(buffer.ptr(), &data, &len))
+          throw py::error_already_set();
+
+        CUDAPP_PRINT_CALL_TRACE("cuLinkAddData");
+        check(cuLinkAddData(m_link_state, input_type,
+              const_cast<char *>(data), len, name.c_str(), 0, 0, 0),
+            "cuLinkAddData");
+      }
+
+      void add_file(std::string const &filename, CUjitInputType input_type)
+      {
+        CUDAPP_PRINT_CALL_TRACE("cuLinkAddFile");
+        check(cuLinkAddFile(m_link_state, input_type,
+              filename.c_str(), 0, 0, 0),
+            "cuLinkAddFile");
+      }
+
+      py::handle<> complete()
+      {
+        void *cubin;
+        size_t cubin_size;
+
+        CUDAPP_PRINT_CALL_TRACE("cuLinkComplete");
+        check(cuLinkComplete(m_link_state, &cubin, &cubin_size),
+            "cuLinkComplete");
+        m_options.report(m_message_handler, true);
+
+        // cubin is owned by the link state, copy it out before it goes away
+#if PY_VERSION_HEX >= 0x03000000
+        return py::handle<>(PyBytes_FromStringAndSize(
+              reinterpret_cast<const char *>(cubin), cubin_size));
+#else
+        return py::handle<>(PyString_FromStringAndSize(
+              reinterpret_cast<const char *>(cubin), cubin_size));
+#endif
+      }
+  };
+#endif
+
+  // }}}
+
   template <class T>
   PyObject *mem_obj_to_long(T const &mo)
   {
@@ -487,6 +666,8 @@ namespace
 void pycuda_expose_tools();
 void pycuda_expose_gl();
 void pycuda_expose_curand();
+void pycuda_expose_sparse();
+void pycuda_expose_sobol();
 
 
 
@@ -786,6 +967,11 @@ BOOST_PYTHON_MODULE(_driver)
     .value("TARGET_FROM_CUCONTEXT", CU_JIT_TARGET_FROM_CUCONTEXT)
     .value("TARGET", CU_JIT_TARGET)
     .value("FALLBACK_STRATEGY", CU_JIT_FALLBACK_STRATEGY)
+#if CUDAPP_CUDA_VERSION >= 5050
+    .value("GENERATE_DEBUG_INFO", CU_JIT_GENERATE_DEBUG_INFO)
+    .value("LOG_VERBOSE", CU_JIT_LOG_VERBOSE)
+    .value("GENERATE_LINE_INFO", CU_JIT_GENERATE_LINE_INFO)
+#endif
     ;
 
   py::enum_<CUjit_target>("jit_target")
@@ -798,6 +984,10 @@ BOOST_PYTHON_MODULE(_driver)
 #endif
 #if CUDAPP_CUDA_VERSION >= 3020
     .value("COMPUTE_21", CU_TARGET_COMPUTE_21)
+#endif
+#if CUDAPP_CUDA_VERSION >= 5000
+    .value("COMPUTE_30", CU_TARGET_COMPUTE_30)
+    .value("COMPUTE_35", CU_TARGET_COMPUTE_35)
 #endif
     ;
 
@@ -807,6 +997,16 @@ BOOST_PYTHON_MODULE(_driver)
     ;
 #endif
 
+#if CUDAPP_CUDA_VERSION >= 5050
+  py::enum_<CUjitInputType>("jit_input_type")
+    .value("CUBIN", CU_JIT_INPUT_CUBIN)
+    .value("PTX", CU_JIT_INPUT_PTX)
+    .value("FATBINARY", CU_JIT_INPUT_FATBINARY)
+    .value("OBJECT", CU_JIT_INPUT_OBJECT)
+    .value("LIBRARY", CU_JIT_INPUT_LIBRARY)
+    ;
+#endif
+
 #if CUDAPP_CUDA_VERSION >= 2020
   {
     py::class_<host_alloc_flags> cls("host_alloc_flags", py::no_init);
@@ -969,7 +1169,7 @@ BOOST_PYTHON_MODULE(_driver)
     typedef module cl;
     py::class_<cl, boost::noncopyable, shared_ptr<cl> >("Module", py::no_init)
       .def("get_function", &cl::get_function, (py::args("self", "name")),
-          py::with_custodian_and_ward_postcall<0, 1>())
+          py::return_internal_reference<>())
       .def("get_global", &cl::get_global, (py::args("self", "name")))
       .def("get_texref", module_get_texref,
           (py::args("self", "name")),
@@ -992,6 +1192,25 @@ BOOST_PYTHON_MODULE(_driver)
 
   // }}}
 
+  // {{{ linker
+#if CUDAPP_CUDA_VERSION >= 5050
+  {
+    typedef linker cl;
+    py::class_<cl, boost::noncopyable, shared_ptr<cl> >("Linker",
+        py::init<py::object, py::object>(
+          (py::arg("options")=py::list(),
+           py::arg("message_handler")=py::object())))
+      .def("add_data", &cl::add_data,
+          (py::arg("data"), py::arg("input_type"),
+           py::arg("name")="unknown"))
+      .def("add_file", &cl::add_file,
+          (py::arg("filename"), py::arg("input_type")))
+      .DEF_SIMPLE_METHOD(complete)
+      ;
+  }
+#endif
+  // }}}
+
   // {{{ function
   {
     typedef function cl;
@@ -1400,6 +1619,8 @@ BOOST_PYTHON_MODULE(_driver)
 #ifdef HAVE_CURAND
   pycuda_expose_curand();
 #endif
+  pycuda_expose_sparse();
+  pycuda_expose_sobol();
 }
 
 // vim: foldmethod=marker
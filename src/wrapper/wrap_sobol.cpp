@@ -0,0 +1,114 @@
+#include <sobol.hpp>
+
+#include "tools.hpp"
+#include "wrap_helpers.hpp"
+
+
+
+
+using namespace pycuda;
+using namespace pycuda::sobol;
+
+
+
+
+namespace
+{
+  void *get_write_buffer(py::object obj, size_t min_size)
+  {
+    void *buf;
+    PYCUDA_BUFFER_SIZE_T len;
+    if (PyObject_AsWriteBuffer(obj.ptr(), &buf, &len))
+      throw py::error_already_set();
+
+    if (size_t(len) < min_size)
+      throw std::invalid_argument("buffer too small");
+    return buf;
+  }
+
+
+
+
+  void py_sobol_direction_vectors(py::object dst, unsigned count,
+      unsigned bits)
+  {
+    if (bits == 32)
+      find_direction_vectors(count, bits, reinterpret_cast<unsigned int *>(
+            get_write_buffer(dst, size_t(count)*bits*sizeof(unsigned int))));
+    else if (bits == 64)
+      find_direction_vectors(count, bits,
+          reinterpret_cast<unsigned long long *>(get_write_buffer(
+              dst, size_t(count)*bits*sizeof(unsigned long long))));
+    else
+      throw std::invalid_argument("bits must be 32 or 64");
+  }
+
+
+
+
+  void py_sobol_scramble_direction_vectors(py::object vectors,
+      unsigned count, unsigned bits, unsigned long long seed)
+  {
+    if (bits == 32)
+      scramble_direction_vectors(count, bits,
+          reinterpret_cast<unsigned int *>(get_write_buffer(
+              vectors, size_t(count)*bits*sizeof(unsigned int))),
+          seed);
+    else if (bits == 64)
+      scramble_direction_vectors(count, bits,
+          reinterpret_cast<unsigned long long *>(get_write_buffer(
+              vectors, size_t(count)*bits*sizeof(unsigned long long))),
+          seed);
+    else
+      throw std::invalid_argument("bits must be 32 or 64");
+  }
+
+
+
+
+  void py_sobol_digital_shifts(py::object dst, unsigned count,
+      unsigned bits, unsigned long long seed)
+  {
+    if (bits == 32)
+      find_digital_shifts(count, reinterpret_cast<unsigned int *>(
+            get_write_buffer(dst, size_t(count)*sizeof(unsigned int))), seed);
+    else if (bits == 64)
+      find_digital_shifts(count, reinterpret_cast<unsigned long long *>(
+            get_write_buffer(dst, size_t(count)*sizeof(unsigned long long))),
+          seed);
+    else
+      throw std::invalid_argument("bits must be 32 or 64");
+  }
+
+
+
+
+  py::list py_sobol_primitive_polynomials(unsigned count)
+  {
+    const std::vector<poly_type> &polys =
+      get_primitive_polynomials(count, 31);
+
+    py::list result;
+    for (unsigned i = 0; i < count; ++i)
+      result.append(polys[i]);
+    return result;
+  }
+}
+
+
+
+
+void pycuda_expose_sobol()
+{
+  using py::arg;
+
+  py::def("_sobol_direction_vectors", py_sobol_direction_vectors,
+      (arg("dst"), arg("count"), arg("bits")));
+  py::def("_sobol_scramble_direction_vectors",
+      py_sobol_scramble_direction_vectors,
+      (arg("vectors"), arg("count"), arg("bits"), arg("seed")));
+  py::def("_sobol_digital_shifts", py_sobol_digital_shifts,
+      (arg("dst"), arg("count"), arg("bits"), arg("seed")));
+  py::def("_sobol_primitive_polynomials", py_sobol_primitive_polynomials,
+      (arg("count")));
+}
@@ -0,0 +1,233 @@
+#include <pkt_build.hpp>
+
+#include "tools.hpp"
+#include "wrap_helpers.hpp"
+
+
+
+
+using namespace pycuda;
+using namespace pycuda::sparse;
+
+
+
+
+namespace
+{
+  class py_gil_release
+  {
+    private:
+      PyThreadState *m_thread_state;
+
+    public:
+      py_gil_release()
+        : m_thread_state(PyEval_SaveThread())
+      { }
+
+      ~py_gil_release()
+      {
+        PyEval_RestoreThread(m_thread_state);
+      }
+  };
+
+
+
+
+  const void *get_read_buffer(py::object obj, size_t min_size,
+      size_t &size)
+  {
+    const void *buf;
+    PYCUDA_BUFFER_SIZE_T len;
+    if (PyObject_AsReadBuffer(obj.ptr(), &buf, &len))
+      throw py::error_already_set();
+
+    size = len;
+    if (size < min_size)
+      throw std::invalid_argument("buffer too small");
+    return buf;
+  }
+
+
+
+
+  py::handle<> bytes_to_numpy(const std::vector<char> &data, py::object dtype)
+  {
+    PyArray_Descr *tp_descr;
+    if (PyArray_DescrConverter(dtype.ptr(), &tp_descr) != NPY_SUCCEED)
+      throw py::error_already_set();
+
+    npy_intp size = data.size() / tp_descr->elsize;
+    py::handle<> result = py::handle<>(PyArray_NewFromDescr(
+        &PyArray_Type, tp_descr, 1, &size, /*strides*/ NULL,
+        /*data*/ NULL, 0, /*obj*/ NULL));
+
+    if (data.size())
+      memcpy(PyArray_DATA(result.get()), &data.front(), data.size());
+    return result;
+  }
+
+
+
+
+  template <class T>
+  py::handle<> vector_to_numpy(const std::vector<T> &data, int typenum)
+  {
+    npy_intp size = data.size();
+    py::handle<> result = py::handle<>(PyArray_SimpleNew(1, &size, typenum));
+
+    if (size)
+      memcpy(PyArray_DATA(result.get()), &data.front(), size*sizeof(T));
+    return result;
+  }
+
+
+
+
+  py::dict py_build_packet_structure(
+      py::object indptr_py, py::object indices_py,
+      py::object data_py, py::object dtype,
+      py::object dof_to_packet_nr_py,
+      index_type packet_count, index_type threads_per_packet,
+      unsigned worker_count)
+  {
+    size_t size;
+
+    const index_type *dof_to_packet_nr = reinterpret_cast<const index_type *>(
+        get_read_buffer(dof_to_packet_nr_py, 0, size));
+    const index_type row_count = size / sizeof(index_type);
+
+    const index_type *indptr = reinterpret_cast<const index_type *>(
+        get_read_buffer(indptr_py, (row_count+1)*sizeof(index_type), size));
+    const index_type nnz = indptr[row_count];
+    if (nnz < 0)
+      throw std::invalid_argument("invalid indptr");
+
+    const index_type *indices = reinterpret_cast<const index_type *>(
+        get_read_buffer(indices_py, nnz*sizeof(index_type), size));
+
+    const size_t value_size = py::extract<size_t>(dtype.attr("itemsize"));
+    const char *data = reinterpret_cast<const char *>(
+        get_read_buffer(data_py, nnz*value_size, size));
+
+    if (worker_count == 0)
+      worker_count = boost::thread::hardware_concurrency();
+
+    packet_structure result;
+    {
+      py_gil_release no_gil;
+      build_packet_structure(result, row_count, indptr, indices, data,
+          value_size, dof_to_packet_nr, packet_count, threads_per_packet,
+          worker_count);
+    }
+
+    py::dict py_result;
+
+#define PYCUDA_EXPORT_INDEX_VECTOR(NAME, TYPENUM) \
+    py_result[#NAME] = py::object(vector_to_numpy(result.NAME, TYPENUM))
+
+    PYCUDA_EXPORT_INDEX_VECTOR(new2old_fetch_indices, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(old2new_fetch_indices, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(packet_base_rows, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(local_row_costs, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(remaining_rows, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(remaining_cols, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(thread_row_starts, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(thread_rows, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(thread_costs, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(thread_starts, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(thread_ends, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(remaining_sources, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(data_sources, NPY_INT32);
+    PYCUDA_EXPORT_INDEX_VECTOR(index_array, NPY_UINT32);
+
+#undef PYCUDA_EXPORT_INDEX_VECTOR
+
+    py_result["remaining_data"] = py::object(
+        bytes_to_numpy(result.remaining_data, dtype));
+    py_result["data_array"] = py::object(
+        bytes_to_numpy(result.data_array, dtype));
+    py_result["max_thread_costs"] = result.max_thread_costs;
+
+    return py_result;
+  }
+
+
+
+
+  void py_expand_csr_rows(py::object indptr_py, py::object rows_py,
+      unsigned worker_count)
+  {
+    size_t size;
+
+    const index_type *indptr = reinterpret_cast<const index_type *>(
+        get_read_buffer(indptr_py, sizeof(index_type), size));
+    const index_type row_count = size / sizeof(index_type) - 1;
+
+    void *rows_buf;
+    PYCUDA_BUFFER_SIZE_T rows_len;
+    if (PyObject_AsWriteBuffer(rows_py.ptr(), &rows_buf, &rows_len))
+      throw py::error_already_set();
+    if (size_t(rows_len) < std::max(indptr[row_count], 0)*sizeof(index_type))
+      throw std::invalid_argument("rows buffer too small");
+
+    if (worker_count == 0)
+      worker_count = boost::thread::hardware_concurrency();
+
+    {
+      py_gil_release no_gil;
+      expand_csr_rows(row_count, indptr,
+          reinterpret_cast<index_type *>(rows_buf), worker_count);
+    }
+  }
+
+
+
+
+  py::tuple py_partition_graph(py::object xadj_py, py::object adjncy_py,
+      index_type max_part_size, unsigned worker_count)
+  {
+    size_t size;
+
+    const index_type *xadj = reinterpret_cast<const index_type *>(
+        get_read_buffer(xadj_py, sizeof(index_type), size));
+    const index_type vertex_count = size / sizeof(index_type) - 1;
+
+    const index_type *adjncy = reinterpret_cast<const index_type *>(
+        get_read_buffer(adjncy_py,
+          std::max(xadj[vertex_count], 0)*sizeof(index_type), size));
+
+    if (worker_count == 0)
+      worker_count = boost::thread::hardware_concurrency();
+
+    std::vector<index_type> part_of_vertex;
+    index_type part_count;
+    {
+      py_gil_release no_gil;
+      part_count = partition_graph(vertex_count, xadj, adjncy,
+          max_part_size, worker_count, part_of_vertex);
+    }
+
+    return py::make_tuple(part_count,
+        py::object(vector_to_numpy(part_of_vertex, NPY_INT32)));
+  }
+}
+
+
+
+
+void pycuda_expose_sparse()
+{
+  using py::arg;
+
+  py::def("_build_packet_structure", py_build_packet_structure,
+      (arg("indptr"), arg("indices"), arg("data"), arg("dtype"),
+       arg("dof_to_packet_nr"), arg("packet_count"),
+       arg("threads_per_packet"), arg("worker_count")=0));
+  py::def("_expand_csr_rows", py_expand_csr_rows,
+      (arg("indptr"), arg("rows"), arg("worker_count")=0));
+  py::def("_partition_graph", py_partition_graph,
+      (arg("xadj"), arg("adjncy"), arg("max_part_size"),
+       arg("worker_count")=0));
+}
+
+// vim: foldmethod=marker
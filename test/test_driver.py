@@ -576,6 +576,93 @@ class TestDriver:
         a = drv.aligned_empty((2**20,), np.float64, alignment=4096)
         drv.register_host_memory(a)
 
+    @mark_cuda_test
+    def test_lazy_module_and_function_cache(self):
+        # count module loads by wrapping the loader SourceModule uses
+        load_count = [0]
+        orig_module_from_buffer = drv.module_from_buffer
+
+        def counting_module_from_buffer(*args, **kwargs):
+            load_count[0] += 1
+            return orig_module_from_buffer(*args, **kwargs)
+
+        drv.module_from_buffer = counting_module_from_buffer
+        try:
+            mod = SourceModule("""
+            __global__ void twice(float *a)
+            {
+              a[threadIdx.x] *= 2;
+            }
+            """, lazy=True)
+
+            assert load_count[0] == 0
+
+            twice = mod.get_function("twice")
+            assert load_count[0] == 1
+
+            twice.prepare("P")
+            assert mod.get_function("twice") is twice
+            assert mod.get_function("twice").arg_format == twice.arg_format
+            assert load_count[0] == 1
+        finally:
+            drv.module_from_buffer = orig_module_from_buffer
+
+        a = np.random.randn(32).astype(np.float32)
+        a_gpu = drv.to_device(a)
+        mod.get_function("twice").prepared_call((1, 1), (32, 1, 1), a_gpu)
+        assert la.norm(drv.from_device_like(a_gpu, a) - 2*a) == 0
+
+    @mark_cuda_test
+    def test_ptx_module(self):
+        if drv.get_version() < (5,):
+            from py.test import skip
+            skip("PTX ISA 3.0 requires CUDA 5.0 and later")
+
+        from pycuda.characterize import platform_bits
+        from pycuda.compiler import PTXModule
+
+        if platform_bits() == 64:
+            ptr, wide = "u64", "mul.wide.u32 %rd3, %r1, 4;"
+        else:
+            ptr, wide = "u32", "mul.lo.u32 %rd3, %r1, 4;"
+
+        ptx = """
+            .version 3.0
+            .target sm_20
+            .address_size %(bits)d
+
+            .visible .entry store_tid(.param .%(ptr)s dest)
+            {
+                .reg .u32 %%r<2>;
+                .reg .%(ptr)s %%rd<4>;
+
+                ld.param.%(ptr)s %%rd1, [dest];
+                cvta.to.global.%(ptr)s %%rd2, %%rd1;
+                mov.u32 %%r1, %%tid.x;
+                %(wide)s
+                add.%(ptr)s %%rd2, %%rd2, %%rd3;
+                st.global.u32 [%%rd2], %%r1;
+                ret;
+            }
+            """ % dict(bits=platform_bits(), ptr=ptr, wide=wide)
+
+        messages = []
+
+        def handler(success, info, error):
+            messages.append((success, info, error))
+
+        for cache_dir in [None, False]:
+            mod = PTXModule(ptx, optimization_level=3, cache_dir=cache_dir,
+                    message_handler=handler)
+            store_tid = mod.get_function("store_tid")
+
+            dest = np.zeros(64, np.uint32)
+            store_tid(drv.Out(dest), block=(64, 1, 1))
+            assert (dest == np.arange(64)).all()
+
+        for success, info, error in messages:
+            assert success
+
 
 def test_import_pyopencl_before_pycuda():
     try:
@@ -282,6 +282,245 @@ class TestGPUArray:
             if get_curand_version() >= (5, 0, 0):
                 gen.gen_poisson(10000, np.uint32, 13.0)
 
+    @mark_cuda_test
+    def test_curand_state(self):
+        from pycuda.curandom import get_curand_version
+        if get_curand_version() is None or get_curand_version() < (3, 2, 0):
+            from pytest import skip
+            skip("curand not installed")
+
+        from pycuda.curandom import (XORWOWRandomNumberGenerator,
+                seed_getter_unique)
+
+        gen = XORWOWRandomNumberGenerator(seed_getter_unique)
+        gen2 = XORWOWRandomNumberGenerator(seed_getter_unique)
+        assert gen.module is gen2.module
+
+        state = gen.get_state()
+
+        from tempfile import TemporaryFile
+        state_file = TemporaryFile()
+        gen.save_state(state_file)
+
+        x = gen.gen_uniform(10000, np.float32).get()
+
+        gen.set_state(state)
+        assert (gen.gen_uniform(10000, np.float32).get() == x).all()
+
+        state_file.seek(0)
+        gen3 = XORWOWRandomNumberGenerator(saved_state=state_file)
+        assert (gen3.gen_uniform(10000, np.float32).get() == x).all()
+
+        gen3 = XORWOWRandomNumberGenerator(saved_state=state)
+        assert (gen3.gen_uniform(10000, np.float32).get() == x).all()
+
+    def test_philox_known_answers(self):
+        from pycuda.curandom import philox4x32_10, philox_reference_words
+
+        # known-answer vectors from the Random123 distribution
+        kat = [
+                ([0, 0, 0, 0], [0, 0],
+                    [0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8]),
+                ([0xffffffff]*4, [0xffffffff]*2,
+                    [0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd]),
+                ([0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344],
+                    [0xa4093822, 0x299f31d0],
+                    [0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1]),
+                ]
+
+        for counter, key, expected in kat:
+            assert philox4x32_10(counter, key) == expected
+
+        words = philox_reference_words(3, (17, 23), counter_base=2**32-1,
+                subsequence=5*2**32+7)
+        for i in range(3):
+            c = 2**32-1+i
+            assert list(words[i]) == philox4x32_10(
+                    [c & 0xffffffff, c >> 32, 7, 5], (17, 23))
+
+    @mark_cuda_test
+    def test_philox_random(self):
+        from pycuda.curandom import (PhiloxRandomNumberGenerator,
+                philox_reference_words)
+
+        seed = 0x123456789abcdef
+        key = (seed & 0xffffffff, seed >> 32)
+
+        gen = PhiloxRandomNumberGenerator(seed, subsequence=3, offset=10)
+        x = gen.gen_uniform(10001, np.uint32).get()
+        ref = philox_reference_words(2501, key, 10, 3).ravel()[:10001]
+        assert (x == ref).all()
+        assert gen.offset == 10 + 2501
+
+        # results do not depend on how the values are requested
+        gen = PhiloxRandomNumberGenerator(seed, subsequence=3, offset=10)
+        x1 = gen.gen_uniform(4000, np.uint32).get()
+        gen.skip_ahead(500)
+        x2 = gen.gen_uniform(1001, np.uint32).get()
+        assert (x1 == ref[:4000]).all()
+        assert (x2 == ref[6000:7001]).all()
+
+        gen = PhiloxRandomNumberGenerator(seed)
+        x = gen.gen_uniform(10000, np.float32).get()
+        ref = philox_reference_words(2500, key).ravel()
+        assert (x == (ref.astype(np.float32)*np.float32(2**-32)
+                + np.float32(2**-33))).all()
+        assert (0 < x).all()
+        assert (x <= 1).all()
+
+        if has_double_support():
+            dtypes = [np.float32, np.float64]
+        else:
+            dtypes = [np.float32]
+
+        for dtype in dtypes:
+            x = gen.gen_uniform(10001, dtype).get()
+            assert (0 < x).all()
+            assert (x <= 1).all()
+
+            x = gen.gen_normal(100001, dtype).get()
+            assert abs(np.mean(x)) < 0.02
+            assert abs(np.std(x) - 1) < 0.02
+
+    @mark_cuda_test
+    def test_fused_random(self):
+        from pycuda.curandom import (PhiloxRandomNumberGenerator,
+                philox_reference_words)
+        from pycuda.elementwise import ElementwiseKernel
+        from pycuda.reduction import ReductionKernel
+
+        seed = 0xfedcba987654321
+        key = (seed & 0xffffffff, seed >> 32)
+        n = 10001
+
+        knl = ElementwiseKernel(
+                "philox_rng rng, unsigned int *bits, float *z",
+                "bits[i] = rand_bits(); z[i] = rand_normal()",
+                "fused_random")
+
+        gen = PhiloxRandomNumberGenerator(seed, subsequence=5, offset=7)
+        bits = gpuarray.empty(n, np.uint32)
+        z = gpuarray.empty(n, np.float32)
+        knl(gen, bits, z)
+        assert gen.offset == 7 + n
+
+        ref = philox_reference_words(n, key, 7, 5)
+        assert (bits.get() == ref[:, 0]).all()
+
+        z = z.get()
+        assert abs(np.mean(z)) < 0.05
+        assert abs(np.std(z) - 1) < 0.05
+
+        # the random numbers of an entry do not depend on the launch
+        knl(gen, bits, z, range=slice(3, n, 2))
+        ref = philox_reference_words(n, key, 7 + n, 5)
+        assert (bits.get()[3::2] == ref[3::2, 0]).all()
+
+        # Monte Carlo estimate of pi
+        mc = ReductionKernel(np.float32, neutral="0", reduce_expr="a+b",
+                map_expr="x[i]*in_circle(rand_uniform(), rand_uniform())",
+                arguments="float *x, philox_rng rng",
+                preamble="""
+                __device__ float in_circle(float u, float v)
+                { return u*u + v*v <= 1 ? 4 : 0; }
+                """)
+
+        x = gpuarray.zeros(2**20, np.float32) + 1
+        est = mc(x, gen).get() / x.size
+        assert abs(est - np.pi) < 0.01
+        assert gen.offset == 7 + 2*n + x.size
+
+    def test_sobol_tables(self):
+        from pycuda.curandom import (generate_sobol_direction_vectors,
+                generate_sobol_digital_shifts)
+        import pycuda._driver as _drv
+
+        # the number of primitive polynomials of degree 1..8
+        polys = _drv._sobol_primitive_polynomials(55)
+        degrees = [len(bin(p)) - 3 for p in polys]
+        assert [degrees.count(d) for d in range(1, 9)] == [
+                1, 1, 2, 2, 6, 6, 18, 16]
+
+        # dimension 0 is the van der Corput sequence
+        dim_degrees = [1] + degrees
+
+        def get_points(vectors, m):
+            # the first 2^m points, as integers
+            points = np.zeros(2**m, dtype=vectors.dtype)
+            for j in range(m):
+                points ^= np.where((np.arange(2**m) >> j) & 1,
+                        vectors[j], 0).astype(vectors.dtype)
+            return points
+
+        def get_leading_bits(points, k, bits):
+            if k == 0:
+                return np.zeros(len(points), dtype=np.int64)
+            return (points >> points.dtype.type(bits - k)).astype(np.int64)
+
+        def check_net(vectors, dim_a, dim_b, bits):
+            # The projection onto two dimensions is a (t, 2)-sequence with
+            # t = (e_a - 1) + (e_b - 1), where e_i are the degrees of the
+            # polynomials: for m >= t, each box of 2^-k by 2^-(m-t-k) holds
+            # exactly 2^t of the first 2^m points.
+            t = (dim_degrees[dim_a] - 1) + (dim_degrees[dim_b] - 1)
+            for m in range(t, 11):
+                points_a = get_points(vectors[dim_a], m)
+                points_b = get_points(vectors[dim_b], m)
+                for k in range(m - t + 1):
+                    boxes = (get_leading_bits(points_a, k, bits)
+                            << (m - t - k)
+                            | get_leading_bits(points_b, m - t - k, bits))
+                    counts = np.bincount(boxes, minlength=2**(m-t))
+                    assert (counts == 2**t).all(), (dim_a, dim_b, m, k)
+
+        dim_pairs = [(0, 1), (0, 5), (1, 2), (2, 3), (3, 4), (1, 9)]
+
+        for bits in [32, 64]:
+            dtype = np.dtype("uint%d" % bits)
+
+            tables = []
+            for count in [300, 25000]:
+                v = np.empty((count, bits), dtype=dtype)
+                _drv._sobol_direction_vectors(v, count, bits)
+                tables.append(v)
+            small_v, v = tables
+
+            # tables for fewer dimensions are prefixes of larger ones
+            assert (small_v == v[:300]).all()
+
+            # dimensions do not repeat
+            assert len(set(tuple(row) for row in v)) == len(v)
+
+            assert (v[0] == (dtype.type(1)
+                << np.arange(bits-1, -1, -1).astype(dtype))).all()
+
+            # dimension 1 is fully determined by the polynomial x+1
+            standard_m = [1, 3, 5, 15, 17, 51, 85, 255, 257, 771, 1285, 3855]
+            assert [int(v[1, k] >> dtype.type(bits-1-k))
+                    for k in range(len(standard_m))] == standard_m
+
+            for dim_a, dim_b in dim_pairs:
+                check_net(v, dim_a, dim_b, bits)
+
+            # linear matrix scrambles preserve the net property
+            sv = v[:300].copy()
+            _drv._sobol_scramble_direction_vectors(sv, 300, bits, 17)
+            assert (sv != v[:300]).any()
+            for dim_a, dim_b in dim_pairs:
+                check_net(sv, dim_a, dim_b, bits)
+
+            gpu_v = generate_sobol_direction_vectors(1000, bits).get()
+            assert gpu_v.shape == (1000, bits)
+            assert gpu_v.dtype == dtype
+            assert (gpu_v == v[:1000]).all()
+            assert (generate_sobol_direction_vectors(300, bits,
+                scramble_seed=17).get() == sv).all()
+
+            shifts = generate_sobol_digital_shifts(100, bits, seed=3).get()
+            assert shifts.shape == (100,)
+            assert shifts.dtype == dtype
+            assert len(np.unique(shifts)) == 100
+
     @mark_cuda_test
     def test_array_gt(self):
         """Test whether array contents are > the other array's
@@ -428,6 +667,171 @@ class TestGPUArray:
 
             assert la.norm(a_cpu - a_gpu.get()) == 0, i
 
+    @mark_cuda_test
+    def test_vectorized_elwise_kernel(self):
+        from pycuda.elementwise import ElementwiseKernel
+
+        for dtype, ctype in [(np.float32, "float"), (np.float64, "double"),
+                (np.int16, "short")]:
+            lin_comb = ElementwiseKernel(
+                    "%(tp)s a, %(tp)s *x, %(tp)s *y, %(tp)s *z" % {"tp": ctype},
+                    "z[i] = a*x[i] + y[i]", "lin_comb_vec")
+            assert lin_comb.get_max_vector_width() > 1
+
+            # aligned, with and without remainder, and misaligned
+            for n, start in [(4096, 0), (1001, 0), (1001, 1)]:
+                x = (np.random.rand(n)*10).astype(dtype)
+                y = (np.random.rand(n)*10).astype(dtype)
+                x_gpu = gpuarray.to_gpu(x)[start:]
+                y_gpu = gpuarray.to_gpu(y)[start:]
+                z_gpu = gpuarray.empty_like(x_gpu)
+
+                lin_comb(3, x_gpu, y_gpu, z_gpu)
+                assert (z_gpu.get() == (3*x + y)[start:]).all()
+
+        # in-place updates must load the vector they overwrite
+        for operation, ref in [
+                ("x[i] = a*x[i] + y[i]", lambda x, y: 3*x + y),
+                ("x[i] += a*y[i]", lambda x, y: x + 3*y),
+                ("x[i] = y[i]; x[i] *= a", lambda x, y: 3*y),
+                ]:
+            update = ElementwiseKernel("float a, float *x, float *y",
+                    operation, "update_vec")
+            assert update.get_max_vector_width() > 1
+
+            for n, start in [(4096, 0), (1001, 1)]:
+                x = np.random.randint(0, 10, n).astype(np.float32)
+                y = np.random.randint(0, 10, n).astype(np.float32)
+                x_gpu = gpuarray.to_gpu(x)[start:]
+                y_gpu = gpuarray.to_gpu(y)[start:]
+
+                update(3, x_gpu, y_gpu)
+                assert (x_gpu.get() == ref(x, y)[start:]).all(), operation
+
+        shift = ElementwiseKernel("float *x, float *z", "z[i] = x[i+1]")
+        assert shift.get_max_vector_width() == 1
+
+    def test_vectorized_loop_loads(self):
+        from pycuda.elementwise import _get_vectorized_loop
+        from pycuda.tools import VectorArg, ScalarArg
+
+        arguments = [ScalarArg(np.float32, "a"),
+                VectorArg(np.float32, "x"), VectorArg(np.float32, "y")]
+
+        def is_loaded(operation, name):
+            loop = _get_vectorized_loop(arguments, operation, 4)
+            return ("%s_pycuda_vv = ((const float4 *) %s)[vi]" % (name, name)
+                    in loop)
+
+        assert not is_loaded("x[i] = a*y[i]", "x")
+        assert is_loaded("x[i] = a*y[i]", "y")
+        assert is_loaded("x[i] = a*x[i] + y[i]", "x")
+        assert is_loaded("x[i] += y[i]", "x")
+        assert is_loaded("x[i] = y[i]; x[i] *= a", "x")
+
+    @mark_cuda_test
+    def test_noncontiguous_elwise_and_reduction(self):
+        from pycuda.elementwise import ElementwiseKernel
+        from pycuda.reduction import ReductionKernel
+
+        lin_comb = ElementwiseKernel(
+                "float a, float *x, float *y, float *z",
+                "z[i] = a*x[i] + y[i]", "lin_comb_strided")
+        dot = ReductionKernel(np.float32, neutral="0",
+                reduce_expr="a+b", map_expr="x[i]*y[i]",
+                arguments="float *x, float *y")
+
+        x = np.random.randn(60, 70).astype(np.float32)
+        y = np.random.randn(60, 70).astype(np.float32)
+        x_gpu = gpuarray.to_gpu(x)
+        y_gpu = gpuarray.to_gpu(y)
+
+        for x_view, y_view, x_sub, y_sub in [
+                (x_gpu[:, ::2], y_gpu[:, 1::2], x[:, ::2], y[:, 1::2]),
+                (x_gpu[::3, 5:], y_gpu[10:30, 5:], x[::3, 5:], y[10:30, 5:]),
+                (x_gpu[:, 3:40], y_gpu[:, 3:40], x[:, 3:40], y[:, 3:40]),
+                ]:
+            z_gpu = gpuarray.empty(x_sub.shape, np.float32)
+            lin_comb(2, x_view, y_view, z_gpu)
+            assert la.norm(z_gpu.get() - (2*x_sub + y_sub)) < 1e-5
+
+            dot_ref = np.sum(x_sub*y_sub)
+            assert abs(dot(x_view, y_view).get() - dot_ref) < 1e-4*x_sub.size
+
+        # strided output, updated in place
+        scale = ElementwiseKernel("float a, float *x",
+                "x[i] = a*x[i]", "scale_strided")
+        z = np.random.randn(60, 70).astype(np.float32)
+        z_gpu = gpuarray.to_gpu(z)
+        scale(3, z_gpu[1::2, ::5])
+        z[1::2, ::5] *= 3
+        assert la.norm(z_gpu.get() - z) < 1e-5
+
+    def test_specialization_policy(self):
+        from pycuda.tools import SpecializationPolicy
+
+        policy = SpecializationPolicy(threshold=3, max_specializations=2)
+        assert [policy.should_specialize(100) for i in range(4)] == [
+                False, False, True, True]
+
+        assert policy.should_specialize(200) is False
+        assert policy.should_specialize(200) is False
+        assert policy.should_specialize(200) is True
+
+        # the cap is reached, further sizes are never specialized
+        assert [policy.should_specialize(300) for i in range(4)] == [
+                False]*4
+        assert policy.specialized_keys == set([100, 200])
+
+        # usage counts are forgotten once too many keys are tracked
+        policy = SpecializationPolicy(threshold=2)
+        policy.max_tracked_keys = 2
+        assert policy.should_specialize(1) is False
+        assert policy.should_specialize(2) is False
+        assert policy.should_specialize(3) is False
+        assert policy.usage_counts == {3: 1}
+        assert policy.should_specialize(1) is False
+        assert policy.should_specialize(1) is True
+
+        from pytest import raises
+        raises(ValueError, SpecializationPolicy, threshold=0)
+
+        from pycuda.elementwise import get_elwise_source
+        from pycuda.tools import VectorArg
+        arguments = [VectorArg(np.float32, "x")]
+        source = get_elwise_source(arguments, "x[i] = 0", "zero")
+        assert "gridDim.x*blockDim.x" in source
+
+        source = get_elwise_source(arguments, "x[i] = 0", "zero",
+                static_n=12345, static_total_threads=256)
+        assert "gridDim.x*blockDim.x" not in source
+        assert "const unsigned long n = 12345ul;" in source
+        assert "const unsigned total_threads = 256u;" in source
+        assert "zero(float *x)" in source
+
+    @mark_cuda_test
+    def test_specialized_kernels(self):
+        from pycuda.tools import SpecializationPolicy
+        from pycuda.elementwise import ElementwiseKernel
+        from pycuda.reduction import ReductionKernel
+
+        policy = SpecializationPolicy(threshold=2, max_specializations=1)
+        scale = ElementwiseKernel("float a, float *x, float *z",
+                "z[i] = a*x[i]", "scale", specialize=policy)
+        sum_knl = ReductionKernel(np.float32, "0", "a+b",
+                arguments="const float *in", specialize=True)
+
+        for n in [1000, 1000, 1000, 3000]:
+            a_gpu = gpuarray.to_gpu(np.random.randn(n).astype(np.float32))
+            z_gpu = gpuarray.empty_like(a_gpu)
+            scale(3, a_gpu, z_gpu)
+            assert la.norm((z_gpu - 3*a_gpu).get()) == 0
+
+            sum_a = np.sum(a_gpu.get())
+            assert abs(sum_knl(a_gpu).get() - sum_a) < 1e-3*n
+
+        assert len(policy.specialized_keys) == 1
+
     @mark_cuda_test
     def test_take(self):
         idx = gpuarray.arange(0, 10000, 2, dtype=np.uint32)
@@ -486,6 +890,63 @@ class TestGPUArray:
 
                 assert op_a_gpu == op_a, (op_a_gpu, op_a, dtype, what)
 
+    def test_axis_reduction_plan(self):
+        from pycuda.reduction import get_axis_layout, get_axis_reduction_plan
+
+        # C order, middle axis: the kept axes stay separate
+        assert get_axis_layout((4, 5, 6), (120, 24, 4), 1, 4) == (
+                (4, 6), (30, 1), 5, 6)
+        # C order, last axis: the kept axes collapse
+        assert get_axis_layout((4, 5, 6), (120, 24, 4), 2, 4) == (
+                (20,), (6,), 6, 1)
+        # Fortran order
+        assert get_axis_layout((4, 5, 6), (4, 16, 80), 2, 4) == (
+                (4, 5), (1, 4), 6, 20)
+        # every other row of a matrix
+        assert get_axis_layout((30, 70), (1120, 8), 0, 8) == (
+                (70,), (1,), 30, 140)
+
+        # many short contiguous rows: a warp per row
+        assert get_axis_reduction_plan(1000, 100, 1) == ("rows", 32, 125)
+        # few long contiguous rows: a block per row
+        assert get_axis_reduction_plan(10, 10**5, 1) == ("rows", 256, 10)
+        # rows shorter than a warp, and strided rows: an output per thread
+        assert get_axis_reduction_plan(10**6, 3, 1) == ("columns", 8, 4096)
+        assert get_axis_reduction_plan(100, 10, 100) == ("columns", 8, 4)
+
+    @mark_cuda_test
+    def test_axis_reductions(self):
+        from pycuda.reduction import ReductionKernel
+
+        x = np.random.randint(-100, 100, (30, 70, 500)).astype(np.float32)
+        x_gpu = gpuarray.to_gpu(x)
+
+        for x_view, x_sub in [
+                (x_gpu, x),
+                (x_gpu[::2, 5:, 1:2], x[::2, 5:, 1:2]),
+                (x_gpu[3, :, :5], x[3, :, :5]),
+                (x_gpu[7], x[7]),
+                ]:
+            for axis in range(-1, len(x_sub.shape)):
+                result = gpuarray.sum(x_view, axis=axis).get()
+                assert result.shape == np.sum(x_sub, axis=axis).shape
+                assert (result == np.sum(x_sub, axis=axis)).all()
+
+                for what in ["min", "max"]:
+                    result = getattr(gpuarray, what)(x_view, axis=axis).get()
+                    assert (result == getattr(np, what)(x_sub, axis=axis)).all()
+
+        y = np.random.randint(-100, 100, (1, 100000)).astype(np.float32)
+        assert (gpuarray.sum(gpuarray.to_gpu(y), axis=1).get()
+                == np.sum(y, axis=1)).all()
+
+        row_dot = ReductionKernel(np.float32, neutral="0",
+                reduce_expr="a+b", map_expr="x[i]*y[i]",
+                arguments="const float *x, const float *y", axis=1)
+        y = np.random.randint(-100, 100, x[0].shape).astype(np.float32)
+        assert (row_dot(x_gpu[0], gpuarray.to_gpu(y)).get()
+                == np.sum(x[0]*y, axis=1)).all()
+
     @mark_cuda_test
     def test_subset_minmax(self):
         from pycuda.curandom import rand as curand
@@ -707,26 +1168,317 @@ class TestGPUArray:
     def test_scan(self):
         from pycuda.scan import ExclusiveScanKernel, InclusiveScanKernel
         for cls in [ExclusiveScanKernel, InclusiveScanKernel]:
-            scan_kern = cls(np.int32, "a+b", "0")
-
-            for n in [
-                    10, 2**10-5, 2**10,
-                    2**20-2**18,
-                    2**20-2**18+5,
-                    2**10+5,
-                    2**20+5,
-                    2**20, 2**24
-                    ]:
-                host_data = np.random.randint(0, 10, n).astype(np.int32)
-                gpu_data = gpuarray.to_gpu(host_data)
+            for single_pass in [False, True]:
+                scan_kern = cls(np.int32, "a+b", "0", single_pass=single_pass)
+
+                for n in [
+                        10, 2**10-5, 2**10,
+                        2**20-2**18,
+                        2**20-2**18+5,
+                        2**10+5,
+                        2**20+5,
+                        2**20, 2**24
+                        ]:
+                    host_data = np.random.randint(0, 10, n).astype(np.int32)
+                    gpu_data = gpuarray.to_gpu(host_data)
+
+                    scan_kern(gpu_data)
+
+                    desired_result = np.cumsum(host_data, axis=0)
+                    if cls is ExclusiveScanKernel:
+                        desired_result -= host_data
 
-                scan_kern(gpu_data)
+                    assert (gpu_data.get() == desired_result).all()
 
-                desired_result = np.cumsum(host_data, axis=0)
-                if cls is ExclusiveScanKernel:
-                    desired_result -= host_data
+    @mark_cuda_test
+    def test_scan_streams(self):
+        from pycuda.scan import InclusiveScanKernel, GenericScanKernel
+
+        scan_kern = InclusiveScanKernel(np.int32, "a+b", single_pass=True)
+        generic_kern = GenericScanKernel(np.int32,
+                arguments="int *ary, int *out",
+                input_expr="ary[i]", scan_expr="a+b", neutral="0",
+                output_statement="out[i] = prev_item", single_pass=True)
+
+        n = 2**22 + 5
+        round_count = 3
+        streams = [drv.Stream(), drv.Stream()]
+        host_data = [np.random.randint(0, 10, n).astype(np.int32)
+                for stream in streams]
+        gpu_data = [gpuarray.to_gpu(ary) for ary in host_data]
+        results = [
+                [(gpuarray.empty(n, np.int32), gpuarray.empty(n, np.int32))
+                    for i in range(round_count)]
+                for stream in streams]
+
+        # interleave launches on both streams without synchronizing
+        for i in range(round_count):
+            for stream, data, stream_results in zip(
+                    streams, gpu_data, results):
+                inclusive, exclusive = stream_results[i]
+                scan_kern(data, inclusive, stream=stream)
+                generic_kern(data, exclusive, stream=stream)
+
+        for stream in streams:
+            stream.synchronize()
+
+        if scan_kern.single_pass:
+            assert len(scan_kern.tile_status.buffers) == len(streams)
+
+        for data, stream_results in zip(host_data, results):
+            desired_result = np.cumsum(data, axis=0)
+            for inclusive, exclusive in stream_results:
+                assert (inclusive.get() == desired_result).all()
+                assert (exclusive.get() == desired_result - data).all()
+
+    def test_scan_sources(self):
+        from pycuda.scan import (get_generic_scan_sources,
+                get_scan_launch_plan, get_scan_wg_seq_batches,
+                get_single_pass_scan_plan)
+
+        sources = get_generic_scan_sources(np.float64,
+                "double *x, int *flags, double *out, double *total",
+                "x[i]", "a+b",
+                "out[i] = prev_item; if (i == N-1) total[0] = last_item",
+                neutral="0", is_segment_start_expr="flags[i]")
+
+        assert "pycuda_scan_combine" in sources["scan_intervals"]
+        assert "scan_scan_group_results" in sources["scan_intervals"]
+        assert "IS_SEGMENT_START(i)" in sources["final_update"]
+        assert "last_item" in sources["final_update"]
+        assert sources["single_pass"] is None
+
+        sources = get_generic_scan_sources(np.int32,
+                "int *x, int *out", "x[i]", "a+b", "out[i] = prev_item",
+                neutral="0")
+        assert "_scan_single_pass" in sources["single_pass"]
+
+        from pytest import raises
+        raises(ValueError, get_generic_scan_sources, np.float32,
+                "float *x, float *out", "x[i]", "a+b", "out[i] = prev_item")
+
+        assert get_scan_wg_seq_batches(4) == 6
+        assert get_scan_wg_seq_batches(32) == 2
+        raises(ValueError, get_scan_wg_seq_batches, 128)
+
+        for n in [1, 767, 768, 769, 10**5, 2**24+5]:
+            interval_size, num_groups = get_scan_launch_plan(n, 14)
+            assert interval_size % (128*6) == 0
+            assert num_groups <= 3*14
+            assert (num_groups-1)*interval_size < n <= num_groups*interval_size
+
+            tile_count, grid = get_single_pass_scan_plan(n)
+            assert (tile_count-1)*128*6 < n <= tile_count*128*6
+            assert max(grid) <= 65535
+            assert tile_count <= grid[0]*grid[1] < tile_count + grid[0]
+
+    @mark_cuda_test
+    def test_generic_scan(self):
+        from pycuda.scan import GenericScanKernel
+
+        n = 2**20+5
+        x = np.random.randint(0, 10, n).astype(np.int32)
+        flags = (np.random.rand(n) < 0.001).astype(np.int32)
+        flags_gpu = gpuarray.to_gpu(flags)
+
+        desired = np.empty_like(x)
+        starts = list(np.nonzero(flags)[0]) + [n]
+        if starts[0] != 0:
+            starts.insert(0, 0)
+        for start, end in zip(starts[:-1], starts[1:]):
+            desired[start:end] = np.cumsum(x[start:end])
+
+        # segmented inclusive scan, in place
+        for single_pass in [False, True]:
+            x_gpu = gpuarray.to_gpu(x)
+            knl = GenericScanKernel(np.int32, "int *x, int *flags",
+                    "x[i]", "a+b", "x[i] = item",
+                    is_segment_start_expr="flags[i]",
+                    single_pass=single_pass)
+            knl(x_gpu, flags_gpu)
+            assert (x_gpu.get() == desired).all()
+
+        # exclusive scan with total, as used by stream compaction
+        out_gpu = gpuarray.empty_like(flags_gpu)
+        total_gpu = gpuarray.empty(1, np.int32)
+        knl = GenericScanKernel(np.int32, "int *flags, int *out, int *total",
+                "flags[i]", "a+b",
+                "out[i] = prev_item; if (i == N-1) total[0] = last_item",
+                neutral="0")
+        knl(flags_gpu, out_gpu, total_gpu)
+
+        assert (out_gpu.get() == np.cumsum(flags) - flags).all()
+        assert total_gpu.get()[0] == flags.sum()
+
+        # scan over pairs of arrays
+        y = np.random.rand(n).astype(np.float32)
+        z = np.random.rand(n).astype(np.float32)
+        y_gpu = gpuarray.to_gpu(y)
+        z_gpu = gpuarray.to_gpu(z)
+        max_y_gpu = gpuarray.empty_like(y_gpu)
+        min_z_gpu = gpuarray.empty_like(z_gpu)
+        knl = GenericScanKernel(gpuarray.vec.float2,
+                "float *y, float *z, float *max_y, float *min_z",
+                "make_float2(y[i], z[i])",
+                "make_float2(fmaxf(a.x, b.x), fminf(a.y, b.y))",
+                "max_y[i] = item.x; min_z[i] = item.y")
+        knl(y_gpu, z_gpu, max_y_gpu, min_z_gpu)
+
+        assert (max_y_gpu.get() == np.maximum.accumulate(y)).all()
+        assert (min_z_gpu.get() == np.minimum.accumulate(z)).all()
+
+    @mark_cuda_test
+    def test_algorithm(self):
+        from pycuda.algorithm import copy_if, remove_if, partition, unique
+
+        n = 2**20+5
+        x = np.random.randint(0, 100, n).astype(np.int32)
+        payload = np.random.rand(n).astype(np.float32)
+        x_gpu = gpuarray.to_gpu(x)
+        payload_gpu = gpuarray.to_gpu(payload)
+
+        selected = x % 3 == 0
+
+        out_gpu, count_gpu = copy_if(x_gpu, "ary[i] % 3 == 0")
+        count = int(count_gpu.get())
+        assert count == selected.sum()
+        assert (out_gpu.get()[:count] == x[selected]).all()
+
+        (out_gpu, out_payload_gpu), count_gpu = remove_if(
+                (x_gpu, payload_gpu), "ary0[i] % 3 == 0")
+        count = int(count_gpu.get())
+        assert count == n - selected.sum()
+        assert (out_gpu.get()[:count] == x[~selected]).all()
+        assert (out_payload_gpu.get()[:count] == payload[~selected]).all()
+
+        threshold = np.int32(50)
+        out_true_gpu, out_false_gpu, count_gpu = partition(
+                x_gpu, "ary[i] < threshold", [("threshold", threshold)])
+        count = int(count_gpu.get())
+        assert count == (x < threshold).sum()
+        assert (out_true_gpu.get()[:count] == x[x < threshold]).all()
+        assert (out_false_gpu.get()[:n-count] == x[x >= threshold]).all()
+
+        sorted_x = np.sort(x)
+        out_gpu, count_gpu = unique(gpuarray.to_gpu(sorted_x))
+        count = int(count_gpu.get())
+        assert (out_gpu.get()[:count] == np.unique(sorted_x)).all()
+
+    def test_radix_sort_key_bits(self):
+        from pycuda.algorithm import (get_radix_sort_key_bits,
+                get_radix_sort_plan)
+
+        assert get_radix_sort_plan(32) == [0, 8, 16, 24]
+        assert get_radix_sort_plan(64, 4, 3, 18) == [3, 7, 11, 15]
+        assert get_radix_sort_plan(32, 2, 5, 5) == []
+
+        from pytest import raises
+        raises(ValueError, get_radix_sort_plan, 32, 0)
+        raises(ValueError, get_radix_sort_plan, 32, 9)
+
+        for dtype in [np.int32, np.uint32, np.int64, np.uint64,
+                np.float32, np.float64]:
+            if np.dtype(dtype).kind == "f":
+                x = (np.random.randn(10000)*1e3).astype(dtype)
+                x[:2] = [-np.inf, np.inf]
+            else:
+                info = np.iinfo(dtype)
+                x = np.random.randint(-2**31 if info.min else 0, 2**31-1,
+                        10000).astype(dtype)
+                x[:2] = [info.min, info.max]
+
+            # simulate the passes of the sort on the CPU
+            bits = get_radix_sort_key_bits(x)
+            perm = np.arange(x.size)
+            for shift in get_radix_sort_plan(8*x.dtype.itemsize):
+                digits = (bits[perm] >> bits.dtype.type(shift)) & 255
+                perm = perm[np.argsort(digits, kind="mergesort")]
+
+            assert (perm == np.argsort(x, kind="mergesort")).all()
+
+    @mark_cuda_test
+    def test_radix_sort(self):
+        from pycuda.algorithm import radix_sort, segmented_radix_sort
+
+        n = 2**18+5
+        payload = np.arange(n, dtype=np.int32)
+        payload_gpu = gpuarray.to_gpu(payload)
+
+        for dtype in [np.int32, np.uint64, np.float32, np.float64]:
+            if np.dtype(dtype).kind == "f":
+                x = np.random.randn(n).astype(dtype)
+            else:
+                x = np.random.randint(-1000 if dtype == np.int32 else 0, 1000,
+                        n).astype(dtype)
+            x_gpu = gpuarray.to_gpu(x)
+
+            perm = np.argsort(x, kind="mergesort")
+            assert (radix_sort(x_gpu).get() == x[perm]).all()
+
+            for bits_per_pass in [1, 4, 8]:
+                keys_gpu, values_gpu = radix_sort((x_gpu, payload_gpu),
+                        bits_per_pass=bits_per_pass)
+                assert (keys_gpu.get() == x[perm]).all()
+                assert (values_gpu.get() == perm).all()
+
+        x = np.random.randint(0, 2**10, n).astype(np.uint32)
+        offsets = np.array([0, 17, 17, 1000, n//2, n], dtype=np.int32)
+        keys_gpu, values_gpu = segmented_radix_sort(
+                (gpuarray.to_gpu(x), payload_gpu), gpuarray.to_gpu(offsets),
+                end_bit=10)
+
+        for start, end in zip(offsets[:-1], offsets[1:]):
+            perm = start + np.argsort(x[start:end], kind="mergesort")
+            assert (keys_gpu.get()[start:end] == x[perm]).all()
+            assert (values_gpu.get()[start:end] == perm).all()
+
+    def test_histogram_plan(self):
+        from pycuda.algorithm import get_histogram_plan
+
+        # few bins: privatized, four groups per multiprocessor
+        assert get_histogram_plan(10**6, 256, 4, 14) == (True, 56)
+        # not enough entries to fill all groups
+        assert get_histogram_plan(1000, 16, 4, 14) == (True, 4)
+        # merging would read more counters than there are entries
+        assert get_histogram_plan(10**4, 1000, 4, 14) == (True, 10)
+        assert get_histogram_plan(500, 1000, 4, 14) == (False, 2)
+        # counters exceed local memory
+        assert get_histogram_plan(10**6, 4097, 4, 14) == (False, 56)
+        assert get_histogram_plan(10**6, 4096, 4, 14) == (True, 56)
+        assert get_histogram_plan(10**6, 4096, 8, 14) == (False, 56)
 
-                assert (gpu_data.get() == desired_result).all()
+    @mark_cuda_test
+    def test_histogram(self):
+        from pycuda.algorithm import histogram, bincount
+
+        n = 10**6+5
+        x = np.random.randn(n)
+        weights = np.random.randint(0, 10, n).astype(np.float64)
+        x_gpu = gpuarray.to_gpu(x)
+        weights_gpu = gpuarray.to_gpu(weights)
+
+        for bins in [1, 100, 5000]:
+            hist_gpu, edges = histogram(x_gpu, bins)
+            ref_hist, ref_edges = np.histogram(x, bins)
+            assert (hist_gpu.get() == ref_hist).all()
+            assert np.allclose(edges, ref_edges)
+
+            hist_gpu, edges = histogram(x_gpu, bins, (-1, 2), weights_gpu)
+            ref_hist, ref_edges = np.histogram(x, bins, (-1, 2), weights=weights)
+            assert (hist_gpu.get() == ref_hist).all()
+
+        edges = np.array([-3, -1, 0, 0, 0.5, 2, 10])
+        hist_gpu, _ = histogram(x_gpu.astype(np.float32), edges)
+        ref_hist, _ = np.histogram(x.astype(np.float32), edges)
+        assert (hist_gpu.get() == ref_hist).all()
+
+        for length in [10, 10000]:
+            ids = np.random.randint(0, length, n).astype(np.int32)
+            ids_gpu = gpuarray.to_gpu(ids)
+            assert (bincount(ids_gpu).get() == np.bincount(ids)).all()
+            assert (bincount(ids_gpu, weights_gpu).get()
+                    == np.bincount(ids, weights)).all()
+            assert bincount(ids_gpu, minlength=2*length).size == 2*length
 
     @mark_cuda_test
     def test_stride_preservation(self):
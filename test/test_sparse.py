@@ -0,0 +1,911 @@
+#! /usr/bin/env python
+from __future__ import division
+import numpy as np
+import numpy.linalg as la
+from pycuda.tools import mark_cuda_test
+
+
+def have_pycuda():
+    try:
+        import pycuda  # noqa
+        return True
+    except:
+        return False
+
+if have_pycuda():
+    import pycuda.gpuarray as gpuarray  # noqa
+    import pycuda.driver as drv  # noqa
+
+
+def get_scipy_sparse():
+    try:
+        import scipy.sparse
+    except ImportError:
+        from pytest import skip
+        skip("scipy not installed")
+
+    return scipy.sparse
+
+
+def make_random_matrix(n, row_length=5, dtype=np.float64, seed=17):
+    """Return a random :class:`scipy.sparse.csr_matrix` of size *n* by *n*
+    with symmetric sparsity pattern and nonzero diagonal.
+    """
+    sparse = get_scipy_sparse()
+
+    rng = np.random.RandomState(seed)
+    rows = rng.randint(0, n, n*row_length//2)
+    cols = rng.randint(0, n, n*row_length//2)
+    values = rng.uniform(-1, 1, n*row_length//2)
+
+    mat = sparse.coo_matrix((values, (rows, cols)), shape=(n, n)).tocsr()
+    mat = mat + mat.T + n*sparse.identity(n, format="csr")
+    mat.sort_indices()
+    return sparse.csr_matrix(mat, dtype=dtype)
+
+
+def make_spd_matrix(n, shift=0.1, dtype=np.float64, seed=17):
+    """Return a random symmetric positive definite
+    :class:`scipy.sparse.csr_matrix`, the graph Laplacian of the pattern of
+    :func:`make_random_matrix` plus *shift* times the identity.
+    """
+    sparse = get_scipy_sparse()
+
+    adj = abs(make_random_matrix(n, seed=seed))
+    adj.setdiag(0)
+    adj.eliminate_zeros()
+
+    degrees = np.asarray(adj.sum(axis=1)).ravel()
+    mat = sparse.diags(degrees + shift, 0, format="csr") - adj
+    mat.sort_indices()
+    return sparse.csr_matrix(mat, dtype=dtype)
+
+
+def make_matrix_with_row_lengths(row_lengths, dtype=np.float64, seed=17):
+    """Return a random square :class:`scipy.sparse.csr_matrix` whose rows
+    have the given numbers of entries.
+    """
+    sparse = get_scipy_sparse()
+
+    rng = np.random.RandomState(seed)
+    n = len(row_lengths)
+
+    indptr = np.zeros(n+1, dtype=np.int32)
+    indptr[1:] = np.cumsum(row_lengths)
+    indices = np.empty(indptr[-1], dtype=np.int32)
+    for i, row_length in enumerate(row_lengths):
+        indices[indptr[i]:indptr[i+1]] = np.sort(
+                rng.permutation(n)[:row_length])
+    data = rng.uniform(-1, 1, indptr[-1]).astype(dtype)
+
+    return sparse.csr_matrix((data, indices, indptr), shape=(n, n))
+
+
+def chebyshev_iteration(matvec, precon, b, degree, lambda_min, lambda_max):
+    """Return the result of *degree* steps of Chebyshev iteration for
+    *precon(matvec(x)) = precon(b)* starting from zero, using the three-term
+    recurrence of the Chebyshev polynomials.
+    """
+    theta = (lambda_max + lambda_min)/2
+    delta = (lambda_max - lambda_min)/2
+    sigma = theta/delta
+
+    # c[k] = T_k(sigma)
+    c_prev, c = 1, sigma
+    x_prev = np.zeros_like(b)
+    x = precon(b)/theta
+
+    for k in range(1, degree):
+        c_next = 2*sigma*c - c_prev
+        r = precon(b - matvec(x))
+        x, x_prev = (2*c/(delta*c_next)*(theta*x + r)
+                - c_prev/c_next*x_prev), x
+        c_prev, c = c, c_next
+
+    return x
+
+
+class TestSparse:
+    disabled = not have_pycuda()
+
+    def test_native_packet_structure(self):
+        from pycuda.sparse.pkt_build import (
+                partition_rows, build_packet_structure)
+
+        for n, rows_per_packet, threads_per_packet in [
+                (1, 64, 32),
+                (300, 64, 32),
+                (1000, 128, 64),
+                (2000, 512, 128),
+                ]:
+            mat = make_random_matrix(n, seed=n)
+            packet_count, dof_to_packet_nr = partition_rows(
+                    mat, rows_per_packet, "bisection")
+
+            ref = build_packet_structure(mat, dof_to_packet_nr,
+                    packet_count, threads_per_packet, mat.dtype,
+                    native=False)
+            result = build_packet_structure(mat, dof_to_packet_nr,
+                    packet_count, threads_per_packet, mat.dtype,
+                    native=True)
+
+            for name, ref_value in ref.items():
+                value = result[name]
+
+                if name == "remaining_coo":
+                    assert value.shape == ref_value.shape
+                    assert value.dtype == ref_value.dtype
+                    for attr in ["row", "col", "data"]:
+                        assert np.array_equal(
+                                getattr(value, attr),
+                                getattr(ref_value, attr)), (n, name, attr)
+                elif isinstance(ref_value, np.ndarray):
+                    assert value.dtype == ref_value.dtype, (n, name)
+                    assert np.array_equal(value, ref_value), (n, name)
+                else:
+                    assert value == ref_value, (n, name)
+
+    def test_partition_rows(self):
+        from pycuda.sparse.pkt_build import partition_rows
+
+        partitioners = ["bisection"]
+        try:
+            import pymetis  # noqa
+        except ImportError:
+            pass
+        else:
+            partitioners.append("metis")
+
+        for n, rows_per_packet in [(1, 2), (100, 2), (1000, 64), (1000, 100),
+                (5000, 512)]:
+            mat = make_random_matrix(n, seed=n)
+
+            # packets have fewer than rows_per_packet rows
+            min_packet_count = (n + rows_per_packet - 2) // (rows_per_packet - 1)
+
+            for partitioner in partitioners:
+                packet_count, dof_to_packet_nr = partition_rows(
+                        mat, rows_per_packet, partitioner)
+
+                dof_to_packet_nr = np.asarray(dof_to_packet_nr)
+                assert dof_to_packet_nr.shape == (n,)
+                assert 0 <= dof_to_packet_nr.min()
+                assert dof_to_packet_nr.max() < packet_count
+
+                packet_sizes = np.bincount(dof_to_packet_nr,
+                        minlength=packet_count)
+                assert packet_sizes.max() < rows_per_packet, partitioner
+
+                if partitioner == "bisection":
+                    assert packet_count == min_packet_count
+                    assert packet_sizes.min() > 0
+                else:
+                    assert packet_count >= min_packet_count
+
+    def test_csr_to_ell(self):
+        sparse = get_scipy_sparse()
+        from pycuda.sparse.ell import csr_to_ell
+
+        rng = np.random.RandomState(3)
+        mat = make_matrix_with_row_lengths(rng.randint(0, 12, 500))
+        row_lengths = np.diff(mat.indptr)
+
+        for width, pitch in [(0, None), (4, None), (4, 512),
+                (int(row_lengths.max()), 512)]:
+            col_idx, data, remainder = csr_to_ell(mat, width, pitch)
+            if pitch is None:
+                pitch = mat.shape[0]
+
+            assert col_idx.shape == data.shape == (width*pitch,)
+            assert col_idx.dtype == np.int32
+            assert data.dtype == mat.dtype
+
+            # column-major storage, padding marked with -1 and zero
+            col_idx = col_idx.reshape(width, pitch)
+            data = data.reshape(width, pitch)
+            assert (col_idx[:, mat.shape[0]:] == -1).all()
+            assert (data[col_idx == -1] == 0).all()
+            assert ((col_idx != -1).sum(axis=0)[:mat.shape[0]]
+                    == np.minimum(row_lengths, width)).all()
+
+            rows = np.repeat(np.arange(pitch)[np.newaxis], width, axis=0)
+            valid = col_idx != -1
+            ell_part = sparse.coo_matrix(
+                    (data[valid], (rows[valid], col_idx[valid])),
+                    shape=mat.shape)
+
+            assert remainder.nnz == np.sum(
+                    np.maximum(row_lengths - width, 0))
+            assert abs(ell_part + remainder - mat).sum() == 0
+
+        from pytest import raises
+        with raises(ValueError):
+            csr_to_ell(mat, 4, mat.shape[0]-1)
+
+    def test_choose_ell_width(self):
+        from pycuda.sparse.ell import choose_ell_width
+
+        assert choose_ell_width([]) == 0
+        assert choose_ell_width([5]*10000) == 5
+        assert choose_ell_width([3]*10000 + [100]*10) == 3
+
+        # too few rows to pay for any ELL column
+        assert choose_ell_width([5]*100) == 0
+
+        # a column is kept while at least 1/relative_speed of rows use it
+        assert choose_ell_width([1]*60 + [2]*40,
+                breakeven_threshold=0) == 2
+        assert choose_ell_width([1]*70 + [2]*30,
+                breakeven_threshold=0) == 1
+        assert choose_ell_width([1]*70 + [2]*30,
+                relative_speed=4, breakeven_threshold=0) == 2
+
+    def test_choose_spmv_format(self):
+        sparse = get_scipy_sparse()
+        from pycuda.sparse.auto import choose_spmv_format
+
+        assert choose_spmv_format(sparse.csr_matrix((100, 100))) == "csr"
+
+        # long rows
+        assert choose_spmv_format(
+                make_matrix_with_row_lengths([40]*200)) == "csr"
+        assert choose_spmv_format(
+                make_matrix_with_row_lengths([40]*200), warp_size=64) == "ell"
+
+        # regular rows
+        assert choose_spmv_format(
+                make_matrix_with_row_lengths([5]*1000 + [7]*100)) == "ell"
+
+        # few long rows
+        assert choose_spmv_format(make_matrix_with_row_lengths(
+            [3]*10000 + [200]*50)) == "hyb"
+
+        # irregular rows, ELL part would hold too few entries
+        assert choose_spmv_format(make_matrix_with_row_lengths(
+            [1]*9000 + [20]*3000)) == "csr"
+
+    @mark_cuda_test
+    def test_spmv_formats(self):
+        from pycuda.sparse.csr import CSRSpMV
+        from pycuda.sparse.ell import ELLSpMV, HybridSpMV
+        from pycuda.characterize import has_double_support
+
+        dtypes = [np.float32]
+        if has_double_support():
+            dtypes.append(np.float64)
+
+        rng = np.random.RandomState(5)
+        row_lengths = np.concatenate([
+            rng.randint(0, 8, 5000), [0]*10, [300]*20])
+        rng.shuffle(row_lengths)
+        mat = make_matrix_with_row_lengths(row_lengths)
+
+        for dtype in dtypes:
+            mat_dtype = mat.astype(dtype)
+            x = rng.uniform(-1, 1, mat.shape[1]).astype(dtype)
+            y = rng.uniform(-1, 1, mat.shape[0]).astype(dtype)
+            x_gpu = gpuarray.to_gpu(x)
+
+            ref = mat_dtype * x
+            eps = np.finfo(dtype).eps
+
+            for spmv in [
+                    CSRSpMV(mat, dtype),
+                    CSRSpMV(mat, dtype, threads_per_row=1),
+                    CSRSpMV(mat, dtype, threads_per_row=8),
+                    CSRSpMV(mat, dtype, threads_per_row=32),
+                    ELLSpMV(mat, dtype),
+                    ELLSpMV(mat, dtype, width=3),
+                    HybridSpMV(mat, dtype),
+                    ]:
+                assert spmv.shape == mat.shape
+                assert spmv.dtype == dtype
+
+                result = spmv(x_gpu).get()
+                assert la.norm(result - ref) < 1e3*eps*la.norm(ref), \
+                        type(spmv).__name__
+
+                # y += A x
+                y_gpu = gpuarray.to_gpu(y)
+                assert spmv(x_gpu, y_gpu) is y_gpu
+                assert la.norm(y_gpu.get() - (y + ref)) \
+                        < 1e3*eps*la.norm(ref), type(spmv).__name__
+
+    def test_pipelined_cg_reference(self):
+        from pycuda.sparse.cg import pipelined_cg_reference
+
+        rng = np.random.RandomState(9)
+        n = 40
+        a = rng.uniform(-1, 1, (n, n))
+        a = np.dot(a, a.T) + 0.1*np.eye(n)
+        b = rng.uniform(-1, 1, n)
+        x0 = rng.uniform(-1, 1, n)
+        inv_diagonal = 1/np.diag(a)
+
+        def matvec(v):
+            return np.dot(a, v)
+
+        def precon(v):
+            return inv_diagonal*v
+
+        def cg(x, iterations):
+            r = b - matvec(x)
+            z = precon(r)
+            p = z
+            rz = np.dot(r, z)
+            for i in range(iterations):
+                ap = matvec(p)
+                alpha = rz/np.dot(p, ap)
+                x = x + alpha*p
+                r = r - alpha*ap
+                z = precon(r)
+                rz_new = np.dot(r, z)
+                p = z + rz_new/rz*p
+                rz = rz_new
+            return x
+
+        for iterations in [1, 2, 5, 10]:
+            x = pipelined_cg_reference(matvec, precon, b, x0, iterations)
+            x_ref = cg(x0, iterations)
+            assert la.norm(x - x_ref) < 1e-8*la.norm(x_ref), iterations
+
+        x = pipelined_cg_reference(matvec, precon, b, x0, 3*n)
+        assert la.norm(matvec(x) - b) < 1e-8*la.norm(b)
+
+    @mark_cuda_test
+    def test_pipelined_cg(self):
+        from pycuda.sparse.packeted import PacketedSpMV
+        from pycuda.sparse.operator import DiagonalPreconditioner
+        from pycuda.sparse.cg import solve_pkt_with_cg
+        from pycuda.characterize import has_double_support
+
+        dtypes = [np.float32]
+        if has_double_support():
+            dtypes.append(np.float64)
+
+        mat = make_spd_matrix(3000)
+        rng = np.random.RandomState(11)
+
+        for dtype in dtypes:
+            tol = 1e-4 if dtype == np.float32 else 1e-9
+            spmv = PacketedSpMV(mat, True, dtype)
+            precon = DiagonalPreconditioner(spmv.permute(
+                gpuarray.to_gpu((1/mat.diagonal()).astype(dtype))))
+
+            b = rng.uniform(-1, 1, mat.shape[0]).astype(dtype)
+            b_gpu = gpuarray.to_gpu(b)
+
+            results = []
+            for pipelined in [False, True]:
+                x_gpu, it_count, res_count = solve_pkt_with_cg(spmv, b_gpu,
+                        precon, tol=tol, pipelined=pipelined)
+                x = x_gpu.get()
+
+                assert 0 < it_count < mat.shape[0]
+                assert la.norm(mat*x - b) < 10*tol*la.norm(b), pipelined
+                results.append(x)
+
+            x_classic, x_pipelined = results
+            assert (la.norm(x_pipelined - x_classic)
+                    < 100*tol*la.norm(x_classic))
+
+    @mark_cuda_test
+    def test_spmm(self):
+        from pycuda.sparse.packeted import PacketedSpMV
+        from pycuda.sparse.coordinate import CoordinateSpMV
+        from pycuda.characterize import has_double_support
+
+        dtypes = [np.float32]
+        if has_double_support():
+            dtypes.append(np.float64)
+
+        rng = np.random.RandomState(13)
+        mat = make_random_matrix(2000, seed=13)
+        # nonsymmetric, with some entries outside of the packets
+        mat = mat + make_matrix_with_row_lengths(
+                rng.randint(0, 3, mat.shape[0]), seed=14)
+
+        for dtype in dtypes:
+            eps = np.finfo(dtype).eps
+            pkt_spmv = PacketedSpMV(mat, False, dtype)
+            coo_spmv = CoordinateSpMV(mat.tocoo(), dtype)
+
+            for rhs_count in [1, 3, 8, 40]:
+                x = rng.uniform(-1, 1,
+                        (mat.shape[1], rhs_count)).astype(dtype)
+                ref = mat.astype(dtype) * x
+
+                x_gpu = gpuarray.to_gpu(x)
+                x_perm_gpu = pkt_spmv.permute_block(x_gpu)
+                assert np.array_equal(
+                        pkt_spmv.unpermute_block(x_perm_gpu).get(), x)
+
+                result = pkt_spmv.unpermute_block(
+                        pkt_spmv.spmm(x_perm_gpu)).get()
+                assert la.norm(result - ref) < 1e3*eps*la.norm(ref), \
+                        rhs_count
+
+                # columns agree with single products
+                y_perm_gpu = pkt_spmv(pkt_spmv.permute(
+                    gpuarray.to_gpu(np.ascontiguousarray(x[:, -1]))))
+                assert la.norm(pkt_spmv.unpermute(y_perm_gpu).get()
+                        - ref[:, -1]) < 1e3*eps*la.norm(ref[:, -1])
+
+                y = rng.uniform(-1, 1, ref.shape).astype(dtype)
+                y_gpu = gpuarray.to_gpu(y)
+                assert coo_spmv.spmm(x_gpu, y_gpu) is y_gpu
+                assert la.norm(y_gpu.get() - (y + ref)) \
+                        < 1e3*eps*la.norm(ref), rhs_count
+
+    @mark_cuda_test
+    def test_batched_cg(self):
+        from pycuda.sparse.packeted import PacketedSpMV
+        from pycuda.sparse.coordinate import CoordinateSpMV
+        from pycuda.sparse.operator import DiagonalPreconditioner
+        from pycuda.sparse.cg import solve_batched_with_cg, solve_pkt_with_cg
+        from pycuda.characterize import has_double_support
+
+        dtypes = [np.float32]
+        if has_double_support():
+            dtypes.append(np.float64)
+
+        mat = make_spd_matrix(3000, seed=19)
+        n = mat.shape[0]
+        rng = np.random.RandomState(19)
+
+        for dtype in dtypes:
+            tol = 1e-4 if dtype == np.float32 else 1e-9
+
+            b = rng.uniform(-1, 1, (n, 4)).astype(dtype)
+            # converges immediately, so that alpha and beta stay zero
+            b[:, 2] = 0
+
+            inv_diagonal = (1/mat.diagonal()).astype(dtype)
+            inv_diagonal_block = np.repeat(inv_diagonal[:, np.newaxis],
+                    b.shape[1], axis=1)
+
+            pkt_spmv = PacketedSpMV(mat, True, dtype)
+            precon = DiagonalPreconditioner(pkt_spmv.permute(
+                gpuarray.to_gpu(inv_diagonal)))
+            x_single = solve_pkt_with_cg(pkt_spmv,
+                    gpuarray.to_gpu(np.ascontiguousarray(b[:, 3])),
+                    precon, tol=tol)[0].get()
+
+            for spmv in [pkt_spmv, CoordinateSpMV(mat, dtype)]:
+                precon_block = spmv.permute_block(
+                        gpuarray.to_gpu(inv_diagonal_block))
+
+                x_gpu, it_count = solve_batched_with_cg(spmv,
+                        gpuarray.to_gpu(b), lambda r: precon_block*r,
+                        tol=tol)
+                x = x_gpu.get()
+
+                assert 0 < it_count < n
+                assert not x[:, 2].any()
+                for c in [0, 1, 3]:
+                    assert la.norm(mat*x[:, c] - b[:, c]) \
+                            < 10*tol*la.norm(b[:, c]), (spmv, c)
+
+                # agrees with solving for the column on its own
+                assert la.norm(x[:, 3] - x_single) \
+                        < 100*tol*la.norm(x_single), spmv
+
+    @mark_cuda_test
+    def test_update_values(self):
+        from pycuda.sparse.packeted import PacketedSpMV
+
+        rng = np.random.RandomState(15)
+        mat = make_random_matrix(2000, seed=15)
+        spmv = PacketedSpMV(mat, True, np.float64)
+        eps = np.finfo(np.float64).eps
+
+        x = rng.uniform(-1, 1, mat.shape[0])
+        x_perm_gpu = spmv.permute(gpuarray.to_gpu(x))
+
+        for on_device in [False, True]:
+            new_mat = mat.copy()
+            new_mat.data = rng.uniform(-1, 1, mat.nnz)
+
+            if on_device:
+                spmv.update_values(gpuarray.to_gpu(
+                    new_mat.data.astype(np.float32)))
+                new_mat.data = new_mat.data.astype(np.float32)
+            else:
+                spmv.update_values(new_mat.data)
+
+            ref = new_mat * x
+            result = spmv.unpermute(spmv(x_perm_gpu)).get()
+            assert la.norm(result - ref) < 1e3*eps*la.norm(ref), on_device
+
+        from pytest import raises
+        with raises(ValueError):
+            spmv.update_values(new_mat.data[:-1])
+
+    def test_packet_file(self):
+        from pycuda.sparse.pkt_build import (
+                write_packet_file, read_packet_file, PKT_FILE_ALIGNMENT)
+        from tempfile import mkdtemp
+        from shutil import rmtree
+        import os.path
+
+        rng = np.random.RandomState(19)
+        arrays = {
+                "ints": rng.randint(-100, 100, 1001).astype(np.int32),
+                "packed": rng.randint(0, 1 << 30, 77).astype(np.uint32),
+                "values": rng.uniform(-1, 1, 333),
+                "empty": np.empty(0, dtype=np.float32),
+                }
+        header = {"shape": [3, 4], "name": "test", "nnz": 12}
+
+        tmpdir = mkdtemp()
+        try:
+            filename = os.path.join(tmpdir, "test.pkt")
+            write_packet_file(filename, header, arrays)
+
+            read_header, read_arrays = read_packet_file(filename)
+            for key, value in header.items():
+                assert read_header[key] == value
+
+            assert sorted(read_arrays) == sorted(arrays)
+            for name, ary in arrays.items():
+                read_ary = read_arrays[name]
+                assert read_ary.dtype == ary.dtype, name
+                assert np.array_equal(read_ary, ary), name
+                if isinstance(read_ary, np.memmap):
+                    assert read_ary.offset % PKT_FILE_ALIGNMENT == 0
+            del read_arrays, read_ary
+
+            bad_filename = os.path.join(tmpdir, "bad.pkt")
+            outf = open(bad_filename, "wb")
+            outf.write(b"not a packet file")
+            outf.close()
+
+            from pytest import raises
+            with raises(ValueError):
+                read_packet_file(bad_filename)
+        finally:
+            rmtree(tmpdir)
+
+    @mark_cuda_test
+    def test_save_load(self):
+        from pycuda.sparse.packeted import PacketedSpMV
+        from pycuda.sparse.pkt_build import get_structure_hash
+        from tempfile import mkdtemp
+        from shutil import rmtree
+        from pytest import raises
+        import os
+
+        rng = np.random.RandomState(21)
+        mat = make_random_matrix(2000, seed=21)
+        x = rng.uniform(-1, 1, mat.shape[0])
+        eps = np.finfo(np.float64).eps
+
+        def check_product(spmv, mat):
+            ref = mat * x
+            result = spmv.unpermute(
+                    spmv(spmv.permute(gpuarray.to_gpu(x)))).get()
+            assert la.norm(result - ref) < 1e3*eps*la.norm(ref)
+
+        tmpdir = mkdtemp()
+        try:
+            spmv = PacketedSpMV(mat, True, np.float64)
+            filename = os.path.join(tmpdir, "mat.pkt")
+            spmv.save(filename)
+
+            loaded = PacketedSpMV.load(filename, get_structure_hash(mat))
+            assert loaded.shape == spmv.shape
+            assert loaded.nnz == spmv.nnz
+            assert loaded.block_count == spmv.block_count
+            assert loaded.structure_hash == spmv.structure_hash
+            check_product(loaded, mat)
+
+            other_mat = make_random_matrix(2000, seed=22)
+            with raises(ValueError):
+                PacketedSpMV.load(filename, get_structure_hash(other_mat))
+
+            # first call builds and saves, second one loads
+            cache_dir = os.path.join(tmpdir, "cache")
+            os.mkdir(cache_dir)
+
+            cached = PacketedSpMV.from_cache(cache_dir, mat, True, np.float64)
+            check_product(cached, mat)
+            cache_files = os.listdir(cache_dir)
+            assert len(cache_files) == 1
+            assert cache_files[0].endswith(".pkt")
+
+            new_mat = mat.copy()
+            new_mat.data = rng.uniform(-1, 1, mat.nnz)
+            cached = PacketedSpMV.from_cache(
+                    cache_dir, new_mat, True, np.float64)
+            check_product(cached, new_mat)
+            assert os.listdir(cache_dir) == cache_files
+        finally:
+            rmtree(tmpdir)
+
+    @mark_cuda_test
+    def test_iterative_refinement(self):
+        from pycuda.characterize import has_double_support
+        if not has_double_support():
+            from pytest import skip
+            skip("double precision not supported")
+
+        from pycuda.sparse.packeted import PacketedSpMV
+        from pycuda.sparse.coordinate import CoordinateSpMV
+        from pycuda.sparse.operator import DiagonalPreconditioner
+        from pycuda.sparse.cg import solve_with_iterative_refinement
+
+        mat = make_spd_matrix(3000, seed=23)
+        inv_diagonal = gpuarray.to_gpu(1/mat.diagonal())
+
+        b = np.random.RandomState(23).uniform(-1, 1, mat.shape[0])
+
+        spmv = PacketedSpMV(mat, True, np.float64)
+        coo_spmv = CoordinateSpMV(mat, np.float64)
+
+        for operator, precon, pipelined in [
+                (spmv, DiagonalPreconditioner(spmv.permute(inv_diagonal)),
+                    False),
+                (spmv, DiagonalPreconditioner(spmv.permute(inv_diagonal)),
+                    True),
+                (coo_spmv, DiagonalPreconditioner(inv_diagonal), False),
+                ]:
+            x_gpu, refinement_count, it_count = \
+                    solve_with_iterative_refinement(operator,
+                            gpuarray.to_gpu(b), precon, tol=1e-12,
+                            inner_dtype=np.float32, pipelined=pipelined)
+
+            assert x_gpu.dtype == np.float64
+            assert 1 < refinement_count <= 50
+            assert it_count > 0
+
+            # well below what a float32 solve can reach
+            x = x_gpu.get()
+            assert la.norm(mat*x - b) < 1e-11*la.norm(b), (
+                    type(operator).__name__, pipelined)
+
+    def test_chebyshev_coefficients(self):
+        from pycuda.sparse.precon import chebyshev_coefficients
+
+        rng = np.random.RandomState(25)
+        n = 30
+        a = rng.uniform(-1, 1, (n, n))
+        a = np.dot(a, a.T) + 0.5*np.eye(n)
+        b = rng.uniform(-1, 1, n)
+        inv_diagonal = 1/np.diag(a)
+
+        def matvec(v):
+            return np.dot(a, v)
+
+        def precon(v):
+            return inv_diagonal*v
+
+        lambda_max = 1.1*np.max(la.eigvals(inv_diagonal[:, np.newaxis]*a).real)
+        lambda_min = lambda_max/30
+
+        for degree in [1, 2, 5, 12]:
+            coefficients = chebyshev_coefficients(
+                    degree, lambda_min, lambda_max)
+            assert len(coefficients) == degree
+
+            # the steps applied by PolynomialPreconditioner
+            z = np.zeros(n)
+            d = np.zeros(n)
+            residual = b
+            for coeff_a, coeff_b in coefficients:
+                d = coeff_a*d + coeff_b*precon(residual)
+                z = z + d
+                residual = residual - matvec(d)
+
+            ref = chebyshev_iteration(matvec, precon, b, degree,
+                    lambda_min, lambda_max)
+            assert la.norm(z - ref) < 1e-12*la.norm(ref), degree
+
+        from pytest import raises
+        with raises(ValueError):
+            chebyshev_coefficients(3, 0, 1)
+        with raises(ValueError):
+            chebyshev_coefficients(3, 2, 1)
+
+    def test_find_block_starts(self):
+        from pycuda.sparse.precon import find_block_starts
+
+        block_starts = find_block_starts([0, 10, 25, 25, 40], 8)
+        assert block_starts.dtype == np.int32
+        assert list(block_starts) == [0, 8, 10, 18, 25, 33, 40]
+
+        assert list(find_block_starts([0, 64], 32)) == [0, 32, 64]
+        assert list(find_block_starts([0, 5], 32)) == [0, 5]
+        assert list(find_block_starts([0], 32)) == [0]
+
+    def test_invert_diagonal_blocks(self):
+        from pycuda.sparse.precon import (
+                find_block_starts, invert_diagonal_blocks)
+
+        n = 300
+        block_size = 16
+        mat = make_random_matrix(n, row_length=10, seed=27)
+        block_starts = find_block_starts([0, 100, 150, 151, n], block_size)
+
+        perm = np.random.RandomState(27).permutation(n)
+        for new2old in [None, perm]:
+            inv_blocks = invert_diagonal_blocks(
+                    mat, block_starts, block_size, new2old)
+            assert inv_blocks.shape == (
+                    len(block_starts)-1, block_size, block_size)
+
+            dense = mat.toarray()
+            if new2old is not None:
+                dense = dense[new2old][:, new2old]
+
+            for i, (start, end) in enumerate(
+                    zip(block_starts[:-1], block_starts[1:])):
+                size = end - start
+                ref = la.inv(dense[start:end, start:end])
+
+                # stored transposed, padded with zeros
+                assert la.norm(inv_blocks[i, :size, :size].T - ref) \
+                        < 1e-12*la.norm(ref)
+                assert (inv_blocks[i, size:] == 0).all()
+                assert (inv_blocks[i, :, size:] == 0).all()
+
+    @mark_cuda_test
+    def test_preconditioners(self):
+        from pycuda.sparse.csr import CSRSpMV
+        from pycuda.sparse.packeted import PacketedSpMV
+        from pycuda.sparse.operator import DiagonalPreconditioner
+        from pycuda.sparse.precon import (BlockJacobiPreconditioner,
+                ChebyshevPreconditioner, NeumannPreconditioner)
+        from pycuda.characterize import has_double_support
+
+        dtypes = [np.float32]
+        if has_double_support():
+            dtypes.append(np.float64)
+
+        mat = make_spd_matrix(2000, seed=29)
+        dense = mat.toarray()
+        inv_diagonal = 1/mat.diagonal()
+        rng = np.random.RandomState(29)
+        x = rng.uniform(-1, 1, mat.shape[0])
+
+        def matvec(v):
+            return mat*v
+
+        def precon(v):
+            return inv_diagonal*v
+
+        for dtype in dtypes:
+            eps = np.finfo(dtype).eps
+            x_gpu = gpuarray.to_gpu(x.astype(dtype))
+
+            def check(result_gpu, ref):
+                assert result_gpu.dtype == dtype
+                assert la.norm(result_gpu.get() - ref) \
+                        < 1e3*eps*la.norm(ref)
+
+            # block jacobi on consecutive rows
+            block_size = 32
+            bj = BlockJacobiPreconditioner(mat, dtype, block_size=block_size)
+            ref = np.empty_like(x)
+            for start in range(0, mat.shape[0], block_size):
+                end = min(start + block_size, mat.shape[0])
+                ref[start:end] = la.solve(
+                        dense[start:end, start:end], x[start:end])
+            check(bj(x_gpu), ref)
+
+            # block jacobi within packets, in permuted ordering
+            pkt_spmv = PacketedSpMV(mat, True, dtype)
+            bj = BlockJacobiPreconditioner(mat, dtype, spmv=pkt_spmv)
+            new2old = pkt_spmv.new2old_fetch_indices.get()
+            packet_boundaries = pkt_spmv.packet_base_rows.get()
+            perm_dense = dense[new2old][:, new2old]
+            ref = np.empty_like(x)
+            for pkt_start, pkt_end in zip(
+                    packet_boundaries[:-1], packet_boundaries[1:]):
+                for start in range(pkt_start, pkt_end, block_size):
+                    end = min(start + block_size, pkt_end)
+                    ref[start:end] = la.solve(
+                            perm_dense[start:end, start:end],
+                            x[new2old][start:end])
+            check(bj(pkt_spmv.permute(x_gpu)), ref)
+
+            # polynomial preconditioners
+            spmv = CSRSpMV(mat, dtype)
+            diag_precon = DiagonalPreconditioner(
+                    gpuarray.to_gpu(inv_diagonal.astype(dtype)))
+
+            for degree in [1, 4]:
+                cheb = ChebyshevPreconditioner(spmv, degree, diag_precon,
+                        lambda_min=0.05, lambda_max=2.1)
+                check(cheb(x_gpu), chebyshev_iteration(
+                    matvec, precon, x, degree, 0.05, 2.1))
+
+                neumann = NeumannPreconditioner(spmv, degree, diag_precon,
+                        omega=0.7)
+                ref = np.zeros_like(x)
+                for i in range(degree):
+                    ref = ref + 0.7*precon(x - matvec(ref))
+                check(neumann(x_gpu), ref)
+
+    def test_expand_csr_rows(self):
+        from pycuda._driver import _expand_csr_rows
+
+        rng = np.random.RandomState(31)
+        for row_lengths in [[], [0, 0], [1], [0, 3, 0, 2],
+                rng.randint(0, 20, 5000)]:
+            mat = make_matrix_with_row_lengths(row_lengths, seed=31)
+            indptr = mat.indptr.astype(np.int32)
+
+            rows = np.empty(mat.nnz, dtype=np.int32)
+            _expand_csr_rows(indptr, rows)
+            assert np.array_equal(rows, mat.tocoo().row)
+
+    @mark_cuda_test
+    def test_coordinate_from_csr(self):
+        sparse = get_scipy_sparse()
+        from pycuda.sparse.coordinate import CoordinateSpMV
+
+        rng = np.random.RandomState(33)
+        matrices = [
+                # fewer entries than a warp
+                make_matrix_with_row_lengths([0, 2, 0, 1, 2]),
+                make_matrix_with_row_lengths([1]*31),
+                make_matrix_with_row_lengths([1]*33),
+                make_matrix_with_row_lengths(rng.randint(0, 20, 3000)),
+                sparse.csr_matrix(
+                    rng.uniform(-1, 1, (40, 70)) * (rng.rand(40, 70) < 0.1)),
+                sparse.csr_matrix((10, 10)),
+                ]
+
+        for mat in matrices:
+            mat = sparse.csr_matrix(mat, dtype=np.float64)
+            coo = sparse.coo_matrix(mat)
+
+            for pagelocked in [False, True]:
+                indices = mat.indices.astype(np.int32)
+                data = mat.data
+                if pagelocked:
+                    indices = drv.pagelocked_empty(mat.nnz, np.int32)
+                    indices[:] = mat.indices
+                    data = drv.pagelocked_empty(mat.nnz, np.float64)
+                    data[:] = mat.data
+
+                spmv = CoordinateSpMV.from_csr(mat.shape, mat.indptr,
+                        indices, data, np.float64)
+                assert spmv.shape == mat.shape
+                assert spmv.nnz == coo.nnz
+                assert np.array_equal(spmv.row_gpu.get(), coo.row)
+                assert np.array_equal(spmv.col_gpu.get(), coo.col)
+                assert np.array_equal(spmv.data_gpu.get(), coo.data)
+
+                x = rng.uniform(-1, 1, mat.shape[1])
+                ref = mat * x
+                result = spmv(gpuarray.to_gpu(x)).get()
+                assert la.norm(result - ref) <= 1e-12*la.norm(ref), \
+                        (mat.shape, mat.nnz)
+
+        # trailing entries beyond indptr[-1] are ignored
+        mat = matrices[0]
+        spmv = CoordinateSpMV.from_csr(mat.shape, mat.indptr,
+                np.concatenate([mat.indices, [-1, -1]]),
+                np.concatenate([mat.data, [7, 7]]), np.float64)
+        assert np.array_equal(spmv.data_gpu.get(), mat.tocoo().data)
+
+        from pytest import raises
+        with raises(ValueError):
+            CoordinateSpMV.from_csr(mat.shape, mat.indptr[:-1],
+                    mat.indices, mat.data, np.float64)
+        with raises(ValueError):
+            CoordinateSpMV.from_csr(mat.shape, mat.indptr,
+                    mat.indices[:-1], mat.data, np.float64)
+
+
+if __name__ == "__main__":
+    # make sure that import failures get reported, instead of skipping the tests.
+    import pycuda.autoinit  # noqa
+
+    import sys
+    if len(sys.argv) > 1:
+        exec (sys.argv[1])
+    else:
+        from py.test.cmdline import main
+        main([__file__])